@@ -87,6 +87,38 @@ endif
 	@echo
 
 
+# Build and run benchmarks, they are linked with the objects
+# of libmdsserver rather than the shared library so they can
+# be run without installing it.
+
+.PHONY: bench
+bench: $(foreach B,$(BENCHMARKS),bin/bench/$(B))
+	@for b in $^; do $$b || exit 1; done
+
+# Re-exec servers in a loop, under load, and report
+# the median and 99:th percentile of their downtime.
+
+.PHONY: reexec-profile
+reexec-profile: bin/bench/reexec $(foreach S,$(REEXEC_PROFILE_SERVERS),bin/$(S))
+	@for s in $(REEXEC_PROFILE_SERVERS); do \
+		LD_LIBRARY_PATH=bin$${LD_LIBRARY_PATH:+:}$$LD_LIBRARY_PATH bin/bench/reexec bin/$$s || exit 1; \
+	done
+
+ifneq ($(LIBMDSSERVER_IS_INSTALLED),y)
+bin/bench/%: src/bench/%.c src/bench/bench.c src/bench/bench.h src/libmdsserver/*.h $(foreach O,$(SERVEROBJ),obj/libmdsserver/$(O).o) $(SEDED)
+	@printf '\e[00;01;31mCC\e[34m %s\e[00m\n' "$@"
+	@mkdir -p $(shell dirname $@)
+	$(CC) $(C_FLAGS) -Isrc -o $@ $< src/bench/bench.c $(foreach O,$(SERVEROBJ),obj/libmdsserver/$(O).o) -pthread -lrt
+	@echo
+else
+bin/bench/%: src/bench/%.c src/bench/bench.c src/bench/bench.h
+	@printf '\e[00;01;31mCC\e[34m %s\e[00m\n' "$@"
+	@mkdir -p $(shell dirname $@)
+	$(CC) $(C_FLAGS) -o $@ $< src/bench/bench.c $(LDS)
+	@echo
+endif
+
+
 # Build object files for kernel/servers/utilities.
 
 ifneq ($(LIBMDSSERVER_IS_INSTALLED),y)
@@ -149,7 +181,7 @@ endif
 bin/libmdsserver.so.$(LIBMDSSERVER_VERSION): $(foreach O,$(SERVEROBJ),obj/libmdsserver/$(O).o)
 	@printf '\e[00;01;31mLD\e[34m %s\e[00m\n' "$@"
 	@mkdir -p $(shell dirname $@)
-	$(CC) $(C_FLAGS) -shared -Wl,-soname,libmdsclient.so.$(LIBMDSSERVER_MAJOR) -o $@ $^
+	$(CC) $(C_FLAGS) -shared -Wl,-soname,libmdsserver.so.$(LIBMDSSERVER_MAJOR) -o $@ $^
 	@echo
 
 bin/libmdsserver.so.$(LIBMDSSERVER_MAJOR): bin/libmdsserver.so.$(LIBMDSSERVER_VERSION)
@@ -0,0 +1,268 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+
+/**
+ * Written to by benchmark cases so that the
+ * compiler cannot remove the work they measure
+ */
+volatile size_t bench_sink;
+
+/**
+ * The number of allocations made by the thread
+ */
+static __thread size_t allocations = 0;
+
+/**
+ * The time `bench_start` was called
+ */
+static unsigned long long start_time;
+
+/**
+ * `allocations` when `bench_start` was called
+ */
+static size_t start_allocations;
+
+/**
+ * The measured time, in nanoseconds
+ */
+static unsigned long long measured_time = 0;
+
+/**
+ * The number of allocations in the measured time
+ */
+static size_t measured_allocations = 0;
+
+/**
+ * The number of operations in the measured time
+ */
+static size_t measured_operations = 0;
+
+/**
+ * The state of `bench_random`
+ */
+static uint64_t random_state = 0x2545F4914F6CDD1DULL;
+
+
+
+#ifdef __GLIBC__
+/* The allocator in the GNU C Library is exposed under these names,
+ * so the allocation functions can be replaced by ones that count. */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+
+/**
+ * Count and perform an allocation
+ * 
+ * @param   size  The size of the allocation
+ * @return        The allocation, `NULL` on error
+ */
+void *
+malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+
+/**
+ * Count and perform an allocation
+ * 
+ * @param   count  The number of elements
+ * @param   size   The size of each element
+ * @return         The allocation, `NULL` on error
+ */
+void *
+calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+
+/**
+ * Count and perform a reallocation
+ * 
+ * @param   ptr   The old allocation, may be `NULL`
+ * @param   size  The new size of the allocation
+ * @return        The allocation, `NULL` on error
+ */
+void *
+realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+
+/**
+ * Get the current time in nanoseconds
+ * 
+ * @return  The current time
+ */
+static unsigned long long
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+
+/**
+ * Start measuring
+ */
+void
+bench_start(void)
+{
+	start_allocations = allocations;
+	start_time = now();
+}
+
+
+/**
+ * Stop measuring, and add to the measurement
+ * 
+ * @param  operations  The number of operations since `bench_start`
+ */
+void
+bench_stop(size_t operations)
+{
+	measured_time += now() - start_time;
+	measured_allocations += allocations - start_allocations;
+	measured_operations += operations;
+}
+
+
+/**
+ * Get a pseudorandom number, the sequence is the same in every run
+ * 
+ * @return  A pseudorandom number
+ */
+size_t
+bench_random(void)
+{
+	/* xorshift64* */
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return (size_t)(random_state * 0x2545F4914F6CDD1DULL);
+}
+
+
+/**
+ * Scramble a number, distinct input give distinct output
+ * 
+ * @param   value  The number
+ * @return         The scrambled number
+ */
+size_t
+bench_mix(size_t value)
+{
+	/* The finaliser of splitmix64, it is a bijection. */
+	uint64_t x = (uint64_t)value;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return (size_t)(x ^ (x >> 31));
+}
+
+
+/**
+ * Shuffle an array
+ * 
+ * @param  array  The array
+ * @param  n      The number of elements in `array`
+ */
+void
+bench_shuffle(size_t *array, size_t n)
+{
+	size_t i, j, t;
+	for (i = n; i > 1; i--) {
+		j = bench_random() % i;
+		t = array[i - 1], array[i - 1] = array[j], array[j] = t;
+	}
+}
+
+
+/**
+ * Run a benchmark case in a child process and print the result
+ * 
+ * @param   benchmark   The name of the benchmark
+ * @param   operation   The name of the measured operation
+ * @param   variant     The name of the variant, such as the key distribution
+ * @param   size        The number of elements in the data structure
+ * @param   operations  The number of operations to measure
+ * @param   function    The benchmark case
+ * @param   data        Passed to `function`
+ * @return              Zero on success, -1 on error, `errno` is
+ *                      zero if the error has already been reported
+ */
+int
+bench_run(const char *benchmark, const char *operation, const char *variant,
+	  size_t size, size_t operations, bench_func *function, const void *data)
+{
+	struct rusage usage;
+	double allocations_per_op;
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	fail_if ((pid = fork()) < 0);
+
+	if (!pid) {
+		if (function(data, size, operations) || !measured_operations) {
+			perror(benchmark);
+			_exit(1);
+		}
+		getrusage(RUSAGE_SELF, &usage);
+#ifdef __GLIBC__
+		allocations_per_op = (double)measured_allocations / (double)measured_operations;
+#else
+		allocations_per_op = -1;
+#endif
+		printf("%s\t%s\t%s\t%zu\t%zu\t%.1f\t%.3f\t%li\n", benchmark, operation, variant, size,
+		       measured_operations, (double)measured_time / (double)measured_operations,
+		       allocations_per_op, (long int)(usage.ru_maxrss));
+		fflush(stdout);
+		_exit(0);
+	}
+
+	while (waitpid(pid, &status, 0) < 0)
+		fail_if (errno != EINTR);
+	/* The child has already reported the error. */
+	fail_if (!WIFEXITED(status) || WEXITSTATUS(status) ? (errno = 0, 1) : 0);
+	return 0;
+fail:
+	return -1;
+}
@@ -0,0 +1,121 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_BENCH_BENCH_H
+#define MDS_BENCH_BENCH_H
+
+
+#include <stddef.h>
+
+
+
+/**
+ * Common functionality for the data structure benchmarks
+ * 
+ * Each benchmark case is run in a child process, so that
+ * its peak resident set size is not affected by the other
+ * cases. The case times the parts of its work that are
+ * being measured, by enclosing them in `bench_start` and
+ * `bench_stop`, and when it returns, a tab-separated line
+ * is printed:
+ * benchmark, operation, variant, size, operations, ns/op,
+ * allocations/op, peak RSS (KiB)
+ * 
+ * Allocations are the calls to malloc(3), calloc(3) and
+ * realloc(3) made by the thread that runs the case, they
+ * are only counted with the GNU C Library, and are reported
+ * as -1 otherwise.
+ */
+
+
+
+/**
+ * A benchmark case
+ * 
+ * @param   data        Benchmark specific data, such as the key distribution
+ * @param   size        The number of elements in the data structure
+ * @param   operations  The number of operations that should be measured,
+ *                      the case may round it to a multiple of `size`
+ * @return              Zero on success, -1 on error
+ */
+typedef int bench_func(const void *data, size_t size, size_t operations);
+
+
+
+/**
+ * Written to by benchmark cases so that the
+ * compiler cannot remove the work they measure
+ */
+extern volatile size_t bench_sink;
+
+
+
+/**
+ * Start measuring
+ */
+void bench_start(void);
+
+/**
+ * Stop measuring, and add to the measurement
+ * 
+ * @param  operations  The number of operations since `bench_start`
+ */
+void bench_stop(size_t operations);
+
+/**
+ * Get a pseudorandom number, the sequence is the same in every run
+ * 
+ * @return  A pseudorandom number
+ */
+size_t bench_random(void);
+
+/**
+ * Scramble a number, distinct input give distinct output
+ * 
+ * @param   value  The number
+ * @return         The scrambled number
+ */
+__attribute__((const))
+size_t bench_mix(size_t value);
+
+/**
+ * Shuffle an array
+ * 
+ * @param  array  The array
+ * @param  n      The number of elements in `array`
+ */
+void bench_shuffle(size_t *array, size_t n);
+
+/**
+ * Run a benchmark case in a child process and print the result
+ * 
+ * @param   benchmark   The name of the benchmark
+ * @param   operation   The name of the measured operation
+ * @param   variant     The name of the variant, such as the key distribution
+ * @param   size        The number of elements in the data structure
+ * @param   operations  The number of operations to measure
+ * @param   function    The benchmark case
+ * @param   data        Passed to `function`
+ * @return              Zero on success, -1 on error, `errno` is
+ *                      zero if the error has already been reported
+ */
+__attribute__((nonnull(1, 2, 3, 6)))
+int bench_run(const char *benchmark, const char *operation, const char *variant,
+	      size_t size, size_t operations, bench_func *function, const void *data);
+
+
+#endif
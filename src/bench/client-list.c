@@ -0,0 +1,275 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include <libmdsserver/client-list.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+
+
+/**
+ * Benchmark of `client_list_t`
+ * 
+ * Usage: client-list [OPERATIONS]
+ * 
+ * Each line of output is tab-separated, see bench.h
+ */
+
+
+
+/**
+ * A benchmark case
+ */
+struct bench_case {
+	/**
+	 * The name of the operation
+	 */
+	const char *operation;
+
+	/**
+	 * The name of the variant
+	 */
+	const char *variant;
+
+	/**
+	 * The benchmark case
+	 */
+	bench_func *function;
+};
+
+
+
+/**
+ * Get the ID of the client with a given index, client ID:s
+ * are allocated sequentially by mds-server
+ * 
+ * @param   i  The index of the client
+ * @return     The client ID
+ */
+static uint64_t __attribute__((const))
+client_id(size_t i)
+{
+	return (uint64_t)i + 1;
+}
+
+
+/**
+ * Create a list
+ * 
+ * @param   list  Memory slot in which to store the list
+ * @param   size  The number of clients to add
+ * @return        Zero on success, -1 on error
+ */
+static int
+make_list(client_list_t *list, size_t size)
+{
+	size_t i;
+
+	if (client_list_create(list, 0))
+		return -1;
+	for (i = 0; i < size; i++)
+		if (client_list_add(list, client_id(i)))
+			return -1;
+	return 0;
+}
+
+
+/**
+ * Benchmark `client_list_add` into a list
+ * that is grown from the default capacity
+ * 
+ * @param   data        Not used
+ * @param   size        The number of clients to add
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_add(const void *data, size_t size, size_t operations)
+{
+	client_list_t list;
+	size_t done;
+
+	(void) data;
+
+	for (done = 0; done < operations; done += size) {
+		bench_start();
+		fail_if (make_list(&list, size));
+		bench_stop(size);
+		client_list_destroy(&list);
+	}
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `client_list_remove` until the list is empty
+ * 
+ * @param   order       The indices of the clients, in the order they are removed
+ * @param   size        The number of clients in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+remove_all(const size_t *order, size_t size, size_t operations)
+{
+	client_list_t list;
+	size_t done, i;
+
+	for (done = 0; done < operations; done += size) {
+		fail_if (make_list(&list, size));
+		bench_start();
+		for (i = 0; i < size; i++)
+			client_list_remove(&list, client_id(order[i]));
+		bench_stop(size);
+		client_list_destroy(&list);
+	}
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `client_list_remove` in the order the clients were added
+ * 
+ * @param   data        Not used
+ * @param   size        The number of clients in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_remove_fifo(const void *data, size_t size, size_t operations)
+{
+	size_t *order = NULL, i;
+	int r;
+
+	(void) data;
+
+	fail_if (xmalloc(order, size, size_t));
+	for (i = 0; i < size; i++)
+		order[i] = i;
+	r = remove_all(order, size, operations);
+	free(order);
+	return r;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `client_list_remove` in the reverse order the clients were added
+ * 
+ * @param   data        Not used
+ * @param   size        The number of clients in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_remove_lifo(const void *data, size_t size, size_t operations)
+{
+	size_t *order = NULL, i;
+	int r;
+
+	(void) data;
+
+	fail_if (xmalloc(order, size, size_t));
+	for (i = 0; i < size; i++)
+		order[i] = size - 1 - i;
+	r = remove_all(order, size, operations);
+	free(order);
+	return r;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `client_list_remove` in a random order
+ * 
+ * @param   data        Not used
+ * @param   size        The number of clients in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_remove_random(const void *data, size_t size, size_t operations)
+{
+	size_t *order = NULL, i;
+	int r;
+
+	(void) data;
+
+	fail_if (xmalloc(order, size, size_t));
+	for (i = 0; i < size; i++)
+		order[i] = i;
+	bench_shuffle(order, size);
+	r = remove_all(order, size, operations);
+	free(order);
+	return r;
+fail:
+	return -1;
+}
+
+
+/**
+ * The benchmark cases
+ */
+static const struct bench_case cases[] = {
+	{ "add",    "sequential", bench_add           },
+	{ "remove", "fifo",       bench_remove_fifo   },
+	{ "remove", "lifo",       bench_remove_lifo   },
+	{ "remove", "random",     bench_remove_random }
+};
+
+
+
+/**
+ * Run the benchmarks
+ * 
+ * @param   argc  The number of command line arguments
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 8, 64, 1024 };
+	size_t i, k, n;
+
+	n = argc > 1 ? (size_t)atol(argv[1]) : (1 << 20);
+
+	for (i = 0; i < sizeof(cases) / sizeof(*cases); i++)
+		for (k = 0; k < sizeof(sizes) / sizeof(*sizes); k++)
+			fail_if (bench_run("client-list", cases[i].operation, cases[i].variant,
+			                   sizes[k], n, cases[i].function, NULL));
+
+	return 0;
+fail:
+	if (errno)
+		perror(*argv);
+	return 1;
+}
@@ -0,0 +1,321 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include <libmdsserver/fd-table.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+
+/**
+ * Benchmark of `fd_table_t`
+ * 
+ * Usage: fd-table [OPERATIONS]
+ * 
+ * Each line of output is tab-separated, see bench.h
+ */
+
+
+
+/**
+ * A key distribution
+ */
+struct distribution {
+	/**
+	 * The name of the distribution
+	 */
+	const char *name;
+
+	/**
+	 * Get a key, distinct indices give distinct keys
+	 * 
+	 * @param   i  The index of the key
+	 * @return     The key
+	 */
+	int (*key)(size_t i);
+};
+
+
+/**
+ * An operation to benchmark
+ */
+struct operation {
+	/**
+	 * The name of the operation
+	 */
+	const char *name;
+
+	/**
+	 * The benchmark case
+	 */
+	bench_func *function;
+};
+
+
+
+/**
+ * Get a key for the dense distribution, like the
+ * file descriptors of clients that stay connected
+ * 
+ * @param   i  The index of the key
+ * @return     The key
+ */
+static int __attribute__((const))
+dense_key(size_t i)
+{
+	return (int)(3 + i);
+}
+
+
+/**
+ * Get a key for the sparse distribution, like the file
+ * descriptors of clients after many have disconnected
+ * 
+ * @param   i  The index of the key
+ * @return     The key
+ */
+static int __attribute__((const))
+sparse_key(size_t i)
+{
+	return (int)(3 + 16 * i + bench_mix(i) % 16);
+}
+
+
+/**
+ * The key distributions
+ */
+static const struct distribution distributions[] = {
+	{ "dense",  dense_key  },
+	{ "sparse", sparse_key }
+};
+
+
+
+/**
+ * Create the keys in a random order, the first `size`
+ * are inserted into the table, the rest are not
+ * 
+ * @param   d     The key distribution
+ * @param   size  The number of keys in the table
+ * @return        The keys, `NULL` on error
+ */
+static size_t *
+make_keys(const struct distribution *d, size_t size)
+{
+	size_t *keys, i;
+	if (xmalloc(keys, 2 * size, size_t))
+		return NULL;
+	for (i = 0; i < 2 * size; i++)
+		keys[i] = (size_t)(d->key(i));
+	bench_shuffle(keys, 2 * size);
+	return keys;
+}
+
+
+/**
+ * Add keys to a table
+ * 
+ * @param   table  The table
+ * @param   keys   The keys
+ * @param   n      The number of keys
+ * @return         Zero on success, -1 on error
+ */
+static int
+fill_table(fd_table_t *table, const size_t *keys, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		errno = 0;
+		if (!fd_table_put(table, (int)(keys[i]), i + 1) && errno)
+			return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Benchmark `fd_table_put` of new keys, into a table
+ * that is grown from the default capacity
+ * 
+ * @param   data        The key distribution
+ * @param   size        The number of keys to insert
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_put(const void *data, size_t size, size_t operations)
+{
+	fd_table_t table;
+	size_t *keys, done;
+
+	fail_if (!(keys = make_keys(data, size)));
+	for (done = 0; done < operations; done += size) {
+		fail_if (fd_table_create(&table));
+		bench_start();
+		fail_if (fill_table(&table, keys, size));
+		bench_stop(size);
+		fd_table_destroy(&table, NULL, NULL);
+	}
+
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `fd_table_get` of keys in the table
+ * 
+ * @param   data        The key distribution
+ * @param   size        The number of keys in the table
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_get_hit(const void *data, size_t size, size_t operations)
+{
+	fd_table_t table;
+	size_t *keys, done, i, sum = 0;
+
+	fail_if (!(keys = make_keys(data, size)));
+	fail_if (fd_table_create(&table));
+	fail_if (fill_table(&table, keys, size));
+	bench_start();
+	for (done = 0; done < operations; done += size)
+		for (i = 0; i < size; i++)
+			sum += fd_table_get(&table, (int)(keys[i]));
+	bench_stop(done);
+	bench_sink = sum;
+
+	fd_table_destroy(&table, NULL, NULL);
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `fd_table_get` of keys not in the table
+ * 
+ * @param   data        The key distribution
+ * @param   size        The number of keys in the table
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_get_miss(const void *data, size_t size, size_t operations)
+{
+	fd_table_t table;
+	size_t *keys, done, i, sum = 0;
+
+	fail_if (!(keys = make_keys(data, size)));
+	fail_if (fd_table_create(&table));
+	fail_if (fill_table(&table, keys, size));
+	bench_start();
+	for (done = 0; done < operations; done += size)
+		for (i = 0; i < size; i++)
+			sum += fd_table_get(&table, (int)(keys[size + i]));
+	bench_stop(done);
+	bench_sink = sum;
+
+	fd_table_destroy(&table, NULL, NULL);
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `fd_table_remove` until the table is empty
+ * 
+ * @param   data        The key distribution
+ * @param   size        The number of keys in the table
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_remove(const void *data, size_t size, size_t operations)
+{
+	fd_table_t table;
+	size_t *keys, done, i, sum = 0;
+
+	fail_if (!(keys = make_keys(data, size)));
+	for (done = 0; done < operations; done += size) {
+		fail_if (fd_table_create(&table));
+		fail_if (fill_table(&table, keys, size));
+		bench_start();
+		for (i = 0; i < size; i++)
+			sum += fd_table_remove(&table, (int)(keys[i]));
+		bench_stop(size);
+		fd_table_destroy(&table, NULL, NULL);
+	}
+	bench_sink = sum;
+
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * The operations to benchmark
+ */
+static const struct operation operations[] = {
+	{ "put",      bench_put      },
+	{ "get-hit",  bench_get_hit  },
+	{ "get-miss", bench_get_miss },
+	{ "remove",   bench_remove   }
+};
+
+
+
+/**
+ * Run the benchmarks
+ * 
+ * @param   argc  The number of command line arguments
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 16, 256, 4096 };
+	size_t i, j, k, n;
+
+	n = argc > 1 ? (size_t)atol(argv[1]) : (1 << 20);
+
+	for (i = 0; i < sizeof(operations) / sizeof(*operations); i++)
+		for (j = 0; j < sizeof(distributions) / sizeof(*distributions); j++)
+			for (k = 0; k < sizeof(sizes) / sizeof(*sizes); k++)
+				fail_if (bench_run("fd-table", operations[i].name, distributions[j].name,
+				                   sizes[k], n, operations[i].function, distributions + j));
+
+	return 0;
+fail:
+	if (errno)
+		perror(*argv);
+	return 1;
+}
@@ -0,0 +1,364 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include <libmdsserver/hash-list.h>
+#include <libmdsserver/hash-help.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+
+/**
+ * Benchmark of the `hash_list` template, instantiated
+ * like in mds-colour, with strings as keys
+ * 
+ * Usage: hash-list [OPERATIONS]
+ * 
+ * Each line of output is tab-separated, see bench.h
+ */
+
+
+
+/**
+ * An operation to benchmark
+ */
+struct operation {
+	/**
+	 * The name of the operation
+	 */
+	const char *name;
+
+	/**
+	 * The benchmark case
+	 */
+	bench_func *function;
+};
+
+
+
+/**
+ * A hash list with strings as keys
+ */
+CREATE_HASH_LIST_SUBCLASS(bench_list, char *restrict, const char *restrict, size_t)
+
+
+
+/**
+ * Comparing keys
+ * 
+ * @param   key_a  The first key, will never be `NULL`
+ * @param   key_b  The second key, will never be `NULL`
+ * @return         Whether the keys are equal
+ */
+static inline int
+bench_list_key_comparer(const char *key_a, const char *key_b)
+{
+	return !strcmp(key_a, key_b);
+}
+
+
+/**
+ * Determine the marshal-size of an entry's key and value
+ * 
+ * @param   entry  The entry, will never be `NULL`, any only used entries will be passed
+ * @return         The marshal-size of the entry's key and value
+ */
+static inline size_t
+bench_list_submarshal_size(const bench_list_entry_t *entry)
+{
+	return sizeof(size_t) + (strlen(entry->key) + 1) * sizeof(char);
+}
+
+
+/**
+ * Marshal an entry's key and value
+ * 
+ * @param   entry  The entry, will never be `NULL`, any only used entries will be passed
+ * @param   data   The buffer where the entry's key and value will be stored
+ * @return         The marshal-size of the entry's key and value
+ */
+static inline size_t
+bench_list_submarshal(const bench_list_entry_t *entry, char *restrict data)
+{
+	size_t n = (strlen(entry->key) + 1) * sizeof(char);
+	memcpy(data, &(entry->value), sizeof(size_t));
+	memcpy(data + sizeof(size_t) / sizeof(char), entry->key, n);
+	return sizeof(size_t) + n;
+}
+
+
+/**
+ * Unmarshal an entry's key and value
+ * 
+ * @param   entry  The entry, will never be `NULL`, any only used entries will be passed
+ * @param   data   The buffer where the entry's key and value is stored
+ * @return         The number of read bytes, zero on error
+ */
+static inline size_t
+bench_list_subunmarshal(bench_list_entry_t *entry, char *restrict data)
+{
+	size_t n;
+	memcpy(&(entry->value), data, sizeof(size_t));
+	data += sizeof(size_t) / sizeof(char);
+	n = (strlen(data) + 1) * sizeof(char);
+	if (xbmalloc(entry->key, n))
+		return 0;
+	memcpy(entry->key, data, n);
+	return sizeof(size_t) + n;
+}
+
+
+
+/**
+ * Create the keys, the first `size` are inserted
+ * into the list, the rest are not
+ * 
+ * @param   size  The number of keys in the list
+ * @return        The keys, `NULL` on error
+ */
+static char **
+make_keys(size_t size)
+{
+	char **keys;
+	size_t i;
+	if (xcalloc(keys, 2 * size, char *))
+		return NULL;
+	for (i = 0; i < 2 * size; i++)
+		if (xasprintf(keys[i], "colour-%zu", i))
+			return NULL;
+	return keys;
+}
+
+
+/**
+ * Create a list
+ * 
+ * @param   list  Memory slot in which to store the list
+ * @return        Zero on success, -1 on error
+ */
+static int
+make_list(bench_list_t *list)
+{
+	if (bench_list_create(list, 0))
+		return -1;
+	list->hasher = string_hash;
+	return 0;
+}
+
+
+/**
+ * Add keys to a list
+ * 
+ * @param   list  The list
+ * @param   keys  The keys
+ * @param   n     The number of keys
+ * @return        Zero on success, -1 on error
+ */
+static int
+fill_list(bench_list_t *list, char **keys, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		if (bench_list_put(list, keys[i], &i))
+			return -1;
+	return 0;
+}
+
+
+/**
+ * Benchmark `hash_list_put` of new keys, into a list
+ * that is grown from the default capacity
+ * 
+ * @param   data        Not used
+ * @param   size        The number of keys to insert
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_put(const void *data, size_t size, size_t operations)
+{
+	bench_list_t list;
+	char **keys;
+	size_t done;
+
+	(void) data;
+
+	fail_if (!(keys = make_keys(size)));
+	for (done = 0; done < operations; done += size) {
+		fail_if (make_list(&list));
+		bench_start();
+		fail_if (fill_list(&list, keys, size));
+		bench_stop(size);
+		bench_list_destroy(&list);
+	}
+
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `hash_list_get` of keys in the list
+ * 
+ * @param   data        Not used
+ * @param   size        The number of keys in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_get_hit(const void *data, size_t size, size_t operations)
+{
+	bench_list_t list;
+	char **keys;
+	size_t done, i, sum = 0, value;
+
+	(void) data;
+
+	fail_if (!(keys = make_keys(size)));
+	fail_if (make_list(&list));
+	fail_if (fill_list(&list, keys, size));
+	bench_start();
+	for (done = 0; done < operations; done += size)
+		for (i = 0; i < size; i++)
+			sum += bench_list_get(&list, keys[i], &value) ? value : 0;
+	bench_stop(done);
+	bench_sink = sum;
+
+	bench_list_destroy(&list);
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `hash_list_get` of keys not in the list
+ * 
+ * @param   data        Not used
+ * @param   size        The number of keys in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_get_miss(const void *data, size_t size, size_t operations)
+{
+	bench_list_t list;
+	char **keys;
+	size_t done, i, sum = 0, value;
+
+	(void) data;
+
+	fail_if (!(keys = make_keys(size)));
+	fail_if (make_list(&list));
+	fail_if (fill_list(&list, keys, size));
+	bench_start();
+	for (done = 0; done < operations; done += size)
+		for (i = 0; i < size; i++)
+			sum += bench_list_get(&list, keys[size + i], &value) ? value : 0;
+	bench_stop(done);
+	bench_sink = sum;
+
+	bench_list_destroy(&list);
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `hash_list_remove` until the list is empty
+ * 
+ * @param   data        Not used
+ * @param   size        The number of keys in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_remove(const void *data, size_t size, size_t operations)
+{
+	bench_list_t list;
+	char **keys;
+	size_t done, i;
+
+	(void) data;
+
+	fail_if (!(keys = make_keys(size)));
+	for (done = 0; done < operations; done += size) {
+		fail_if (make_list(&list));
+		fail_if (fill_list(&list, keys, size));
+		bench_start();
+		for (i = 0; i < size; i++)
+			bench_list_remove(&list, keys[i]);
+		bench_stop(size);
+		bench_list_destroy(&list);
+	}
+
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * The operations to benchmark
+ */
+static const struct operation operations[] = {
+	{ "put",      bench_put      },
+	{ "get-hit",  bench_get_hit  },
+	{ "get-miss", bench_get_miss },
+	{ "remove",   bench_remove   }
+};
+
+
+
+/**
+ * Run the benchmarks
+ * 
+ * @param   argc  The number of command line arguments
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 16, 64, 256 };
+	size_t i, k, n;
+
+	n = argc > 1 ? (size_t)atol(argv[1]) : (1 << 20);
+
+	for (i = 0; i < sizeof(operations) / sizeof(*operations); i++)
+		for (k = 0; k < sizeof(sizes) / sizeof(*sizes); k++)
+			fail_if (bench_run("hash-list", operations[i].name, "string",
+			                   sizes[k], n, operations[i].function, NULL));
+
+	return 0;
+fail:
+	if (errno)
+		perror(*argv);
+	return 1;
+}
@@ -0,0 +1,392 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include <libmdsserver/hash-table.h>
+#include <libmdsserver/hash-help.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+
+/**
+ * Benchmark of `hash_table_t`
+ * 
+ * Usage: hash-table [OPERATIONS]
+ * 
+ * Each line of output is tab-separated, see bench.h
+ */
+
+
+
+/**
+ * A key distribution
+ */
+struct distribution {
+	/**
+	 * The name of the distribution
+	 */
+	const char *name;
+
+	/**
+	 * Get a key, distinct indices give distinct keys
+	 * 
+	 * @param   i  The index of the key
+	 * @return     The key, 0 on error
+	 */
+	size_t (*key)(size_t i);
+
+	/**
+	 * Whether the keys are strings, that are hashed
+	 * and compared like in mds-registry
+	 */
+	int strings;
+};
+
+
+/**
+ * An operation to benchmark
+ */
+struct operation {
+	/**
+	 * The name of the operation
+	 */
+	const char *name;
+
+	/**
+	 * The benchmark case
+	 */
+	bench_func *function;
+};
+
+
+
+/**
+ * Get a key for the sequential distribution, like
+ * the message modification ID:s in mds-server
+ * 
+ * @param   i  The index of the key
+ * @return     The key
+ */
+static size_t __attribute__((const))
+sequential_key(size_t i)
+{
+	return i + 1;
+}
+
+
+/**
+ * Get a key for the random distribution
+ * 
+ * @param   i  The index of the key
+ * @return     The key
+ */
+static size_t __attribute__((const))
+random_key(size_t i)
+{
+	return bench_mix(i + 1);
+}
+
+
+/**
+ * Get a key for the string distribution
+ * 
+ * @param   i  The index of the key
+ * @return     The key, 0 on error
+ */
+static size_t
+string_key(size_t i)
+{
+	char *str;
+	if (xasprintf(str, "org.example.key.%zx", bench_mix(i)))
+		return 0;
+	return (size_t)(void *)str;
+}
+
+
+/**
+ * The key distributions
+ */
+static const struct distribution distributions[] = {
+	{ "sequential", sequential_key, 0 },
+	{ "random",     random_key,     0 },
+	{ "string",     string_key,     1 }
+};
+
+
+
+/**
+ * Create the keys, the first `size` are inserted
+ * into the table, the rest are not
+ * 
+ * @param   d     The key distribution
+ * @param   size  The number of keys in the table
+ * @return        The keys, `NULL` on error
+ */
+static size_t *
+make_keys(const struct distribution *d, size_t size)
+{
+	size_t *keys, i;
+	if (xmalloc(keys, 2 * size, size_t))
+		return NULL;
+	for (i = 0; i < 2 * size; i++)
+		if (!(keys[i] = d->key(i)))
+			return free(keys), NULL;
+	return keys;
+}
+
+
+/**
+ * Compare two string keys
+ * 
+ * @param   a  The first key
+ * @param   b  The second key
+ * @return     Whether the keys are equal
+ */
+static int __attribute__((pure))
+compare_strings(size_t a, size_t b)
+{
+	return !strcmp((const char *)(void *)a, (const char *)(void *)b);
+}
+
+
+/**
+ * Hash a string key
+ * 
+ * @param   key  The key
+ * @return       The hash of the key
+ */
+static size_t __attribute__((pure))
+hash_string(size_t key)
+{
+	return string_hash((const char *)(void *)key);
+}
+
+
+/**
+ * Create a table
+ * 
+ * @param   table  Memory slot in which to store the table
+ * @param   d      The key distribution
+ * @return         Zero on success, -1 on error
+ */
+static int
+make_table(hash_table_t *table, const struct distribution *d)
+{
+	if (hash_table_create(table))
+		return -1;
+	if (d->strings) {
+		table->key_comparator = compare_strings;
+		table->hasher = hash_string;
+	}
+	return 0;
+}
+
+
+/**
+ * Add keys to a table
+ * 
+ * @param   table  The table
+ * @param   keys   The keys
+ * @param   n      The number of keys
+ * @return         Zero on success, -1 on error
+ */
+static int
+fill_table(hash_table_t *table, const size_t *keys, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		errno = 0;
+		if (!hash_table_put(table, keys[i], i + 1) && errno)
+			return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Benchmark `hash_table_put` of new keys, into a table
+ * that is grown from the default capacity
+ * 
+ * @param   data        The key distribution
+ * @param   size        The number of keys to insert
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_put(const void *data, size_t size, size_t operations)
+{
+	hash_table_t table;
+	size_t *keys, done;
+
+	fail_if (!(keys = make_keys(data, size)));
+	for (done = 0; done < operations; done += size) {
+		fail_if (make_table(&table, data));
+		bench_start();
+		fail_if (fill_table(&table, keys, size));
+		bench_stop(size);
+		hash_table_destroy(&table, NULL, NULL);
+	}
+
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `hash_table_get` of keys in the table
+ * 
+ * @param   data        The key distribution
+ * @param   size        The number of keys in the table
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_get_hit(const void *data, size_t size, size_t operations)
+{
+	hash_table_t table;
+	size_t *keys, done, i, sum = 0;
+
+	fail_if (!(keys = make_keys(data, size)));
+	fail_if (make_table(&table, data));
+	fail_if (fill_table(&table, keys, size));
+	bench_start();
+	for (done = 0; done < operations; done += size)
+		for (i = 0; i < size; i++)
+			sum += hash_table_get(&table, keys[i]);
+	bench_stop(done);
+	bench_sink = sum;
+
+	hash_table_destroy(&table, NULL, NULL);
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `hash_table_get` of keys not in the table
+ * 
+ * @param   data        The key distribution
+ * @param   size        The number of keys in the table
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_get_miss(const void *data, size_t size, size_t operations)
+{
+	hash_table_t table;
+	size_t *keys, done, i, sum = 0;
+
+	fail_if (!(keys = make_keys(data, size)));
+	fail_if (make_table(&table, data));
+	fail_if (fill_table(&table, keys, size));
+	bench_start();
+	for (done = 0; done < operations; done += size)
+		for (i = 0; i < size; i++)
+			sum += hash_table_get(&table, keys[size + i]);
+	bench_stop(done);
+	bench_sink = sum;
+
+	hash_table_destroy(&table, NULL, NULL);
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `hash_table_remove` until the table is empty
+ * 
+ * @param   data        The key distribution
+ * @param   size        The number of keys in the table
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_remove(const void *data, size_t size, size_t operations)
+{
+	hash_table_t table;
+	size_t *keys, done, i, sum = 0;
+
+	fail_if (!(keys = make_keys(data, size)));
+	for (done = 0; done < operations; done += size) {
+		fail_if (make_table(&table, data));
+		fail_if (fill_table(&table, keys, size));
+		bench_start();
+		for (i = 0; i < size; i++)
+			sum += hash_table_remove(&table, keys[i]);
+		bench_stop(size);
+		hash_table_destroy(&table, NULL, NULL);
+	}
+	bench_sink = sum;
+
+	free(keys);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * The operations to benchmark
+ */
+static const struct operation operations[] = {
+	{ "put",      bench_put      },
+	{ "get-hit",  bench_get_hit  },
+	{ "get-miss", bench_get_miss },
+	{ "remove",   bench_remove   }
+};
+
+
+
+/**
+ * Run the benchmarks
+ * 
+ * @param   argc  The number of command line arguments
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 16, 1024, 65536 };
+	size_t i, j, k, n;
+
+	n = argc > 1 ? (size_t)atol(argv[1]) : (1 << 20);
+
+	for (i = 0; i < sizeof(operations) / sizeof(*operations); i++)
+		for (j = 0; j < sizeof(distributions) / sizeof(*distributions); j++)
+			for (k = 0; k < sizeof(sizes) / sizeof(*sizes); k++)
+				fail_if (bench_run("hash-table", operations[i].name, distributions[j].name,
+				                   sizes[k], n, operations[i].function, distributions + j));
+
+	return 0;
+fail:
+	if (errno)
+		perror(*argv);
+	return 1;
+}
@@ -0,0 +1,311 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include <libmdsserver/linked-list.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+
+/**
+ * Benchmark of `linked_list_t`
+ * 
+ * Usage: linked-list [OPERATIONS]
+ * 
+ * Each line of output is tab-separated, see bench.h
+ */
+
+
+
+/**
+ * A benchmark case
+ */
+struct bench_case {
+	/**
+	 * The name of the operation
+	 */
+	const char *operation;
+
+	/**
+	 * The name of the variant
+	 */
+	const char *variant;
+
+	/**
+	 * The benchmark case
+	 */
+	bench_func *function;
+};
+
+
+
+/**
+ * Create a list
+ * 
+ * @param   list   Memory slot in which to store the list
+ * @param   size   The number of values to insert
+ * @param   nodes  Output parameter for the nodes, in the order
+ *                 they were inserted, may be `NULL`
+ * @return         Zero on success, -1 on error
+ */
+static int
+make_list(linked_list_t *list, size_t size, ssize_t *nodes)
+{
+	ssize_t node;
+	size_t i;
+
+	if (linked_list_create(list, 0))
+		return -1;
+	for (i = 0; i < size; i++) {
+		if ((node = linked_list_insert_end(list, i + 1)) == LINKED_LIST_UNUSED)
+			return -1;
+		if (nodes)
+			nodes[i] = node;
+	}
+	return 0;
+}
+
+
+/**
+ * Benchmark `linked_list_insert_end` into a list
+ * that is grown from the default capacity
+ * 
+ * @param   data        Not used
+ * @param   size        The number of values to insert
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_insert_end(const void *data, size_t size, size_t operations)
+{
+	linked_list_t list;
+	size_t done;
+
+	(void) data;
+
+	for (done = 0; done < operations; done += size) {
+		bench_start();
+		fail_if (make_list(&list, size, NULL));
+		bench_stop(size);
+		linked_list_destroy(&list);
+	}
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `foreach_linked_list_node`, each visited node is an operation
+ * 
+ * @param   list        The list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+iterate(linked_list_t *list, size_t operations)
+{
+	size_t done = 0, sum = 0;
+	ssize_t node;
+
+	bench_start();
+	while (done < operations) {
+		foreach_linked_list_node (*list, node) {
+			sum += list->values[node];
+			done++;
+		}
+	}
+	bench_stop(done);
+	bench_sink = sum;
+
+	linked_list_destroy(list);
+	return 0;
+}
+
+
+/**
+ * Benchmark iteration over a list whose nodes
+ * are in the same order as in the arrays
+ * 
+ * @param   data        Not used
+ * @param   size        The number of values in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_iterate_packed(const void *data, size_t size, size_t operations)
+{
+	linked_list_t list;
+
+	(void) data;
+
+	fail_if (make_list(&list, size, NULL));
+	return iterate(&list, operations);
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark iteration over a list where half of the
+ * values have been removed and inserted again, so
+ * the nodes are not in the same order as in the arrays,
+ * like a list of clients after clients have reconnected
+ * 
+ * @param   data        Not used
+ * @param   size        The number of values in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_iterate_fragmented(const void *data, size_t size, size_t operations)
+{
+	linked_list_t list;
+	ssize_t *nodes = NULL;
+	size_t i;
+
+	(void) data;
+
+	fail_if (xmalloc(nodes, size, ssize_t));
+	fail_if (make_list(&list, size, nodes));
+	bench_shuffle((size_t *)nodes, size);
+	for (i = 0; i < size / 2; i++)
+		linked_list_remove(&list, nodes[i]);
+	for (i = 0; i < size / 2; i++)
+		fail_if (linked_list_insert_end(&list, i + 1) == LINKED_LIST_UNUSED);
+	free(nodes);
+
+	return iterate(&list, operations);
+fail:
+	free(nodes);
+	return -1;
+}
+
+
+/**
+ * Benchmark `linked_list_remove_beginning` until the list is empty
+ * 
+ * @param   data        Not used
+ * @param   size        The number of values in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_remove_fifo(const void *data, size_t size, size_t operations)
+{
+	linked_list_t list;
+	size_t done, i, sum = 0;
+
+	(void) data;
+
+	for (done = 0; done < operations; done += size) {
+		fail_if (make_list(&list, size, NULL));
+		bench_start();
+		for (i = 0; i < size; i++)
+			sum += (size_t)linked_list_remove_beginning(&list);
+		bench_stop(size);
+		linked_list_destroy(&list);
+	}
+	bench_sink = sum;
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Benchmark `linked_list_remove` in a random order until the list is empty
+ * 
+ * @param   data        Not used
+ * @param   size        The number of values in the list
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_remove_random(const void *data, size_t size, size_t operations)
+{
+	linked_list_t list;
+	ssize_t *nodes = NULL;
+	size_t done, i;
+
+	(void) data;
+
+	fail_if (xmalloc(nodes, size, ssize_t));
+	for (done = 0; done < operations; done += size) {
+		fail_if (make_list(&list, size, nodes));
+		bench_shuffle((size_t *)nodes, size);
+		bench_start();
+		for (i = 0; i < size; i++)
+			linked_list_remove(&list, nodes[i]);
+		bench_stop(size);
+		linked_list_destroy(&list);
+	}
+
+	free(nodes);
+	return 0;
+fail:
+	free(nodes);
+	return -1;
+}
+
+
+/**
+ * The benchmark cases
+ */
+static const struct bench_case cases[] = {
+	{ "insert-end", "append",     bench_insert_end         },
+	{ "iterate",    "packed",     bench_iterate_packed     },
+	{ "iterate",    "fragmented", bench_iterate_fragmented },
+	{ "remove",     "fifo",       bench_remove_fifo        },
+	{ "remove",     "random",     bench_remove_random      }
+};
+
+
+
+/**
+ * Run the benchmarks
+ * 
+ * @param   argc  The number of command line arguments
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 16, 1024, 65536 };
+	size_t i, k, n;
+
+	n = argc > 1 ? (size_t)atol(argv[1]) : (1 << 20);
+
+	for (i = 0; i < sizeof(cases) / sizeof(*cases); i++)
+		for (k = 0; k < sizeof(sizes) / sizeof(*sizes); k++)
+			fail_if (bench_run("linked-list", cases[i].operation, cases[i].variant,
+			                   sizes[k], n, cases[i].function, NULL));
+
+	return 0;
+fail:
+	if (errno)
+		perror(*argv);
+	return 1;
+}
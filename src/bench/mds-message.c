@@ -0,0 +1,387 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include <libmdsserver/mds-message.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+/**
+ * Benchmark of `mds_message_read`, `mds_message_compose`,
+ * `mds_message_marshal` and `mds_message_unmarshal`
+ * 
+ * Usage: mds-message [OPERATIONS]
+ * 
+ * Each line of output is tab-separated, see bench.h,
+ * the size is the number of bytes in the message
+ */
+
+
+
+/**
+ * The maximum number of bytes written to the
+ * socket before the messages are read
+ */
+#define BATCH_BYTES  (32 << 10)
+
+/**
+ * The number of messages unmarshalled before they are destroyed
+ */
+#define UNMARSHAL_BATCH  64
+
+
+/**
+ * A message to benchmark with
+ */
+struct variant {
+	/**
+	 * The name of the variant
+	 */
+	const char *name;
+
+	/**
+	 * The headers of the message, including the empty line
+	 */
+	const char *headers;
+
+	/**
+	 * The size of the payload
+	 */
+	size_t payload_size;
+};
+
+
+/**
+ * An operation to benchmark
+ */
+struct operation {
+	/**
+	 * The name of the operation
+	 */
+	const char *name;
+
+	/**
+	 * The benchmark case
+	 */
+	bench_func *function;
+};
+
+
+
+/**
+ * The messages to benchmark with
+ */
+static const struct variant variants[] = {
+	{ "command",
+	  "Command: get-size\nMessage ID: 1\nClient ID: 0:1\n\n", 0 },
+	{ "headers",
+	  "Command: keyboard-enumeration\nModify: yes\nModify ID: 2\nMessage ID: 1\n"
+	  "Client ID: 0:1\nTo: 0:2\nIn response to: 1\nOrigin: 0:1\nAction: add\n"
+	  "Level: 1\nTime to live: until-death\nClient closed: 0:3\nKeyboard: ps2\n"
+	  "Scancode: 28\nKeycode: 28\nReleased: no\n\n", 0 },
+	{ "payload",
+	  "Command: clipboard\nAction: add\nLevel: 1\nTime to live: forever\n"
+	  "Message ID: 1\nClient ID: 0:1\nLength: 4096\n\n", 4096 }
+};
+
+
+
+/**
+ * Create the text of one or more copies of a message
+ * 
+ * @param   v       The message
+ * @param   count   The number of copies
+ * @param   length  Output parameter for the length of the text
+ * @return          The text, `NULL` on error
+ */
+static char *
+make_text(const struct variant *v, size_t count, size_t *length)
+{
+	size_t n = strlen(v->headers), i;
+	char *text, *p;
+	if (xmalloc(text, count * (n + v->payload_size), char))
+		return NULL;
+	for (p = text, i = 0; i < count; i++) {
+		memcpy(p, v->headers, n);
+		memset(p + n, 'x', v->payload_size);
+		p += n + v->payload_size;
+	}
+	*length = count * (n + v->payload_size);
+	return text;
+}
+
+
+/**
+ * Write to a socket
+ * 
+ * @param   fd      The socket
+ * @param   text    The text
+ * @param   length  The length of the text
+ * @return          Zero on success, -1 on error
+ */
+static int
+write_text(int fd, const char *text, size_t length)
+{
+	size_t off;
+	ssize_t n;
+	for (off = 0; off < length; off += (size_t)n)
+		if ((n = send(fd, text + off, length - off, 0)) < 0)
+			return -1;
+	return 0;
+}
+
+
+/**
+ * Read a message, like a server that receives it
+ * 
+ * @param   message  The message to initialise and read
+ * @param   v        The message
+ * @return           Zero on success, -1 on error
+ */
+static int
+read_message(mds_message_t *message, const struct variant *v)
+{
+	int fds[2] = { -1, -1 };
+	size_t length;
+	char *text;
+
+	fail_if (!(text = make_text(v, 1, &length)));
+	fail_if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	fail_if (write_text(fds[1], text, length));
+	fail_if (mds_message_initialise(message));
+	fail_if (mds_message_read(message, fds[0]));
+	close(fds[0]);
+	close(fds[1]);
+	free(text);
+	return 0;
+fail:
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	free(text);
+	return -1;
+}
+
+
+/**
+ * Benchmark `mds_message_read`, from a socket
+ * that the messages have been written to
+ * 
+ * @param   data        The message
+ * @param   size        The length of the message
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_read(const void *data, size_t size, size_t operations)
+{
+	int fds[2] = { -1, -1 };
+	mds_message_t message;
+	size_t length, done, i, batch;
+	char *text;
+
+	mds_message_zero_initialise(&message);
+	batch = size < BATCH_BYTES ? BATCH_BYTES / size : 1;
+	fail_if (!(text = make_text(data, batch, &length)));
+	fail_if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	fail_if (mds_message_initialise(&message));
+
+	for (done = 0; done < operations; done += batch) {
+		fail_if (write_text(fds[1], text, length));
+		bench_start();
+		for (i = 0; i < batch; i++)
+			fail_if (mds_message_read(&message, fds[0]));
+		bench_stop(batch);
+	}
+
+	mds_message_destroy(&message);
+	close(fds[0]);
+	close(fds[1]);
+	free(text);
+	return 0;
+fail:
+	mds_message_destroy(&message);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	free(text);
+	return -1;
+}
+
+
+/**
+ * Benchmark `mds_message_compose_size` and `mds_message_compose`
+ * 
+ * @param   data        The message
+ * @param   size        The length of the message
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_compose(const void *data, size_t size, size_t operations)
+{
+	mds_message_t message;
+	char *buffer = NULL;
+	size_t done, sum = 0;
+
+	(void) size;
+
+	fail_if (read_message(&message, data));
+	fail_if (xmalloc(buffer, mds_message_compose_size(&message), char));
+
+	bench_start();
+	for (done = 0; done < operations; done++) {
+		sum += mds_message_compose_size(&message);
+		mds_message_compose(&message, buffer);
+	}
+	bench_stop(done);
+	bench_sink = sum;
+
+	mds_message_destroy(&message);
+	free(buffer);
+	return 0;
+fail:
+	free(buffer);
+	return -1;
+}
+
+
+/**
+ * Benchmark `mds_message_marshal_size` and `mds_message_marshal`
+ * 
+ * @param   data        The message
+ * @param   size        The length of the message
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_marshal(const void *data, size_t size, size_t operations)
+{
+	mds_message_t message;
+	char *buffer = NULL;
+	size_t done, sum = 0;
+
+	(void) size;
+
+	fail_if (read_message(&message, data));
+	fail_if (xmalloc(buffer, mds_message_marshal_size(&message), char));
+
+	bench_start();
+	for (done = 0; done < operations; done++) {
+		sum += mds_message_marshal_size(&message);
+		mds_message_marshal(&message, buffer);
+	}
+	bench_stop(done);
+	bench_sink = sum;
+
+	mds_message_destroy(&message);
+	free(buffer);
+	return 0;
+fail:
+	free(buffer);
+	return -1;
+}
+
+
+/**
+ * Benchmark `mds_message_unmarshal`
+ * 
+ * @param   data        The message
+ * @param   size        The length of the message
+ * @param   operations  The number of operations to measure
+ * @return              Zero on success, -1 on error
+ */
+static int
+bench_unmarshal(const void *data, size_t size, size_t operations)
+{
+	mds_message_t message, messages[UNMARSHAL_BATCH];
+	char *buffer = NULL;
+	size_t done, i;
+
+	(void) size;
+
+	fail_if (read_message(&message, data));
+	fail_if (xmalloc(buffer, mds_message_marshal_size(&message), char));
+	mds_message_marshal(&message, buffer);
+	mds_message_destroy(&message);
+
+	for (done = 0; done < operations; done += UNMARSHAL_BATCH) {
+		bench_start();
+		for (i = 0; i < UNMARSHAL_BATCH; i++)
+			fail_if (mds_message_unmarshal(messages + i, buffer));
+		bench_stop(UNMARSHAL_BATCH);
+		for (i = 0; i < UNMARSHAL_BATCH; i++)
+			mds_message_destroy(messages + i);
+	}
+
+	free(buffer);
+	return 0;
+fail:
+	free(buffer);
+	return -1;
+}
+
+
+/**
+ * The operations to benchmark
+ */
+static const struct operation operations[] = {
+	{ "read",      bench_read      },
+	{ "compose",   bench_compose   },
+	{ "marshal",   bench_marshal   },
+	{ "unmarshal", bench_unmarshal }
+};
+
+
+
+/**
+ * Run the benchmarks
+ * 
+ * @param   argc  The number of command line arguments
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	size_t i, j, n;
+
+	n = argc > 1 ? (size_t)atol(argv[1]) : (1 << 20);
+
+	for (i = 0; i < sizeof(operations) / sizeof(*operations); i++)
+		for (j = 0; j < sizeof(variants) / sizeof(*variants); j++)
+			fail_if (bench_run("mds-message", operations[i].name, variants[j].name,
+			                   strlen(variants[j].headers) + variants[j].payload_size,
+			                   n, operations[i].function, variants + j));
+
+	return 0;
+fail:
+	if (errno)
+		perror(*argv);
+	return 1;
+}
@@ -0,0 +1,327 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <libmdsserver/mpsc-queue.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+
+
+
+/**
+ * Benchmark of the handoff of elements from producer threads
+ * to one consumer thread, comparing `mpsc_queue_t` with a
+ * mutex-protected array that is shifted with memmove(3) when
+ * an element is removed, and with a mutex-protected ring buffer
+ * 
+ * Usage: mpsc-queue [ELEMENTS-PER-PRODUCER]
+ * 
+ * Each line of output is tab-separated:
+ * benchmark, implementation, producers, elements, ns/op
+ */
+
+
+
+/**
+ * The number of elements each queue can hold
+ */
+#define CAPACITY  256
+
+/**
+ * The size of each element, the size of a queued multicast in mds-server
+ */
+#define ELEMENT_SIZE  96
+
+
+/**
+ * A queue implementation
+ */
+struct implementation {
+	/**
+	 * The name of the implementation
+	 */
+	const char *name;
+
+	/**
+	 * Add an element, fails if the queue is full
+	 */
+	int (*push)(const char *element);
+
+	/**
+	 * Remove an element, fails if the queue is empty
+	 */
+	int (*pop)(char *element);
+};
+
+
+
+/**
+ * The lock-free queue
+ */
+static mpsc_queue_t queue;
+
+/**
+ * The mutex for `array` and `ring`
+ */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The elements for the mutex-protected implementations
+ */
+static char elements[CAPACITY * ELEMENT_SIZE];
+
+/**
+ * The number of elements in `elements`
+ */
+static size_t count = 0;
+
+/**
+ * The index of the first element in `elements` for the ring buffer
+ */
+static size_t head = 0;
+
+/**
+ * The number of elements each producer adds
+ */
+static size_t per_producer;
+
+
+
+/**
+ * Add an element to `queue`
+ * 
+ * @param   element  The element
+ * @return           Zero on success, -1 if full
+ */
+static int
+queue_push(const char *element)
+{
+	return mpsc_queue_push(&queue, element);
+}
+
+
+/**
+ * Remove an element from `queue`
+ * 
+ * @param   element  Output parameter for the element
+ * @return           Zero on success, -1 if empty
+ */
+static int
+queue_pop(char *element)
+{
+	return mpsc_queue_pop(&queue, element);
+}
+
+
+/**
+ * Add an element to the memmove(3):d array
+ * 
+ * @param   element  The element
+ * @return           Zero on success, -1 if full
+ */
+static int
+array_push(const char *element)
+{
+	int r = -1;
+	with_mutex (mutex,
+	            if (count < CAPACITY) {
+	                    memcpy(elements + count++ * ELEMENT_SIZE, element, ELEMENT_SIZE);
+	                    r = 0;
+	            }
+	           );
+	return r;
+}
+
+
+/**
+ * Remove an element from the memmove(3):d array
+ * 
+ * @param   element  Output parameter for the element
+ * @return           Zero on success, -1 if empty
+ */
+static int
+array_pop(char *element)
+{
+	int r = -1;
+	with_mutex (mutex,
+	            if (count) {
+	                    memcpy(element, elements, ELEMENT_SIZE);
+	                    memmove(elements, elements + ELEMENT_SIZE, --count * ELEMENT_SIZE);
+	                    r = 0;
+	            }
+	           );
+	return r;
+}
+
+
+/**
+ * Add an element to the ring buffer
+ * 
+ * @param   element  The element
+ * @return           Zero on success, -1 if full
+ */
+static int
+ring_push(const char *element)
+{
+	int r = -1;
+	with_mutex (mutex,
+	            if (count < CAPACITY) {
+	                    memcpy(elements + (head + count++) % CAPACITY * ELEMENT_SIZE, element, ELEMENT_SIZE);
+	                    r = 0;
+	            }
+	           );
+	return r;
+}
+
+
+/**
+ * Remove an element from the ring buffer
+ * 
+ * @param   element  Output parameter for the element
+ * @return           Zero on success, -1 if empty
+ */
+static int
+ring_pop(char *element)
+{
+	int r = -1;
+	with_mutex (mutex,
+	            if (count) {
+	                    memcpy(element, elements + head * ELEMENT_SIZE, ELEMENT_SIZE);
+	                    head = (head + 1) % CAPACITY;
+	                    count--;
+	                    r = 0;
+	            }
+	           );
+	return r;
+}
+
+
+/**
+ * The implementations to benchmark
+ */
+static struct implementation implementations[] = {
+	{ "mpsc_queue_t",   queue_push, queue_pop },
+	{ "mutex+memmove",  array_push, array_pop },
+	{ "mutex+ring",     ring_push,  ring_pop  }
+};
+
+
+
+/**
+ * Get the current time in nanoseconds
+ * 
+ * @return  The current time
+ */
+static unsigned long long
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+
+/**
+ * Producer thread, adds `per_producer` elements
+ * 
+ * @param   data  The implementation
+ * @return        `NULL`
+ */
+static void *
+producer(void *data)
+{
+	const struct implementation *impl = data;
+	char element[ELEMENT_SIZE];
+	size_t i;
+
+	memset(element, 0, sizeof(element));
+	for (i = 0; i < per_producer; i++) {
+		*(size_t *)(void *)element = i;
+		while (impl->push(element))
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Run a benchmark and print the result
+ * 
+ * @param   impl       The implementation
+ * @param   producers  The number of producer threads
+ * @return             Zero on success, -1 on error
+ */
+static int
+run(struct implementation *impl, size_t producers)
+{
+	pthread_t threads[8];
+	char element[ELEMENT_SIZE];
+	unsigned long long start, end;
+	size_t i, total = producers * per_producer;
+
+	start = now();
+	for (i = 0; i < producers; i++)
+		fail_if ((errno = pthread_create(threads + i, NULL, producer, impl)));
+	for (i = 0; i < total; i++)
+		while (impl->pop(element))
+			sched_yield();
+	for (i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+	end = now();
+
+	printf("mpsc-queue\t%s\t%zu\t%zu\t%.1f\n", impl->name, producers, total,
+	       (double)(end - start) / (double)total);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Run the benchmarks
+ * 
+ * @param   argc  The number of command line arguments
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	static const size_t producer_counts[] = { 1, 2, 4, 8 };
+	size_t i, j;
+
+	per_producer = argc > 1 ? (size_t)atol(argv[1]) : 200000;
+
+	fail_if (mpsc_queue_create(&queue, CAPACITY, ELEMENT_SIZE, 0));
+	for (i = 0; i < sizeof(implementations) / sizeof(*implementations); i++)
+		for (j = 0; j < sizeof(producer_counts) / sizeof(*producer_counts); j++)
+			fail_if (run(implementations + i, producer_counts[j]));
+	mpsc_queue_destroy(&queue);
+
+	return 0;
+fail:
+	perror(*argv);
+	mpsc_queue_destroy(&queue);
+	return 1;
+}
@@ -0,0 +1,364 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <libmdsserver/config.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+
+
+/**
+ * Benchmark of the downtime of a server during a re-exec
+ * 
+ * The benchmark acts as the display the server connects
+ * to. It sends the server a burst of messages, re-execs
+ * it with `SIGUSR1` while it is processing them, and reads
+ * the `reexec-profile` message the server sends when it
+ * has unmarshalled its state. This is repeated and the
+ * median and 99:th percentile of the downtime is reported.
+ * 
+ * Usage: reexec SERVER [ITERATIONS [MESSAGES-PER-ITERATION]]
+ * 
+ * Each line of output is tab-separated:
+ * benchmark, server, iterations, state size (bytes),
+ * p50 downtime (ms), p99 downtime (ms)
+ */
+
+
+
+/**
+ * The number of milliseconds to wait for the server
+ */
+#define TIMEOUT  10000
+
+
+/**
+ * Messages for the server to process as load
+ */
+struct load {
+	/**
+	 * The name of the server
+	 */
+	const char *server;
+
+	/**
+	 * The headers of the message, except `Message ID`
+	 */
+	const char *headers;
+};
+
+
+
+/**
+ * The load for each server, the message is sent with a
+ * payload, `Command: echo` is used for unlisted servers
+ */
+static const struct load loads[] = {
+	{ "mds-clipboard", "Command: clipboard\nAction: get-size\nLevel: 0\nClient ID: 1:2\n" },
+	{ "mds-colour",    "Command: list-colours\nClient ID: 1:2\n" },
+	{ "mds-registry",  "Command: register\nAction: list\nClient ID: 1:2\n" },
+	{ NULL,            "Command: echo\nClient ID: 1:2\n" }
+};
+
+/**
+ * The socket the server is connected to
+ */
+static int connection = -1;
+
+/**
+ * Data read from `connection` that has not been parsed
+ */
+static char *inbuf = NULL;
+
+/**
+ * The number of bytes in `inbuf`
+ */
+static size_t inbuf_used = 0;
+
+/**
+ * The allocation size of `inbuf`
+ */
+static size_t inbuf_size = 0;
+
+/**
+ * The downtime of the last re-exec, in nanoseconds, -1 if not received
+ */
+static long long int downtime;
+
+/**
+ * The state size of the last re-exec
+ */
+static size_t state_size;
+
+
+
+/**
+ * Get the value of a header in a message
+ * 
+ * @param   headers  The headers, terminated by an empty line
+ * @param   header   The header, including the colon and space
+ * @return           The value, `NULL` if missing
+ */
+static const char * __attribute__((pure, nonnull))
+get_header(const char *headers, const char *header)
+{
+	const char *p = headers;
+	size_t n = strlen(header);
+
+	while (*p && *p != '\n') {
+		if (!strncmp(p, header, n))
+			return p + n;
+		p = strchr(p, '\n') + 1;
+	}
+	return NULL;
+}
+
+
+/**
+ * Parse the complete messages in `inbuf`, and remove them
+ */
+static void
+parse_messages(void)
+{
+	char *end;
+	const char *value;
+	size_t n, length;
+
+	while (inbuf_used && (end = memmem(inbuf, inbuf_used, "\n\n", 2))) {
+		end[1] = '\0';
+		value = get_header(inbuf, "Length: ");
+		length = value ? (size_t)atoll(value) : 0;
+		n = (size_t)(end - inbuf) + 2 + length;
+		if (n > inbuf_used) {
+			end[1] = '\n';
+			break;
+		}
+		value = get_header(inbuf, "Command: ");
+		if (value && !strncmp(value, "reexec-profile\n", strlen("reexec-profile\n"))) {
+			value = get_header(inbuf, "Downtime: ");
+			downtime = value ? atoll(value) : 0;
+			value = get_header(inbuf, "State size: ");
+			state_size = value ? (size_t)atoll(value) : 0;
+		}
+		memmove(inbuf, inbuf + n, inbuf_used -= n);
+	}
+}
+
+
+/**
+ * Read available data from the server
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+receive(void)
+{
+	ssize_t got;
+
+	if (inbuf_size - inbuf_used < 4096)
+		fail_if (xrealloc(inbuf, inbuf_size = inbuf_size * 2 + 8192, char));
+	got = recv(connection, inbuf + inbuf_used, inbuf_size - inbuf_used, MSG_DONTWAIT);
+	if (got < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	fail_if (got <= 0 ? (got == 0 ? (errno = ECONNRESET) : errno) : 0);
+	inbuf_used += (size_t)got;
+	parse_messages();
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Send data to the server while reading what it sends
+ * 
+ * @param   data    The data
+ * @param   length  The length of `data`
+ * @return          Zero on success, -1 on error
+ */
+static int
+transmit(const char *data, size_t length)
+{
+	struct pollfd pfd;
+	ssize_t sent;
+
+	pfd.fd = connection;
+	while (length) {
+		pfd.events = POLLIN | POLLOUT;
+		fail_if (poll(&pfd, 1, TIMEOUT) < 0 && errno != EINTR);
+		fail_if (!pfd.revents && (errno = ETIMEDOUT));
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+			fail_if (receive());
+		if (pfd.revents & POLLOUT) {
+			sent = send(connection, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (sent < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			fail_if (sent < 0);
+			data += sent;
+			length -= (size_t)sent;
+		}
+	}
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Compare two `long long int`:s
+ * 
+ * @param   a  The first value
+ * @param   b  The second value
+ * @return     Negative, zero or positive if `a` is less than, equal to, or greater than `b`
+ */
+static int
+cmp_ll(const void *a, const void *b)
+{
+	long long int x = *(const long long int *)a;
+	long long int y = *(const long long int *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Run the benchmark
+ * 
+ * @param   argc  The number of command line arguments
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	char pathname[PATH_MAX];
+	char display[3 * sizeof(intmax_t) + 2];
+	struct sockaddr_un address;
+	struct pollfd pfd;
+	const struct load *load;
+	const char *server, *name;
+	char *burst = NULL, *p;
+	long long int *downtimes = NULL;
+	size_t i, j, iterations, messages;
+	int listener = -1, null, r, saved_errno;
+	pid_t pid = -1;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s SERVER [ITERATIONS [MESSAGES-PER-ITERATION]]\n", *argv);
+		return 1;
+	}
+	server = argv[1];
+	iterations = argc > 2 ? (size_t)atol(argv[2]) : 100;
+	messages = argc > 3 ? (size_t)atol(argv[3]) : 64;
+	name = strrchr(server, '/') ? strrchr(server, '/') + 1 : server;
+	for (load = loads; load->server && strcmp(load->server, name); load++);
+
+	/* Act as a display. */
+	fail_if (mkdir(MDS_RUNTIME_ROOT_DIRECTORY, 0755) < 0 && errno != EEXIST);
+	xsnprintf(display, ":%ji", (intmax_t)getpid());
+	xsnprintf(pathname, "%s/%s.socket", MDS_RUNTIME_ROOT_DIRECTORY, display + 1);
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, pathname);
+	fail_if ((listener = socket(PF_UNIX, SOCK_STREAM, 0)) < 0);
+	unlink(pathname);
+	fail_if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0);
+	fail_if (listen(listener, 1) < 0);
+	fail_if (setenv("MDS_DISPLAY", display, 1) < 0);
+
+	/* Start the server, without its chatter on stderr. */
+	fail_if ((pid = fork()) < 0);
+	if (!pid) {
+		if ((null = open("/dev/null", O_WRONLY)) >= 0)
+			dup2(null, STDERR_FILENO);
+		execl(server, server, "--initial-spawn", NULL);
+		_exit(1);
+	}
+	pfd.fd = listener;
+	pfd.events = POLLIN;
+	fail_if ((r = poll(&pfd, 1, TIMEOUT)) < 0);
+	fail_if (!r && (errno = ETIMEDOUT));
+	fail_if ((connection = accept(listener, NULL, NULL)) < 0);
+
+	/* Prepare the load. */
+	fail_if (xmalloc(burst, messages * (strlen(load->headers) + 64), char));
+	for (p = burst, j = 0; j < messages; j++)
+		p += sprintf(p, "%sMessage ID: %zu\nLength: 5\n\nload\n", load->headers, j);
+	fail_if (xmalloc(downtimes, iterations ? iterations : 1, long long int));
+
+	/* Re-exec the server under load, over and over again. */
+	for (i = 0; i < iterations; i++) {
+		downtime = -1;
+		fail_if (transmit(burst, (size_t)(p - burst)));
+		fail_if (kill(pid, SIGUSR1) < 0);
+		pfd.fd = connection;
+		while (downtime < 0) {
+			fail_if (poll(&pfd, 1, TIMEOUT) < 0 && errno != EINTR);
+			fail_if (!pfd.revents && (errno = ETIMEDOUT));
+			fail_if (receive());
+		}
+		downtimes[i] = downtime;
+	}
+
+	/* Report. */
+	if (iterations) {
+		qsort(downtimes, iterations, sizeof(*downtimes), cmp_ll);
+		printf("reexec\t%s\t%zu\t%zu\t%.3f\t%.3f\n", name, iterations, state_size,
+		       (double)downtimes[(iterations - 1) * 50 / 100] / 1000000,
+		       (double)downtimes[(iterations - 1) * 99 / 100] / 1000000);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	close(connection);
+	close(listener);
+	unlink(pathname);
+	free(burst);
+	free(downtimes);
+	free(inbuf);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	fprintf(stderr, "%s: %s: %s\n", *argv, server, strerror(saved_errno));
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	if (connection >= 0)
+		close(connection);
+	if (listener >= 0) {
+		close(listener);
+		unlink(pathname);
+	}
+	free(burst);
+	free(downtimes);
+	free(inbuf);
+	return 1;
+}
@@ -0,0 +1,518 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "async.h"
+
+#include "proto-util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+
+#define static_strlen(str) (sizeof(str) / sizeof(char) - 1)
+
+#if EAGAIN == EWOULDBLOCK
+# define would_block(error)  ((error) == EAGAIN)
+#else
+# define would_block(error)  ((error) == EAGAIN || (error) == EWOULDBLOCK)
+#endif
+
+
+
+/**
+ * Initialise an asynchronous connection
+ * 
+ * The socket of the connection is made nonblocking, so
+ * `libmds_connection_send` may fail with `EAGAIN` on the
+ * connection afterwards, use `libmds_async_send` instead
+ * 
+ * @param   this        The asynchronous connection
+ * @param   connection  The connection, it must be established, and must
+ *                      not be destroyed before `this` is destroyed
+ * @param   on_message  Function to call for received messages that
+ *                      are not replies to requests, may be `NULL`
+ * @param   data        The user data for `on_message`
+ * @return              Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for fcntl(3)
+ */
+int
+libmds_async_initialise(libmds_async_t *restrict this, libmds_connection_t *restrict connection,
+                        libmds_async_message_func *on_message, void *data)
+{
+	int flags;
+
+	this->connection = connection;
+	this->on_message = on_message;
+	this->data = data;
+	this->writes = NULL;
+	this->writes_size = 0;
+	this->writes_head = 0;
+	this->writes_tail = 0;
+	this->requests = NULL;
+	this->requests_size = 0;
+	this->request_count = 0;
+	this->message.headers = NULL;
+	this->message.buffer = NULL;
+	this->message.flattened = 0;
+
+	if ((flags = fcntl(connection->socket_fd, F_GETFL)) < 0)
+		return -1;
+	if (!(flags & O_NONBLOCK) && fcntl(connection->socket_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+
+	return libmds_message_initialise(&(this->message));
+}
+
+
+/**
+ * Release all resources held by an asynchronous connection
+ * 
+ * The callbacks of all queued messages are called with `sent` set
+ * to zero, and the callbacks of all requests awaiting replies are
+ * called with `reply` set to `NULL`. The connection itself is not
+ * destroyed, but its socket remains nonblocking
+ * 
+ * @param  this  The asynchronous connection
+ */
+void
+libmds_async_destroy(libmds_async_t *restrict this)
+{
+	libmds_async_write_t *w;
+	libmds_async_request_t *r;
+	size_t i;
+
+	for (i = this->writes_head; i < this->writes_tail; i++) {
+		w = this->writes + i;
+		free(w->message);
+		if (w->callback)
+			w->callback(this, 0, w->data);
+	}
+	free(this->writes);
+	this->writes = NULL;
+	this->writes_head = this->writes_tail = this->writes_size = 0;
+
+	for (i = 0; i < this->request_count; i++) {
+		r = this->requests + i;
+		r->callback(this, NULL, r->data);
+	}
+	free(this->requests);
+	this->requests = NULL;
+	this->request_count = this->requests_size = 0;
+
+	libmds_message_destroy(&(this->message));
+}
+
+
+/**
+ * Get the events that an asynchronous connection shall be polled for
+ * 
+ * The returned value is usable both with poll(3) and epoll(7)
+ * 
+ * @param   this  The asynchronous connection
+ * @return        `POLLIN`, and `POLLOUT` if messages are queued
+ */
+int
+libmds_async_events(const libmds_async_t *restrict this)
+{
+	return POLLIN | (this->writes_head < this->writes_tail ? POLLOUT : 0);
+}
+
+
+/**
+ * Send queued messages until the queue is empty
+ * or the socket's send buffer is full
+ * 
+ * @param   this  The asynchronous connection
+ * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ECONNRESET  If the connection was closed
+ * @throws              Any error specified for send(2),
+ *                      except `EAGAIN`, `EWOULDBLOCK` and `EINTR`
+ */
+static int __attribute__((nonnull, warn_unused_result))
+flush(libmds_async_t *restrict this)
+{
+	libmds_async_write_t *w;
+	libmds_async_sent_func *callback;
+	void *data;
+	ssize_t n;
+
+	while (this->writes_head < this->writes_tail) {
+		w = this->writes + this->writes_head;
+		n = send(this->connection->socket_fd, w->message + w->sent, w->length - w->sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (would_block(errno))
+				return 0;
+			if (errno == EPIPE)
+				errno = ECONNRESET;
+			return -1;
+		}
+		if ((w->sent += (size_t)n) < w->length)
+			continue;
+
+		/* The callback may queue messages, so `w` is invalid after it. */
+		callback = w->callback;
+		data = w->data;
+		free(w->message);
+		this->writes_head++;
+		if (callback)
+			callback(this, 1, data);
+	}
+
+	this->writes_head = this->writes_tail = 0;
+	return 0;
+}
+
+
+/**
+ * Get the value of the `In response to`-header of a message
+ * 
+ * @param   message     The message
+ * @param   message_id  Output parameter for the value
+ * @return              Zero on success, -1 if the message does not
+ *                      have the header or if its value is invalid
+ */
+static int __attribute__((nonnull, warn_unused_result))
+get_in_response_to(const libmds_message_t *restrict message, uint32_t *restrict message_id)
+{
+	const char *value;
+	uint64_t id = 0;
+	size_t i;
+
+	for (i = 0; i < message->header_count; i++) {
+		if (strncmp(message->headers[i], "In response to: ", static_strlen("In response to: ")))
+			continue;
+		value = message->headers[i] + static_strlen("In response to: ");
+		if (!*value)
+			return -1;
+		for (; *value; value++) {
+			if (*value < '0' || '9' < *value)
+				return -1;
+			if ((id = id * 10 + (uint64_t)(*value & 15)) > UINT32_MAX)
+				return -1;
+		}
+		*message_id = (uint32_t)id;
+		return 0;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Remove a request from the list of requests awaiting replies
+ * 
+ * @param  this     The asynchronous connection
+ * @param  index    The index of the request
+ * @param  request  Output parameter for the removed request
+ */
+static void __attribute__((nonnull))
+remove_request(libmds_async_t *restrict this, size_t index, libmds_async_request_t *restrict request)
+{
+	*request = this->requests[index];
+	this->request_count -= 1;
+	memmove(this->requests + index, this->requests + index + 1,
+	        (this->request_count - index) * sizeof(libmds_async_request_t));
+}
+
+
+/**
+ * Pass a received message to its callback
+ * 
+ * Replies usually arrive in the same order as the requests
+ * were sent, and requests are kept oldest first, so the
+ * search for the request usually stops at the first one
+ * 
+ * @param  this     The asynchronous connection
+ * @param  message  The message
+ */
+static void __attribute__((nonnull))
+dispatch(libmds_async_t *restrict this, libmds_message_t *restrict message)
+{
+	libmds_async_request_t request;
+	uint32_t message_id;
+	size_t i;
+
+	if (!get_in_response_to(message, &message_id)) {
+		for (i = 0; i < this->request_count; i++) {
+			if (this->requests[i].message_id == message_id) {
+				remove_request(this, i, &request);
+				request.callback(this, message, request.data);
+				return;
+			}
+		}
+	}
+
+	if (this->on_message)
+		this->on_message(this, message, this->data);
+}
+
+
+/**
+ * Receive messages until no more are available
+ * 
+ * @param   this  The asynchronous connection
+ * @return        The return value follows the rules of `libmds_async_process`
+ * 
+ * @throws  ECONNRESET  If the connection was closed
+ * @throws  ENOMEM      Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                      RLIMIT_DATA limit described in getrlimit(2).
+ * @throws              Any error specified for recv(2),
+ *                      except `EAGAIN`, `EWOULDBLOCK` and `EINTR`
+ */
+static int __attribute__((nonnull, warn_unused_result))
+receive(libmds_async_t *restrict this)
+{
+	int r;
+
+	/* `libmds_message_read` keeps what it has read when `recv` fails,
+	   so a partially received message is resumed on the next call. */
+	for (;;) {
+		r = libmds_message_read(&(this->message), this->connection->socket_fd);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (would_block(errno))
+				return 0;
+		}
+		if (r)
+			return r;
+		dispatch(this, &(this->message));
+	}
+}
+
+
+/**
+ * Send queued messages and receive available messages,
+ * without blocking
+ * 
+ * Callbacks are called from this function, they may call
+ * `libmds_async_send`, `libmds_async_request` and `libmds_async_cancel`,
+ * but may not destroy the asynchronous connection
+ * 
+ * @param   this     The asynchronous connection
+ * @param   revents  The events that occurred on the file descriptor,
+ *                   as returned by poll(3) or epoll_wait(2)
+ * @return           Zero on success, -1 on error, `errno` will be set
+ *                   accordingly. -2 if a malformatted message was
+ *                   received, which is a state that cannot be
+ *                   recovered from, `errno` will not have been set
+ * 
+ * @throws  ECONNRESET  If the connection was closed
+ * @throws  ENOMEM      Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                      RLIMIT_DATA limit described in getrlimit(2).
+ * @throws              Any error specified for send(2) or recv(2),
+ *                      except `EAGAIN`, `EWOULDBLOCK` and `EINTR`
+ */
+int
+libmds_async_process(libmds_async_t *restrict this, int revents)
+{
+	if (revents & (POLLOUT | POLLERR | POLLHUP))
+		if (flush(this) < 0)
+			return -1;
+
+	if (revents & (POLLIN | POLLERR | POLLHUP))
+		return receive(this);
+
+	return 0;
+}
+
+
+/**
+ * Send a message
+ * 
+ * The message is copied and queued, it is sent by
+ * `libmds_async_process` when the socket is writable
+ * 
+ * @param   this      The asynchronous connection
+ * @param   message   The message, it is copied
+ * @param   length    The length of the message, should be positive
+ * @param   callback  Function to call when the message has been sent, may be `NULL`
+ * @param   data      The user data for `callback`
+ * @return            Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_async_send(libmds_async_t *restrict this, const char *restrict message, size_t length,
+                  libmds_async_sent_func *callback, void *data)
+{
+	libmds_async_write_t *new_writes;
+	libmds_async_write_t *w;
+	size_t n, new_size;
+	char *copy;
+
+	if (!(copy = malloc(length * sizeof(char))))
+		return -1;
+	memcpy(copy, message, length * sizeof(char));
+
+	if (this->writes_tail == this->writes_size) {
+		n = this->writes_tail - this->writes_head;
+		if (this->writes_head) {
+			/* Reuse the space of sent messages. */
+			memmove(this->writes, this->writes + this->writes_head, n * sizeof(libmds_async_write_t));
+			this->writes_head = 0;
+			this->writes_tail = n;
+		} else {
+			new_size = this->writes_size ? (this->writes_size << 1) : 8;
+			new_writes = realloc(this->writes, new_size * sizeof(libmds_async_write_t));
+			if (!new_writes)
+				return free(copy), -1;
+			this->writes = new_writes;
+			this->writes_size = new_size;
+		}
+	}
+
+	w = this->writes + this->writes_tail++;
+	w->message = copy;
+	w->length = length;
+	w->sent = 0;
+	w->callback = callback;
+	w->data = data;
+	return 0;
+}
+
+
+/**
+ * Send a request, and register a callback for its reply
+ * 
+ * @param   this        The asynchronous connection
+ * @param   message     The request, it is copied
+ * @param   length      The length of the request, should be positive
+ * @param   message_id  The value of the `Message ID`-header of the request,
+ *                      `libmds_async_next_message_id` can be used to select it
+ * @param   callback    Function to call when the reply is received
+ * @param   data        The user data for `callback`
+ * @return              Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_async_request(libmds_async_t *restrict this, const char *restrict message, size_t length,
+                     uint32_t message_id, libmds_async_reply_func *callback, void *data)
+{
+	libmds_async_request_t *new_requests;
+	libmds_async_request_t *r;
+	size_t new_size;
+
+	if (this->request_count == this->requests_size) {
+		new_size = this->requests_size ? (this->requests_size << 1) : 8;
+		new_requests = realloc(this->requests, new_size * sizeof(libmds_async_request_t));
+		if (!new_requests)
+			return -1;
+		this->requests = new_requests;
+		this->requests_size = new_size;
+	}
+
+	if (libmds_async_send(this, message, length, NULL, NULL) < 0)
+		return -1;
+
+	r = this->requests + this->request_count++;
+	r->message_id = message_id;
+	r->callback = callback;
+	r->data = data;
+	return 0;
+}
+
+
+/**
+ * Stop waiting for the reply to a request, its
+ * callback is called with `reply` set to `NULL`
+ * 
+ * @param   this        The asynchronous connection
+ * @param   message_id  The message ID of the request
+ * @return              Zero on success, -1 if there was no such request
+ */
+int
+libmds_async_cancel(libmds_async_t *restrict this, uint32_t message_id)
+{
+	libmds_async_request_t request;
+	size_t i;
+
+	for (i = 0; i < this->request_count; i++) {
+		if (this->requests[i].message_id == message_id) {
+			remove_request(this, i, &request);
+			request.callback(this, NULL, request.data);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+/**
+ * Check whether a message ID is not used by a request awaiting a reply
+ * 
+ * @param   message_id  The message ID
+ * @param   data        The asynchronous connection
+ * @return              1 if the message ID is free, 0 if it is in use
+ */
+static int __attribute__((pure))
+message_id_free(uint32_t message_id, void *data)
+{
+	const libmds_async_t *this = data;
+	size_t i;
+
+	for (i = 0; i < this->request_count; i++)
+		if (this->requests[i].message_id == message_id)
+			return 0;
+
+	return 1;
+}
+
+
+/**
+ * Select the message ID of the next message, skipping
+ * message ID:s of requests that are awaiting replies
+ * 
+ * The connection's message ID is updated, so the
+ * `LIBMDS_HEADER_MESSAGE_ID` macro can be used
+ * 
+ * @param   this        The asynchronous connection
+ * @param   message_id  Output parameter for the message ID, may be `NULL`
+ * @return              Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  EAGAIN  If all message ID:s are awaiting replies
+ * @throws          See pthread_mutex_lock(3)
+ */
+int
+libmds_async_next_message_id(libmds_async_t *restrict this, uint32_t *restrict message_id)
+{
+	int r, saved_errno;
+
+	if (libmds_connection_lock(this->connection))
+		return -1;
+
+	r = libmds_next_message_id(&(this->connection->message_id), message_id_free, this);
+	if (!r && message_id)
+		*message_id = this->connection->message_id;
+
+	saved_errno = errno;
+	(void) libmds_connection_unlock(this->connection);
+	return errno = saved_errno, r;
+}
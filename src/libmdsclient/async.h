@@ -0,0 +1,350 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSCLIENT_ASYNC_H
+#define MDS_LIBMDSCLIENT_ASYNC_H
+
+
+#include "comm.h"
+#include "inbound.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+
+
+
+struct libmds_async;
+
+
+/**
+ * Callback for received messages
+ * 
+ * @param  this     The asynchronous connection
+ * @param  message  The message, it is only valid until the callback
+ *                  returns, use `libmds_message_duplicate` to keep it
+ * @param  data     The user data given to `libmds_async_initialise`
+ */
+typedef void libmds_async_message_func(struct libmds_async *restrict this,
+                                       libmds_message_t *restrict message, void *data);
+
+/**
+ * Callback for replies to requests
+ * 
+ * @param  this   The asynchronous connection
+ * @param  reply  The reply, it is only valid until the callback returns,
+ *                use `libmds_message_duplicate` to keep it. `NULL` if
+ *                the request was cancelled, or if the connection is
+ *                being destroyed before a reply was received
+ * @param  data   The user data given with the request
+ */
+typedef void libmds_async_reply_func(struct libmds_async *restrict this,
+                                     libmds_message_t *restrict reply, void *data);
+
+/**
+ * Callback for sent messages
+ * 
+ * @param  this  The asynchronous connection
+ * @param  sent  Non-zero if the message was sent in full, zero if it
+ *               was discarded because the connection is being destroyed
+ * @param  data  The user data given with the message
+ */
+typedef void libmds_async_sent_func(struct libmds_async *restrict this, int sent, void *data);
+
+
+/**
+ * A queued outbound message
+ */
+typedef struct libmds_async_write
+{
+	/**
+	 * The message, owned by the queue
+	 */
+	char *message;
+
+	/**
+	 * The length of `message`
+	 */
+	size_t length;
+
+	/**
+	 * The number of bytes of `message` that have been sent
+	 */
+	size_t sent;
+
+	/**
+	 * Function to call when the message has been sent, may be `NULL`
+	 */
+	libmds_async_sent_func *callback;
+
+	/**
+	 * The user data for `callback`
+	 */
+	void *data;
+
+} libmds_async_write_t;
+
+
+/**
+ * A request awaiting its reply
+ */
+typedef struct libmds_async_request
+{
+	/**
+	 * The message ID of the request, the reply
+	 * has the same value in its `In response to`-header
+	 */
+	uint32_t message_id;
+
+	/**
+	 * Function to call when the reply is received
+	 */
+	libmds_async_reply_func *callback;
+
+	/**
+	 * The user data for `callback`
+	 */
+	void *data;
+
+} libmds_async_request_t;
+
+
+/**
+ * Asynchronous communication over a connection to the display server
+ * 
+ * Rather than blocking, the owner polls the file descriptor of the
+ * connection, for the events returned by `libmds_async_events`, and
+ * calls `libmds_async_process` with the events that occurred. This
+ * allows one thread to serve many connections, and to have many
+ * requests outstanding on each of them
+ * 
+ * The structure is not thread-safe, it should only be used by the
+ * thread that polls it
+ */
+typedef struct libmds_async
+{
+	/**
+	 * The connection, not owned by this structure
+	 */
+	libmds_connection_t *connection;
+
+	/**
+	 * The message being received (internal data)
+	 */
+	libmds_message_t message;
+
+	/**
+	 * Function to call for received messages
+	 * that are not replies to requests
+	 */
+	libmds_async_message_func *on_message;
+
+	/**
+	 * The user data for `on_message`
+	 */
+	void *data;
+
+	/**
+	 * Queued outbound messages (internal data)
+	 */
+	libmds_async_write_t *writes;
+
+	/**
+	 * The number of elements the current allocation
+	 * of `writes` can hold (internal data)
+	 */
+	size_t writes_size;
+
+	/**
+	 * The index of the first queued message in `writes` (internal data)
+	 */
+	size_t writes_head;
+
+	/**
+	 * The index after the last queued message in `writes` (internal data)
+	 */
+	size_t writes_tail;
+
+	/**
+	 * Requests awaiting replies, oldest first (internal data)
+	 */
+	libmds_async_request_t *requests;
+
+	/**
+	 * The number of elements the current allocation
+	 * of `requests` can hold (internal data)
+	 */
+	size_t requests_size;
+
+	/**
+	 * The number of requests awaiting replies (internal data)
+	 */
+	size_t request_count;
+
+} libmds_async_t;
+
+
+
+/**
+ * Initialise an asynchronous connection
+ * 
+ * The socket of the connection is made nonblocking, so
+ * `libmds_connection_send` may fail with `EAGAIN` on the
+ * connection afterwards, use `libmds_async_send` instead
+ * 
+ * @param   this        The asynchronous connection
+ * @param   connection  The connection, it must be established, and must
+ *                      not be destroyed before `this` is destroyed
+ * @param   on_message  Function to call for received messages that
+ *                      are not replies to requests, may be `NULL`
+ * @param   data        The user data for `on_message`
+ * @return              Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for fcntl(3)
+ */
+__attribute__((nonnull(1, 2), warn_unused_result))
+int libmds_async_initialise(libmds_async_t *restrict this, libmds_connection_t *restrict connection,
+                            libmds_async_message_func *on_message, void *data);
+
+/**
+ * Release all resources held by an asynchronous connection
+ * 
+ * The callbacks of all queued messages are called with `sent` set
+ * to zero, and the callbacks of all requests awaiting replies are
+ * called with `reply` set to `NULL`. The connection itself is not
+ * destroyed, but its socket remains nonblocking
+ * 
+ * @param  this  The asynchronous connection
+ */
+__attribute__((nonnull))
+void libmds_async_destroy(libmds_async_t *restrict this);
+
+/**
+ * Get the events that an asynchronous connection shall be polled for
+ * 
+ * The returned value is usable both with poll(3) and epoll(7)
+ * 
+ * @param   this  The asynchronous connection
+ * @return        `POLLIN`, and `POLLOUT` if messages are queued
+ */
+__attribute__((nonnull, pure, warn_unused_result))
+int libmds_async_events(const libmds_async_t *restrict this);
+
+/**
+ * Get the file descriptor that an asynchronous connection shall be polled on
+ * 
+ * @param   this:const libmds_async_t*  The asynchronous connection
+ * @return  :int                        The file descriptor
+ */
+#define libmds_async_fd(this)  ((this)->connection->socket_fd)
+
+/**
+ * Send queued messages and receive available messages,
+ * without blocking
+ * 
+ * Callbacks are called from this function, they may call
+ * `libmds_async_send`, `libmds_async_request` and `libmds_async_cancel`,
+ * but may not destroy the asynchronous connection
+ * 
+ * @param   this     The asynchronous connection
+ * @param   revents  The events that occurred on the file descriptor,
+ *                   as returned by poll(3) or epoll_wait(2)
+ * @return           Zero on success, -1 on error, `errno` will be set
+ *                   accordingly. -2 if a malformatted message was
+ *                   received, which is a state that cannot be
+ *                   recovered from, `errno` will not have been set
+ * 
+ * @throws  ECONNRESET  If the connection was closed
+ * @throws  ENOMEM      Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                      RLIMIT_DATA limit described in getrlimit(2).
+ * @throws              Any error specified for send(2) or recv(2),
+ *                      except `EAGAIN`, `EWOULDBLOCK` and `EINTR`
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_async_process(libmds_async_t *restrict this, int revents);
+
+/**
+ * Send a message
+ * 
+ * The message is copied and queued, it is sent by
+ * `libmds_async_process` when the socket is writable
+ * 
+ * @param   this      The asynchronous connection
+ * @param   message   The message, it is copied
+ * @param   length    The length of the message, should be positive
+ * @param   callback  Function to call when the message has been sent, may be `NULL`
+ * @param   data      The user data for `callback`
+ * @return            Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull(1, 2), warn_unused_result))
+int libmds_async_send(libmds_async_t *restrict this, const char *restrict message, size_t length,
+                      libmds_async_sent_func *callback, void *data);
+
+/**
+ * Send a request, and register a callback for its reply
+ * 
+ * @param   this        The asynchronous connection
+ * @param   message     The request, it is copied
+ * @param   length      The length of the request, should be positive
+ * @param   message_id  The value of the `Message ID`-header of the request,
+ *                      `libmds_async_next_message_id` can be used to select it
+ * @param   callback    Function to call when the reply is received
+ * @param   data        The user data for `callback`
+ * @return              Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull(1, 2, 5), warn_unused_result))
+int libmds_async_request(libmds_async_t *restrict this, const char *restrict message, size_t length,
+                         uint32_t message_id, libmds_async_reply_func *callback, void *data);
+
+/**
+ * Stop waiting for the reply to a request, its
+ * callback is called with `reply` set to `NULL`
+ * 
+ * @param   this        The asynchronous connection
+ * @param   message_id  The message ID of the request
+ * @return              Zero on success, -1 if there was no such request
+ */
+__attribute__((nonnull))
+int libmds_async_cancel(libmds_async_t *restrict this, uint32_t message_id);
+
+/**
+ * Select the message ID of the next message, skipping
+ * message ID:s of requests that are awaiting replies
+ * 
+ * The connection's message ID is updated, so the
+ * `LIBMDS_HEADER_MESSAGE_ID` macro can be used
+ * 
+ * @param   this        The asynchronous connection
+ * @param   message_id  Output parameter for the message ID, may be `NULL`
+ * @return              Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  EAGAIN  If all message ID:s are awaiting replies
+ * @throws          See pthread_mutex_lock(3)
+ */
+__attribute__((nonnull(1), warn_unused_result))
+int libmds_async_next_message_id(libmds_async_t *restrict this, uint32_t *restrict message_id);
+
+
+#endif
@@ -221,7 +221,7 @@ size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const
  * @throws  See pthread_mutex_lock(3)
  */
 #define libmds_connection_lock(this)\
-	(errno = pthread_mutex_lock(&((this)->mutex)), (errno ? 0 : -1))
+	(errno = pthread_mutex_lock(&((this)->mutex)), (errno ? -1 : 0))
 
 /**
  * Lock the connection descriptor for being modified,
@@ -234,7 +234,7 @@ size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const
  * @throws  See pthread_mutex_trylock(3)
  */
 #define libmds_connection_trylock(this)\
-	(errno = pthread_mutex_trylock(&((this)->mutex)), (errno ? 0 : -1))
+	(errno = pthread_mutex_trylock(&((this)->mutex)), (errno ? -1 : 0))
 
 /**
  * Lock the connection descriptor for being modified,
@@ -249,7 +249,7 @@ size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const
  * @throws  See pthread_mutex_timedlock(3)
  */
 #define libmds_connection_timedlock(this, deadline)\
-	(errno = pthread_mutex_timedlock(&((this)->mutex), deadline), (errno ? 0 : -1))
+	(errno = pthread_mutex_timedlock(&((this)->mutex), deadline), (errno ? -1 : 0))
 
 /**
  * Undo the action of `libmds_connection_lock`, `libmds_connection_trylock`
@@ -262,7 +262,7 @@ size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const
  * @throws  See pthread_mutex_unlock(3)
  */
 #define libmds_connection_unlock(this)\
-	(errno = pthread_mutex_unlock(&((this)->mutex)), (errno ? 0 : -1))
+	(errno = pthread_mutex_unlock(&((this)->mutex)), (errno ? -1 : 0))
 
 /**
  * Arguments for `libmds_compose` to compose the `Client ID`-header
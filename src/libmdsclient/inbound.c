@@ -24,14 +24,47 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <stdio.h>
-#include <assert.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <libmdsserver/scan.h>
 
 
 #define try(INSTRUCTION)   do { if ((r = INSTRUCTION) < 0) return r; } while (0)
 #define static_strlen(str) (sizeof(str) / sizeof(char) - 1)
 
 
+/**
+ * The default size of the blocks of a `libmds_receiver_t`
+ */
+#define RECEIVER_BLOCK_SIZE  (64 << 10)
+
+
+
+/**
+ * Reference counted block that messages are received into
+ */
+struct libmds_rxblock
+{
+	/**
+	 * The number of references to the block: one
+	 * for the receiver while it uses the block,
+	 * and one for each view into the block
+	 */
+	size_t references;
+
+	/**
+	 * The size of `data`
+	 */
+	size_t size;
+
+	/**
+	 * The received bytes
+	 */
+	char data[];
+};
+
+
 
 /**
  * Initialise a message slot so that it can
@@ -53,8 +86,10 @@ libmds_message_initialise(libmds_message_t *restrict this)
 	this->payload_size = 0;
 	this->buffer_size = 128;
 	this->buffer_ptr = 0;
+	this->buffer_off = 0;
 	this->stage = 0;
 	this->flattened = 0;
+	this->block = NULL;
 	this->buffer = malloc(this->buffer_size * sizeof(char));
 	return this->buffer == NULL ? -1 : 0;
 }
@@ -111,6 +146,7 @@ repoll:
 	*rc = *this;
 	rc->flattened   = reused ? reused : flattened_size;
 	rc->buffer_size = this->buffer_off;
+	rc->block       = NULL;
 
 	rc->buffer  = ((char*)rc) + sizeof(libmds_message_t) / sizeof(char);
 	rc->headers = rc->header_count ? (char**)(void*)(rc->buffer + this->buffer_off)        : NULL;
@@ -146,7 +182,13 @@ verify_utf8(const char *string, int allow_modified_nul)
 	  1111110. 10...... 10...... 10...... 10...... 10......   27        31
 	 */
 
-	while ((c = (long)(*string++))) {
+	for (;;) {
+		/* Skip past ASCII, which is most text, with vector instructions. */
+		if (!read_bytes)
+			string += scan_ascii(string);
+		if (!(c = (long)(*string++)))
+			break;
+
 		if (!read_bytes) {
 			/* First byte of the character. */
 
@@ -163,7 +205,7 @@ verify_utf8(const char *string, int allow_modified_nul)
 			while ((c & 0x80))
 				bytes++, c <<= 1;
 			read_bytes = 1;
-			character = c & 0x7F;
+			character = (c & 0x7F) >> bytes;
 			if (bytes > 6)
 				/* 31-bit characters can be encoded with 6-bytes,
 				   and UTF-8 does not cover higher code points. */
@@ -237,9 +279,12 @@ extend_buffer(libmds_message_t *restrict this, int shift)
 	char *new_buf = realloc(this->buffer, (this->buffer_size << shift) * sizeof(char));
 	if (!new_buf)
 		return -1;
-	if (new_buf != this->buffer)
+	if (new_buf != this->buffer) {
 		for (i = 0; i < n; i++)
 			this->headers[i] = new_buf + (size_t)(this->headers[i] - this->buffer);
+		if (this->payload)
+			this->payload = new_buf + (size_t)(this->payload - this->buffer);
+	}
 	this->buffer = new_buf;
 	this->buffer_size <<= shift;
 	return 0;
@@ -272,20 +317,23 @@ reset_message(libmds_message_t *restrict this)
 /**
  * Read the headers the message and determine, and store, its payload's length
  * 
- * @param   this  The message
- * @return        Zero on success, negative on error (malformated message: unrecoverable state)
+ * @param   headers       The headers of the message
+ * @param   header_count  The number of elements in `headers`
+ * @param   payload_size  Output parameter for the length of the payload,
+ *                        left unmodified if there is no `Length` header
+ * @return                Zero on success, negative on error (malformated message: unrecoverable state)
  */
-static int __attribute__((pure, nonnull, warn_unused_result))
-get_payload_length(libmds_message_t *restrict this)
+static int __attribute__((nonnull(3), warn_unused_result))
+get_payload_length(char **restrict headers, size_t header_count, size_t *restrict payload_size)
 {
 	char *header;
 	size_t i;
 
-	for (i = 0; i < this->header_count; i++) {
-		if (strstr(this->headers[i], "Length: ") == this->headers[i]) {
+	for (i = 0; i < header_count; i++) {
+		if (strstr(headers[i], "Length: ") == headers[i]) {
 			/* Store the message length. */
-			header = this->headers[i] + static_strlen("Length: ");
-			this->payload_size = (size_t)atoll(header);
+			header = headers[i] + static_strlen("Length: ");
+			*payload_size = (size_t)atoll(header);
 
 			/* Do not except a length that is not correctly formated. */
 			for (; *header; header++)
@@ -306,14 +354,15 @@ get_payload_length(libmds_message_t *restrict this)
  * 
  * @param   header  The header, must be NUL-terminated
  * @param   length  The length of the header
+ * @param   ascii   Whether the header is known to be ASCII
  * @return          Zero if valid, negative if invalid (malformated message: unrecoverable state)
  */
 static int __attribute__((pure, nonnull, warn_unused_result))
-validate_header(const char *header, size_t length)
+validate_header(const char *header, size_t length, int ascii)
 {
 	char *p = memchr(header, ':', length * sizeof(char));
 
-	if (verify_utf8(header, 0) < 0)
+	if (!ascii && verify_utf8(header, 0) < 0)
 		/* Either the string is not UTF-8, or your are under an UTF-8 attack,
 		   let's just call this unrecoverable because the client will not correct. */
 		return -2;
@@ -345,7 +394,7 @@ initialise_payload(libmds_message_t *restrict this)
 	this->buffer_off++;
 
 	/* Get the length of the payload. */
-	if (get_payload_length(this) < 0)
+	if (get_payload_length(this->headers, this->header_count, &(this->payload_size)) < 0)
 		return -2; /* Malformated value, enters unrecoverable state. */
 
 	/* Reallocate the buffer if it is too small. */
@@ -366,13 +415,14 @@ initialise_payload(libmds_message_t *restrict this)
  * 
  * @param   this    The message
  * @param   length  The length of the header, including LF-termination
+ * @param   ascii   Whether the header is known to be ASCII
  * @return          The return value follows the rules of `mds_message_read`
  * 
  * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
  *                  RLIMIT_DATA limit described in getrlimit(2).
  */
 static int __attribute__((nonnull, warn_unused_result))
-store_header(libmds_message_t *restrict this, size_t length)
+store_header(libmds_message_t *restrict this, size_t length, int ascii)
 {
 	char *header;
 
@@ -382,11 +432,11 @@ store_header(libmds_message_t *restrict this, size_t length)
 	header[length - 1] = '\0';
 
 	/* Update read offset. */
-	this->buffer += length;
+	this->buffer_off += length;
 
 	/* Make sure the the header syntax is correct so that
 	   the program does not need to care about it. */
-	if (validate_header(header, length))
+	if (validate_header(header, length, ascii))
 		return -2;
 
 	/* Store the header in the header list. */
@@ -460,8 +510,7 @@ int
 libmds_message_read(libmds_message_t *restrict this, int fd)
 {
 	size_t header_commit_buffer = 0;
-	int r;
-	char *p;
+	int r, ascii;
 	size_t length;
 
 	/* If we are at stage 2, we are done and it is time to start over.
@@ -474,10 +523,14 @@ libmds_message_read(libmds_message_t *restrict this, int fd)
 	/* Read from file descriptor until we have a full message. */
 	for (;;) {
 		/* Stage 0: headers. */
-		/* Read all headers that we have stored into the read buffer. */
-		while (!this->stage && ((p = memchr(this->buffer + this->buffer_off, '\n',
-		                                    (this->buffer_ptr - this->buffer_off) * sizeof(char))))) {
-			if ((length = (size_t)(p - (this->buffer + this->buffer_off)))) {
+		/* Read all headers that we have stored into the read buffer, checking
+		   whether they are ASCII while looking for their ends. */
+		while (!this->stage) {
+			ascii = 1;
+			length = scan_line(this->buffer + this->buffer_off, this->buffer_ptr - this->buffer_off, &ascii);
+			if (length == this->buffer_ptr - this->buffer_off)
+				break;
+			if (length) {
 				/* We have found a header. */
 
 				/* On every eighth header found with this function call,
@@ -487,7 +540,7 @@ libmds_message_read(libmds_message_t *restrict this, int fd)
 					try (extend_headers(this, header_commit_buffer = 8));
 
 				/* Store header. */
-				try (store_header(this, length + 1));
+				try (store_header(this, length + 1, ascii));
 				header_commit_buffer -= 1;
 			} else {
 				/* We have found an empty line, i.e. the end of the headers. */
@@ -525,6 +578,378 @@ libmds_message_read(libmds_message_t *restrict this, int fd)
 
 
 
+/**
+ * Drop a reference to a receive block, and free
+ * the block if it was the last reference
+ * 
+ * @param  block  The block, may be `NULL`
+ */
+static void
+block_release(struct libmds_rxblock *block)
+{
+	if (block && !__atomic_sub_fetch(&(block->references), 1, __ATOMIC_ACQ_REL))
+		free(block);
+}
+
+
+/**
+ * Release a message returned by `libmds_message_duplicate`,
+ * `libmds_receiver_read`, `libmds_mspool_poll` or `libmds_mspool_poll_try`
+ * 
+ * @param  this  The message
+ * @param  pool  Message allocation pool to offer the allocation to, may be `NULL`
+ */
+void
+libmds_message_release(libmds_message_t *restrict this, libmds_mpool_t *restrict pool)
+{
+	block_release(this->block);
+	this->block = NULL;
+	if (!pool || libmds_mpool_offer(pool, this) < 0)
+		free(this);
+}
+
+
+/**
+ * Initialise a zero-copy message receiver
+ * 
+ * @param   this        The receiver
+ * @param   block_size  The size of the receive blocks, zero for the default
+ * @return              Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_receiver_initialise(libmds_receiver_t *restrict this, size_t block_size)
+{
+	this->block_size = block_size < 256 ? (block_size ? 256 : RECEIVER_BLOCK_SIZE) : block_size;
+	this->ptr = 0;
+	this->off = 0;
+	this->scan = 0;
+	this->headers = NULL;
+	this->header_count = 0;
+	this->headers_size = 0;
+	this->payload_size = 0;
+	this->stage = 0;
+	this->block = malloc(sizeof(struct libmds_rxblock) + this->block_size * sizeof(char));
+	if (!this->block)
+		return -1;
+	this->block->references = 1;
+	this->block->size = this->block_size;
+	return 0;
+}
+
+
+/**
+ * Release all resources held by a receiver, views
+ * it has returned remain valid until they are released
+ * 
+ * @param  this  The receiver
+ */
+void
+libmds_receiver_destroy(libmds_receiver_t *restrict this)
+{
+	block_release(this->block), this->block = NULL;
+	free(this->headers), this->headers = NULL;
+}
+
+
+/**
+ * Move the current message to the beginning of a block
+ * that is large enough for it and for more data
+ * 
+ * The block is reused if no view refers to it,
+ * otherwise the message is copied to a new block
+ * 
+ * @param   this  The receiver
+ * @return        Zero on success, -1 on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static int __attribute__((nonnull, warn_unused_result))
+receiver_relocate(libmds_receiver_t *restrict this)
+{
+	struct libmds_rxblock *old = this->block, *new;
+	size_t i, partial = this->ptr - this->off, size = this->block_size;
+	char *old_data = old->data + this->off;
+
+	/* Make room for at least 128 more bytes, and for the whole payload. */
+	while (size < partial + 128)
+		size <<= 1;
+	if (this->stage == 1)
+		while (size < (this->scan - this->off) + this->payload_size)
+			size <<= 1;
+
+	if (__atomic_load_n(&(old->references), __ATOMIC_ACQUIRE) == 1) {
+		/* No view refers to the block, so it can be reused. */
+		if (size > old->size) {
+			new = realloc(old, sizeof(struct libmds_rxblock) + size * sizeof(char));
+			if (!new)
+				return -1;
+			new->size = size;
+		} else {
+			new = old;
+		}
+		memmove(new->data, new->data + this->off, partial * sizeof(char));
+	} else {
+		new = malloc(sizeof(struct libmds_rxblock) + size * sizeof(char));
+		if (!new)
+			return -1;
+		new->references = 1;
+		new->size = size;
+		memcpy(new->data, old_data, partial * sizeof(char));
+		block_release(old);
+	}
+
+	for (i = 0; i < this->header_count; i++)
+		this->headers[i] = new->data + (size_t)(this->headers[i] - old_data);
+	this->block = new;
+	this->ptr  -= this->off;
+	this->scan -= this->off;
+	this->off   = 0;
+	return 0;
+}
+
+
+/**
+ * Continue reading from the socket into the receiver's block
+ * 
+ * @param   this  The receiver
+ * @param   fd    The file descriptor of the socket
+ * @return        The return value follows the rules of `libmds_receiver_read`
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for recv(3)
+ */
+static int __attribute__((nonnull))
+receiver_fill(libmds_receiver_t *restrict this, int fd)
+{
+	struct libmds_rxblock *block = this->block;
+	ssize_t got;
+
+	/* Start over at the beginning of the block if
+	   nothing is buffered and no view refers to it. */
+	if (this->off == this->ptr && __atomic_load_n(&(block->references), __ATOMIC_ACQUIRE) == 1)
+		this->ptr = this->scan = this->off = 0;
+
+	/* Move the message if it does not fit in the rest of the block. */
+	if (this->stage == 1
+	    ? block->size - this->off < (this->scan - this->off) + this->payload_size
+	    : block->size - this->ptr < 128) {
+		if (receiver_relocate(this) < 0)
+			return -1;
+		block = this->block;
+	}
+
+	errno = 0;
+	got = recv(fd, block->data + this->ptr, block->size - this->ptr, 0);
+	this->ptr += (size_t)(got < 0 ? 0 : got);
+	if (errno)
+		return -1;
+	if (!got)
+		return errno = ECONNRESET, -1;
+
+	return 0;
+}
+
+
+/**
+ * Create a view of the current message, and start the next message
+ * 
+ * @param   this  The receiver
+ * @param   pool  Message allocation pool to take the view from, may be `NULL`
+ * @return        The view, `NULL` on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static libmds_message_t * __attribute__((nonnull(1), warn_unused_result))
+receiver_complete(libmds_receiver_t *restrict this, libmds_mpool_t *restrict pool)
+{
+	size_t view_size, reused, n = this->header_count;
+	size_t length = (this->scan - this->off) + this->payload_size;
+	libmds_message_t *rc;
+
+	/* Only the header list is stored in the view,
+	   everything else is left in the block. */
+	view_size = sizeof(libmds_message_t) + n * sizeof(char*);
+repoll:
+	reused = 0;
+	rc = !pool ? NULL : libmds_mpool_poll(pool);
+	if (rc) {
+		if ((reused = rc->flattened) < view_size) {
+			free(rc);
+			goto repoll;
+		}
+	}
+	if (!rc && !(rc = malloc(view_size)))
+		return NULL;
+
+	rc->headers      = n ? (char**)(void*)(rc + 1) : NULL;
+	rc->header_count = n;
+	rc->payload      = this->payload_size ? this->block->data + this->scan : NULL;
+	rc->payload_size = this->payload_size;
+	rc->buffer       = this->block->data + this->off;
+	rc->buffer_size  = rc->buffer_ptr = rc->buffer_off = length;
+	rc->flattened    = reused ? reused : view_size;
+	rc->stage        = 2;
+	rc->block        = this->block;
+	if (n)
+		memcpy(rc->headers, this->headers, n * sizeof(char*));
+	__atomic_add_fetch(&(this->block->references), 1, __ATOMIC_RELAXED);
+
+	this->off = this->scan += this->payload_size;
+	this->header_count = 0;
+	this->payload_size = 0;
+	this->stage = 0;
+	return rc;
+}
+
+
+/**
+ * Receive the next message from a file descriptor, without copying it
+ * 
+ * @param   this  The receiver
+ * @param   fd    The file descriptor
+ * @param   pool  Message allocation pool to take the view from, may be `NULL`
+ * @param   view  Output parameter for the message, it is flat, but its
+ *                headers and payload point into the receiver's block, so
+ *                it must not be modified. It must be released with
+ *                `libmds_message_release` or `libmds_mpool_offer`, and it
+ *                may be passed to other threads, for example with a
+ *                `libmds_mspool_t`, before it is released
+ * @return        Zero on success, -1 on error or interruption, `errno`
+ *                will be set accordingly. If interrupted, the function
+ *                can be called again to continue. If -2 is returned
+ *                `errno` will not have been set, -2 indicates that
+ *                the message is malformated, which is a state that
+ *                cannot be recovered from.
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for recv(3)
+ */
+int
+libmds_receiver_read(libmds_receiver_t *restrict this, int fd, libmds_mpool_t *restrict pool,
+                     libmds_message_t **restrict view)
+{
+	char **new_headers;
+	char *header;
+	size_t length;
+	int r, ascii;
+
+	/* Parse what has already been received before receiving more,
+	   the previous call may have received several messages. */
+	for (;;) {
+		/* Stage 0: headers. */
+		while (!this->stage) {
+			ascii = 1;
+			length = scan_line(this->block->data + this->scan, this->ptr - this->scan, &ascii);
+			if (length == this->ptr - this->scan)
+				break;
+			if (length) {
+				/* We have found a header, NUL-terminate it in place. */
+				if (this->header_count == this->headers_size) {
+					new_headers = realloc(this->headers, (this->headers_size + 8) * sizeof(char *));
+					if (!new_headers)
+						return -1;
+					this->headers = new_headers;
+					this->headers_size += 8;
+				}
+				header = this->block->data + this->scan;
+				header[length] = '\0';
+				this->scan += length + 1;
+				if (validate_header(header, length + 1, ascii))
+					return -2;
+				this->headers[this->header_count++] = header;
+			} else {
+				/* We have found an empty line, i.e. the end of the headers. */
+				this->scan += 1;
+				if (get_payload_length(this->headers, this->header_count, &(this->payload_size)) < 0)
+					return -2; /* Malformated value, enters unrecoverable state. */
+				this->stage = 1;
+			}
+		}
+
+		/* Stage 1: payload. */
+		if (this->stage == 1 && this->ptr - this->scan >= this->payload_size)
+			return (*view = receiver_complete(this, pool)) ? 0 : -1;
+
+		/* Continue reading from the socket into the block. */
+		try (receiver_fill(this, fd));
+	}
+}
+
+
+
+/**
+ * Get the slot that a message position maps to
+ * 
+ * The sequence number of the slot that the message with
+ * the position `p` (the value of `head` when it is spooled)
+ * will be stored in is `p` when the slot is free for it,
+ * `p + 1` when the message has been stored, and changed to
+ * `p + LIBMDS_MSPOOL_CAPACITY` when the message is polled,
+ * so that it is free for the message spooled a lap later
+ * 
+ * @param   this      The message spool
+ * @param   position  The position of the message
+ * @return            The slot
+ */
+#define SLOT(this, position)\
+	((this)->slots + ((position) & (LIBMDS_MSPOOL_CAPACITY - 1)))
+
+
+/**
+ * Wait until a futex is woken, or no longer has an expected value
+ * 
+ * @param   futex     The futex
+ * @param   value     The expected value of the futex
+ * @param   deadline  The CLOCK_REALTIME time the function must return, `NULL` for none
+ * @return            Zero on success or if the value has already changed,
+ *                    -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  EINTR      If interrupted
+ * @throws  EINVAL     If `deadline->tv_nsecs` is outside [0, 1 milliard[
+ * @throws  ETIMEDOUT  If the time specified `deadline` passed
+ */
+static int __attribute__((nonnull(1)))
+futex_wait(int *futex, int value, const struct timespec *restrict deadline)
+{
+	if (!syscall(SYS_futex, futex, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+	             value, deadline, NULL, FUTEX_BITSET_MATCH_ANY))
+		return 0;
+	return errno == EAGAIN ? 0 : -1;
+}
+
+
+/**
+ * Announce an event on a futex, and wake one
+ * thread waiting for it if there is any
+ * 
+ * @param  futex    The futex
+ * @param  waiting  The number of threads waiting on the futex
+ */
+static void __attribute__((nonnull))
+futex_post(int *futex, int *waiting)
+{
+	int saved_errno;
+
+	/* The event must be visible before `waiting` is read, and waiters
+	   increase `waiting` before they check for the event, so either
+	   the waiter sees the event or this thread sees the waiter. */
+	__atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+		return;
+
+	saved_errno = errno;
+	syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	errno = saved_errno;
+}
+
+
 /**
  * Initialise a message spool
  * 
@@ -537,27 +962,22 @@ libmds_message_read(libmds_message_t *restrict this, int fd)
 int
 libmds_mspool_initialise(libmds_mspool_t *restrict this)
 {
-	int stage = 0, saved_errno;
-	this->size = 1;
+	size_t i;
 	this->head = 0;
 	this->tail = 0;
 	this->spooled_bytes = 0;
 	this->spool_limit_bytes = 4 << 10;
 	this->spool_limit_messages = 8;
-	this->please_post = 0;
-	this->messages = malloc(sizeof(libmds_message_t*));
-	if (!this->messages)
+	this->spooled = 0;
+	this->polled = 0;
+	this->pollers_waiting = 0;
+	this->spoolers_waiting = 0;
+	this->slots = malloc(LIBMDS_MSPOOL_CAPACITY * sizeof(libmds_mspool_slot_t));
+	if (!this->slots)
 		return -1;
-	if (sem_init(&(this->lock),           0, 1) < 0) goto fail; else stage++;
-	if (sem_init(&(this->semaphore),      0, 0) < 0) goto fail; else stage++;
-	if (sem_init(&(this->wait_semaphore), 0, 0) < 0) goto fail;
+	for (i = 0; i < LIBMDS_MSPOOL_CAPACITY; i++)
+		this->slots[i].sequence = i;
 	return 0;
- fail:
-	saved_errno = errno;
-	if (stage >= 1) sem_destroy(&(this->lock));
-	if (stage >= 2) sem_destroy(&(this->semaphore));
-	free(this->messages), this->messages = NULL;
-	return errno = saved_errno, -1;
 }
 
 
@@ -569,123 +989,230 @@ libmds_mspool_initialise(libmds_mspool_t *restrict this)
 void
 libmds_mspool_destroy(libmds_mspool_t *restrict this)
 {
-	if (!this->messages)
+	if (!this->slots)
 		return;
 	while (this->tail < this->head)
-		free(this->messages[this->tail++]);
-	sem_destroy(&(this->lock));
-	sem_destroy(&(this->semaphore));
-	sem_destroy(&(this->wait_semaphore));
-	free(this->messages);
-	this->messages = NULL;
+		libmds_message_release(SLOT(this, this->tail++)->message, NULL);
+	free(this->slots);
+	this->slots = NULL;
 }
 
 
 /**
- * Spool a message
+ * Check whether a message spool is full
  * 
- * @param   this     The message spool
- * @param   message  The message to spool, must be flat (created with `libmds_message_duplicate`)
- * @return           Zero on success, -1 on error, `errno` will be set accordingly
+ * @param   this  The message spool
+ * @return        Whether the spool is full
+ */
+static int __attribute__((nonnull))
+mspool_full(libmds_mspool_t *restrict this)
+{
+	size_t limit = this->spool_limit_messages;
+	size_t tail = __atomic_load_n(&(this->tail), __ATOMIC_SEQ_CST);
+	size_t count = __atomic_load_n(&(this->head), __ATOMIC_SEQ_CST) - tail;
+
+	if (limit > LIBMDS_MSPOOL_CAPACITY)
+		limit = LIBMDS_MSPOOL_CAPACITY;
+	return (__atomic_load_n(&(this->spooled_bytes), __ATOMIC_SEQ_CST) >= this->spool_limit_bytes ||
+	        count >= limit);
+}
+
+
+/**
+ * Get the number of bytes a spooled message accounts for
  * 
- * @throws  EINTR   If interrupted
- * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
- *                  RLIMIT_DATA limit described in getrlimit(2).
+ * A view accounts for the message in its receive block,
+ * because the message keeps the block from being freed
+ * 
+ * @param   message  The message
+ * @return           The number of bytes
  */
-int
-libmds_mspool_spool(libmds_mspool_t *restrict this, libmds_message_t *restrict message)
+static inline size_t __attribute__((pure, nonnull))
+spooled_size(const libmds_message_t *restrict message)
 {
-	libmds_message_t **new;
-	int saved_errno;
+	return message->flattened + (message->block ? message->buffer_size : 0);
+}
 
-start_over:
-	/* Lock. */
-	if (sem_wait(&(this->lock)) < 0)
-		return -1;
 
-	/* Block if spool is full. */
-	if ((this->spooled_bytes     >= this->spool_limit_bytes) ||
-	    (this->head - this->tail >= this->spool_limit_messages)) {
-		this->please_post++;
-		if (sem_post(&this->lock) < 0 || sem_wait(&this->wait_semaphore) < 0)
-			return this->please_post--, -1;
-		goto start_over;
+/**
+ * Spool a message, without blocking
+ * 
+ * The message is spooled only if neither limit has been
+ * reached, the limits are checked with the same atomic
+ * operations that reserve the room for the message, so
+ * concurrent spoolers cannot exceed them together
+ * 
+ * @param   this     The message spool
+ * @param   message  The message to spool
+ * @return           Zero on success, -1 if the spool is full
+ */
+static int __attribute__((nonnull))
+mspool_try_spool(libmds_mspool_t *restrict this, libmds_message_t *restrict message)
+{
+	size_t size = spooled_size(message);
+	size_t limit = this->spool_limit_messages;
+	size_t bytes, position, tail;
+	libmds_mspool_slot_t *slot;
+	ssize_t difference;
+
+	if (limit > LIBMDS_MSPOOL_CAPACITY)
+		limit = LIBMDS_MSPOOL_CAPACITY;
+
+	/* Reserve the message's bytes, unless the limit has been reached. The
+	   message may exceed the limit, otherwise a message larger than the
+	   limit could never be spooled. Reserving the bytes before the message
+	   can be polled also ensures that `spooled_bytes` never underflows. */
+	bytes = __atomic_load_n(&(this->spooled_bytes), __ATOMIC_RELAXED);
+	do {
+		if (bytes >= this->spool_limit_bytes)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&(this->spooled_bytes), &bytes, bytes + size, 1,
+	                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	/* Claim the slot at `head`, unless the spool holds `limit` messages
+	   or the slot still holds the message from the previous lap. If
+	   another spooler claims it first, `position` is updated and the
+	   next slot is tried. `tail` only grows, so a stale value can only
+	   make the spool look fuller than it is. */
+	position = __atomic_load_n(&(this->head), __ATOMIC_RELAXED);
+	for (;;) {
+		tail = __atomic_load_n(&(this->tail), __ATOMIC_SEQ_CST);
+		if (tail > position) {
+			position = __atomic_load_n(&(this->head), __ATOMIC_RELAXED);
+			continue;
+		}
+		if (position - tail >= limit)
+			goto full;
+		slot = SLOT(this, position);
+		difference = (ssize_t)(__atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE) - position);
+		if (!difference) {
+			if (__atomic_compare_exchange_n(&(this->head), &position, position + 1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (difference < 0) {
+			goto full;
+		} else {
+			position = __atomic_load_n(&(this->head), __ATOMIC_RELAXED);
+		}
 	}
 
-	/* Rebase if the tail has come too far. */
-	if (this->tail << 1 > this->size) {
-		memmove(this->messages, this->messages + this->tail,
-		        (this->head - this->tail) * sizeof(sizeof(libmds_message_t *)));
-		this->head -= this->tail, this->tail = 0;
-	}
+	slot->message = message;
+	__atomic_store_n(&(slot->sequence), position + 1, __ATOMIC_RELEASE);
 
-	/* Grow the spool if necessary. */
-	if (this->size == this->head) {
-		new = realloc(this->messages, (this->size << 1) * sizeof(libmds_message_t *));
-		if (!new)
-			goto fail;
-		this->messages = new;
-		this->size <<= 1;
-	}
+	futex_post(&(this->spooled), &(this->pollers_waiting));
+	return 0;
 
-	/* Spool. */
-	this->spooled_bytes += message->flattened;
-	this->messages[this->head++] = message;
+full:
+	/* Give back the reserved bytes. Another spooler may have found
+	   the spool full because of them, but the spool holds messages,
+	   so it will be woken when one of them is polled. */
+	__atomic_sub_fetch(&(this->spooled_bytes), size, __ATOMIC_SEQ_CST);
+	return -1;
+}
 
-	/* Signal. */
-	if (sem_post(&(this->semaphore)) < 0)
-		goto fail;
 
-	/* Unlock. */
-	if (sem_post(&(this->lock)) < 0)
-		return -1;
+/**
+ * Spool a message
+ * 
+ * @param   this     The message spool
+ * @param   message  The message to spool, must be flat (created with
+ *                   `libmds_message_duplicate` or `libmds_receiver_read`)
+ * @return           Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  EINTR  If interrupted
+ */
+int
+libmds_mspool_spool(libmds_mspool_t *restrict this, libmds_message_t *restrict message)
+{
+	int polled, r;
+
+	while (mspool_try_spool(this, message)) {
+		/* Block until a message has been polled. */
+		__atomic_add_fetch(&(this->spoolers_waiting), 1, __ATOMIC_SEQ_CST);
+		polled = __atomic_load_n(&(this->polled), __ATOMIC_SEQ_CST);
+		r = mspool_full(this) ? futex_wait(&(this->polled), polled, NULL) : 0;
+		__atomic_sub_fetch(&(this->spoolers_waiting), 1, __ATOMIC_RELAXED);
+		if (r < 0)
+			return -1;
+	}
 
 	return 0;
-fail:
-	saved_errno = errno;
-	sem_post(&(this->lock));
-	return errno = saved_errno, -1;
 }
 
 
 /**
- * Poll a message from a spool
+ * Poll a message from a spool, without blocking
  * 
- * @param   this  The message spool, must not be empty
- * @return        A spooled message, `NULL`on error, `errno` will be set accordingly
+ * @param   this  The message spool
+ * @return        A spooled message, `NULL` if the spool is empty
  */
-static inline libmds_message_t *
-mspool_poll(libmds_mspool_t *restrict this)
+static libmds_message_t * __attribute__((nonnull))
+mspool_try_poll(libmds_mspool_t *restrict this)
 {
+	size_t position = __atomic_load_n(&(this->tail), __ATOMIC_RELAXED);
+	libmds_mspool_slot_t *slot;
 	libmds_message_t *msg;
+	ssize_t difference;
 
-	/* Lock. */
-	if (sem_wait(&(this->lock)) < 0)
-		return sem_post(&(this->semaphore)), NULL;
-
-	/* Fetch message. */
-	assert(this->tail < this->head);
-	msg = this->messages[this->tail++];
-	this->spooled_bytes -= msg->flattened;
-
-	/* Unblock spooler, takes effect when this->lock is unlocked. */
-	if (this->please_post) {
-		if (sem_post(&(this->wait_semaphore)) < 0)
-			perror("libmsdclient");
-		else
-			this->please_post--;
+	/* Claim the slot at `tail`, unless no message
+	   has been stored in it yet. If another poller
+	   claims it first, the next slot is tried. */
+	for (;;) {
+		slot = SLOT(this, position);
+		difference = (ssize_t)(__atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE) - (position + 1));
+		if (!difference) {
+			if (__atomic_compare_exchange_n(&(this->tail), &position, position + 1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (difference < 0) {
+			return NULL;
+		} else {
+			position = __atomic_load_n(&(this->tail), __ATOMIC_RELAXED);
+		}
 	}
 
-	/* Unlock. */
-	if (sem_post(&(this->lock)) < 0)
-		goto fail;
+	/* Fetch the message, and free the slot for the next lap. */
+	msg = slot->message;
+	__atomic_store_n(&(slot->sequence), position + LIBMDS_MSPOOL_CAPACITY, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&(this->spooled_bytes), spooled_size(msg), __ATOMIC_RELAXED);
+
+	/* Unblock a spooler. */
+	futex_post(&(this->polled), &(this->spoolers_waiting));
+	return msg;
+}
+
+
+/**
+ * Poll a message from a spool, wait until a deadline if empty
+ * 
+ * @param   this      The message spool
+ * @param   deadline  The CLOCK_REALTIME time the function must return,
+ *                    `NULL` to wait indefinitely
+ * @return            A spooled message, `NULL`on error, `errno` will be set accordingly
+ * 
+ * @throws  EINTR      If interrupted
+ * @throws  EINVAL     If `deadline->tv_nsecs` is outside [0, 1 milliard[
+ * @throws  ETIMEDOUT  If the time specified `deadline` passed and the spool was till empty
+ */
+static libmds_message_t * __attribute__((nonnull(1)))
+mspool_poll(libmds_mspool_t *restrict this, const struct timespec *restrict deadline)
+{
+	libmds_message_t *msg;
+	int spooled, r;
+
+	while (!(msg = mspool_try_poll(this))) {
+		/* Block until a message has been spooled. */
+		__atomic_add_fetch(&(this->pollers_waiting), 1, __ATOMIC_SEQ_CST);
+		spooled = __atomic_load_n(&(this->spooled), __ATOMIC_SEQ_CST);
+		r = (__atomic_load_n(&(this->head), __ATOMIC_SEQ_CST) ==
+		     __atomic_load_n(&(this->tail), __ATOMIC_SEQ_CST))
+			? futex_wait(&(this->spooled), spooled, deadline) : 0;
+		__atomic_sub_fetch(&(this->pollers_waiting), 1, __ATOMIC_RELAXED);
+		if (r < 0)
+			return NULL;
+	}
 
 	return msg;
-fail:
-	sem_post(&(this->semaphore));
-	this->messages[--(this->tail)] = msg;
-	this->spooled_bytes += msg->flattened;
-	return NULL;
 }
 
 
@@ -700,11 +1227,7 @@ fail:
 libmds_message_t *
 libmds_mspool_poll(libmds_mspool_t *restrict this)
 {
-	/* Wait until there is a message available. */
-	if (sem_wait(&(this->semaphore)) < 0)
-		return NULL;
-
-	return mspool_poll(this);
+	return mspool_poll(this, NULL);
 }
 
 
@@ -725,13 +1248,14 @@ libmds_mspool_poll(libmds_mspool_t *restrict this)
 libmds_message_t *
 libmds_mspool_poll_try(libmds_mspool_t *restrict this, const struct timespec *restrict deadline)
 {
-	/* Is a message available? */
-	if (!deadline && sem_trywait(&this->semaphore) < 0)
-		return NULL;
-	if (deadline && sem_timedwait(&this->semaphore, deadline) < 0)
-		return NULL;
+	libmds_message_t *msg;
+
+	if (deadline)
+		return mspool_poll(this, deadline);
 
-	return mspool_poll(this);
+	if (!(msg = mspool_try_poll(this)))
+		errno = EAGAIN;
+	return msg;
 }
 
 
@@ -789,13 +1313,18 @@ libmds_mpool_destroy(libmds_mpool_t *restrict this)
  * 
  * @param   this     The message allocation pool
  * @param   message  Message allocation to pool, must be flat (created with
- *                   `libmds_message_duplicate` or fetched with `libmds_mspool_poll`
- *                   or `libmds_mspool_poll_try`)
+ *                   `libmds_message_duplicate` or `libmds_receiver_read`, or
+ *                   fetched with `libmds_mspool_poll` or `libmds_mspool_poll_try`),
+ *                   if it is a view, its block is released
  * @return           Zero on success, -1 on error, `errno` will be set accordingly
  */
 int
 libmds_mpool_offer(libmds_mpool_t *restrict this, libmds_message_t *restrict message)
 {
+	/* Release the block if the message is a view, only the allocation is pooled. */
+	block_release(message->block);
+	message->block = NULL;
+
 	/* Discard if pool is full. */
 	if (this->tip == this->size)
 		return free(message), 0;
@@ -26,6 +26,13 @@
 
 
 
+/**
+ * Reference counted block that messages are received
+ * into by `libmds_receiver_read` (internal data)
+ */
+struct libmds_rxblock;
+
+
 /**
  * Message passed between a server and a client or between two of either
  */
@@ -89,32 +96,131 @@ typedef struct libmds_message
 	 */
 	int stage;
 
+	/**
+	 * The receive block that `buffer`, `headers` and `payload`
+	 * point into, `NULL` unless the message is a view
+	 * returned by `libmds_receiver_read` (internal data)
+	 */
+	struct libmds_rxblock *block;
+
 } libmds_message_t;
 
 
 /**
- * Queue of spooled messages
+ * Reader that frames messages in place in large receive
+ * blocks, and returns them as read-only views into the blocks
+ * 
+ * A block is shared by all views into it, and it is
+ * freed when the receiver and all views have released
+ * it. Only a message that straddles the end of a block
+ * is moved, the receiver otherwise copies nothing
  */
-typedef struct libmds_mspool
+typedef struct libmds_receiver
 {
 	/**
-	 * Array of messages (internal data)
+	 * The block that is being received into (internal data)
 	 */
-	libmds_message_t **messages;
+	struct libmds_rxblock *block;
 
 	/**
-	 * The number of elements the current
-	 * allocation of `messages` can hold (internal data)
+	 * The size of new blocks, a block is
+	 * only larger if a message requires it
 	 */
-	size_t size;
+	size_t block_size;
+
+	/**
+	 * The number of bytes used in `block` (internal data)
+	 */
+	size_t ptr;
+
+	/**
+	 * The offset of the current message in `block` (internal data)
+	 */
+	size_t off;
+
+	/**
+	 * The number of bytes in `block` that have been parsed (internal data)
+	 */
+	size_t scan;
+
+	/**
+	 * The headers of the current message, they
+	 * point into `block` (internal data)
+	 */
+	char **headers;
+
+	/**
+	 * The number of headers in the current message (internal data)
+	 */
+	size_t header_count;
+
+	/**
+	 * The number of elements allocated to `headers` (internal data)
+	 */
+	size_t headers_size;
+
+	/**
+	 * The size of the payload of the current message (internal data)
+	 */
+	size_t payload_size;
+
+	/**
+	 * 0 while reading headers, 1 while reading payload (internal data)
+	 */
+	int stage;
+
+} libmds_receiver_t;
+
+
+/**
+ * The number of messages a message spool can hold,
+ * `spool_limit_messages` is capped to this value
+ */
+#define LIBMDS_MSPOOL_CAPACITY  256
+
+
+/**
+ * A slot in a message spool (internal data)
+ */
+typedef struct libmds_mspool_slot
+{
+	/**
+	 * The sequence number of the slot, it tells whether
+	 * the slot is free or holds a message (internal data)
+	 */
+	size_t sequence;
+
+	/**
+	 * The message in the slot (internal data)
+	 */
+	libmds_message_t *message;
+
+} libmds_mspool_slot_t;
+
+
+/**
+ * Queue of spooled messages
+ * 
+ * The spool is a bounded, lock-free ring buffer, and any
+ * number of threads may spool and poll messages concurrently.
+ * Threads only make system calls when they have to block:
+ * when the spool is empty or full
+ */
+typedef struct libmds_mspool
+{
+	/**
+	 * Ring of `LIBMDS_MSPOOL_CAPACITY` slots (internal data)
+	 */
+	libmds_mspool_slot_t *slots;
 
 	/**
-	 * Push end (internal data)
+	 * The number of messages that have been spooled,
+	 * or are being spooled (internal data)
 	 */
 	size_t head;
 
 	/**
-	 * Poll end (internal data)
+	 * The number of messages that have been polled (internal data)
 	 */
 	size_t tail;
 
@@ -138,37 +244,28 @@ typedef struct libmds_mspool
 	size_t spool_limit_messages;
 
 	/**
-	 * If non-zero, `wait_semaphore` shall
-	 * be incremented when a message is
-	 * polled (internal data)
+	 * Futex that is incremented each time a
+	 * message is spooled (internal data)
 	 */
-	int please_post;
-
-	/* POSIX semaphores are lighter weight than XSI semaphores, so we use POSIX here. */
+	int spooled;
 
 	/**
-	 * Binary semaphore used to lock the spool whilst
-	 * manipulating it (internal data)
+	 * Futex that is incremented each time a
+	 * message is polled (internal data)
 	 */
-	sem_t lock;
+	int polled;
 
 	/**
-	 * Semaphore used to signal addition of messages.
-	 * Each time a message is spooled, this semaphore
-	 * is increased, the polling thread decreases the
-	 * semaphore before despooling a message, causing
-	 * it to block when the spool is empty
-	 * (internal data)
+	 * The number of threads that are, or are about to start,
+	 * waiting on `spooled` for a message (internal data)
 	 */
-	sem_t semaphore;
+	int pollers_waiting;
 
 	/**
-	 * If the spool is full, the semaphore is acquired
-	 * so that the spool function blocks, it is then
-	 * posted when a message is polled so that the
-	 * spool function may try again (internal data)
+	 * The number of threads that are, or are about to start,
+	 * waiting on `polled` for room in the spool (internal data)
 	 */
-	sem_t wait_semaphore;
+	int spoolers_waiting;
 
 } libmds_mspool_t;
 
@@ -263,6 +360,67 @@ libmds_message_t *libmds_message_duplicate(libmds_message_t *restrict this, libm
 __attribute__((nonnull, warn_unused_result))
 int libmds_message_read(libmds_message_t *restrict this, int fd);
 
+/**
+ * Release a message returned by `libmds_message_duplicate`,
+ * `libmds_receiver_read`, `libmds_mspool_poll` or `libmds_mspool_poll_try`
+ * 
+ * @param  this  The message
+ * @param  pool  Message allocation pool to offer the allocation to, may be `NULL`
+ */
+__attribute__((nonnull(1)))
+void libmds_message_release(libmds_message_t *restrict this, libmds_mpool_t *restrict pool);
+
+
+
+/**
+ * Initialise a zero-copy message receiver
+ * 
+ * @param   this        The receiver
+ * @param   block_size  The size of the receive blocks, zero for the default
+ * @return              Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_receiver_initialise(libmds_receiver_t *restrict this, size_t block_size);
+
+/**
+ * Release all resources held by a receiver, views
+ * it has returned remain valid until they are released
+ * 
+ * @param  this  The receiver
+ */
+__attribute__((nonnull))
+void libmds_receiver_destroy(libmds_receiver_t *restrict this);
+
+/**
+ * Receive the next message from a file descriptor, without copying it
+ * 
+ * @param   this  The receiver
+ * @param   fd    The file descriptor
+ * @param   pool  Message allocation pool to take the view from, may be `NULL`
+ * @param   view  Output parameter for the message, it is flat, but its
+ *                headers and payload point into the receiver's block, so
+ *                it must not be modified. It must be released with
+ *                `libmds_message_release` or `libmds_mpool_offer`, and it
+ *                may be passed to other threads, for example with a
+ *                `libmds_mspool_t`, before it is released
+ * @return        Zero on success, -1 on error or interruption, `errno`
+ *                will be set accordingly. If interrupted, the function
+ *                can be called again to continue. If -2 is returned
+ *                `errno` will not have been set, -2 indicates that
+ *                the message is malformated, which is a state that
+ *                cannot be recovered from.
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for recv(3)
+ */
+__attribute__((nonnull(1, 4), warn_unused_result))
+int libmds_receiver_read(libmds_receiver_t *restrict this, int fd, libmds_mpool_t *restrict pool,
+                         libmds_message_t **restrict view);
+
 
 
 /**
@@ -289,12 +447,11 @@ void libmds_mspool_destroy(libmds_mspool_t *restrict this);
  * Spool a message
  * 
  * @param   this     The message spool
- * @param   message  The message to spool, must be flat (created with `libmds_message_duplicate`)
+ * @param   message  The message to spool, must be flat (created with
+ *                   `libmds_message_duplicate` or `libmds_receiver_read`)
  * @return           Zero on success, -1 on error, `errno` will be set accordingly
  * 
- * @throws  EINTR   If interrupted
- * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
- *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws  EINTR  If interrupted
  */
 __attribute__((nonnull, warn_unused_result))
 int libmds_mspool_spool(libmds_mspool_t *restrict this, libmds_message_t *restrict message);
@@ -357,8 +514,9 @@ void libmds_mpool_destroy(libmds_mpool_t *restrict this);
  * 
  * @param   this     The message allocation pool
  * @param   message  Message allocation to pool, must be flat (created with
- *                   `libmds_message_duplicate` or fetched with `libmds_mspool_poll`
- *                   or `libmds_mspool_poll_try`)
+ *                   `libmds_message_duplicate` or `libmds_receiver_read`, or
+ *                   fetched with `libmds_mspool_poll` or `libmds_mspool_poll_try`),
+ *                   if it is a view, its block is released
  * @return           Zero on success, -1 on error, `errno` will be set accordingly
  */
 __attribute__((nonnull, warn_unused_result))
@@ -25,6 +25,8 @@
 #include <errno.h>
 #include <stdio.h>
 
+#include <libmdsserver/header-hash.h>
+
 
 
 /**
@@ -59,8 +61,6 @@
 # define LIBMDS_HEADERS_BINSEARCH_THRESHOLD 1000  /* XXX: Value is chosen at semirandom */
 #endif
 
-
-
 /**
  * Variant of `strcmp` that regards the first string as
  * ending at the first occurrence of the substring ": "
@@ -567,6 +567,74 @@ libmds_headers_sort(char **restrict headers, size_t header_count)
 }
 
 
+/**
+ * Compile a set of header names for `libmds_headers_match`
+ * 
+ * @param   this   Memory slot in which to store the matcher
+ * @param   names  The names of the headers, the array and its strings
+ *                 must not be modified or freed before the matcher
+ *                 is no longer used
+ * @param   count  The number of elements in `names`, at least 1
+ *                 and at most `LIBMDS_HEADER_MATCHER_MAX_NAMES`
+ * @return         Zero on success, -1 on error, `errno` will have been set
+ *                 accordingly on error.
+ * 
+ * @throws  EINVAL  If `count` is out of range, or if `names` contains duplicates
+ */
+int
+libmds_header_matcher_compile(libmds_header_matcher_t *restrict this,
+                              const char *const *restrict names, size_t count)
+{
+	this->count = 0;
+	if (header_hash_compile(names, count, LIBMDS_HEADER_MATCHER_MAX_NAMES, LIBMDS_HEADER_MATCHER_MAX_SLOTS,
+	                        this->lengths, &(this->seed), &(this->mask), this->table))
+		return -1;
+	this->names = names;
+	this->count = count;
+	return 0;
+}
+
+
+/**
+ * Cherrypick headers from a message, in a single
+ * pass over the headers, using a compiled matcher
+ * 
+ * @param   this          The matcher
+ * @param   headers       The headers in the message
+ * @param   header_count  The number of headers
+ * @param   values        Output parameter for the values of the headers, in the
+ *                        same order as the names the matcher was compiled with.
+ *                        If a header is found, its value will be stored, and it
+ *                        will be a NUL-terminated string. If the header is not
+ *                        found, `NULL` will be stored. If the header occurs
+ *                        multiple times, the first occurrence is used.
+ * @return                The number of found headers of those that were requested
+ */
+size_t
+libmds_headers_match(const libmds_header_matcher_t *restrict this, char **restrict headers,
+                     size_t header_count, char **restrict values)
+{
+	size_t found = 0, i;
+	const char *value;
+	ssize_t index;
+
+	for (i = 0; i < this->count; i++)
+		values[i] = NULL;
+
+	for (i = 0; i < header_count && found < this->count; i++) {
+		index = header_hash_lookup(headers[i], this->names, this->lengths,
+		                           this->seed, this->mask, this->table, &value);
+		if (index < 0 || values[index])
+			continue;
+		/* The value is in the caller's header, which is not constant. */
+		values[index] = headers[i] + (value - headers[i]);
+		found++;
+	}
+
+	return found;
+}
+
+
 /**
  * Compose a message
  * 
@@ -85,6 +85,62 @@ typedef enum libmds_cherrypick_optimisation
 } libmds_cherrypick_optimisation_t;
 
 
+/**
+ * The maximum number of header names in a `libmds_header_matcher_t`
+ */
+#define LIBMDS_HEADER_MATCHER_MAX_NAMES  64
+
+/**
+ * The maximum number of slots in the hash table of a `libmds_header_matcher_t`
+ */
+#define LIBMDS_HEADER_MATCHER_MAX_SLOTS  256
+
+
+/**
+ * A set of header names compiled for `libmds_headers_match`
+ * 
+ * The header names are compiled into a perfect hash table,
+ * so each header in a message is hashed once, up to its
+ * colon, and compared against at most one of the names.
+ * The matcher does not allocate any memory, and it can be
+ * used by any number of threads once it has been compiled.
+ */
+typedef struct libmds_header_matcher
+{
+	/**
+	 * The header names, not owned by the matcher (internal data)
+	 */
+	const char *const *names;
+
+	/**
+	 * The lengths of the header names (internal data)
+	 */
+	size_t lengths[LIBMDS_HEADER_MATCHER_MAX_NAMES];
+
+	/**
+	 * The number of header names
+	 */
+	size_t count;
+
+	/**
+	 * The seed of the hash function (internal data)
+	 */
+	uint32_t seed;
+
+	/**
+	 * The number of slots in `table`, less one (internal data)
+	 */
+	size_t mask;
+
+	/**
+	 * For each hash, the index of the only name
+	 * with that hash plus one, or zero (internal data)
+	 */
+	unsigned char table[LIBMDS_HEADER_MATCHER_MAX_SLOTS];
+
+} libmds_header_matcher_t;
+
+
 /**
  * Cherrypick headers from a message
  * 
@@ -327,6 +383,46 @@ size_t libmds_headers_cherrypick_binary_sorted_v(char **restrict headers, size_t
  */
 void libmds_headers_sort(char **restrict headers, size_t header_count);
 
+/**
+ * Compile a set of header names for `libmds_headers_match`
+ * 
+ * Use this instead of `libmds_headers_cherrypick` when
+ * the same headers are picked from many messages
+ * 
+ * @param   this   Memory slot in which to store the matcher
+ * @param   names  The names of the headers, the array and its strings
+ *                 must not be modified or freed before the matcher
+ *                 is no longer used
+ * @param   count  The number of elements in `names`, at least 1
+ *                 and at most `LIBMDS_HEADER_MATCHER_MAX_NAMES`
+ * @return         Zero on success, -1 on error, `errno` will have been set
+ *                 accordingly on error.
+ * 
+ * @throws  EINVAL  If `count` is out of range, or if `names` contains duplicates
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_header_matcher_compile(libmds_header_matcher_t *restrict this,
+                                  const char *const *restrict names, size_t count);
+
+/**
+ * Cherrypick headers from a message, in a single
+ * pass over the headers, using a compiled matcher
+ * 
+ * @param   this          The matcher
+ * @param   headers       The headers in the message
+ * @param   header_count  The number of headers
+ * @param   values        Output parameter for the values of the headers, in the
+ *                        same order as the names the matcher was compiled with.
+ *                        If a header is found, its value will be stored, and it
+ *                        will be a NUL-terminated string. If the header is not
+ *                        found, `NULL` will be stored. If the header occurs
+ *                        multiple times, the first occurrence is used.
+ * @return                The number of found headers of those that were requested
+ */
+__attribute__((nonnull))
+size_t libmds_headers_match(const libmds_header_matcher_t *restrict this, char **restrict headers,
+                            size_t header_count, char **restrict values);
+
 /**
  * Compose a message
  * 
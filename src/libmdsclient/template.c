@@ -0,0 +1,431 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "template.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+#define static_strlen(str) (sizeof(str) / sizeof(char) - 1)
+
+
+/**
+ * The maximum length of a formatted 64-bit integer, including the sign
+ */
+#define INTEGER_MAX_LENGTH  20
+
+/**
+ * The maximum length of a formatted client ID
+ */
+#define CLIENT_ID_MAX_LENGTH  (2 * 10 + 1)
+
+
+
+/**
+ * The decimal representations of all numbers from 0 to 99, with two digits
+ */
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+
+
+/**
+ * Compile a message template
+ * 
+ * @param   this    The template
+ * @param   format  The headers of the message, separated by LF. The
+ *                  `Length`-header should not be included, it is added
+ *                  automatically, and neither should the empty line
+ *                  that ends the headers. The headers may contain the
+ *                  slots `%u`, `%i`, `%c` and `%s`, see `libmds_template_slot_t`,
+ *                  and `%%` for a literal percent sign
+ * @return          Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  EINVAL  If `format` contains an empty header or an unknown slot
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_template_compile(libmds_template_t *restrict this, const char *restrict format)
+{
+	size_t n = strlen(format), max_parts = 1, i;
+	libmds_template_part_t *part;
+	libmds_template_slot_t slot;
+
+	this->text = NULL;
+	this->text_length = 0;
+	this->parts = NULL;
+	this->part_count = 0;
+	this->slot_count = 0;
+
+	/* Each slot and each LF ends a part. */
+	for (i = 0; i < n; i++)
+		if (format[i] == '%' || format[i] == '\n')
+			max_parts++;
+
+	/* One extra character for the LF that ends the last header. */
+	this->text = malloc((n + 1) * sizeof(char));
+	this->parts = malloc(max_parts * sizeof(libmds_template_part_t));
+	if (!this->text || !this->parts)
+		goto fail;
+
+	part = this->parts;
+	part->offset = 0;
+	part->length = 0;
+	part->slot = LIBMDS_TEMPLATE_NONE;
+	part->starts_header = 1;
+
+	for (i = 0; i < n; i++) {
+		if (format[i] == '\n') {
+			if (part->starts_header && !part->length)
+				goto einval;
+			this->text[this->text_length++] = '\n';
+			part->length++;
+			part++;
+			part->starts_header = 1;
+		} else if (format[i] == '%' && format[i + 1] != '%') {
+			switch (format[++i]) {
+			case 'u':  slot = LIBMDS_TEMPLATE_UNSIGNED;   break;
+			case 'i':  slot = LIBMDS_TEMPLATE_SIGNED;     break;
+			case 'c':  slot = LIBMDS_TEMPLATE_CLIENT_ID;  break;
+			case 's':  slot = LIBMDS_TEMPLATE_STRING;     break;
+			default:
+				goto einval;
+			}
+			part->slot = slot;
+			this->slot_count++;
+			part++;
+			part->starts_header = 0;
+		} else {
+			i += format[i] == '%';
+			this->text[this->text_length++] = format[i];
+			part->length++;
+			continue;
+		}
+		part->offset = this->text_length;
+		part->length = 0;
+		part->slot = LIBMDS_TEMPLATE_NONE;
+	}
+
+	/* End the last header with a LF, unless `format` did. */
+	if (n && format[n - 1] != '\n') {
+		this->text[this->text_length++] = '\n';
+		part->length++;
+	}
+
+	/* The last part is empty if `format` ended with a LF. */
+	this->part_count = (size_t)(part - this->parts) + (part->length ? 1 : 0);
+	return 0;
+
+einval:
+	errno = EINVAL;
+fail:
+	libmds_template_destroy(this);
+	return -1;
+}
+
+
+/**
+ * Release all resources held by a message template
+ * 
+ * @param  this  The template
+ */
+void
+libmds_template_destroy(libmds_template_t *restrict this)
+{
+	free(this->text);
+	this->text = NULL;
+	free(this->parts);
+	this->parts = NULL;
+}
+
+
+/**
+ * Format an unsigned integer in decimal, two digits at a time
+ * 
+ * @param   buffer  The output buffer, must have room for `INTEGER_MAX_LENGTH` characters
+ * @param   value   The integer
+ * @return          The number of written characters
+ */
+static size_t __attribute__((nonnull))
+format_unsigned(char *restrict buffer, uint64_t value)
+{
+	char digits[INTEGER_MAX_LENGTH];
+	char *p = digits + INTEGER_MAX_LENGTH;
+	size_t pair, n;
+
+	while (value >= 100) {
+		pair = (size_t)(value % 100) * 2;
+		value /= 100;
+		*--p = digit_pairs[pair + 1];
+		*--p = digit_pairs[pair];
+	}
+	if (value >= 10) {
+		pair = (size_t)value * 2;
+		*--p = digit_pairs[pair + 1];
+		*--p = digit_pairs[pair];
+	} else {
+		*--p = (char)('0' + value);
+	}
+
+	n = (size_t)(digits + INTEGER_MAX_LENGTH - p);
+	memcpy(buffer, p, n * sizeof(char));
+	return n;
+}
+
+
+/**
+ * Calculate the maximum length of the headers of a
+ * message composed from a template, including the
+ * `Length`-header and the empty line
+ * 
+ * @param   this            The template
+ * @param   values          The values of the slots
+ * @param   payload_length  The length of the payload
+ * @return                  The maximum length of the headers
+ */
+static size_t __attribute__((nonnull(1), pure))
+headers_size(const libmds_template_t *restrict this, const libmds_template_value_t *restrict values,
+             size_t payload_length)
+{
+	size_t size = this->text_length + 1, i;
+
+	for (i = 0; i < this->part_count; i++) {
+		switch (this->parts[i].slot) {
+		case LIBMDS_TEMPLATE_NONE:
+			continue;
+		case LIBMDS_TEMPLATE_UNSIGNED:
+		case LIBMDS_TEMPLATE_SIGNED:
+			size += INTEGER_MAX_LENGTH;
+			break;
+		case LIBMDS_TEMPLATE_CLIENT_ID:
+			size += CLIENT_ID_MAX_LENGTH;
+			break;
+		case LIBMDS_TEMPLATE_STRING:
+		default:
+			size += values->s ? strlen(values->s) : 0;
+			break;
+		}
+		values++;
+	}
+
+	if (payload_length)
+		size += static_strlen("Length: \n") + INTEGER_MAX_LENGTH;
+
+	return size;
+}
+
+
+/**
+ * Write the headers of a message composed from a template,
+ * including the `Length`-header and the empty line
+ * 
+ * @param   this            The template
+ * @param   values          The values of the slots
+ * @param   payload_length  The length of the payload
+ * @param   buffer          The output buffer, must have room
+ *                          for at least `headers_size` characters
+ * @return                  The length of the headers
+ */
+static size_t __attribute__((nonnull(1, 4)))
+render_headers(const libmds_template_t *restrict this, const libmds_template_value_t *restrict values,
+               size_t payload_length, char *restrict buffer)
+{
+	const libmds_template_part_t *part;
+	size_t len = 0, header = 0, i, n;
+	int skip = 0;
+
+	for (i = 0; i < this->part_count; i++) {
+		part = this->parts + i;
+		if (part->starts_header)
+			header = len, skip = 0;
+		if (skip)
+			goto next;
+
+		memcpy(buffer + len, this->text + part->offset, part->length * sizeof(char));
+		len += part->length;
+
+		switch (part->slot) {
+		case LIBMDS_TEMPLATE_NONE:
+			continue;
+		case LIBMDS_TEMPLATE_UNSIGNED:
+			len += format_unsigned(buffer + len, values->u);
+			break;
+		case LIBMDS_TEMPLATE_SIGNED:
+			if (values->i < 0) {
+				buffer[len++] = '-';
+				len += format_unsigned(buffer + len, -(uint64_t)(values->i));
+			} else {
+				len += format_unsigned(buffer + len, (uint64_t)(values->i));
+			}
+			break;
+		case LIBMDS_TEMPLATE_CLIENT_ID:
+			len += format_unsigned(buffer + len, values->u >> 32);
+			buffer[len++] = ':';
+			len += format_unsigned(buffer + len, values->u & UINT32_MAX);
+			break;
+		case LIBMDS_TEMPLATE_STRING:
+		default:
+			if (!values->s) {
+				/* Leave out the header. */
+				len = header, skip = 1;
+				break;
+			}
+			n = strlen(values->s);
+			memcpy(buffer + len, values->s, n * sizeof(char));
+			len += n;
+			break;
+		}
+	next:
+		values += part->slot != LIBMDS_TEMPLATE_NONE;
+	}
+
+	if (payload_length) {
+		memcpy(buffer + len, "Length: ", static_strlen("Length: ") * sizeof(char));
+		len += static_strlen("Length: ");
+		len += format_unsigned(buffer + len, payload_length);
+		buffer[len++] = '\n';
+	}
+	buffer[len++] = '\n';
+
+	return len;
+}
+
+
+/**
+ * Make sure a buffer is large enough
+ * 
+ * @param   buffer       Pointer to the buffer
+ * @param   buffer_size  Pointer to the allocation size of the buffer
+ * @param   size         The required size
+ * @return               Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static int __attribute__((nonnull, warn_unused_result))
+ensure_size(char **restrict buffer, size_t *restrict buffer_size, size_t size)
+{
+	char *new_buffer;
+	if (*buffer_size >= size)
+		return 0;
+	if (!(new_buffer = realloc(*buffer, size * sizeof(char))))
+		return -1;
+	*buffer = new_buffer;
+	*buffer_size = size;
+	return 0;
+}
+
+
+/**
+ * Compose a message from a template
+ * 
+ * @param   this            The template
+ * @param   values          The values of the slots, in the order of the
+ *                          slots, `this->slot_count` elements
+ * @param   payload         The payload, `NULL` if the message should not have a payload
+ * @param   payload_length  The length of the payload, unused if `payload` is `NULL`
+ * @param   buffer          Pointer to the buffer where the message should be written,
+ *                          may point to `NULL` if `buffer_size` points to zero. The
+ *                          buffer is reallocated if it is too small, it can be reused
+ *                          for the next message. The message is not NUL-terminated
+ * @param   buffer_size     The allocation size, in `char`, of `*buffer`, will be
+ *                          updated with the new allocation size
+ * @param   length          Output parameter for the length of the message
+ * @return                  Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_template_compose(const libmds_template_t *restrict this, const libmds_template_value_t *restrict values,
+                        const char *restrict payload, size_t payload_length,
+                        char **restrict buffer, size_t *restrict buffer_size, size_t *restrict length)
+{
+	size_t len;
+
+	if (!payload)
+		payload_length = 0;
+
+	if (ensure_size(buffer, buffer_size, headers_size(this, values, payload_length) + payload_length))
+		return -1;
+
+	len = render_headers(this, values, payload_length, *buffer);
+	if (payload_length)
+		memcpy(*buffer + len, payload, payload_length * sizeof(char));
+	*length = len + payload_length;
+	return 0;
+}
+
+
+/**
+ * Compose a message from a template, for writev(3) or sendmsg(3),
+ * without copying the payload
+ * 
+ * @param   this            The template
+ * @param   values          The values of the slots, in the order of the
+ *                          slots, `this->slot_count` elements
+ * @param   payload         The payload, `NULL` if the message should not have a payload
+ * @param   payload_length  The length of the payload, unused if `payload` is `NULL`
+ * @param   buffer          Pointer to the buffer where the headers should be written,
+ *                          may point to `NULL` if `buffer_size` points to zero. The
+ *                          buffer is reallocated if it is too small, it can be reused
+ *                          for the next message
+ * @param   buffer_size     The allocation size, in `char`, of `*buffer`, will be
+ *                          updated with the new allocation size
+ * @param   iov             Output parameter for the message, the first element is
+ *                          set to the headers in `*buffer`, and the second element
+ *                          is set to the payload if there is one
+ * @return                  The number of elements used in `iov`, 1 or 2,
+ *                          -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_template_compose_iov(const libmds_template_t *restrict this, const libmds_template_value_t *restrict values,
+                            const char *restrict payload, size_t payload_length,
+                            char **restrict buffer, size_t *restrict buffer_size, struct iovec iov[2])
+{
+	if (!payload)
+		payload_length = 0;
+
+	if (ensure_size(buffer, buffer_size, headers_size(this, values, payload_length)))
+		return -1;
+
+	iov[0].iov_base = *buffer;
+	iov[0].iov_len = render_headers(this, values, payload_length, *buffer);
+	if (!payload_length)
+		return 1;
+
+	/* The payload is only read, `iov_base` is not `const` because
+	   `struct iovec` is also used for reading. */
+	iov[1].iov_base = (void *)(uintptr_t)payload;
+	iov[1].iov_len = payload_length;
+	return 2;
+}
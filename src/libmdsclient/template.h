@@ -0,0 +1,238 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSCLIENT_TEMPLATE_H
+#define MDS_LIBMDSCLIENT_TEMPLATE_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+
+
+/**
+ * The type of a slot in a message template
+ */
+typedef enum libmds_template_slot
+{
+	/**
+	 * No slot (internal use)
+	 */
+	LIBMDS_TEMPLATE_NONE = 0,
+
+	/**
+	 * `%u` in the format, an unsigned integer, `.u` in the value
+	 */
+	LIBMDS_TEMPLATE_UNSIGNED = 1,
+
+	/**
+	 * `%i` in the format, a signed integer, `.i` in the value
+	 */
+	LIBMDS_TEMPLATE_SIGNED = 2,
+
+	/**
+	 * `%c` in the format, a client ID, `.u` in the value,
+	 * it is formatted as the high 32 bits and the low
+	 * 32 bits, in decimal, separated by a colon
+	 */
+	LIBMDS_TEMPLATE_CLIENT_ID = 3,
+
+	/**
+	 * `%s` in the format, a NUL-terminated string, `.s` in the value,
+	 * if `NULL`, the header that contains the slot is left out
+	 */
+	LIBMDS_TEMPLATE_STRING = 4
+
+} libmds_template_slot_t;
+
+
+/**
+ * The value of a slot in a message template
+ */
+typedef union libmds_template_value
+{
+	/**
+	 * For `LIBMDS_TEMPLATE_UNSIGNED` and `LIBMDS_TEMPLATE_CLIENT_ID`
+	 */
+	uint64_t u;
+
+	/**
+	 * For `LIBMDS_TEMPLATE_SIGNED`
+	 */
+	int64_t i;
+
+	/**
+	 * For `LIBMDS_TEMPLATE_STRING`
+	 */
+	const char *s;
+
+} libmds_template_value_t;
+
+
+/**
+ * A part of a message template: a piece of
+ * text followed by a slot (internal data)
+ */
+typedef struct libmds_template_part
+{
+	/**
+	 * The offset of the text in the template's text
+	 */
+	size_t offset;
+
+	/**
+	 * The length of the text
+	 */
+	size_t length;
+
+	/**
+	 * The slot that follows the text, `LIBMDS_TEMPLATE_NONE` if none
+	 */
+	libmds_template_slot_t slot;
+
+	/**
+	 * Whether the text begins a header
+	 */
+	int starts_header;
+
+} libmds_template_part_t;
+
+
+/**
+ * A precompiled message shape
+ * 
+ * The headers of a template are parsed once, and the
+ * fixed parts of them are kept rendered, so composing
+ * a message from the template only copies text and
+ * formats the values of the slots
+ */
+typedef struct libmds_template
+{
+	/**
+	 * The fixed text of the headers (internal data)
+	 */
+	char *text;
+
+	/**
+	 * The length of `text` (internal data)
+	 */
+	size_t text_length;
+
+	/**
+	 * The parts of the template (internal data)
+	 */
+	libmds_template_part_t *parts;
+
+	/**
+	 * The number of elements in `parts` (internal data)
+	 */
+	size_t part_count;
+
+	/**
+	 * The number of slots in the template, and thus the
+	 * number of values to compose a message with
+	 */
+	size_t slot_count;
+
+} libmds_template_t;
+
+
+
+/**
+ * Compile a message template
+ * 
+ * @param   this    The template
+ * @param   format  The headers of the message, separated by LF. The
+ *                  `Length`-header should not be included, it is added
+ *                  automatically, and neither should the empty line
+ *                  that ends the headers. The headers may contain the
+ *                  slots `%u`, `%i`, `%c` and `%s`, see `libmds_template_slot_t`,
+ *                  and `%%` for a literal percent sign
+ * @return          Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  EINVAL  If `format` contains an empty header or an unknown slot
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_template_compile(libmds_template_t *restrict this, const char *restrict format);
+
+/**
+ * Release all resources held by a message template
+ * 
+ * @param  this  The template
+ */
+__attribute__((nonnull))
+void libmds_template_destroy(libmds_template_t *restrict this);
+
+/**
+ * Compose a message from a template
+ * 
+ * @param   this            The template
+ * @param   values          The values of the slots, in the order of the
+ *                          slots, `this->slot_count` elements
+ * @param   payload         The payload, `NULL` if the message should not have a payload
+ * @param   payload_length  The length of the payload, unused if `payload` is `NULL`
+ * @param   buffer          Pointer to the buffer where the message should be written,
+ *                          may point to `NULL` if `buffer_size` points to zero. The
+ *                          buffer is reallocated if it is too small, it can be reused
+ *                          for the next message. The message is not NUL-terminated
+ * @param   buffer_size     The allocation size, in `char`, of `*buffer`, will be
+ *                          updated with the new allocation size
+ * @param   length          Output parameter for the length of the message
+ * @return                  Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull(1, 5, 6, 7), warn_unused_result))
+int libmds_template_compose(const libmds_template_t *restrict this, const libmds_template_value_t *restrict values,
+                            const char *restrict payload, size_t payload_length,
+                            char **restrict buffer, size_t *restrict buffer_size, size_t *restrict length);
+
+/**
+ * Compose a message from a template, for writev(3) or sendmsg(3),
+ * without copying the payload
+ * 
+ * @param   this            The template
+ * @param   values          The values of the slots, in the order of the
+ *                          slots, `this->slot_count` elements
+ * @param   payload         The payload, `NULL` if the message should not have a payload
+ * @param   payload_length  The length of the payload, unused if `payload` is `NULL`
+ * @param   buffer          Pointer to the buffer where the headers should be written,
+ *                          may point to `NULL` if `buffer_size` points to zero. The
+ *                          buffer is reallocated if it is too small, it can be reused
+ *                          for the next message
+ * @param   buffer_size     The allocation size, in `char`, of `*buffer`, will be
+ *                          updated with the new allocation size
+ * @param   iov             Output parameter for the message, the first element is
+ *                          set to the headers in `*buffer`, and the second element
+ *                          is set to the payload if there is one
+ * @return                  The number of elements used in `iov`, 1 or 2,
+ *                          -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull(1, 5, 6, 7), warn_unused_result))
+int libmds_template_compose_iov(const libmds_template_t *restrict this, const libmds_template_value_t *restrict values,
+                                const char *restrict payload, size_t payload_length,
+                                char **restrict buffer, size_t *restrict buffer_size, struct iovec iov[2]);
+
+
+#endif
@@ -0,0 +1,143 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "arena.h"
+
+#include "macros.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+
+
+/**
+ * Allocate a chunk and make it the chunk allocations are made from
+ * 
+ * @param   this  The arena
+ * @param   size  The number of bytes in the chunk
+ * @return        Zero on success, -1 on error
+ */
+static int __attribute__((nonnull))
+add_chunk(arena_t *restrict this, size_t size)
+{
+	arena_chunk_t *chunk;
+	fail_if (xbmalloc(chunk, sizeof(arena_chunk_t) + size));
+	chunk->previous = this->chunk;
+	chunk->size = size;
+	this->chunk = chunk;
+	this->used = 0;
+	this->total += size;
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Initialise an arena, this does not allocate any memory
+ * 
+ * @param  this  Memory slot in which to store the new arena
+ */
+void
+arena_initialise(arena_t *restrict this)
+{
+	this->chunk = NULL;
+	this->used = 0;
+	this->total = 0;
+}
+
+
+/**
+ * Release all memory in an arena
+ * 
+ * @param  this  The arena
+ */
+void
+arena_destroy(arena_t *restrict this)
+{
+	arena_chunk_t *chunk;
+	while ((chunk = this->chunk)) {
+		this->chunk = chunk->previous;
+		free(chunk);
+	}
+	this->used = 0;
+	this->total = 0;
+}
+
+
+/**
+ * Allocate memory from an arena
+ * 
+ * @param   this  The arena
+ * @param   size  The number of bytes to allocate
+ * @return        The allocated memory, `NULL` on error,
+ *                `errno` will have been set accordingly
+ */
+void *
+arena_alloc(arena_t *restrict this, size_t size)
+{
+	size_t chunk_size;
+	void *rc;
+
+	if (size > SIZE_MAX - ARENA_ALIGNMENT)
+		return errno = ENOMEM, NULL;
+	size = (size + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+	/* Grow the arena geometrically, so that it has to be
+	   reset fewer times before it is a single chunk. */
+	if (!this->chunk || (this->chunk->size - this->used < size)) {
+		chunk_size = max(max(size, (size_t)ARENA_CHUNK_SIZE), this->total);
+		if (add_chunk(this, chunk_size))
+			return NULL;
+	}
+
+	rc = this->chunk->data + this->used;
+	this->used += size;
+	return rc;
+}
+
+
+/**
+ * Release all allocations in an arena
+ * 
+ * If the arena consists of a single chunk, its memory is kept for reuse
+ * unless it is larger than `keep` bytes. If it consists of multiple chunks,
+ * they are replaced with a single chunk large enough to hold all of them,
+ * unless that is larger than `keep` bytes, so that equal use of the arena
+ * after the reset does not allocate any memory.
+ * 
+ * @param  this  The arena
+ * @param  keep  The largest number of bytes to keep
+ */
+void
+arena_reset(arena_t *restrict this, size_t keep)
+{
+	size_t total = this->total;
+
+	if (!this->chunk)
+		return;
+
+	this->used = 0;
+	if (!this->chunk->previous && (total <= keep))
+		return;
+
+	arena_destroy(this);
+	if (total <= keep)
+		/* If this fails, the chunk is allocated when it is needed. */
+		add_chunk(this, total);
+}
@@ -0,0 +1,131 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_ARENA_H
+#define MDS_LIBMDSSERVER_ARENA_H
+
+
+#include <stddef.h>
+
+
+
+/**
+ * The alignment of allocations in an arena,
+ * sufficient for any object, as with malloc(3)
+ */
+#define ARENA_ALIGNMENT  16
+
+/**
+ * The smallest chunk an arena allocates
+ */
+#define ARENA_CHUNK_SIZE  1024
+
+
+/**
+ * A chunk of memory in an arena
+ */
+typedef struct arena_chunk {
+	/**
+	 * The chunk that was filled before this chunk
+	 * was allocated, `NULL` if this is the first
+	 */
+	struct arena_chunk *previous;
+
+	/**
+	 * The number of bytes in `data`
+	 */
+	size_t size;
+
+	/**
+	 * The memory allocations are made from
+	 */
+	char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+} arena_chunk_t;
+
+/**
+ * Memory arena for objects that are released together
+ * 
+ * Allocations are never moved or freed individually, instead
+ * the arena is reset, which releases all of its allocations
+ * at once but keeps the memory for reuse. An arena is not
+ * thread-safe, it is intended to be owned by the thread
+ * that uses it, or an object that one thread uses at a time.
+ */
+typedef struct arena {
+	/**
+	 * The chunk allocations are made from,
+	 * `NULL` if nothing has been allocated
+	 */
+	arena_chunk_t *chunk;
+
+	/**
+	 * The number of bytes used in `chunk`
+	 */
+	size_t used;
+
+	/**
+	 * The number of bytes in all chunks
+	 */
+	size_t total;
+} arena_t;
+
+
+
+/**
+ * Initialise an arena, this does not allocate any memory
+ * 
+ * @param  this  Memory slot in which to store the new arena
+ */
+__attribute__((nonnull))
+void arena_initialise(arena_t *restrict this);
+
+/**
+ * Release all memory in an arena
+ * 
+ * @param  this  The arena
+ */
+__attribute__((nonnull))
+void arena_destroy(arena_t *restrict this);
+
+/**
+ * Allocate memory from an arena
+ * 
+ * @param   this  The arena
+ * @param   size  The number of bytes to allocate
+ * @return        The allocated memory, `NULL` on error,
+ *                `errno` will have been set accordingly
+ */
+__attribute__((malloc, nonnull))
+void *arena_alloc(arena_t *restrict this, size_t size);
+
+/**
+ * Release all allocations in an arena
+ * 
+ * If the arena consists of a single chunk, its memory is kept for reuse
+ * unless it is larger than `keep` bytes. If it consists of multiple chunks,
+ * they are replaced with a single chunk large enough to hold all of them,
+ * unless that is larger than `keep` bytes, so that equal use of the arena
+ * after the reset does not allocate any memory.
+ * 
+ * @param  this  The arena
+ * @param  keep  The largest number of bytes to keep
+ */
+__attribute__((nonnull))
+void arena_reset(arena_t *restrict this, size_t keep);
+
+
+#endif
@@ -129,7 +129,7 @@ client_list_add(client_list_t *restrict this, uint64_t client)
 	uint64_t* old;
 	if (this->size == this->capacity) {
 		old = this->clients;
-		if (xrealloc(old, this->capacity <<= 1, uint64_t)) {
+		if (xrealloc(this->clients, this->capacity <<= 1, uint64_t)) {
 			this->capacity >>= 1;
 			this->clients = old;
 			fail_if (1);
@@ -159,9 +159,9 @@ client_list_remove(client_list_t *restrict this, uint64_t client)
 			n = (--(this->size) - i) * sizeof(uint64_t);
 			memmove(this->clients + i, this->clients + i + 1, n);
 
-			if (this->size << 1 <= this->capacity) {
+			if (this->size << 1 <= this->capacity && this->capacity > 1) {
 				old = this->clients;
-				if (xrealloc(old, this->capacity >>= 1, uint64_t)) {
+				if (xrealloc(this->clients, this->capacity >>= 1, uint64_t)) {
 					this->capacity <<= 1;
 					this->clients = old;
 				}
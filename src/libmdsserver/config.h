@@ -0,0 +1,149 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_CONFIG_H
+#define MDS_CONFIG_H
+
+
+/**
+ * The name under which this package is installed
+ */
+#define PKGNAME "mds"
+
+/**
+ * The directory where all servers are installed
+ */
+#define LIBEXECDIR "/usr/libexec"
+
+/**
+ * The system's directory for non-persistent temporary files
+ */
+#define TMPDIR "/tmp"
+
+/**
+ * The system's directory for runtime data
+ */
+#define RUNDIR "/run"
+
+/**
+ * The system's directory for site-specific configurations
+ */
+#define SYSCONFDIR "/etc"
+
+/**
+ * The system's directory for pseudo-devices
+ */
+#define DEVDIR "/dev"
+
+/**
+ * Pathname pattern for virtual terminals
+ */
+#define VT_PATH_PATTERN "/dev/tty%i"
+
+/**
+ * The root directory of all runtime data stored by mds
+ */
+#define MDS_RUNTIME_ROOT_DIRECTORY "/run/mds"
+
+/**
+ * The root directory of temporarily stored data stored by mds servers
+ */
+#define MDS_STORAGE_ROOT_DIRECTORY "/tmp/.{system-directory}.mds"
+
+/**
+ * The user ID for the root user
+ */
+#define ROOT_USER_UID 0
+
+/**
+ * The group ID for the root group
+ */
+#define ROOT_GROUP_GID 0
+
+/**
+ * The group ID for the nobody group
+ */
+#define NOBODY_GROUP_GID 0
+
+/* These three names above are redundant, but that is to avoid errors. */
+
+/**
+ * The byte length of the authentication token
+ */
+#define TOKEN_LENGTH 1024
+
+/**
+ * Random number generator to use for generating a token
+ */
+#define TOKEN_RANDOM "/dev/urandom"
+
+/**
+ * The path of the symlink to the executed command
+ */
+#define SELF_EXE "/proc/self/exe"
+
+/**
+ * The path to the directory with symlinks to each file that is open
+ */
+#define SELF_FD "/proc/self/fd"
+
+/**
+ * Pattern for the names of shared object to which states are marshalled
+ */
+#define SHM_PATH_PATTERN "/.proc-pid-%ji"
+
+/**
+ * The maximum number of command line arguments to allow
+ */
+#define ARGC_LIMIT 50
+
+/**
+ * The number of additional arguments a libexec server may have
+ */
+#define LIBEXEC_ARGC_EXTRA_LIMIT 5
+
+/**
+ * The maximum number of display allowed on the system
+ */
+#define DISPLAY_MAX 1000
+
+/**
+ * The name of the environment variable that
+ * indicates the index of the display
+ */
+#define DISPLAY_ENV "MDS_DISPLAY"
+
+/**
+ * The name of the environment variable that
+ * indicates the display server's process group
+ */
+#define PGROUP_ENV "MDS_PGROUP"
+
+/**
+ * The minimum time that most have elapsed
+ * for respawning to be allowed
+ */
+#define RESPAWN_TIME_LIMIT_SECONDS 5
+
+/**
+ * The dot-prefixless basename of the initrc
+ * file that the master server executes
+ */
+#define INITRC_FILE "mdsinitrc"
+
+
+#endif
@@ -149,7 +149,7 @@ fd_table_get(const fd_table_t *restrict this, int key)
 size_t
 fd_table_put(fd_table_t *restrict this, int key, size_t value)
 {
-	size_t rc, old_bitcap, new_bitcap, *old_values;
+	size_t rc, old_bitcap, new_bitcap, new_capacity, *old_values;
 	uint64_t *old_used;
 
 	/* Override current value if the key is already used. */
@@ -162,28 +162,33 @@ fd_table_put(fd_table_t *restrict this, int key, size_t value)
 	/* Grow the table if it is too small. */
 	errno = 0;
 	if ((size_t)key >= this->capacity) {
+		/* Double the capacity until the key fits, a key
+		   can be more than twice the current capacity. */
+		for (new_capacity = this->capacity << 1; (size_t)key >= new_capacity;)
+			new_capacity <<= 1;
+
 		old_values = this->values;
-		if (xrealloc(this->values, this->capacity << 1, size_t)) {
+		if (xrealloc(this->values, new_capacity, size_t)) {
 			this->values = old_values;
 			fail_if (1);
 		}
 
-		memset(this->values + this->capacity, 0, this->capacity * sizeof(size_t));
-      
+		memset(this->values + this->capacity, 0, (new_capacity - this->capacity) * sizeof(size_t));
+
 		old_bitcap = (this->capacity + 63) / 64;
-		this->capacity <<= 1;
-		new_bitcap = (this->capacity + 63) / 64;
+		new_bitcap = (new_capacity + 63) / 64;
 
 		if (new_bitcap > old_bitcap) {
 			old_used = this->used;
 			if (xrealloc(this->used, new_bitcap, size_t)) {
 				this->used = old_used;
-				this->capacity >>= 1;
 				fail_if (1);
 			}
 
 			memset(this->used + old_bitcap, 0, (new_bitcap - old_bitcap) * sizeof(uint64_t));
 		}
+
+		this->capacity = new_capacity;
 	}
 
 	/* Store the entry. */
@@ -246,7 +246,7 @@ typedef struct T\
  * @param   capacity  The minimum initial capacity of the hash list, 0 for default
  * @return            Non-zero on error, `errno` will have been set accordingly
  */\
-static inline int __attribute__((unused, nonnull))\
+static int __attribute__((unused, nonnull))\
 T##_create(T##_t *restrict this, size_t capacity)\
 {\
 	if (!capacity)\
@@ -273,7 +273,7 @@ T##_create(T##_t *restrict this, size_t capacity)\
  * 
  * @param  this  The hash list
  */\
-static inline void __attribute__((unused, nonnull))\
+static void __attribute__((unused, nonnull))\
 T##_destroy(T##_t *restrict this)\
 {\
 	size_t i, n;\
@@ -297,7 +297,7 @@ T##_destroy(T##_t *restrict this)\
  * @param   out   Memory slot in which to store the new hash list
  * @return        Non-zero on error, `errno` will have been set accordingly
  */\
-static inline int __attribute__((unused, nonnull))\
+static int __attribute__((unused, nonnull))\
 T##_clone(const T##_t *restrict this, T##_t *restrict out)\
 {\
 	if (T##_create(out, this->allocated) < 0)\
@@ -320,7 +320,7 @@ T##_clone(const T##_t *restrict this, T##_t *restrict out)\
  * @return        Non-zero on error, `errno` will have
  *                been set accordingly. Errors are non-fatal.
  */\
-static inline int __attribute__((unused, nonnull))\
+static int __attribute__((unused, nonnull))\
 T##_pack(T##_t *restrict this)\
 {\
 	size_t i, j, n;\
@@ -356,7 +356,7 @@ T##_pack(T##_t *restrict this)\
  * @param   value  Output parameter for the value
  * @return         Whether the key was found, error is impossible
  */\
-static inline int __attribute__((unused, nonnull))\
+static int __attribute__((unused, nonnull))\
 T##_get(T##_t *restrict this, CKEY_T key, T##_value_t *restrict value)\
 {\
 	size_t i, n, hash = HASH_LIST_HASH(key);\
@@ -374,7 +374,7 @@ T##_get(T##_t *restrict this, CKEY_T key, T##_value_t *restrict value)\
  * @param  this  The hash list
  * @param  key   The key of the entry to remove, must not be `NULL`
  */\
-static inline void __attribute__((unused, nonnull))\
+static void __attribute__((unused, nonnull))\
 T##_remove(T##_t *restrict this, CKEY_T key)\
 {\
 	size_t i = this->last, n, hash = HASH_LIST_HASH(key);\
@@ -420,7 +420,7 @@ do_remove:\
  *                 `NULL` if the entry should be removed instead
  * @return         Non-zero on error, `errno` will have been set accordingly
  */\
-static inline int __attribute__((unused, nonnull(1, 2)))\
+static int __attribute__((unused, nonnull(1, 2)))\
 T##_put(T##_t *restrict this, KEY_T key, const T##_value_t *restrict value)\
 {\
 	size_t i = this->last, n, empty = this->used, hash;\
@@ -472,6 +472,10 @@ T##_put(T##_t *restrict this, KEY_T key, const T##_value_t *restrict value)\
 	\
 	/* Store entry. */\
 	i = empty;\
+	if (i == this->used)\
+		this->used++;\
+	else\
+		this->unused--;\
 	goto put_no_free;\
 put:\
 	if (this->freer)\
@@ -490,7 +494,7 @@ put_no_free:\
  * @param   this  The hash table
  * @return        The number of bytes to allocate to the output buffer
  */\
-static inline size_t __attribute__((unused, pure, nonnull))\
+static size_t __attribute__((unused, pure, nonnull))\
 T##_marshal_size(const T##_t *restrict this)\
 {\
 	size_t i, n = this->used;\
@@ -508,7 +512,7 @@ T##_marshal_size(const T##_t *restrict this)\
  * @param  this  The hash list
  * @param  data  Output buffer for the marshalled data
  */\
-static inline void __attribute__((unused, nonnull))\
+static void __attribute__((unused, nonnull))\
 T##_marshal(const T##_t *restrict this, char *restrict data)\
 {\
 	size_t wrote, i, n = this->used;\
@@ -540,7 +544,7 @@ T##_marshal(const T##_t *restrict this, char *restrict data)\
  * @return            Non-zero on error, `errno` will be set accordingly.
  *                    Destroy the table on error.
  */\
-static inline int __attribute__((unused, nonnull))\
+static int __attribute__((unused, nonnull))\
 T##_unmarshal(T##_t *restrict this, char *restrict data)\
 {\
 	size_t i, n, got;\
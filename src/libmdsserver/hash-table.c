@@ -20,9 +20,35 @@
 #include "macros.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <errno.h>
 
 
+/**
+ * The value of a control byte of an unused slot
+ */
+#define CONTROL_EMPTY  0
+
+/**
+ * The value of a control byte of a bucket, in the buckets
+ * the table had before it grew, whose entry has been moved
+ * or removed, probes must continue past such buckets
+ */
+#define CONTROL_MOVED  0x01
+
+/**
+ * Bit that is set in the control byte of every used slot
+ */
+#define CONTROL_USED  HASH_TABLE_CONTROL_USED
+
+/**
+ * The number of buckets to move for each addition or
+ * removal while the table grows incrementally
+ */
+#define MIGRATION_STEP  8
+
+
 /**
  * Test if a key matches the key in a bucket
  * 
@@ -49,62 +75,291 @@ hash(const hash_table_t *restrict this, size_t key)
 }
 
 
+/**
+ * Scramble the hash of a key, the identity hash of
+ * aligned pointers would otherwise leave most slots unused
+ * 
+ * @param   hash  The hash of the key
+ * @return        The scrambled hash
+ */
+static inline size_t __attribute__((const))
+mix(size_t hash)
+{
+	return hash * (size_t)0x9E3779B97F4A7C15ULL;
+}
+
+
 /**
  * Truncates the hash of a key to constrain it to the buckets
  * 
- * @param   this  The hash table
- * @param   key   The key to hash
- * @return        A non-negative value less the the table's capacity
+ * @param   capacity  The number of buckets, a power of 2
+ * @param   mixed     The scrambled hash of the key, as returned by `mix`
+ * @return            A non-negative value less the the capacity
  */
-static inline size_t __attribute__((pure, nonnull))
-truncate_hash(const hash_table_t *restrict this, size_t hash)
+static inline size_t __attribute__((const))
+truncate_hash(size_t capacity, size_t mixed)
 {
-	return hash % this->capacity;
+	return (mixed ^ (mixed >> (sizeof(size_t) * 4))) & (capacity - 1);
 }
 
 
 /**
- * Grow the table
+ * Calculate the control byte for a slot used by a key
  * 
- * @param   this  The hash table
- * @return        Non-zero on error, `errno` will be set accordingly
+ * @param   mixed  The scrambled hash of the key, as returned by `mix`
+ * @return         The control byte
+ */
+static inline unsigned char __attribute__((const))
+control_byte(size_t mixed)
+{
+	return (unsigned char)(CONTROL_USED | (mixed >> (sizeof(size_t) * 8 - 7)));
+}
+
+
+/**
+ * Calculate when, in the number of entries, to grow the table
+ * 
+ * At least one slot is always kept unused, so that
+ * a search for a missing key always terminates
+ * 
+ * @param   capacity     The capacity of the table
+ * @param   load_factor  The load factor of the table
+ * @return               The maximum number of entries before the table must grow
+ */
+static inline size_t __attribute__((const))
+calculate_threshold(size_t capacity, float load_factor)
+{
+	size_t threshold = (size_t)((float)capacity * load_factor);
+	return threshold < capacity ? threshold : capacity - 1;
+}
+
+
+/**
+ * Allocate the buckets and the control bytes for
+ * the table, with all buckets unused
+ * 
+ * @param   this      The hash table
+ * @param   capacity  The number of buckets, must be a power of 2
+ * @return            Non-zero on error, `errno` will be set accordingly
+ */
+static int __attribute__((nonnull))
+allocate_buckets(hash_table_t *restrict this, size_t capacity)
+{
+	fail_if (xbmalloc(this->buckets, capacity * (sizeof(hash_entry_t) + sizeof(unsigned char))));
+	this->control = (unsigned char *)(this->buckets + capacity);
+	memset(this->control, CONTROL_EMPTY, capacity * sizeof(unsigned char));
+	this->capacity = capacity;
+	this->threshold = calculate_threshold(capacity, this->load_factor);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Find the bucket of a key in an array of buckets
+ * 
+ * Only the control bytes are read for buckets that
+ * are used by keys with a different control byte
+ * 
+ * @param   this      The hash table
+ * @param   buckets   The buckets to search
+ * @param   controls  The control bytes of `buckets`
+ * @param   capacity  The number of buckets in `buckets`
+ * @param   key       The key
+ * @param   key_hash  The hash of the key
+ * @return            The bucket, `NULL` if the key is not used
+ */
+static hash_entry_t * __attribute__((pure, nonnull))
+find_in(const hash_table_t *restrict this, hash_entry_t *restrict buckets,
+        const unsigned char *restrict controls, size_t capacity, size_t key, size_t key_hash)
+{
+	size_t mixed = mix(key_hash);
+	size_t mask = capacity - 1;
+	size_t i = truncate_hash(capacity, mixed);
+	unsigned char control = control_byte(mixed);
+	unsigned char c;
+	hash_entry_t *restrict bucket;
+
+	for (; (c = controls[i]) != CONTROL_EMPTY; i = (i + 1) & mask) {
+		bucket = buckets + i;
+		if (c == control && TEST_KEY(this, bucket, key, key_hash))
+			return bucket;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Find the bucket of a key in the table's current buckets
+ * 
+ * @param   this      The hash table
+ * @param   key       The key
+ * @param   key_hash  The hash of the key
+ * @return            The bucket, `NULL` if the key is not used
+ */
+static hash_entry_t * __attribute__((pure, nonnull))
+find_new(const hash_table_t *restrict this, size_t key, size_t key_hash)
+{
+	return find_in(this, this->buckets, this->control, this->capacity, key, key_hash);
+}
+
+
+/**
+ * Find the bucket of a key in the buckets the table had
+ * before it grew, that have not yet been moved
+ * 
+ * @param   this      The hash table
+ * @param   key       The key
+ * @param   key_hash  The hash of the key
+ * @return            The bucket, `NULL` if the key is not used
+ *                    or if the table is not growing
+ */
+static hash_entry_t * __attribute__((pure, nonnull))
+find_old(const hash_table_t *restrict this, size_t key, size_t key_hash)
+{
+	if (!this->old_buckets)
+		return NULL;
+	return find_in(this, this->old_buckets, this->old_control, this->old_capacity, key, key_hash);
+}
+
+
+/**
+ * Find the bucket of a key
+ * 
+ * A key is never stored both in the current buckets and
+ * in the buckets the table had before it grew
+ * 
+ * @param   this      The hash table
+ * @param   key       The key
+ * @param   key_hash  The hash of the key
+ * @return            The bucket, `NULL` if the key is not used
+ */
+static hash_entry_t * __attribute__((pure, nonnull))
+find(const hash_table_t *restrict this, size_t key, size_t key_hash)
+{
+	hash_entry_t *restrict bucket = find_new(this, key, key_hash);
+	return bucket ? bucket : find_old(this, key, key_hash);
+}
+
+
+/**
+ * Store an entry in the first unused bucket from its
+ * home bucket, the key must not already be used and
+ * the table must have an unused bucket
+ * 
+ * @param  this      The hash table
+ * @param  key       The key of the entry
+ * @param  value     The value of the entry
+ * @param  key_hash  The hash of the key
+ */
+static void __attribute__((nonnull))
+place(hash_table_t *restrict this, size_t key, size_t value, size_t key_hash)
+{
+	size_t mixed = mix(key_hash);
+	size_t mask = this->capacity - 1;
+	size_t i = truncate_hash(this->capacity, mixed);
+	hash_entry_t *restrict bucket;
+
+	while (this->control[i] != CONTROL_EMPTY)
+		i = (i + 1) & mask;
+
+	this->control[i] = control_byte(mixed);
+	bucket = this->buckets + i;
+	bucket->key = key;
+	bucket->value = value;
+	bucket->hash = key_hash;
+}
+
+
+/**
+ * Move entries from the buckets the table had before
+ * it grew, and release those buckets once all entries
+ * have been moved
+ * 
+ * @param  this   The hash table
+ * @param  count  The maximum number of buckets to move
+ */
+static void __attribute__((nonnull))
+migrate(hash_table_t *restrict this, size_t count)
+{
+	hash_entry_t *bucket;
+	size_t i;
+
+	if (!this->old_buckets)
+		return;
+
+	while (count-- && this->migrated < this->old_capacity) {
+		i = this->migrated++;
+		if (!(this->old_control[i] & CONTROL_USED))
+			continue;
+		bucket = this->old_buckets + i;
+		place(this, bucket->key, bucket->value, bucket->hash);
+		this->old_control[i] = CONTROL_MOVED;
+	}
+
+	if (this->migrated == this->old_capacity) {
+		free(this->old_buckets);
+		this->old_buckets = NULL;
+		this->old_control = NULL;
+		this->old_capacity = 0;
+		this->migrated = 0;
+	}
+}
+
+
+/**
+ * Change the capacity of the table
+ * 
+ * If the table was created with `HASH_TABLE_INCREMENTAL_REHASH`,
+ * the entries are left in the old buckets, and are moved by
+ * `migrate` a few at a time. A growth that is still in progress
+ * is completed first.
+ * 
+ * @param   this      The hash table
+ * @param   capacity  The new capacity, must be a power of 2 and greater than the size of the table
+ * @return            Non-zero on error, `errno` will be set accordingly
  */
 static int __attribute__((nonnull))
-rehash(hash_table_t *restrict this)
+rehash(hash_table_t *restrict this, size_t capacity)
 {
-	hash_entry_t **old_buckets = this->buckets;
-	size_t old_capacity = this->capacity;
-	size_t i = old_capacity, index;
+	hash_entry_t *old_buckets;
+	unsigned char *old_control;
+	size_t i;
 	hash_entry_t *bucket;
-	hash_entry_t *destination;
-	hash_entry_t *next;
 
-	fail_if (xcalloc(this->buckets, old_capacity * 2 + 1, hash_entry_t*));
-	this->capacity = old_capacity * 2 + 1;
-	this->threshold = (size_t)((float)(this->capacity) * this->load_factor);
+	migrate(this, SIZE_MAX);
+
+	old_buckets = this->buckets;
+	old_control = this->control;
+	i = this->capacity;
+
+	if (allocate_buckets(this, capacity)) {
+		this->buckets = old_buckets;
+		this->control = old_control;
+		this->capacity = i;
+		this->threshold = calculate_threshold(i, this->load_factor);
+		return -1;
+	}
+
+	if (this->flags & HASH_TABLE_INCREMENTAL_REHASH) {
+		this->old_buckets = old_buckets;
+		this->old_control = old_control;
+		this->old_capacity = i;
+		this->migrated = 0;
+		return 0;
+	}
 
 	while (i--) {
-		bucket = this->buckets[i];
-		while (bucket) {
-			index = truncate_hash(this, bucket->hash);
-			if ((destination = this->buckets[index])) {
-				while ((next = destination->next))
-					destination = next;
-				destination->next = bucket;
-			} else {
-				this->buckets[index] = bucket;
-			}
-
-			next = bucket->next;
-			bucket->next = NULL;
-			bucket = next;
-		}
+		if (old_control[i] == CONTROL_EMPTY)
+			continue;
+		bucket = old_buckets + i;
+		place(this, bucket->key, bucket->value, bucket->hash);
 	}
 
 	free(old_buckets);
 	return 0;
-fail:
-	return -1;
 }
 
 
@@ -114,17 +369,27 @@ fail:
  * @param   this              Memory slot in which to store the new hash table
  * @param   initial_capacity  The initial capacity of the table
  * @param   load_factor       The load factor of the table, i.e. when to grow the table
+ * @param   flags             Bitwise-or of zero or more of the `HASH_TABLE_*` flags
  * @return                    Non-zero on error, `errno` will have been set accordingly
  */
 int
-hash_table_create_fine_tuned(hash_table_t *restrict this, size_t initial_capacity, float load_factor)
+hash_table_create_fine_tuned(hash_table_t *restrict this, size_t initial_capacity, float load_factor, int flags)
 {
-	this->buckets = NULL;
+	size_t capacity = 2;
 
-	this->capacity = initial_capacity ? initial_capacity : 1;
-	fail_if (xcalloc(this->buckets, this->capacity, hash_entry_t*));
+	this->buckets = NULL;
+	this->control = NULL;
+	this->capacity = 0;
+	this->old_buckets = NULL;
+	this->old_control = NULL;
+	this->old_capacity = 0;
+	this->migrated = 0;
+	this->flags = flags;
+
+	while (capacity < initial_capacity)
+		capacity <<= 1;
 	this->load_factor = load_factor;
-	this->threshold = (size_t)((float)(this->capacity) * load_factor);
+	fail_if (allocate_buckets(this, capacity));
 	this->size = 0;
 	this->value_comparator = NULL;
 	this->key_comparator = NULL;
@@ -147,20 +412,32 @@ fail:
 void
 hash_table_destroy(hash_table_t *restrict this, free_func *key_freer, free_func *value_freer)
 {
-	size_t i = this->capacity;
-	hash_entry_t *bucket, *last;
+	size_t i;
+	hash_entry_t *bucket;
+
+	if (this->old_buckets) {
+		for (i = this->old_capacity; i--;) {
+			if (!(this->old_control[i] & CONTROL_USED))
+				continue;
+			bucket = this->old_buckets + i;
+			if (key_freer)   key_freer(bucket->key);
+			if (value_freer) value_freer(bucket->value);
+		}
+		free(this->old_buckets);
+		this->old_buckets = NULL;
+		this->old_capacity = 0;
+	}
 
 	if (this->buckets) {
-		while (i) {
-			bucket = this->buckets[--i];
-			while (bucket) {
-				if (key_freer)   key_freer(bucket->key);
-				if (value_freer) value_freer(bucket->value);
-				bucket = (last = bucket)->next;
-				free(last);
-			}
+		for (i = this->capacity; i--;) {
+			if (this->control[i] == CONTROL_EMPTY)
+				continue;
+			bucket = this->buckets + i;
+			if (key_freer)   key_freer(bucket->key);
+			if (value_freer) value_freer(bucket->value);
 		}
 		free(this->buckets);
+		this->buckets = NULL;
 	}
 }
 
@@ -175,18 +452,14 @@ hash_table_destroy(hash_table_t *restrict this, free_func *key_freer, free_func
 int
 hash_table_contains_value(const hash_table_t *restrict this, size_t value)
 {
-	size_t i = this->capacity;
+	size_t i;
 	hash_entry_t *restrict bucket;
 
-	while (i--) {
-		bucket = this->buckets[i];
-		while (bucket) {
-			if (bucket->value == value)
-				return 1;
-			if (this->value_comparator && this->value_comparator(bucket->value, value))
-				return 1;
-			bucket = bucket->next;
-		}
+	foreach_hash_table_entry (*this, i, bucket) {
+		if (bucket->value == value)
+			return 1;
+		if (this->value_comparator && this->value_comparator(bucket->value, value))
+			return 1;
 	}
 
 	return 0;
@@ -203,17 +476,7 @@ hash_table_contains_value(const hash_table_t *restrict this, size_t value)
 int
 hash_table_contains_key(const hash_table_t *restrict this, size_t key)
 {
-	size_t key_hash = hash(this, key);
-	size_t index = truncate_hash(this, key_hash);
-	hash_entry_t *restrict bucket = this->buckets[index];
-
-	while (bucket) {
-		if (TEST_KEY(this, bucket, key, key_hash))
-			return 1;
-		bucket = bucket->next;
-	}
-
-	return 0;
+	return find(this, key, hash(this, key)) != NULL;
 }
 
 
@@ -227,17 +490,8 @@ hash_table_contains_key(const hash_table_t *restrict this, size_t key)
 size_t
 hash_table_get(const hash_table_t *restrict this, size_t key)
 {
-	size_t key_hash = hash(this, key);
-	size_t index = truncate_hash(this, key_hash);
-	hash_entry_t *restrict bucket = this->buckets[index];
-
-	while (bucket) {
-		if (TEST_KEY(this, bucket, key, key_hash))
-			return bucket->value;
-		bucket = bucket->next;
-	}
-
-	return 0;
+	hash_entry_t *restrict bucket = find(this, key, hash(this, key));
+	return bucket ? bucket->value : 0;
 }
 
 
@@ -251,17 +505,7 @@ hash_table_get(const hash_table_t *restrict this, size_t key)
 hash_entry_t *
 hash_table_get_entry(const hash_table_t *restrict this, size_t key)
 {
-	size_t key_hash = hash(this, key);
-	size_t index = truncate_hash(this, key_hash);
-	hash_entry_t *restrict bucket = this->buckets[index];
-
-	while (bucket) {
-		if (TEST_KEY(this, bucket, key, key_hash))
-			return bucket;
-		bucket = bucket->next;
-	}
-
-	return NULL;
+	return find(this, key, hash(this, key));
 }
 
 
@@ -278,34 +522,25 @@ size_t
 hash_table_put(hash_table_t *restrict this, size_t key, size_t value)
 {
 	size_t key_hash = hash(this, key);
-	size_t index = truncate_hash(this, key_hash);
-	hash_entry_t *restrict bucket = this->buckets[index];
+	hash_entry_t *restrict bucket = find(this, key, key_hash);
 	size_t rc;
 
-	while (bucket) {
-		if (TEST_KEY(this, bucket, key, key_hash)) {
-				rc = bucket->value;
-				bucket->value = value;
-				return rc;
-		} else {
-			bucket = bucket->next;
-		}
+	if (bucket) {
+		rc = bucket->value;
+		bucket->value = value;
+		return rc;
 	}
 
-	if (++(this->size) > this->threshold) {
+	if (this->size + 1 > this->threshold) {
 		errno = 0;
-		fail_if (rehash(this));
-		index = truncate_hash(this, key_hash);
+		fail_if (rehash(this, this->capacity << 1));
 	}
 
-	errno = 0;
-	fail_if (xmalloc(bucket, 1, hash_entry_t));
-	bucket->value = value;
-	bucket->key = key;
-	bucket->hash = key_hash;
-	bucket->next = this->buckets[index];
-	this->buckets[index] = bucket;
+	place(this, key, value, key_hash);
+	this->size++;
+	migrate(this, MIGRATION_STEP);
 
+	errno = 0;
 	return 0;
 fail:
 	return 0;
@@ -315,6 +550,12 @@ fail:
 /**
  * Remove an entry in the table
  * 
+ * The entries that follow the removed entry in its
+ * probe sequence are moved backwards to fill the
+ * hole, so no tombstones are ever left behind in the
+ * current buckets, the buckets the table had before
+ * it grew are released once they have been emptied
+ * 
  * @param   this  The hash table
  * @param   key   The key of the entry to remove
  * @return        The previous value associated with the key, 0 if the key was not used
@@ -323,27 +564,41 @@ size_t
 hash_table_remove(hash_table_t *restrict this, size_t key)
 {
 	size_t key_hash = hash(this, key);
-	size_t index = truncate_hash(this, key_hash);
-	hash_entry_t *bucket = this->buckets[index];
-	hash_entry_t *last = NULL;
+	hash_entry_t *bucket = find_new(this, key, key_hash);
+	size_t mask = this->capacity - 1;
+	size_t i, j, home;
 	size_t rc;
 
-	while (bucket) {
-		if (TEST_KEY(this, bucket, key, key_hash)) {
-			if (!last)
-				this->buckets[index] = bucket->next;
-			else
-				last->next = bucket->next;
-			this->size--;
-			rc = bucket->value;
-			free(bucket);
-			return rc;
+	if (!bucket) {
+		if (!(bucket = find_old(this, key, key_hash)))
+			return 0;
+		rc = bucket->value;
+		this->old_control[bucket - this->old_buckets] = CONTROL_MOVED;
+		this->size--;
+		migrate(this, MIGRATION_STEP);
+		return rc;
+	}
+
+	rc = bucket->value;
+	i = j = (size_t)(bucket - this->buckets);
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (this->control[j] == CONTROL_EMPTY)
+			break;
+		/* The entry can fill the hole unless its home bucket is between the hole and itself. */
+		home = truncate_hash(this->capacity, mix(this->buckets[j].hash));
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			this->buckets[i] = this->buckets[j];
+			this->control[i] = this->control[j];
+			i = j;
 		}
-		last = bucket;
-		bucket = bucket->next;
 	}
 
-	return 0;
+	this->control[i] = CONTROL_EMPTY;
+	this->size--;
+	migrate(this, MIGRATION_STEP);
+	return rc;
 }
 
 
@@ -355,24 +610,16 @@ hash_table_remove(hash_table_t *restrict this, size_t key)
 void
 hash_table_clear(hash_table_t *restrict this)
 {
-	hash_entry_t **buf, *bucket;
-	size_t i, ptr;
+	if (this->old_buckets) {
+		free(this->old_buckets);
+		this->old_buckets = NULL;
+		this->old_control = NULL;
+		this->old_capacity = 0;
+		this->migrated = 0;
+	}
 
 	if (this->size) {
-		buf = alloca((this->size + 1) * sizeof(hash_entry_t*));
-		i = this->capacity;
-		while (i--) {
-			bucket = this->buckets[i];
-			ptr = 0;
-			buf[ptr++] = bucket;
-			while (bucket) {
-				bucket = bucket->next;
-				buf[ptr++] = bucket;
-			}
-			while (ptr)
-				free(buf[--ptr]);
-			this->buckets[i] = NULL;
-		}
+		memset(this->control, CONTROL_EMPTY, this->capacity * sizeof(unsigned char));
 		this->size = 0;
 	}
 }
@@ -387,34 +634,30 @@ hash_table_clear(hash_table_t *restrict this)
 size_t
 hash_table_marshal_size(const hash_table_t *restrict this)
 {
-	size_t n = this->capacity;
-	size_t rc = 3 * sizeof(size_t) + sizeof(float) + n * sizeof(size_t);
-	size_t i, m = 0;
-	hash_entry_t *restrict bucket;
-
-	for (i = 0; i < n; i++) {
-		bucket = this->buckets[i];
-		while (bucket) {
-			bucket = bucket->next;
-			m++;
-		}
-	}
-
-	return rc + m * 3 * sizeof(size_t) + sizeof(int);
+	size_t rc = 3 * sizeof(size_t) + sizeof(float) + this->capacity * sizeof(size_t);
+	return rc + this->size * 3 * sizeof(size_t) + sizeof(int);
 }
 
 
 /**
  * Marshals a hash table
  * 
+ * The format is the one used for separately chained
+ * buckets, where each bucket has zero or one entry,
+ * or, if the table is growing incrementally, up to
+ * two entries if the entry with same index in the
+ * buckets the table had before it grew has not
+ * been moved yet
+ * 
  * @param  this  The hash table
  * @param  data  Output buffer for the marshalled data
  */
 void
 hash_table_marshal(const hash_table_t *restrict this, char *restrict data)
 {
-	size_t i, n = this->capacity, m;
+	size_t i, n = this->capacity;
 	hash_entry_t *restrict bucket;
+	hash_entry_t *restrict old_bucket;
 
 	buf_set_next(data, int, HASH_TABLE_T_VERSION);
 	buf_set_next(data, size_t, this->capacity);
@@ -423,17 +666,22 @@ hash_table_marshal(const hash_table_t *restrict this, char *restrict data)
 	buf_set_next(data, size_t, this->size);
 
 	for (i = 0; i < n; i++) {
-		bucket = this->buckets[i];
-		m = 0;
-		while (bucket) {
-			buf_set(data, size_t, 1 + m * 3 + 0, bucket->key);
-			buf_set(data, size_t, 1 + m * 3 + 1, bucket->value);
-			buf_set(data, size_t, 1 + m * 3 + 2, bucket->hash);
-			bucket = bucket->next;
-			m++;
+		bucket = this->control[i] == CONTROL_EMPTY ? NULL : this->buckets + i;
+		old_bucket = NULL;
+		if (i < this->old_capacity && (this->old_control[i] & CONTROL_USED))
+			old_bucket = this->old_buckets + i;
+
+		buf_set_next(data, size_t, (size_t)!!bucket + (size_t)!!old_bucket);
+		if (bucket) {
+			buf_set_next(data, size_t, bucket->key);
+			buf_set_next(data, size_t, bucket->value);
+			buf_set_next(data, size_t, bucket->hash);
+		}
+		if (old_bucket) {
+			buf_set_next(data, size_t, old_bucket->key);
+			buf_set_next(data, size_t, old_bucket->value);
+			buf_set_next(data, size_t, old_bucket->hash);
 		}
-		buf_set(data, size_t, 0, m);
-		buf_next(data, size_t, 1 + m * 3);
 	}
 }
 
@@ -441,6 +689,10 @@ hash_table_marshal(const hash_table_t *restrict this, char *restrict data)
 /**
  * Unmarshals a hash table
  * 
+ * Buckets with more than one entry, as marshalled by
+ * separately chained tables, are accepted, the entries
+ * are placed by their marshalled hashes
+ * 
  * @param   this      Memory slot in which to store the new hash table
  * @param   data      In buffer with the marshalled data
  * @param   remapper  Function that translates values, `NULL` if not translation takes place
@@ -450,38 +702,44 @@ hash_table_marshal(const hash_table_t *restrict this, char *restrict data)
 int
 hash_table_unmarshal(hash_table_t *restrict this, char *restrict data, remap_func *remapper)
 {
-	size_t i, n, m;
-	hash_entry_t *restrict bucket;
+	size_t i, n, m, size, capacity = 2;
+	size_t key, value, key_hash;
 
 	/* buf_get(data, int, 0, HASH_TABLE_T_VERSION); */
 	buf_next(data, int, 1);
 
+	this->buckets          = NULL;
+	this->control          = NULL;
+	this->capacity         = 0;
+	this->old_buckets      = NULL;
+	this->old_control      = NULL;
+	this->old_capacity     = 0;
+	this->migrated         = 0;
+	this->flags            = 0;
+	this->size             = 0;
 	this->value_comparator = NULL;
 	this->key_comparator   = NULL;
 	this->hasher           = NULL;
 
-	buf_get_next(data, size_t, this->capacity = n);
+	buf_get_next(data, size_t, n);
 	buf_get_next(data, float, this->load_factor);
-	buf_get_next(data, size_t, this->threshold);
-	buf_get_next(data, size_t, this->size);
+	buf_next(data, size_t, 1);
+	buf_get_next(data, size_t, size);
 
-	fail_if (xcalloc(this->buckets, this->capacity, hash_entry_t*));
+	while (capacity < n || capacity <= size)
+		capacity <<= 1;
+	fail_if (allocate_buckets(this, capacity));
 
 	for (i = 0; i < n; i++) {
 		buf_get_next(data, size_t, m);
-
-		fail_if (xmalloc(this->buckets[i] = bucket, 1, hash_entry_t));
-
 		while (m--) {
-			if (!m)
-				bucket->next = NULL;
-			else
-				fail_if (xmalloc(bucket->next, 1, hash_entry_t));
-			buf_get_next(data, size_t, bucket->key);
-			buf_get_next(data, size_t, bucket->value);
+			buf_get_next(data, size_t, key);
+			buf_get_next(data, size_t, value);
+			buf_get_next(data, size_t, key_hash);
 			if (remapper)
-				bucket->value = remapper(bucket->value);
-			buf_get_next(data, size_t, bucket->hash);
+				value = remapper(value);
+			place(this, key, value, key_hash);
+			this->size++;
 		}
 	}
 
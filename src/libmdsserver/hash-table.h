@@ -25,6 +25,21 @@
 
 #define HASH_TABLE_T_VERSION 0
 
+/**
+ * Flag for `hash_table_create_fine_tuned`: when the table grows,
+ * keep the old buckets and move their entries a few at a time
+ * in each later call to `hash_table_put` and `hash_table_remove`,
+ * rather than moving all entries at once, this bounds the time
+ * of each call at the expense of slightly slower lookups and
+ * higher memory usage while the table grows
+ */
+#define HASH_TABLE_INCREMENTAL_REHASH  1
+
+/**
+ * Bit that is set in the control byte of every used bucket
+ */
+#define HASH_TABLE_CONTROL_USED  0x80
+
 /**
  * Hash table entry
  */
@@ -41,32 +56,69 @@ typedef struct hash_entry
 	size_t value;
 
 	/**
-	 * The truncated hash value of the key
+	 * The hash value of the key
 	 */
 	size_t hash;
 
-	/**
-	 * The next entry in the bucket
-	 */
-	struct hash_entry *next;
-
 } hash_entry_t;
 
 
 /**
  * Value lookup table based on hash value, that do not support
+ * 
+ * The table uses open addressing with linear probing, all
+ * entries are stored in one allocation together with one
+ * control byte per bucket. Pointers to entries are invalidated
+ * whenever an entry is added to or removed from the table.
  */
 typedef struct hash_table
 {
 	/**
-	 * The table's capacity, i.e. the number of buckets
+	 * The table's capacity, i.e. the number of buckets,
+	 * this is always a power of 2
 	 */
 	size_t capacity;
 
 	/**
-	 * Entry buckets
+	 * Entry buckets, each bucket holds at most one entry
+	 */
+	hash_entry_t *buckets;
+
+	/**
+	 * The control byte of each bucket, zero if the bucket is
+	 * unused, otherwise the highest bit is set and the other
+	 * bits are taken from the hash of the key, so that most
+	 * buckets with other keys can be skipped without reading
+	 * them. This array is stored directly after `buckets`
+	 * in the same allocation.
+	 */
+	unsigned char *control;
+
+	/**
+	 * The buckets the table had before it grew, `NULL`
+	 * unless the table is growing incrementally, the
+	 * control bytes are stored directly after them
 	 */
-	hash_entry_t **buckets;
+	hash_entry_t *old_buckets;
+
+	/**
+	 * The control bytes of `old_buckets`, a bucket whose
+	 * entry has been moved or removed has a control byte
+	 * that is neither zero nor has the highest bit set
+	 */
+	unsigned char *old_control;
+
+	/**
+	 * The number of buckets in `old_buckets`, 0 unless
+	 * the table is growing incrementally
+	 */
+	size_t old_capacity;
+
+	/**
+	 * The number of buckets, from the beginning of `old_buckets`,
+	 * whose entries have been moved to `buckets`
+	 */
+	size_t migrated;
 
 	/**
 	 * When, in the ratio of entries comparied to the capacity, to grow the table
@@ -113,6 +165,13 @@ typedef struct hash_table
 	 */
 	hash_func *hasher;
 
+	/**
+	 * Bitwise-or of zero or more of the `HASH_TABLE_*` flags
+	 * 
+	 * Be aware, this variable cannot be marshalled
+	 */
+	int flags;
+
 } hash_table_t;
 
 
@@ -123,10 +182,11 @@ typedef struct hash_table
  * @param   this              Memory slot in which to store the new hash table
  * @param   initial_capacity  The initial capacity of the table
  * @param   load_factor       The load factor of the table, i.e. when to grow the table
+ * @param   flags             Bitwise-or of zero or more of the `HASH_TABLE_*` flags
  * @return                    Non-zero on error, `errno` will have been set accordingly
  */
 __attribute__((nonnull))
-int hash_table_create_fine_tuned(hash_table_t *restrict this, size_t initial_capacity, float load_factor);
+int hash_table_create_fine_tuned(hash_table_t *restrict this, size_t initial_capacity, float load_factor, int flags);
 
 /**
  * Create a hash table
@@ -136,7 +196,7 @@ int hash_table_create_fine_tuned(hash_table_t *restrict this, size_t initial_cap
  * @return  :int                     Non-zero on error, `errno` will have been set accordingly
  */
 #define hash_table_create_tuned(this, initial_capacity)\
-	hash_table_create_fine_tuned(this, initial_capacity, 0.75f)
+	hash_table_create_fine_tuned(this, initial_capacity, 0.75f, 0)
 
 /**
  * Create a hash table
@@ -191,6 +251,9 @@ size_t hash_table_get(const hash_table_t *restrict this, size_t key);
 /**
  * Look up an entry in the table
  * 
+ * The entry is only valid until an entry is added
+ * to or removed from the table
+ * 
  * @param   this  The hash table
  * @param   key   The key associated with the value
  * @return        The entry associated with the key, `NULL` if the key was not used
@@ -231,13 +294,22 @@ void hash_table_clear(hash_table_t *restrict this);
 /**
  * Wrapper for `for` keyword that iterates over entry element in a hash table
  * 
+ * The table must not be modified during the iteration,
+ * except immediately before the iteration is broken
+ * 
  * @param  this:hash_table_t    The hash table
- * @param  i:size_t             The variable to store the buckey index in at each iteration
+ * @param  i:size_t             The variable to store the buckey index in at each iteration,
+ *                              buckets that are yet to be moved while the table grows have
+ *                              indices from `(this).capacity`
  * @param  entry:hash_entry_t*  The variable to store the entry in at each iteration
  */
 #define foreach_hash_table_entry(this, i, entry)\
-	for (i = 0; i < (this).capacity; i++)\
-		for (entry = (this).buckets[i]; entry; entry = entry->next)
+	for (i = 0; i < (this).capacity + (this).old_capacity; i++)\
+		for (entry = i < (this).capacity\
+		             ? ((this).control[i] ? (this).buckets + i : NULL)\
+		             : (((this).old_control[i - (this).capacity] & HASH_TABLE_CONTROL_USED)\
+		                ? (this).old_buckets + (i - (this).capacity) : NULL);\
+		     entry; entry = NULL)
 
 /**
  * Calculate the buffer size need to marshal a hash table
@@ -0,0 +1,192 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_HEADER_HASH_H
+#define MDS_LIBMDSSERVER_HEADER_HASH_H
+
+
+/* Perfect hashing of header names, used by both libmdsserver's
+ * `header_matcher_t` and libmdsclient's `libmds_header_matcher_t`,
+ * libmdsclient does not link against libmdsserver, so it is
+ * implemented in this header. The matchers pass their fields
+ * because they are different types with the same layout. */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+
+
+/**
+ * The number of seeds to try, for each table size but
+ * the largest, before the table size is doubled
+ */
+#define HEADER_HASH_SEEDS_PER_SIZE  1024
+
+
+
+/**
+ * Add a byte to the hash of a header name, this is FNV-1a
+ * 
+ * @param   hash  The hash of the preceding bytes, or the seed
+ * @param   byte  The byte
+ * @return        The new hash
+ */
+static inline uint32_t __attribute__((const))
+header_hash_byte(uint32_t hash, char byte)
+{
+	return (hash ^ (uint32_t)(unsigned char)byte) * UINT32_C(16777619);
+}
+
+/**
+ * Get the slot in a hash table for a hash
+ * 
+ * @param   hash  The hash of the header name
+ * @param   mask  The number of slots in the table, less one
+ * @return        The index of the slot
+ */
+static inline size_t __attribute__((const))
+header_hash_slot(uint32_t hash, size_t mask)
+{
+	return (size_t)(hash ^ (hash >> 16)) & mask;
+}
+
+/**
+ * Try to build a hash table with a seed
+ * 
+ * @param   names    The header names
+ * @param   lengths  The lengths of the header names
+ * @param   count    The number of header names
+ * @param   seed     The seed of the hash function
+ * @param   mask     The number of slots in `table`, less one
+ * @param   table    Output parameter for the index of the
+ *                   name for each slot plus one, or zero
+ * @return           Whether the hash is perfect for the names
+ */
+static int __attribute__((nonnull, unused))
+header_hash_try_seed(const char *const *restrict names, const size_t *restrict lengths, size_t count,
+                     uint32_t seed, size_t mask, unsigned char *restrict table)
+{
+	size_t i, j, slot;
+	uint32_t hash;
+
+	memset(table, 0, (mask + 1) * sizeof(*table));
+
+	for (i = 0; i < count; i++) {
+		hash = seed;
+		for (j = 0; j < lengths[i]; j++)
+			hash = header_hash_byte(hash, names[i][j]);
+		slot = header_hash_slot(hash, mask);
+		if (table[slot])
+			return 0;
+		table[slot] = (unsigned char)(i + 1);
+	}
+
+	return 1;
+}
+
+/**
+ * Build a perfect hash table for a set of header names
+ * 
+ * @param   names      The header names, without the colon
+ * @param   count      The number of elements in `names`,
+ *                     at least 1 and at most `max_names`
+ * @param   max_names  The maximum number of names, at most a quarter of `max_slots`
+ * @param   max_slots  The number of elements allocated to `table`, a power of two
+ * @param   lengths    Output parameter for the lengths of the header names
+ * @param   seed       Output parameter for the seed of the hash function
+ * @param   mask       Output parameter for the number of slots used in `table`, less one
+ * @param   table      Output parameter for the index of the name
+ *                     for each slot plus one, or zero
+ * @return             Zero on success, -1 on error, in which case `errno`
+ *                     is set to `EINVAL` because `count` is out of range,
+ *                     or because `names` contains duplicates
+ */
+static int __attribute__((nonnull, unused))
+header_hash_compile(const char *const *restrict names, size_t count, size_t max_names, size_t max_slots,
+                    size_t *restrict lengths, uint32_t *restrict seed, size_t *restrict mask,
+                    unsigned char *restrict table)
+{
+	size_t i, j, slots, attempt;
+
+	if (!count || count > max_names)
+		return errno = EINVAL, -1;
+
+	for (i = 0; i < count; i++) {
+		lengths[i] = strlen(names[i]);
+		for (j = 0; j < i; j++)
+			if (!strcmp(names[i], names[j]))
+				return errno = EINVAL, -1;
+	}
+
+	/* Start with a table that is at most half full, and search for a seed
+	   that gives each name its own slot. With the largest table, the search
+	   is not bounded, but it is at most a quarter full, so it ends soon. */
+	for (slots = 8; slots < 2 * count; slots <<= 1);
+	for (;; slots <<= 1) {
+		*mask = slots - 1;
+		for (attempt = 0; slots == max_slots || attempt < HEADER_HASH_SEEDS_PER_SIZE; attempt++) {
+			*seed = UINT32_C(2166136261) + (uint32_t)attempt * UINT32_C(2654435769);
+			if (header_hash_try_seed(names, lengths, count, *seed, *mask, table))
+				return 0;
+		}
+	}
+}
+
+/**
+ * Look up a header in a perfect hash table
+ * 
+ * @param   header   The header, NUL-terminated
+ * @param   names    The header names the table was built for
+ * @param   lengths  The lengths of the header names
+ * @param   seed     The seed of the hash function
+ * @param   mask     The number of slots in `table`, less one
+ * @param   table    The index of the name for each slot plus one, or zero
+ * @param   value    Output parameter for the header's value,
+ *                   only set if the header is found
+ * @return           The index of the header's name, -1 if it is not in the table
+ */
+static ssize_t __attribute__((nonnull, unused))
+header_hash_lookup(const char *restrict header, const char *const *restrict names,
+                   const size_t *restrict lengths, uint32_t seed, size_t mask,
+                   const unsigned char *restrict table, const char **restrict value)
+{
+	const char *p;
+	uint32_t hash = seed;
+	size_t index, length;
+
+	for (p = header; *p && (*p != ':' || p[1] != ' '); p++)
+		hash = header_hash_byte(hash, *p);
+	if (!*p)
+		return -1;
+
+	index = table[header_hash_slot(hash, mask)];
+	if (!index--)
+		return -1;
+	length = (size_t)(p - header);
+	if (length != lengths[index] || memcmp(header, names[index], length))
+		return -1;
+
+	*value = p + 2;
+	return (ssize_t)index;
+}
+
+
+#endif
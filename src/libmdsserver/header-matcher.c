@@ -0,0 +1,89 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "header-matcher.h"
+
+#include "header-hash.h"
+
+
+
+/**
+ * Compile a header matcher
+ * 
+ * @param   this   Memory slot in which to store the matcher
+ * @param   names  The names of the headers, without the colon, the
+ *                 array and its strings must not be modified or freed
+ *                 before the matcher is no longer used
+ * @param   count  The number of elements in `names`, at least 1
+ *                 and at most `HEADER_MATCHER_MAX_NAMES`
+ * @return         Zero on success, -1 on error, in which case `errno`
+ *                 is set to `EINVAL` because `count` is out of range,
+ *                 or because `names` contains duplicates
+ */
+int
+header_matcher_compile(header_matcher_t *restrict this, const char *const *restrict names, size_t count)
+{
+	this->count = 0;
+	if (header_hash_compile(names, count, HEADER_MATCHER_MAX_NAMES, HEADER_MATCHER_MAX_SLOTS,
+	                        this->lengths, &(this->seed), &(this->mask), this->table))
+		return -1;
+	this->names = names;
+	this->count = count;
+	return 0;
+}
+
+
+/**
+ * Extract the values of headers from a message
+ * 
+ * If a header occurs multiple times in the message,
+ * the first occurrence is used
+ * 
+ * @param   this          The matcher
+ * @param   headers       The headers in the message
+ * @param   header_count  The number of elements in `headers`
+ * @param   values        For each name the matcher was compiled with, in the
+ *                        same order, a pointer to where the value of the header
+ *                        shall be stored, it is left unmodified if the message
+ *                        does not have the header, so it can be set to a default
+ * @return                The number of found headers of those in the matcher
+ */
+size_t
+header_matcher_match(const header_matcher_t *restrict this, char **restrict headers,
+                     size_t header_count, const char **const *restrict values)
+{
+	uint64_t found = 0, bit;
+	size_t found_count = 0, i;
+	const char *value;
+	ssize_t index;
+
+	for (i = 0; i < header_count && found_count < this->count; i++) {
+		index = header_hash_lookup(headers[i], this->names, this->lengths,
+		                           this->seed, this->mask, this->table, &value);
+		if (index < 0)
+			continue;
+
+		bit = (uint64_t)1 << index;
+		if (found & bit)
+			continue;
+		found |= bit;
+		found_count++;
+		*(values[index]) = value;
+	}
+
+	return found_count;
+}
@@ -0,0 +1,121 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_HEADER_MATCHER_H
+#define MDS_LIBMDSSERVER_HEADER_MATCHER_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/**
+ * The maximum number of header names in a header matcher
+ */
+#define HEADER_MATCHER_MAX_NAMES  64
+
+/**
+ * The maximum number of slots in the hash table of a header matcher
+ */
+#define HEADER_MATCHER_MAX_SLOTS  256
+
+
+/**
+ * Matcher that extracts the values of a fixed set
+ * of headers from a message in a single pass
+ * 
+ * The header names are compiled into a perfect hash table,
+ * so each header in a message is hashed once, up to its
+ * colon, and compared against at most one of the names.
+ * The matcher does not allocate any memory, and it can be
+ * used by any number of threads once it has been compiled.
+ */
+typedef struct header_matcher {
+	/**
+	 * The header names, without the colon,
+	 * not owned by the matcher
+	 */
+	const char *const *names;
+
+	/**
+	 * The lengths of the header names
+	 */
+	size_t lengths[HEADER_MATCHER_MAX_NAMES];
+
+	/**
+	 * The number of header names,
+	 * zero if the matcher has not been compiled
+	 */
+	size_t count;
+
+	/**
+	 * The seed of the hash function
+	 */
+	uint32_t seed;
+
+	/**
+	 * The number of slots in `table`, less one
+	 */
+	size_t mask;
+
+	/**
+	 * For each hash, the index of the only
+	 * name with that hash plus one, or zero
+	 */
+	unsigned char table[HEADER_MATCHER_MAX_SLOTS];
+} header_matcher_t;
+
+
+
+/**
+ * Compile a header matcher
+ * 
+ * @param   this   Memory slot in which to store the matcher
+ * @param   names  The names of the headers, without the colon, the
+ *                 array and its strings must not be modified or freed
+ *                 before the matcher is no longer used
+ * @param   count  The number of elements in `names`, at least 1
+ *                 and at most `HEADER_MATCHER_MAX_NAMES`
+ * @return         Zero on success, -1 on error, in which case `errno`
+ *                 is set to `EINVAL` because `count` is out of range,
+ *                 or because `names` contains duplicates
+ */
+__attribute__((nonnull))
+int header_matcher_compile(header_matcher_t *restrict this, const char *const *restrict names, size_t count);
+
+/**
+ * Extract the values of headers from a message
+ * 
+ * If a header occurs multiple times in the message,
+ * the first occurrence is used
+ * 
+ * @param   this          The matcher
+ * @param   headers       The headers in the message
+ * @param   header_count  The number of elements in `headers`
+ * @param   values        For each name the matcher was compiled with, in the
+ *                        same order, a pointer to where the value of the header
+ *                        shall be stored, it is left unmodified if the message
+ *                        does not have the header, so it can be set to a default
+ * @return                The number of found headers of those in the matcher
+ */
+__attribute__((nonnull))
+size_t header_matcher_match(const header_matcher_t *restrict this, char **restrict headers,
+                            size_t header_count, const char **const *restrict values);
+
+
+#endif
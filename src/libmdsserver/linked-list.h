@@ -162,7 +162,7 @@ int linked_list_pack(linked_list_t *restrict this);
  *                               `LINKED_LIST_UNUSED` on error, `errno` will be set accordingly
  */
 #define linked_list_insert_beginning(this, value)\
-	(linked_list_insert_after(this, value, this->edge))
+	(linked_list_insert_after((this), (value), (this)->edge))
 
 /**
  * Remove the node at the beginning of the list
@@ -171,7 +171,7 @@ int linked_list_pack(linked_list_t *restrict this);
  * @return  :ssize_t             The node that has been removed
  */
 #define linked_list_remove_beginning(this)\
-	(linked_list_remove_after(this, this->edge))
+	(linked_list_remove_after((this), (this)->edge))
 
 /**
  * Insert a value after a specified, reference, node
@@ -221,6 +221,36 @@
 		errno = pthread_mutex_unlock(&mutex);\
 	} while (0)
 
+/**
+ * Wrapper for `pthread_rwlock_rdlock` and `pthread_rwlock_unlock`
+ * 
+ * @param  lock:pthread_rwlock_t  The read–write lock
+ * @param  instructions           The instructions to run while the lock is read-locked
+ */
+#define with_rdlock(lock, instructions)\
+	do {\
+		errno = pthread_rwlock_rdlock(&lock);\
+		do {\
+			instructions;\
+		} while (0);\
+		errno = pthread_rwlock_unlock(&lock);\
+	} while (0)
+
+/**
+ * Wrapper for `pthread_rwlock_wrlock` and `pthread_rwlock_unlock`
+ * 
+ * @param  lock:pthread_rwlock_t  The read–write lock
+ * @param  instructions           The instructions to run while the lock is write-locked
+ */
+#define with_wrlock(lock, instructions)\
+	do {\
+		errno = pthread_rwlock_wrlock(&lock);\
+		do {\
+			instructions;\
+		} while (0);\
+		errno = pthread_rwlock_unlock(&lock);\
+	} while (0)
+
 
 /**
  * Return the maximum value of two values
@@ -729,7 +759,7 @@
 		int _fail_if_saved_errno;\
 		if (__VA_ARGS__) {\
 			_fail_if_saved_errno = errno;\
-			if (errno != EMSGSIZE && errno != ECONNRESET && errno != EINTR)\
+			if (errno != EMSGSIZE && errno != ECONNRESET && errno != EINTR && errno != EAGAIN)\
 				fprintf(stderr, "failure at %s:%i\n", __FILE__, __LINE__);\
 			errno = _fail_if_saved_errno;\
 			goto fail;\
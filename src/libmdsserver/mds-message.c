@@ -19,6 +19,7 @@
 
 #include "macros.h"
 #include "util.h"
+#include "scan.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +31,14 @@
 #define try(INSTRUCTION) do { if ((r = INSTRUCTION) < 0) return r; } while (0)
 
 
+/**
+ * The largest arena a message keeps when it is reset,
+ * messages that do not fit are allocated from chunks
+ * that are freed when the next message is read
+ */
+#define ARENA_KEEP  (64 << 10)
+
+
 /**
  * Initialise a message slot so that it can
  * be used by `mds_message_read`
@@ -48,7 +57,14 @@ mds_message_initialise(mds_message_t *restrict this)
 	this->payload_ptr = 0;
 	this->buffer_size = 128;
 	this->buffer_ptr = 0;
+	this->buffer_off = 0;
+	this->scan_ptr = 0;
+	this->header_ends = NULL;
+	this->header_ends_count = 0;
+	this->header_ends_size = 0;
+	this->header_ends_ascii = 1;
 	this->stage = 0;
+	arena_initialise(&(this->arena));
 	fail_if (xmalloc(this->buffer, this->buffer_size, char));
 	return 0;
 fail:
@@ -72,7 +88,14 @@ mds_message_zero_initialise(mds_message_t *restrict this)
 	this->buffer = NULL;
 	this->buffer_size = 0;
 	this->buffer_ptr = 0;
+	this->buffer_off = 0;
+	this->scan_ptr = 0;
+	this->header_ends = NULL;
+	this->header_ends_count = 0;
+	this->header_ends_size = 0;
+	this->header_ends_ascii = 1;
 	this->stage = 0;
+	arena_initialise(&(this->arena));
 }
 
 
@@ -85,18 +108,24 @@ mds_message_zero_initialise(mds_message_t *restrict this)
 void
 mds_message_destroy(mds_message_t *restrict this)
 {
-	size_t i;
-	if (this->headers)
-		xfree(this->headers, this->header_count);
+	arena_destroy(&(this->arena));
+	this->headers = NULL;
+	this->header_count = 0;
+	this->payload = NULL;
 
-	free(this->payload), this->payload = NULL;
-	free(this->buffer),  this->buffer  = NULL;
+	free(this->header_ends), this->header_ends = NULL;
+	this->header_ends_count = this->header_ends_size = 0;
+	free(this->buffer), this->buffer = NULL;
 }
 
 
 /**
  * Extend the header list's allocation
  * 
+ * The header list is allocated from the message's arena,
+ * so the old header list is not freed until the message
+ * is reset or destroyed
+ * 
  * @param   this    The message
  * @param   extent  The number of additional entries
  * @return          Zero on success, -1 on error
@@ -104,8 +133,12 @@ mds_message_destroy(mds_message_t *restrict this)
 int
 mds_message_extend_headers(mds_message_t *restrict this, size_t extent)
 {
-	char **new_headers = this->headers;
-	fail_if (xrealloc(new_headers, this->header_count + extent, char*));
+	char **new_headers;
+	if (extent > SIZE_MAX / sizeof(char *) - this->header_count)
+		fail_if ((errno = ENOMEM));
+	fail_if (!(new_headers = arena_alloc(&(this->arena), (this->header_count + extent) * sizeof(char *))));
+	if (this->header_count)
+		memcpy(new_headers, this->headers, this->header_count * sizeof(char *));
 	this->headers = new_headers;
 	return 0;
 fail:
@@ -140,15 +173,18 @@ fail:
 static void __attribute__((nonnull))
 reset_message(mds_message_t *restrict this)
 {
-	size_t i;
-	if (this->headers)
-		xfree(this->headers, this->header_count);
+	/* Release the header list, the headers and
+	   the payload at once, keeping the memory. */
+	arena_reset(&(this->arena), ARENA_KEEP);
+	this->headers = NULL;
 	this->header_count = 0;
 
-	free(this->payload);
 	this->payload = NULL;
 	this->payload_size = 0;
 	this->payload_ptr = 0;
+	this->header_ends_count = 0;
+	this->header_ends_ascii = 1;
+	this->scan_ptr = this->buffer_off;
 }
 
 
@@ -189,14 +225,15 @@ get_payload_length(mds_message_t *restrict this)
  * 
  * @param   header  The header, must be NUL-terminated
  * @param   length  The length of the header
+ * @param   ascii   Whether the header is known to be ASCII
  * @return          Zero if valid, negative if invalid (malformated message: unrecoverable state)
  */
 static int __attribute__((pure, nonnull))
-validate_header(const char *header, size_t length)
+validate_header(const char *header, size_t length, int ascii)
 {
 	char *p = memchr(header, ':', length * sizeof(char));
 
-	if (verify_utf8(header, 0) < 0)
+	if (!ascii && verify_utf8(header, 0) < 0)
 		/* Either the string is not UTF-8, or your are under an UTF-8 attack,
 		   let's just call this unrecoverable because the client will not correct. */
 		return -2;
@@ -210,42 +247,93 @@ validate_header(const char *header, size_t length)
 
 
 /**
- * Remove the beginning of the read buffer
+ * Remove the parsed data from the beginning of the read buffer
  * 
- * @param  this        The message
- * @param  length      The number of characters to remove  
- * @param  update_ptr  Whether to update the buffer pointer
+ * @param  this  The message
  */
 static void __attribute__((nonnull))
-unbuffer_beginning(mds_message_t *restrict this, size_t length, int update_ptr)
+compact_buffer(mds_message_t *restrict this)
 {
-	memmove(this->buffer, this->buffer + length, (this->buffer_ptr - length) * sizeof(char));
-	if (update_ptr)
-		this->buffer_ptr -= length;
+	size_t n = this->buffer_off;
+	memmove(this->buffer, this->buffer + n, (this->buffer_ptr - n) * sizeof(char));
+	this->buffer_ptr -= n;
+	this->buffer_off = 0;
+	if (!this->stage)
+		this->scan_ptr -= n;
 }
 
 
 /**
- * Remove the header–payload delimiter from the buffer,
- * get the payload's size and allocate the payload
+ * Remember where a header ends, so that it can be
+ * stored when all headers have been found
+ * 
+ * @param   this  The message
+ * @param   end   The position of the header's LF, relative to `buffer_off`
+ * @return        Zero on success, -1 on error
+ */
+static int __attribute__((nonnull))
+add_header_end(mds_message_t *restrict this, size_t end)
+{
+	size_t *new_ends = this->header_ends;
+	size_t new_size;
+
+	if (this->header_ends_count == this->header_ends_size) {
+		new_size = this->header_ends_size ? this->header_ends_size << 1 : 8;
+		fail_if (xrealloc(new_ends, new_size, size_t));
+		this->header_ends = new_ends;
+		this->header_ends_size = new_size;
+	}
+
+	this->header_ends[this->header_ends_count++] = end;
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Store the headers that have been found in the read buffer,
+ * they are copied at once, and NUL-terminated in place of their LF
  * 
  * @param   this  The message
  * @return        The return value follows the rules of `mds_message_read`
  */
 static int __attribute__((nonnull))
-initialise_payload(mds_message_t *restrict this)
+store_headers(mds_message_t *restrict this)
 {
-	/* Remove the \n (end of empty line) we found from the buffer. */
-	unbuffer_beginning(this, 1, 1);
+	size_t i, start = 0, end, n = this->header_ends_count;
+	char **new_headers;
+	char *block;
+	int r;
 
-	/* Get the length of the payload. */
-	if (get_payload_length(this) < 0)
-		return -2; /* Malformated value, enters unrecoverable state. */
+	if (!n)
+		return 0;
 
-	/* Allocate the payload buffer. */
-	if (this->payload_size > 0)
-		fail_if (xmalloc(this->payload, this->payload_size, char));
+	/* Make room for the headers. (There are only already
+	   stored headers if the message was unmarshalled.) */
+	try (mds_message_extend_headers(this, n));
+
+	/* Copy all headers with a single copy, excluding the empty line. */
+	end = this->header_ends[n - 1] + 1;
+	fail_if (!(block = arena_alloc(&(this->arena), end * sizeof(char))));
+	memcpy(block, this->buffer + this->buffer_off, end * sizeof(char));
+
+	new_headers = this->headers + this->header_count;
+	for (i = 0; i < n; i++, start = end + 1) {
+		end = this->header_ends[i];
+		block[end] = '\0';
 
+		/* Make sure the the header syntax is correct so that
+		   the program does not need to care about it. */
+		if (validate_header(block + start, end - start + 1, this->header_ends_ascii))
+			return -2;
+
+		new_headers[i] = block + start;
+	}
+
+	this->header_count += n;
+	this->header_ends_count = 0;
+	this->header_ends_ascii = 1;
 	return 0;
 fail:
 	return -1;
@@ -253,36 +341,53 @@ fail:
 
 
 /**
- * Create a header from the buffer and store it
+ * Find the headers in the read buffer, and once the
+ * empty line after them has been found, store them,
+ * get the payload's size and allocate the payload
  * 
- * @param   this    The message
- * @param   length  The length of the header, including LF-termination
- * @return          The return value follows the rules of `mds_message_read`
+ * Headers that have been found are not scanned again
+ * if the function is called multiple times while the
+ * headers are being received
+ * 
+ * @param   this  The message
+ * @return        The return value follows the rules of `mds_message_read`
  */
 static int __attribute__((nonnull))
-store_header(mds_message_t *restrict this, size_t length)
+read_headers(mds_message_t *restrict this)
 {
-	char *header;
+	size_t end;
+	int r;
+
+	/* Find the LFs and check whether the headers are ASCII in the same pass. */
+	for (;;) {
+		end = this->scan_ptr + scan_line(this->buffer + this->scan_ptr, this->buffer_ptr - this->scan_ptr,
+		                                 &(this->header_ends_ascii));
+		if (end == this->buffer_ptr)
+			break;
 
-	/* Allocate the header. */
-	fail_if (xmalloc(header, length, char)); /* Last char is a LF, which is substituted with NUL. */
-	/* Copy the header data into the allocated header, */
-	memcpy(header, this->buffer, length * sizeof(char));
-	/* and NUL-terminate it. */
-	header[length - 1] = '\0';
+		if (end > this->scan_ptr) {
+			/* We have found a header, remember where it is. */
+			fail_if (add_header_end(this, end - this->buffer_off));
+			this->scan_ptr = end + 1;
+			continue;
+		}
 
-	/* Remove the header data from the read buffer. */
-	unbuffer_beginning(this, length, 1);
+		/* We have found an empty line, i.e. the end of the headers. */
+		try (store_headers(this));
+		this->buffer_off = this->scan_ptr = end + 1;
 
-	/* Make sure the the header syntax is correct so that
-	   the program does not need to care about it. */
-	if (validate_header(header, length)) {
-		free(header);
-		return -2;
-	}
+		/* Get the length of the payload. */
+		if (get_payload_length(this) < 0)
+			return -2; /* Malformated value, enters unrecoverable state. */
 
-	/* Store the header in the header list. */
-	this->headers[this->header_count++] = header;
+		/* Allocate the payload buffer. */
+		if (this->payload_size > 0)
+			fail_if (!(this->payload = arena_alloc(&(this->arena), this->payload_size * sizeof(char))));
+
+		/* Mark end of stage, next stage is getting the payload. */
+		this->stage = 1;
+		break;
+	}
 
 	return 0;
 fail:
@@ -309,8 +414,12 @@ continue_read(mds_message_t *restrict this, int fd)
 
 	/* If we do not have too much left, */
 	if (n < 128) {
-		/* grow the buffer, */
-		try (mds_message_extend_buffer(this));
+		/* remove the parsed data from the buffer, and
+		   grow the buffer if that does not suffice, */
+		if (this->buffer_off)
+			compact_buffer(this);
+		if (this->buffer_size - this->buffer_ptr < 128)
+			try (mds_message_extend_buffer(this));
 
 		/* and recalculate how much space we have left. */
 		n = this->buffer_size - this->buffer_ptr;
@@ -346,9 +455,8 @@ fail:
 int
 mds_message_read(mds_message_t *restrict this, int fd)
 {
-	size_t header_commit_buffer = 0, length, need, move;
+	size_t need, move;
 	int r;
-	char *p;
 
 	/* If we are at stage 2, we are done and it is time to start over.
 	   This is important because the function could have been interrupted. */
@@ -360,31 +468,11 @@ mds_message_read(mds_message_t *restrict this, int fd)
 	/* Read from file descriptor until we have a full message. */
 	for (;;) {
 		/* Stage 0: headers. */
-		/* Read all headers that we have stored into the read buffer. */
-		while (!this->stage && ((p = memchr(this->buffer, '\n', this->buffer_ptr * sizeof(char))))) {
-			if ((length = (size_t)(p - this->buffer))) {
-				/* We have found a header. */
-
-				/* On every eighth header found with this function call,
-				   we prepare the header list for eight more headers so
-				   that it does not need to be reallocated again and again. */
-				if (!header_commit_buffer)
-					try (mds_message_extend_headers(this, header_commit_buffer = 8));
-
-				/* Create and store header. */
-				try (store_header(this, length + 1));
-				header_commit_buffer -= 1;
-			} else {
-				/* We have found an empty line, i.e. the end of the headers. */
-
-				/* Remove the header–payload delimiter from the buffer,
-				   get the payload's size and allocate the payload. */
-				try (initialise_payload(this));
-
-				/* Mark end of stage, next stage is getting the payload. */
-				this->stage = 1;
-			}
-		}
+		/* Find the headers that we have stored into the read buffer,
+		   they are not removed from the read buffer until all have
+		   been found, so that the buffer is not moved for each header. */
+		if (!this->stage)
+			try (read_headers(this));
 
 
 		/* Stage 1: payload. */
@@ -392,11 +480,11 @@ mds_message_read(mds_message_t *restrict this, int fd)
 			/* How much of the payload that has not yet been filled. */
 			need = this->payload_size - this->payload_ptr;
 			/* How much we have of that what is needed. */
-			move = min(this->buffer_ptr, need);
+			move = min(this->buffer_ptr - this->buffer_off, need);
 
-			/* Copy what we have, and remove it from the the read buffer. */
-			memcpy(this->payload + this->payload_ptr, this->buffer, move * sizeof(char));
-			unbuffer_beginning(this, move, 1);
+			/* Copy what we have, and skip past it in the the read buffer. */
+			memcpy(this->payload + this->payload_ptr, this->buffer + this->buffer_off, move * sizeof(char));
+			this->buffer_off += move;
 
 			/* Keep track of how much we have read. */
 			this->payload_ptr += move;
@@ -404,7 +492,10 @@ mds_message_read(mds_message_t *restrict this, int fd)
 		if (this->stage == 1 && this->payload_ptr == this->payload_size) {
 			/* If we have filled the payload (or there was no payload),
 			   mark the end of this stage, i.e. that the message is
-			   complete, and return with success. */
+			   complete, and return with success. If the read buffer
+			   has been emptied, rewind it, which is free. */
+			if (this->buffer_off == this->buffer_ptr)
+				this->buffer_off = this->buffer_ptr = 0;
 			this->stage = 2;
 			return 0;
 		}
@@ -418,6 +509,48 @@ mds_message_read(mds_message_t *restrict this, int fd)
 }
 
 
+/**
+ * Check whether the next message has already been received
+ * in full, so that `mds_message_read` will not have to read
+ * from the socket, and thus will not block, to get it
+ * 
+ * @param   this  The message, that has been read with `mds_message_read`
+ * @return        1 if the next message can be read without blocking, 0 otherwise
+ */
+int
+mds_message_ready(const mds_message_t *restrict this)
+{
+	const char *p = this->buffer + this->buffer_off;
+	const char *end = this->buffer + this->buffer_ptr;
+	const char *lf, *q;
+	size_t length = 0, n = strlen("Length: ");
+	int have_length = 0;
+
+	/* A message that is still being read has not been returned yet. */
+	if (this->stage != 2)
+		return 0;
+
+	/* Find the end of the headers, and the length of the payload. */
+	for (;; p = lf + 1) {
+		if (!(lf = memchr(p, '\n', (size_t)(end - p) * sizeof(char))))
+			return 0;
+		if (lf == p)
+			break;
+		if (have_length || (size_t)(lf - p) < n || memcmp(p, "Length: ", n * sizeof(char)))
+			continue;
+		have_length = 1;
+		for (q = p + n; q != lf; q++) {
+			/* A malformated value is reported without reading more. */
+			if (*q < '0' || '9' < *q)
+				return 1;
+			length = length * 10 + (size_t)(*q - '0');
+		}
+	}
+
+	return (size_t)(end - (lf + 1)) >= length;
+}
+
+
 /**
  * Get the required allocation size for `data` of the
  * function `mds_message_marshal`
@@ -431,6 +564,7 @@ mds_message_marshal_size(const mds_message_t *restrict this)
 	size_t i, rc = this->header_count + this->payload_size;
 	for (i = 0; i < this->header_count; i++)
 		rc += strlen(this->headers[i]);
+	rc += this->buffer_ptr - this->buffer_off;
 	rc *= sizeof(char);
 	rc += 4 * sizeof(size_t) + 2 * sizeof(int);
 	return rc;
@@ -453,7 +587,7 @@ mds_message_marshal(const mds_message_t *restrict this, char *restrict data)
 	buf_set_next(data, size_t, this->header_count);
 	buf_set_next(data, size_t, this->payload_size);
 	buf_set_next(data, size_t, this->payload_ptr);
-	buf_set_next(data, size_t, this->buffer_ptr);
+	buf_set_next(data, size_t, this->buffer_ptr - this->buffer_off);
 	buf_set_next(data, int, this->stage);
 
 	for (i = 0; i < this->header_count; i++) {
@@ -465,7 +599,10 @@ mds_message_marshal(const mds_message_t *restrict this, char *restrict data)
 	memcpy(data, this->payload, this->payload_ptr * sizeof(char));
 	buf_next(data, char, this->payload_ptr);
 
-	memcpy(data, this->buffer, this->buffer_ptr * sizeof(char));
+	/* The parsed data in the read buffer is not marshalled, nor are
+	   the headers that have been found but not stored, they are
+	   found again after the message has been unmarshalled. */
+	memcpy(data, this->buffer + this->buffer_off, (this->buffer_ptr - this->buffer_off) * sizeof(char));
 }
 
 
@@ -498,9 +635,16 @@ mds_message_unmarshal(mds_message_t *restrict this, char *restrict data)
 	this->headers = NULL;
 	this->payload = NULL;
 	this->buffer  = NULL;
+	this->buffer_off = 0;
+	this->scan_ptr = 0;
+	this->header_ends = NULL;
+	this->header_ends_count = 0;
+	this->header_ends_size = 0;
+	this->header_ends_ascii = 1;
+	arena_initialise(&(this->arena));
 
 	/* To 2-power-multiple of 128 bytes. */
-	this->buffer_size >>= 7;
+	this->buffer_size = (this->buffer_size + 127) >> 7;
 	if (!this->buffer_size) {
 		this->buffer_size = 1;
 	} else {
@@ -520,10 +664,10 @@ mds_message_unmarshal(mds_message_t *restrict this, char *restrict data)
 	/* Allocate header list, payload and read buffer. */
 
 	if (header_count > 0)
-		fail_if (xmalloc(this->headers, header_count, char*));
+		fail_if (!(this->headers = arena_alloc(&(this->arena), header_count * sizeof(char *))));
 
 	if (this->payload_size > 0)
-		fail_if (xmalloc(this->payload, this->payload_size, char));
+		fail_if (!(this->payload = arena_alloc(&(this->arena), this->payload_size * sizeof(char))));
 
 	fail_if (xmalloc(this->buffer, this->buffer_size, char));
 
@@ -531,7 +675,8 @@ mds_message_unmarshal(mds_message_t *restrict this, char *restrict data)
 
 	for (i = 0; i < header_count; i++) {
 		n = strlen(data) + 1;
-		fail_if (xmemdup(this->headers[i], data, n, char));
+		fail_if (!(this->headers[i] = arena_alloc(&(this->arena), n * sizeof(char))));
+		memcpy(this->headers[i], data, n * sizeof(char));
 		buf_next(data, char, n);
 		this->header_count++;
 	}
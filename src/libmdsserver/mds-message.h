@@ -19,6 +19,8 @@
 #define MDS_LIBMDSSERVER_MDS_MESSAGE_H
 
 
+#include "arena.h"
+
 #include <stddef.h>
 
 
@@ -74,11 +76,53 @@ typedef struct mds_message
 	 */
 	size_t buffer_ptr;
 
+	/**
+	 * The number of bytes at the beginning of `buffer`
+	 * that have already been parsed (internal data)
+	 */
+	size_t buffer_off;
+
+	/**
+	 * The beginning of the line in `buffer` that is
+	 * being looked for while reading headers (internal data)
+	 */
+	size_t scan_ptr;
+
+	/**
+	 * The position of the LF that terminates each header found while
+	 * reading headers, relative to `buffer_off`, the headers are not
+	 * stored in `headers` until all of them have been found (internal data)
+	 */
+	size_t *header_ends;
+
+	/**
+	 * The number of elements in `header_ends` (internal data)
+	 */
+	size_t header_ends_count;
+
+	/**
+	 * The number of elements allocated to `header_ends` (internal data)
+	 */
+	size_t header_ends_size;
+
+	/**
+	 * Whether all headers found while reading headers are ASCII,
+	 * in which case they are not validated as UTF-8 (internal data)
+	 */
+	int header_ends_ascii;
+
 	/**
 	 * 0 while reading headers, 1 while reading payload, and 2 when done (internal data)
 	 */
 	int stage;
 
+	/**
+	 * The memory the header list, the headers and the payload
+	 * are allocated from, it is reset when the next message
+	 * is read, or when the message is destroyed (internal data)
+	 */
+	arena_t arena;
+
 } mds_message_t;
 
 
@@ -113,6 +157,10 @@ void mds_message_destroy(mds_message_t *restrict this);
 /**
  * Extend the header list's allocation
  * 
+ * The header list is allocated from the message's arena,
+ * so the old header list is not freed until the message
+ * is reset or destroyed
+ * 
  * @param   this    The message
  * @param   extent  The number of additional entries
  * @return          Zero on success, -1 on error
@@ -136,6 +184,17 @@ int mds_message_extend_headers(mds_message_t *restrict this, size_t extent);
 __attribute__((nonnull))
 int mds_message_read(mds_message_t *restrict this, int fd);
 
+/**
+ * Check whether the next message has already been received
+ * in full, so that `mds_message_read` will not have to read
+ * from the socket, and thus will not block, to get it
+ * 
+ * @param   this  The message, that has been read with `mds_message_read`
+ * @return        1 if the next message can be read without blocking, 0 otherwise
+ */
+__attribute__((pure, nonnull))
+int mds_message_ready(const mds_message_t *restrict this);
+
 /**
  * Get the required allocation size for `data` of the
  * function `mds_message_marshal`
@@ -0,0 +1,319 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "mpsc-queue.h"
+
+#include "macros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+
+/**
+ * Get the sequence number of a slot, the element follows it
+ * 
+ * The sequence number of the slot that the element with
+ * the position `p` (the value of `head` when it is pushed)
+ * will be stored in is `p` when the slot is free for it,
+ * `p + 1` when the element has been stored, and changed to
+ * `p + capacity` when the element is popped, so that it is
+ * free for the element that will be pushed a lap later
+ * 
+ * @param   T  The queue
+ * @param   I  The index of the slot
+ * @return     The sequence number of the slot, as a `size_t*`
+ */
+#define SEQUENCE(T, I)\
+	((size_t *)(void *)((T)->slots + (I) * (T)->slot_size))
+
+
+/**
+ * Create a queue
+ * 
+ * @param   this          Memory slot in which to store the new queue
+ * @param   capacity      The number of elements the queue can hold, rounded up to a power of 2
+ * @param   element_size  The size of each element
+ * @param   flags         Bitwise-or of zero or more of the `MPSC_QUEUE_*` flags
+ * @return                Non-zero on error, `errno` will have been set accordingly
+ */
+int
+mpsc_queue_create(mpsc_queue_t *restrict this, size_t capacity, size_t element_size, int flags)
+{
+	size_t i;
+
+	this->slots = NULL;
+	this->wakeup_fd = -1;
+	this->head = 0;
+	this->tail = 0;
+	this->waiting = 0;
+
+	for (this->capacity = 2; this->capacity < capacity;)
+		this->capacity <<= 1;
+	this->element_size = element_size;
+	element_size = (element_size + sizeof(size_t) - 1) / sizeof(size_t);
+	this->slot_size = (1 + element_size) * sizeof(size_t);
+
+	fail_if (xbmalloc(this->slots, this->capacity * this->slot_size));
+	for (i = 0; i < this->capacity; i++)
+		*SEQUENCE(this, i) = i;
+
+	if (flags & MPSC_QUEUE_WAKEUP)
+		fail_if ((this->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Release all resources in a queue, should be done even if
+ * construction fails, elements left in the queue are discarded
+ * 
+ * @param  this  The queue
+ */
+void
+mpsc_queue_destroy(mpsc_queue_t *restrict this)
+{
+	free(this->slots);
+	this->slots = NULL;
+	if (this->wakeup_fd >= 0)
+		xclose(this->wakeup_fd);
+	this->wakeup_fd = -1;
+}
+
+
+/**
+ * Wake the consumer if it is sleeping
+ * 
+ * @param  this  The queue
+ */
+static void __attribute__((nonnull))
+wake(mpsc_queue_t *this)
+{
+	uint64_t one = 1;
+	int saved_errno;
+
+	/* The element must be visible before `waiting` is read, and the consumer
+	   sets `waiting` before it checks whether the queue is empty, so either
+	   the consumer sees the element or this thread sees `waiting`. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&(this->waiting), __ATOMIC_RELAXED))
+		return;
+	if (!__atomic_exchange_n(&(this->waiting), 0, __ATOMIC_ACQ_REL))
+		return;
+
+	saved_errno = errno;
+	while (write(this->wakeup_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+	errno = saved_errno;
+}
+
+
+/**
+ * Add an element to the end of a queue, this
+ * may be done by any thread
+ * 
+ * @param   this     The queue
+ * @param   element  The element to copy into the queue
+ * @return           Zero on success, -1 if the queue is full,
+ *                   in which case `errno` is set to `EAGAIN`
+ */
+int
+mpsc_queue_push(mpsc_queue_t *this, const void *restrict element)
+{
+	size_t mask = this->capacity - 1;
+	size_t position = __atomic_load_n(&(this->head), __ATOMIC_RELAXED);
+	size_t *sequence;
+	ssize_t difference;
+
+	/* Claim the slot at `head`, unless it still holds the
+	   element from the previous lap, in which case the
+	   queue is full. If another producer claims it first,
+	   `position` is updated and the next slot is tried. */
+	for (;;) {
+		sequence = SEQUENCE(this, position & mask);
+		difference = (ssize_t)(__atomic_load_n(sequence, __ATOMIC_ACQUIRE) - position);
+		if (!difference) {
+			if (__atomic_compare_exchange_n(&(this->head), &position, position + 1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (difference < 0) {
+			return errno = EAGAIN, -1;
+		} else {
+			position = __atomic_load_n(&(this->head), __ATOMIC_RELAXED);
+		}
+	}
+
+	/* Store the element, and publish it to the consumer. */
+	memcpy(sequence + 1, element, this->element_size);
+	__atomic_store_n(sequence, position + 1, __ATOMIC_RELEASE);
+
+	if (this->wakeup_fd >= 0)
+		wake(this);
+	return 0;
+}
+
+
+/**
+ * Remove the first element from a queue, this
+ * may only be done by the consumer
+ * 
+ * @param   this     The queue
+ * @param   element  Output parameter for the element
+ * @return           Zero on success, -1 if the queue is empty,
+ *                   in which case `errno` is set to `EAGAIN`
+ */
+int
+mpsc_queue_pop(mpsc_queue_t *this, void *restrict element)
+{
+	size_t position = this->tail;
+	size_t *sequence = SEQUENCE(this, position & (this->capacity - 1));
+
+	if (__atomic_load_n(sequence, __ATOMIC_ACQUIRE) != position + 1)
+		return errno = EAGAIN, -1;
+
+	memcpy(element, sequence + 1, this->element_size);
+	__atomic_store_n(sequence, position + this->capacity, __ATOMIC_RELEASE);
+	__atomic_store_n(&(this->tail), position + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/**
+ * Get the first element in a queue without removing
+ * it, this may only be done by the consumer
+ * 
+ * @param   this  The queue
+ * @return        The first element, `NULL` if the queue is empty
+ */
+void *
+mpsc_queue_peek(const mpsc_queue_t *this)
+{
+	size_t position = this->tail;
+	size_t *sequence = SEQUENCE(this, position & (this->capacity - 1));
+
+	if (__atomic_load_n(sequence, __ATOMIC_ACQUIRE) != position + 1)
+		return NULL;
+	return sequence + 1;
+}
+
+
+/**
+ * Get the number of elements in a queue
+ * 
+ * Unless called by the consumer while no element is being
+ * pushed, the number is only a snapshot, and it includes
+ * elements that are being pushed but cannot be popped yet
+ * 
+ * @param   this  The queue
+ * @return        The number of elements in the queue
+ */
+size_t
+mpsc_queue_size(const mpsc_queue_t *this)
+{
+	size_t tail = __atomic_load_n(&(this->tail), __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(this->head), __ATOMIC_ACQUIRE) - tail;
+}
+
+
+/**
+ * Get an element in a queue without removing it, this may
+ * only be done while no thread is using the queue, for
+ * example to marshal the elements
+ * 
+ * @param   this   The queue
+ * @param   index  The index of the element, 0 for the first
+ *                 element, must be less than the size of the queue
+ * @return         The element
+ */
+void *
+mpsc_queue_get(const mpsc_queue_t *restrict this, size_t index)
+{
+	return SEQUENCE(this, (this->tail + index) & (this->capacity - 1)) + 1;
+}
+
+
+/**
+ * Tell producers that the consumer is about to sleep on `wakeup_fd`,
+ * the consumer must call `mpsc_queue_finish_wait` once it has been
+ * woken up, but must not sleep if this function returns non-zero
+ * 
+ * @param   this  The queue, created with `MPSC_QUEUE_WAKEUP`
+ * @return        Non-zero if the queue is not empty
+ */
+int
+mpsc_queue_prepare_wait(mpsc_queue_t *this)
+{
+	__atomic_store_n(&(this->waiting), 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!mpsc_queue_peek(this))
+		return 0;
+	__atomic_store_n(&(this->waiting), 0, __ATOMIC_RELAXED);
+	return 1;
+}
+
+
+/**
+ * Tell producers that the consumer is no longer
+ * sleeping, and reset `wakeup_fd`
+ * 
+ * @param  this  The queue, created with `MPSC_QUEUE_WAKEUP`
+ */
+void
+mpsc_queue_finish_wait(mpsc_queue_t *this)
+{
+	uint64_t counter;
+	int saved_errno = errno;
+
+	__atomic_store_n(&(this->waiting), 0, __ATOMIC_RELAXED);
+	if (read(this->wakeup_fd, &counter, sizeof(counter)) < 0)
+		errno = saved_errno;
+}
+
+
+/**
+ * Sleep until a queue is not empty, this
+ * may only be done by the consumer
+ * 
+ * @param   this  The queue, created with `MPSC_QUEUE_WAKEUP`
+ * @return        Zero on success, -1 on error, `errno` will be
+ *                set to `EINTR` if interrupted by a signal
+ */
+int
+mpsc_queue_wait(mpsc_queue_t *this)
+{
+	struct pollfd pfd;
+	int r, saved_errno;
+
+	if (mpsc_queue_prepare_wait(this))
+		return 0;
+
+	pfd.fd = this->wakeup_fd;
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, -1);
+
+	saved_errno = errno;
+	mpsc_queue_finish_wait(this);
+	errno = saved_errno;
+	return r < 0 ? -1 : 0;
+}
@@ -0,0 +1,210 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_MPSC_QUEUE_H
+#define MDS_LIBMDSSERVER_MPSC_QUEUE_H
+
+
+#include <stddef.h>
+
+
+
+/**
+ * Flag for `mpsc_queue_create`: create an eventfd(2) that
+ * the consumer can wait on for elements to be pushed
+ */
+#define MPSC_QUEUE_WAKEUP  1
+
+
+/**
+ * Bounded, lock-free queue with any number of producers
+ * but only one consumer at a time
+ * 
+ * Elements are copied into and out of the queue, they
+ * are aligned to `size_t`. Pushing fails rather than
+ * blocks if the queue is full, and popping fails rather
+ * than blocks if the queue is empty, but if the queue
+ * is created with `MPSC_QUEUE_WAKEUP` the consumer can
+ * sleep until an element has been pushed, either with
+ * `mpsc_queue_wait`, or by polling `wakeup_fd` between
+ * `mpsc_queue_prepare_wait` and `mpsc_queue_finish_wait`.
+ * Producers only write to `wakeup_fd` when the consumer
+ * is sleeping.
+ */
+typedef struct mpsc_queue {
+	/**
+	 * The slots, each slot is a `size_t` sequence number
+	 * followed by the element, the sequence number tells
+	 * whether the slot is free or holds an element
+	 */
+	char *slots;
+
+	/**
+	 * The number of slots, a power of 2
+	 */
+	size_t capacity;
+
+	/**
+	 * The size of an element
+	 */
+	size_t element_size;
+
+	/**
+	 * The size of a slot
+	 */
+	size_t slot_size;
+
+	/**
+	 * The number of elements that have been pushed,
+	 * or are being pushed
+	 */
+	size_t head;
+
+	/**
+	 * The number of elements that have been popped
+	 */
+	size_t tail;
+
+	/**
+	 * Event file descriptor that is written to when an element is
+	 * pushed while the consumer is sleeping, -1 unless the queue
+	 * was created with `MPSC_QUEUE_WAKEUP`
+	 */
+	int wakeup_fd;
+
+	/**
+	 * Whether the consumer is, or is about to start, sleeping
+	 */
+	int waiting;
+} mpsc_queue_t;
+
+
+
+/**
+ * Create a queue
+ * 
+ * @param   this          Memory slot in which to store the new queue
+ * @param   capacity      The number of elements the queue can hold, rounded up to a power of 2
+ * @param   element_size  The size of each element
+ * @param   flags         Bitwise-or of zero or more of the `MPSC_QUEUE_*` flags
+ * @return                Non-zero on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull))
+int mpsc_queue_create(mpsc_queue_t *restrict this, size_t capacity, size_t element_size, int flags);
+
+/**
+ * Release all resources in a queue, should be done even if
+ * construction fails, elements left in the queue are discarded
+ * 
+ * @param  this  The queue
+ */
+__attribute__((nonnull))
+void mpsc_queue_destroy(mpsc_queue_t *restrict this);
+
+/**
+ * Add an element to the end of a queue, this
+ * may be done by any thread
+ * 
+ * @param   this     The queue
+ * @param   element  The element to copy into the queue
+ * @return           Zero on success, -1 if the queue is full,
+ *                   in which case `errno` is set to `EAGAIN`
+ */
+__attribute__((nonnull))
+int mpsc_queue_push(mpsc_queue_t *this, const void *restrict element);
+
+/**
+ * Remove the first element from a queue, this
+ * may only be done by the consumer
+ * 
+ * @param   this     The queue
+ * @param   element  Output parameter for the element
+ * @return           Zero on success, -1 if the queue is empty,
+ *                   in which case `errno` is set to `EAGAIN`
+ */
+__attribute__((nonnull))
+int mpsc_queue_pop(mpsc_queue_t *this, void *restrict element);
+
+/**
+ * Get the first element in a queue without removing
+ * it, this may only be done by the consumer
+ * 
+ * @param   this  The queue
+ * @return        The first element, `NULL` if the queue is empty
+ */
+__attribute__((nonnull))
+void *mpsc_queue_peek(const mpsc_queue_t *this);
+
+/**
+ * Get the number of elements in a queue
+ * 
+ * Unless called by the consumer while no element is being
+ * pushed, the number is only a snapshot, and it includes
+ * elements that are being pushed but cannot be popped yet
+ * 
+ * @param   this  The queue
+ * @return        The number of elements in the queue
+ */
+__attribute__((nonnull))
+size_t mpsc_queue_size(const mpsc_queue_t *this);
+
+/**
+ * Get an element in a queue without removing it, this may
+ * only be done while no thread is using the queue, for
+ * example to marshal the elements
+ * 
+ * @param   this   The queue
+ * @param   index  The index of the element, 0 for the first
+ *                 element, must be less than the size of the queue
+ * @return         The element
+ */
+__attribute__((pure, nonnull))
+void *mpsc_queue_get(const mpsc_queue_t *restrict this, size_t index);
+
+/**
+ * Tell producers that the consumer is about to sleep on `wakeup_fd`,
+ * the consumer must call `mpsc_queue_finish_wait` once it has been
+ * woken up, but must not sleep if this function returns non-zero
+ * 
+ * @param   this  The queue, created with `MPSC_QUEUE_WAKEUP`
+ * @return        Non-zero if the queue is not empty
+ */
+__attribute__((nonnull))
+int mpsc_queue_prepare_wait(mpsc_queue_t *this);
+
+/**
+ * Tell producers that the consumer is no longer
+ * sleeping, and reset `wakeup_fd`
+ * 
+ * @param  this  The queue, created with `MPSC_QUEUE_WAKEUP`
+ */
+__attribute__((nonnull))
+void mpsc_queue_finish_wait(mpsc_queue_t *this);
+
+/**
+ * Sleep until a queue is not empty, this
+ * may only be done by the consumer
+ * 
+ * @param   this  The queue, created with `MPSC_QUEUE_WAKEUP`
+ * @return        Zero on success, -1 on error, `errno` will be
+ *                set to `EINTR` if interrupted by a signal
+ */
+__attribute__((nonnull))
+int mpsc_queue_wait(mpsc_queue_t *this);
+
+
+#endif
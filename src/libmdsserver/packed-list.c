@@ -0,0 +1,370 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "packed-list.h"
+
+#include "macros.h"
+
+#include <string.h>
+#include <errno.h>
+
+
+/**
+ * The default initial capacity
+ */
+#ifndef PACKED_LIST_DEFAULT_INITIAL_CAPACITY
+# define PACKED_LIST_DEFAULT_INITIAL_CAPACITY 128
+#endif
+
+
+/**
+ * Computes the nearest, but higher, power of two,
+ * but only if the current value is not a power of two
+ * 
+ * @param   value  The value to be rounded up to a power of two
+ * @return         The nearest, but not smaller, power of two
+ */
+static size_t __attribute__((const))
+to_power_of_two(size_t value)
+{
+	value -= 1;
+	value |= value >> 1;
+	value |= value >> 2;
+	value |= value >> 4;
+	value |= value >> 8;
+	value |= value >> 16;
+#if SIZE_MAX == UINT64_MAX
+	value |= value >> 32;
+#endif
+	return value + 1;
+}
+
+
+/**
+ * Change the size of the arrays
+ * 
+ * @param   this      The list
+ * @param   capacity  The new capacity, must not be less than `this->handles_end`
+ * @return            Non-zero on error, `errno` will have been set accordingly
+ */
+static int __attribute__((nonnull))
+resize(packed_list_t *restrict this, size_t capacity)
+{
+	size_t *tmp_values;
+	ssize_t *tmp;
+	char *tmp_records;
+
+	fail_if (yrealloc(tmp_values, this->values,    capacity, size_t));
+	fail_if (yrealloc(tmp,        this->handles,   capacity, ssize_t));
+	fail_if (yrealloc(tmp,        this->positions, capacity, ssize_t));
+	if (this->record_size)
+		fail_if (yrealloc(tmp_records, this->records, capacity * this->record_size, char));
+
+	this->capacity = capacity;
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Create a packed list
+ * 
+ * @param   this      Memory slot in which to store the new packed list
+ * @param   capacity  The minimum initial capacity of the packed list, 0 for default
+ * @return            Non-zero on error, `errno` will have been set accordingly
+ */
+int
+packed_list_create(packed_list_t *restrict this, size_t capacity)
+{
+	return packed_list_create_with_records(this, capacity, 0);
+}
+
+
+/**
+ * Create a packed list with a record stored inline with
+ * each value, the records are moved with the values
+ * 
+ * @param   this         Memory slot in which to store the new packed list
+ * @param   capacity     The minimum initial capacity of the packed list, 0 for default
+ * @param   record_size  The size of each record, 0 for no records
+ * @return               Non-zero on error, `errno` will have been set accordingly
+ */
+int
+packed_list_create_with_records(packed_list_t *restrict this, size_t capacity, size_t record_size)
+{
+	/* Use default capacity of zero is specified. */
+	if (!capacity)
+		capacity = PACKED_LIST_DEFAULT_INITIAL_CAPACITY;
+
+	/* Initialise the packed list. */
+	this->capacity    = capacity = to_power_of_two(capacity);
+	this->count       = 0;
+	this->handles_end = 0;
+	this->reuse_head  = PACKED_LIST_UNUSED;
+	this->values      = NULL;
+	this->handles     = NULL;
+	this->positions   = NULL;
+	this->record_size = record_size;
+	this->records     = NULL;
+	fail_if (xmalloc(this->values,    capacity,  size_t));
+	fail_if (xmalloc(this->handles,   capacity, ssize_t));
+	fail_if (xmalloc(this->positions, capacity, ssize_t));
+	if (record_size)
+		fail_if (xmalloc(this->records, capacity * record_size, char));
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Release all resources in a packed list, should
+ * be done even if `packed_list_create` fails
+ * 
+ * @param  this  The packed list
+ */
+void
+packed_list_destroy(packed_list_t *restrict this)
+{
+	free(this->values),    this->values    = NULL;
+	free(this->handles),   this->handles   = NULL;
+	free(this->positions), this->positions = NULL;
+	free(this->records),   this->records   = NULL;
+}
+
+
+/**
+ * Reduce the capacity of the list to the smallest
+ * capacity that can be used without changing the
+ * handles of the values. This method has linear
+ * time complexity and linear memory complexity.
+ * 
+ * @param   this  The list
+ * @return        Non-zero on error, `errno` will have been set accordingly
+ */
+int
+packed_list_pack(packed_list_t *restrict this)
+{
+	size_t i, end = 0;
+	ssize_t handle;
+
+	/* Find the highest handle in use. */
+	for (i = 0; i < this->count; i++)
+		if ((size_t)(this->handles[i]) >= end)
+			end = (size_t)(this->handles[i]) + 1;
+
+	/* Rebuild the stack of reusable handles, without those above it. */
+	for (i = 0; i < end; i++)
+		this->positions[i] = PACKED_LIST_UNUSED;
+	for (i = 0; i < this->count; i++)
+		this->positions[this->handles[i]] = (ssize_t)i;
+	this->reuse_head = PACKED_LIST_UNUSED;
+	for (handle = (ssize_t)end; handle-- > 0;) {
+		if (this->positions[handle] != PACKED_LIST_UNUSED)
+			continue;
+		this->positions[handle] = this->reuse_head;
+		this->reuse_head = handle;
+	}
+	this->handles_end = end;
+
+	return resize(this, to_power_of_two(end ? end : 1));
+}
+
+
+/**
+ * Insert a value in the list
+ * 
+ * @param   this   The list
+ * @param   value  The value to insert
+ * @return         The handle of the value, `PACKED_LIST_UNUSED`
+ *                 on error, `errno` will be set accordingly
+ */
+ssize_t
+packed_list_insert(packed_list_t *restrict this, size_t value)
+{
+	ssize_t handle;
+
+	/* Reuse a handle if possible, otherwise use a new one. */
+	if (this->reuse_head != PACKED_LIST_UNUSED) {
+		handle = this->reuse_head;
+		this->reuse_head = this->positions[handle];
+	} else {
+		if (this->handles_end == this->capacity)
+			fail_if (resize(this, this->capacity << 1));
+		handle = (ssize_t)(this->handles_end++);
+	}
+
+	/* Add the value to the end. There is always room when there is a
+	   reusable handle, as there are more handles than values then. */
+	this->values[this->count] = value;
+	this->handles[this->count] = handle;
+	this->positions[handle] = (ssize_t)(this->count++);
+	if (this->record_size)
+		memset(this->records + (this->count - 1) * this->record_size, 0, this->record_size);
+
+	return handle;
+fail:
+	return PACKED_LIST_UNUSED;
+}
+
+
+/**
+ * Remove a value from the list, the
+ * last value is moved into its position
+ * 
+ * @param  this    The list
+ * @param  handle  The handle of the value
+ */
+void
+packed_list_remove(packed_list_t *restrict this, ssize_t handle)
+{
+	size_t position = (size_t)(this->positions[handle]);
+	size_t last = --(this->count);
+
+	/* Move the last value into the hole. */
+	this->values[position] = this->values[last];
+	this->handles[position] = this->handles[last];
+	this->positions[this->handles[position]] = (ssize_t)position;
+	if (this->record_size && (position != last))
+		memcpy(this->records + position * this->record_size,
+		       this->records + last * this->record_size, this->record_size);
+
+	/* Make the handle reusable. */
+	this->positions[handle] = this->reuse_head;
+	this->reuse_head = handle;
+}
+
+
+/**
+ * Calculate the buffer size need to marshal a packed list
+ * 
+ * @param   this  The list
+ * @return        The number of bytes to allocate to the output buffer
+ */
+size_t
+packed_list_marshal_size(const packed_list_t *restrict this)
+{
+	return sizeof(size_t) * (5 + 2 * this->count + this->handles_end)
+		+ this->count * this->record_size + sizeof(int);
+}
+
+
+/**
+ * Marshals a packed list
+ * 
+ * @param  this  The list
+ * @param  data  Output buffer for the marshalled data
+ */
+void
+packed_list_marshal(const packed_list_t *restrict this, char *restrict data)
+{
+	buf_set(data, int, 0, PACKED_LIST_T_VERSION);
+	buf_next(data, int, 1);
+
+	buf_set(data, size_t, 0, this->capacity);
+	buf_set(data, size_t, 1, this->count);
+	buf_set(data, size_t, 2, this->handles_end);
+	buf_set(data, ssize_t, 3, this->reuse_head);
+	buf_set(data, size_t, 4, this->record_size);
+	buf_next(data, size_t, 5);
+
+	memcpy(data, this->values, this->count * sizeof(size_t));
+	buf_next(data, size_t, this->count);
+
+	memcpy(data, this->handles, this->count * sizeof(ssize_t));
+	buf_next(data, ssize_t, this->count);
+
+	memcpy(data, this->positions, this->handles_end * sizeof(ssize_t));
+	buf_next(data, ssize_t, this->handles_end);
+
+	if (this->record_size)
+		memcpy(data, this->records, this->count * this->record_size);
+}
+
+
+/**
+ * Unmarshals a packed list
+ * 
+ * @param   this  Memory slot in which to store the new packed list
+ * @param   data  In buffer with the marshalled data
+ * @return        Non-zero on error, `errno` will be set accordingly.
+ *                Destroy the list on error.
+ */
+int
+packed_list_unmarshal(packed_list_t *restrict this, char *restrict data)
+{
+	/* buf_get(data, int, 0, PACKED_LIST_T_VERSION); */
+	buf_next(data, int, 1);
+
+	this->values    = NULL;
+	this->handles   = NULL;
+	this->positions = NULL;
+	this->records   = NULL;
+
+	buf_get(data, size_t, 0, this->capacity);
+	buf_get(data, size_t, 1, this->count);
+	buf_get(data, size_t, 2, this->handles_end);
+	buf_get(data, ssize_t, 3, this->reuse_head);
+	buf_get(data, size_t, 4, this->record_size);
+	buf_next(data, size_t, 5);
+
+	fail_if (xmalloc(this->values,    this->capacity,  size_t));
+	fail_if (xmalloc(this->handles,   this->capacity, ssize_t));
+	fail_if (xmalloc(this->positions, this->capacity, ssize_t));
+	if (this->record_size)
+		fail_if (xmalloc(this->records, this->capacity * this->record_size, char));
+
+	memcpy(this->values, data, this->count * sizeof(size_t));
+	buf_next(data, size_t, this->count);
+
+	memcpy(this->handles, data, this->count * sizeof(ssize_t));
+	buf_next(data, ssize_t, this->count);
+
+	memcpy(this->positions, data, this->handles_end * sizeof(ssize_t));
+	buf_next(data, ssize_t, this->handles_end);
+
+	if (this->record_size)
+		memcpy(this->records, data, this->count * this->record_size);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Print the content of the list
+ * 
+ * @param  this    The list
+ * @param  output  Output file
+ */
+void
+packed_list_dump(packed_list_t *restrict this, FILE *restrict output)
+{
+	size_t i;
+	fprintf(output, "======= PACKED LIST DUMP =======\n");
+	fprintf(output, "Capacity:    %zu\n", this->capacity);
+	fprintf(output, "Count:       %zu\n", this->count);
+	fprintf(output, "Handles end: %zu\n", this->handles_end);
+	fprintf(output, "Reuse head:  %zi\n", this->reuse_head);
+	fprintf(output, "Values:\n");
+	for (i = 0; i < this->count; i++)
+		fprintf(output, "  [%zu] handle %zi: %zu\n", i, this->handles[i], this->values[i]);
+	fprintf(output, "================================\n");
+}
@@ -0,0 +1,264 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_PACKED_LIST_H
+#define MDS_LIBMDSSERVER_PACKED_LIST_H
+
+
+/**
+ * Unordered list class, with the values stored
+ * in a packed array, so that iterating over the
+ * list is a linear scan, rather than a walk
+ * through links as with `linked_list_t`. When
+ * a value is removed, the last value is moved
+ * into its position. Values are identified by
+ * handles that are not changed when values
+ * are moved, a removed value's handle is reused
+ * by later insertions. Insertion has constant
+ * amortised time complexity, and constant
+ * amortised memory complexity, removal has
+ * constant time complexity and constant memory
+ * complexity. Optionally, a fixed-size record
+ * is stored inline with each value, so that
+ * fields that are read when iterating over the
+ * list can be kept in the packed list rather
+ * than behind the values.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+
+
+/**
+ * Sentinel value indicating that a handle is unused
+ */
+#define PACKED_LIST_UNUSED (-((ssize_t)(SIZE_MAX >> 1)) - 1)
+
+
+
+#define PACKED_LIST_T_VERSION 0
+
+/**
+ * Unordered list class with packed values
+ */
+typedef struct packed_list
+{
+	/**
+	 * The size of the arrays
+	 */
+	size_t capacity;
+
+	/**
+	 * The number of values in the list
+	 */
+	size_t count;
+
+	/**
+	 * The number of handles that have been used,
+	 * including handles that can be reused
+	 */
+	size_t handles_end;
+
+	/**
+	 * The most recently freed handle, `PACKED_LIST_UNUSED`
+	 * if there are no handles that can be reused
+	 */
+	ssize_t reuse_head;
+
+	/**
+	 * The values, the first `count` elements are used
+	 */
+	size_t *values;
+
+	/**
+	 * The handle of each value
+	 */
+	ssize_t *handles;
+
+	/**
+	 * The position in `values` of the value for each
+	 * handle, for handles that can be reused, the
+	 * next handle that can be reused, or `PACKED_LIST_UNUSED`
+	 */
+	ssize_t *positions;
+
+	/**
+	 * The size of each record, 0 if the list has no records
+	 */
+	size_t record_size;
+
+	/**
+	 * The record of each value, in the same order as
+	 * `values`, `NULL` if the list has no records
+	 */
+	char *records;
+
+} packed_list_t;
+
+
+
+/**
+ * Create a packed list
+ * 
+ * @param   this      Memory slot in which to store the new packed list
+ * @param   capacity  The minimum initial capacity of the packed list, 0 for default
+ * @return            Non-zero on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull))
+int packed_list_create(packed_list_t *restrict this, size_t capacity);
+
+/**
+ * Create a packed list with a record stored inline with
+ * each value, the records are moved with the values
+ * 
+ * @param   this         Memory slot in which to store the new packed list
+ * @param   capacity     The minimum initial capacity of the packed list, 0 for default
+ * @param   record_size  The size of each record, 0 for no records
+ * @return               Non-zero on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull))
+int packed_list_create_with_records(packed_list_t *restrict this, size_t capacity, size_t record_size);
+
+/**
+ * Release all resources in a packed list, should
+ * be done even if `packed_list_create` fails
+ * 
+ * @param  this  The packed list
+ */
+__attribute__((nonnull))
+void packed_list_destroy(packed_list_t *restrict this);
+
+/**
+ * Reduce the capacity of the list to the smallest
+ * capacity that can be used without changing the
+ * handles of the values. This method has linear
+ * time complexity and linear memory complexity.
+ * 
+ * @param   this  The list
+ * @return        Non-zero on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull))
+int packed_list_pack(packed_list_t *restrict this);
+
+/**
+ * Insert a value in the list, its record,
+ * if the list has records, is zeroed
+ * 
+ * @param   this   The list
+ * @param   value  The value to insert
+ * @return         The handle of the value, `PACKED_LIST_UNUSED`
+ *                 on error, `errno` will be set accordingly
+ */
+__attribute__((nonnull))
+ssize_t packed_list_insert(packed_list_t *restrict this, size_t value);
+
+/**
+ * Remove a value from the list, the
+ * last value is moved into its position
+ * 
+ * @param  this    The list
+ * @param  handle  The handle of the value
+ */
+__attribute__((nonnull))
+void packed_list_remove(packed_list_t *restrict this, ssize_t handle);
+
+/**
+ * Get the value for a handle
+ * 
+ * @param   this:packed_list_t*  The list
+ * @param   handle:ssize_t       The handle of the value
+ * @return  :size_t              The value
+ */
+#define packed_list_get(this, handle)\
+	((this)->values[(this)->positions[handle]])
+
+/**
+ * Get the record at a position in the list
+ * 
+ * @param   this:packed_list_t*  The list, it must have records
+ * @param   i:size_t             The position of the value
+ * @return  :void*               The record of the value
+ */
+#define packed_list_record_at(this, i)\
+	((void *)((this)->records + (size_t)(i) * (this)->record_size))
+
+/**
+ * Get the record for a handle
+ * 
+ * @param   this:packed_list_t*  The list, it must have records
+ * @param   handle:ssize_t       The handle of the value
+ * @return  :void*               The record of the value
+ */
+#define packed_list_record(this, handle)\
+	packed_list_record_at(this, (this)->positions[handle])
+
+/**
+ * Calculate the buffer size need to marshal a packed list
+ * 
+ * @param   this  The list
+ * @return        The number of bytes to allocate to the output buffer
+ */
+__attribute__((pure, nonnull))
+size_t packed_list_marshal_size(const packed_list_t *restrict this);
+
+/**
+ * Marshals a packed list
+ * 
+ * @param  this  The list
+ * @param  data  Output buffer for the marshalled data
+ */
+__attribute__((nonnull))
+void packed_list_marshal(const packed_list_t *restrict this, char *restrict data);
+
+/**
+ * Unmarshals a packed list
+ * 
+ * @param   this  Memory slot in which to store the new packed list
+ * @param   data  In buffer with the marshalled data
+ * @return        Non-zero on error, `errno` will be set accordingly.
+ *                Destroy the list on error.
+ */
+__attribute__((nonnull))
+int packed_list_unmarshal(packed_list_t *restrict this, char *restrict data);
+
+/**
+ * Wrapper for `for` keyword that iterates over each value in a
+ * packed list, from the last to the first, so the current value
+ * may be removed with `packed_list_remove` during the iteration
+ * 
+ * @param  list:packed_list_t  The packed list
+ * @param  i:size_t            The variable to store the position of
+ *                             the value in `values` at each iteration
+ */
+#define foreach_packed_list_value(list, i)\
+	for (i = (list).count; i-- > 0;)
+
+/**
+ * Print the content of the list
+ * 
+ * @param  this    The list
+ * @param  output  Output file
+ */
+__attribute__((nonnull))
+void packed_list_dump(packed_list_t *restrict this, FILE *restrict output);
+
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_SCAN_H
+#define MDS_LIBMDSSERVER_SCAN_H
+
+
+/* Scanning of message text, used by both libmdsserver and libmdsclient,
+ * which does not link against libmdsserver, so it is implemented in
+ * this header. On x86, SSE2 is used when the compiler may assume it,
+ * and AVX2 is used if the CPU supports it, which is checked at runtime. */
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+# define MDS_SCAN_SSE2
+# include <immintrin.h>
+# if defined(__clang__) ? (__clang_major__ >= 4) : (__GNUC__ >= 5)
+#  define MDS_SCAN_AVX2
+# endif
+#endif
+
+
+
+#ifdef MDS_SCAN_SSE2
+/**
+ * Get the bits of a vector's bytes that are either NUL or not ASCII
+ * 
+ * @param   v  The vector
+ * @return     Bitmask of the bytes that are either NUL or not ASCII
+ */
+static inline unsigned __attribute__((const))
+scan_ascii_mask_sse2(__m128i v)
+{
+	return (unsigned)_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+}
+
+/**
+ * Get the number of bytes at the beginning of a NUL-terminated
+ * string before the first byte that is NUL or not ASCII
+ * 
+ * Whole aligned blocks are read, they cannot cross a page
+ * boundary, so bytes after the NUL-termination are read safely
+ * 
+ * @param   string  The string
+ * @return          The number of ASCII bytes at the beginning of the string
+ */
+static size_t __attribute__((pure, nonnull, unused))
+scan_ascii_sse2(const char *string)
+{
+	const char *p = (const char *)((uintptr_t)string & ~(uintptr_t)15);
+	unsigned mask;
+
+	mask = scan_ascii_mask_sse2(_mm_load_si128((const __m128i *)(const void *)p));
+	mask &= ~0U << (size_t)(string - p);
+	while (!mask) {
+		p += 16;
+		mask = scan_ascii_mask_sse2(_mm_load_si128((const __m128i *)(const void *)p));
+	}
+
+	return (size_t)(p - string) + (size_t)__builtin_ctz(mask);
+}
+
+/**
+ * Find the first LF in a buffer, and check whether
+ * the bytes before it are ASCII, 16 bytes at a time
+ * 
+ * @param   buffer  The buffer
+ * @param   length  The length of the buffer
+ * @param   ascii   Set to zero if any byte before the LF is not ASCII
+ * @param   i       Output parameter for how far into the buffer was scanned
+ * @return          The position of the first LF, `length` if it was not found
+ */
+static size_t __attribute__((nonnull, unused))
+scan_line_sse2(const char *buffer, size_t length, int *ascii, size_t *i)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	unsigned lf, hi;
+	__m128i v;
+
+	for (; *i + 16 <= length; *i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)(buffer + *i));
+		lf = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		hi = (unsigned)_mm_movemask_epi8(v);
+		if (lf) {
+			lf = (unsigned)__builtin_ctz(lf);
+			if (hi & ((1U << lf) - 1))
+				*ascii = 0;
+			return *i + lf;
+		}
+		if (hi)
+			*ascii = 0;
+	}
+
+	return length;
+}
+#endif
+
+
+#ifdef MDS_SCAN_AVX2
+/**
+ * Get the number of bytes at the beginning of a NUL-terminated
+ * string before the first byte that is NUL or not ASCII
+ * 
+ * Whole aligned blocks are read, they cannot cross a page
+ * boundary, so bytes after the NUL-termination are read safely
+ * 
+ * @param   string  The string
+ * @return          The number of ASCII bytes at the beginning of the string
+ */
+static size_t __attribute__((pure, nonnull, unused, target("avx2")))
+scan_ascii_avx2(const char *string)
+{
+	const char *p = (const char *)((uintptr_t)string & ~(uintptr_t)31);
+	__m256i v;
+	uint32_t mask;
+
+	for (;; p += 32) {
+		v = _mm256_load_si256((const __m256i *)(const void *)p);
+		mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+		if (p < string)
+			mask &= ~(uint32_t)0 << (size_t)(string - p);
+		if (mask)
+			return (size_t)(p - string) + (size_t)__builtin_ctz(mask);
+	}
+}
+
+/**
+ * Find the first LF in a buffer, and check whether
+ * the bytes before it are ASCII, 32 bytes at a time
+ * 
+ * @param   buffer  The buffer
+ * @param   length  The length of the buffer
+ * @param   ascii   Set to zero if any byte before the LF is not ASCII
+ * @param   i       Output parameter for how far into the buffer was scanned
+ * @return          The position of the first LF, `length` if it was not found
+ */
+static size_t __attribute__((nonnull, unused, target("avx2")))
+scan_line_avx2(const char *buffer, size_t length, int *ascii, size_t *i)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	uint32_t lf, hi;
+	__m256i v;
+
+	for (; *i + 32 <= length; *i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(const void *)(buffer + *i));
+		lf = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		hi = (uint32_t)_mm256_movemask_epi8(v);
+		if (lf) {
+			lf = (uint32_t)__builtin_ctz(lf);
+			if (hi & (((uint32_t)1 << lf) - 1))
+				*ascii = 0;
+			return *i + lf;
+		}
+		if (hi)
+			*ascii = 0;
+	}
+
+	return length;
+}
+#endif
+
+
+/**
+ * Get the number of bytes at the beginning of a NUL-terminated
+ * string before the first byte that is NUL or not ASCII
+ * 
+ * @param   string  The string
+ * @return          The number of ASCII bytes at the beginning of the string
+ */
+static size_t __attribute__((pure, nonnull, unused))
+scan_ascii(const char *string)
+{
+	size_t i = 0;
+#if defined(MDS_SCAN_AVX2)
+	if (__builtin_cpu_supports("avx2"))
+		return scan_ascii_avx2(string);
+#endif
+#if defined(MDS_SCAN_SSE2)
+	return scan_ascii_sse2(string);
+#endif
+	while (string[i] && !(string[i] & 0x80))
+		i++;
+	return i;
+}
+
+/**
+ * Find the first LF in a buffer, and check whether
+ * the bytes before it are ASCII
+ * 
+ * This is done in one pass, because messages are framed
+ * by LF and their headers must be valid UTF-8, which
+ * can be skipped if they only contain ASCII
+ * 
+ * @param   buffer  The buffer
+ * @param   length  The length of the buffer
+ * @param   ascii   Set to zero if any byte before the LF, or in the
+ *                  whole buffer if there is no LF, is not ASCII,
+ *                  otherwise it is not modified
+ * @return          The position of the first LF, `length` if it was not found
+ */
+static size_t __attribute__((nonnull, unused))
+scan_line(const char *buffer, size_t length, int *ascii)
+{
+	size_t i = 0, r = length;
+#if defined(MDS_SCAN_AVX2)
+	if (__builtin_cpu_supports("avx2"))
+		r = scan_line_avx2(buffer, length, ascii, &i);
+	else
+#endif
+#if defined(MDS_SCAN_SSE2)
+		r = scan_line_sse2(buffer, length, ascii, &i);
+#endif
+	if (r < length)
+		return r;
+	for (; i < length; i++) {
+		if (buffer[i] == '\n')
+			return i;
+		if (buffer[i] & 0x80)
+			*ascii = 0;
+	}
+	return length;
+}
+
+
+#endif
@@ -18,6 +18,7 @@
 #include "util.h"
 #include "config.h"
 #include "macros.h"
+#include "scan.h"
 
 #include <alloca.h>
 #include <stdlib.h>
@@ -35,6 +36,14 @@
 
 
 
+/**
+ * The largest number of bytes `full_send_corked`
+ * holds back, larger messages are sent immediately
+ */
+#define SEND_CORK_LIMIT  (4 << 10)
+
+
+
 /**
  * The content of `/proc/self/exe`, when
  * `prepare_reexec` was invoked.
@@ -217,6 +226,74 @@ send_message(int socket, const char *message, size_t length)
 }
 
 
+/**
+ * Send a message, that is split into multiple buffers, over a socket
+ * 
+ * The buffers are sent as one message, using scatter–gather I/O, so
+ * they do not have to be concatenated into one buffer before they are
+ * sent. `iov` is updated to describe the data that has not been sent.
+ * If the socket reports that the message is too large, the buffers
+ * are sent one by one with `send_message`, and `flags` are ignored.
+ * 
+ * @param   socket  The file descriptor of the socket
+ * @param   iov     The buffers to send
+ * @param   iovcnt  The number of elements in `iov`
+ * @param   flags   Flags for `sendmsg`, in addition to `MSG_NOSIGNAL`,
+ *                  for example `MSG_DONTWAIT`
+ * @return          The number of bytes that have been sent (even on error)
+ */
+size_t
+send_message_vector(int socket, struct iovec *iov, size_t iovcnt, int flags)
+{
+	struct msghdr msg;
+	size_t sent = 0, n;
+	ssize_t just_sent;
+
+	memset(&msg, 0, sizeof(msg));
+
+	errno = 0;
+	while (iovcnt > 0) {
+		/* Skip empty and already sent buffers. */
+		if (!iov->iov_len) {
+			iov++, iovcnt--;
+			continue;
+		}
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		if ((just_sent = sendmsg(socket, &msg, MSG_NOSIGNAL | flags)) < 0) {
+			if (errno == EPIPE)
+				errno = ECONNRESET;
+			if (errno != EMSGSIZE)
+				return sent;
+			/* Too large, let `send_message` send the first buffer in smaller blocks. */
+			n = send_message(socket, iov->iov_base, iov->iov_len);
+			sent += n;
+			iov->iov_base = (char *)(iov->iov_base) + n;
+			iov->iov_len -= n;
+			if (iov->iov_len)
+				return sent;
+			continue;
+		}
+
+		/* Skip over what has been sent. */
+		sent += n = (size_t)just_sent;
+		while (n > 0) {
+			if (n < iov->iov_len) {
+				iov->iov_base = (char *)(iov->iov_base) + n;
+				iov->iov_len -= n;
+				break;
+			}
+			n -= iov->iov_len;
+			iov->iov_len = 0;
+			iov++, iovcnt--;
+		}
+	}
+
+	return sent;
+}
+
+
 /**
  * A version of `atoi` that is strict about the syntax and bounds
  * 
@@ -263,7 +340,7 @@ strict_atoj(const char *str, intmax_t *value, intmax_t min, intmax_t max)
 
 	if (*str == '-') {
 		if (!*minstr)
-			sprintf(minstr, "%j", INTMAX_MIN);
+			sprintf(minstr, "%jd", INTMAX_MIN);
 		if (!strcmp(str, minstr)) {
 			r = INTMAX_MIN;
 			goto done;
@@ -274,7 +351,7 @@ strict_atoj(const char *str, intmax_t *value, intmax_t min, intmax_t max)
 	if (!*str)
 		return -1;
 
-	while ((c = *str)) {
+	while ((c = *str++)) {
 		if ('0' <= c && c <= '9') {
 			if (r > INTMAX_MAX / 10) {
 				return -1;
@@ -325,7 +402,7 @@ strict_atouj(const char *str, uintmax_t *value, uintmax_t min, uintmax_t max)
 	if (!*str)
 		return -1;
 
-	while ((c = *str)) {
+	while ((c = *str++)) {
 		if ('0' <= c && c <= '9') {
 			if (r > INTMAX_MAX / 10) {
 				return -1;
@@ -670,6 +747,89 @@ fail:
 }
 
 
+/**
+ * Send a full message, that is split into multiple
+ * buffers, in as few system calls as possible, even
+ * if interrupted
+ * 
+ * `iov` is updated to describe the data that has not been sent
+ * 
+ * @param   socket  The file descriptor for the socket to use
+ * @param   iov     The buffers to send
+ * @param   iovcnt  The number of elements in `iov`
+ * @param   flags   Flags for `sendmsg`, in addition to `MSG_NOSIGNAL`,
+ *                  for example `MSG_MORE`
+ * @return          Zero on success, -1 on error
+ */
+int
+full_send_vector(int socket, struct iovec *iov, size_t iovcnt, int flags)
+{
+	for (;;) {
+		send_message_vector(socket, iov, iovcnt, flags);
+		fail_if (errno && errno != EINTR);
+		while (iovcnt && !iov->iov_len)
+			iov++, iovcnt--;
+		if (!iovcnt)
+			return 0;
+	}
+fail:
+	return -1;
+}
+
+
+/**
+ * Send a full message, that is split into multiple buffers,
+ * together with the messages that have been corked before it
+ * 
+ * If more messages will follow, and the message is small,
+ * it is copied to the cork rather than sent. Otherwise, the
+ * corked messages and the message are sent together, without
+ * copying the message. Messages are therefore never copied
+ * just to send them together with their headers. To send
+ * the corked messages, call with `iovcnt` and `more` set
+ * to zero; this must be done before waiting for input.
+ * 
+ * @param   socket         The file descriptor for the socket to use
+ * @param   iov            The buffers to send, may be updated
+ * @param   iovcnt         The number of elements in `iov`
+ * @param   more           Whether more messages will be sent soon
+ * @param   cork           Pointer to the buffer with corked messages, it should
+ *                         be `NULL` before the first call and be freed by the caller
+ * @param   cork_size      Pointer to the number of bytes in `*cork`
+ * @return                 Zero on success, -1 on error, the
+ *                         corked messages are dropped on error
+ */
+int
+full_send_corked(int socket, struct iovec *iov, size_t iovcnt, int more,
+                 char **restrict cork, size_t *restrict cork_size)
+{
+	struct iovec all[iovcnt + 1];
+	size_t i, n = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		n += iov[i].iov_len;
+
+	if (more && *cork_size + n <= SEND_CORK_LIMIT) {
+		if (!*cork)
+			fail_if (xmalloc(*cork, SEND_CORK_LIMIT, char));
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(*cork + *cork_size, iov[i].iov_base, iov[i].iov_len);
+			*cork_size += iov[i].iov_len;
+		}
+		return 0;
+	}
+
+	all[0].iov_base = *cork;
+	all[0].iov_len = *cork_size;
+	if (iovcnt)
+		memcpy(all + 1, iov, iovcnt * sizeof(struct iovec));
+	*cork_size = 0;
+	return full_send_vector(socket, all, iovcnt + 1, more ? MSG_MORE : 0);
+fail:
+	return -1;
+}
+
+
 /**
  * Check whether a string begins with a specific string,
  * where neither of the strings are necessarily NUL-terminated
@@ -754,7 +914,13 @@ verify_utf8(const char *string, int allow_modified_nul)
 	  1111110. 10...... 10...... 10...... 10...... 10......   27        31
 	*/
 
-	while ((c = (long)(*string++))) {
+	for (;;) {
+		/* Skip past ASCII, which is most text, with vector instructions. */
+		if (read_bytes == 0)
+			string += scan_ascii(string);
+		if (!(c = (long)(*string++)))
+			break;
+
 		if (read_bytes == 0) {
 			/* First byte of the character. */
 
@@ -771,7 +937,7 @@ verify_utf8(const char *string, int allow_modified_nul)
 			while ((c & 0x80))
 				bytes++, c <<= 1;
 			read_bytes = 1;
-			character = c & 0x7F;
+			character = (c & 0x7F) >> bytes;
 			if (bytes > 6)
 				/* 31-bit characters can be encoded with 6-bytes,
 				   and UTF-8 does not cover higher code points. */
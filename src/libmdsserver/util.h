@@ -22,6 +22,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 
 
@@ -114,6 +115,24 @@ int xsigaction(int signo, void (*function)(int signo));
  */
 size_t send_message(int socket, const char *message, size_t length);
 
+/**
+ * Send a message, that is split into multiple buffers, over a socket
+ * 
+ * The buffers are sent as one message, using scatter–gather I/O, so
+ * they do not have to be concatenated into one buffer before they are
+ * sent. `iov` is updated to describe the data that has not been sent.
+ * If the socket reports that the message is too large, the buffers
+ * are sent one by one with `send_message`, and `flags` are ignored.
+ * 
+ * @param   socket  The file descriptor of the socket
+ * @param   iov     The buffers to send
+ * @param   iovcnt  The number of elements in `iov`
+ * @param   flags   Flags for `sendmsg`, in addition to `MSG_NOSIGNAL`,
+ *                  for example `MSG_DONTWAIT`
+ * @return          The number of bytes that have been sent (even on error)
+ */
+size_t send_message_vector(int socket, struct iovec *iov, size_t iovcnt, int flags);
+
 /**
  * A version of `atoi` that is strict about the syntax and bounds
  * 
@@ -384,6 +403,48 @@ char *full_read(int fd, size_t *length);
  */
 int full_send(int socket, const char *message, size_t length);
 
+/**
+ * Send a full message, that is split into multiple
+ * buffers, in as few system calls as possible, even
+ * if interrupted
+ * 
+ * `iov` is updated to describe the data that has not been sent
+ * 
+ * @param   socket  The file descriptor for the socket to use
+ * @param   iov     The buffers to send
+ * @param   iovcnt  The number of elements in `iov`
+ * @param   flags   Flags for `sendmsg`, in addition to `MSG_NOSIGNAL`,
+ *                  for example `MSG_MORE`
+ * @return          Zero on success, -1 on error
+ */
+int full_send_vector(int socket, struct iovec *iov, size_t iovcnt, int flags);
+
+/**
+ * Send a full message, that is split into multiple buffers,
+ * together with the messages that have been corked before it
+ * 
+ * If more messages will follow, and the message is small,
+ * it is copied to the cork rather than sent. Otherwise, the
+ * corked messages and the message are sent together, without
+ * copying the message. Messages are therefore never copied
+ * just to send them together with their headers. To send
+ * the corked messages, call with `iovcnt` and `more` set
+ * to zero; this must be done before waiting for input.
+ * 
+ * @param   socket         The file descriptor for the socket to use
+ * @param   iov            The buffers to send, may be updated
+ * @param   iovcnt         The number of elements in `iov`
+ * @param   more           Whether more messages will be sent soon
+ * @param   cork           Pointer to the buffer with corked messages, it should
+ *                         be `NULL` before the first call and be freed by the caller
+ * @param   cork_size      Pointer to the number of bytes in `*cork`
+ * @return                 Zero on success, -1 on error, the
+ *                         corked messages are dropped on error
+ */
+__attribute__((nonnull(5, 6)))
+int full_send_corked(int socket, struct iovec *iov, size_t iovcnt, int more,
+                     char **restrict cork, size_t *restrict cork_size);
+
 /**
  * Check whether a string begins with a specific string,
  * where neither of the strings are necessarily NUL-terminated
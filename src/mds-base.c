@@ -30,6 +30,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
@@ -98,6 +99,27 @@ volatile sig_atomic_t reexecing = 0;
  */
 volatile sig_atomic_t danger = 0;
 
+/**
+ * Profile of the re-exec the server continued from
+ */
+reexec_profile_t reexec_profile;
+
+
+/**
+ * The mapping of the marshalled state, `NULL` if not mapped
+ */
+static char *state_map = NULL;
+
+/**
+ * The size of `state_map`
+ */
+static size_t state_map_size = 0;
+
+/**
+ * The number of references to `state_map`
+ */
+static size_t state_map_refs = 0;
+
 
 /**
  * The file descriptor of the socket
@@ -411,6 +433,47 @@ received_info(int signo)
 #endif
 
 
+/**
+ * Keep the marshalled state mapped if a pointer points into it,
+ * so that the memory can be used without being copied
+ * 
+ * @param   ptr  The pointer
+ * @return       Whether the pointer points into the marshalled state,
+ *               if so, it must be released with `base_state_release`
+ */
+int
+base_state_adopt(const void *ptr)
+{
+	const char *p = ptr;
+	if (!state_map || p < state_map || p >= state_map + state_map_size)
+		return 0;
+	state_map_refs++;
+	return 1;
+}
+
+
+/**
+ * Release a pointer, if it points into the marshalled state,
+ * the state is unmapped when the last reference is released
+ * 
+ * @param   ptr  The pointer, may be `NULL`
+ * @return       Whether the pointer pointed into the marshalled state,
+ *               if not, the caller remains responsible for freeing it
+ */
+int
+base_state_release(const void *ptr)
+{
+	const char *p = ptr;
+	if (!state_map || p < state_map || p >= state_map + state_map_size)
+		return 0;
+	if (!--state_map_refs) {
+		munmap(state_map, state_map_size);
+		state_map = NULL;
+	}
+	return 1;
+}
+
+
 /**
  * Unmarshal the server's saved state
  * 
@@ -420,36 +483,51 @@ static int
 base_unmarshal(void)
 {
 	pid_t pid = getpid();
-	int reexec_fd, r;
+	int reexec_fd, r, version;
 	char shm_path[NAME_MAX + 1];
+	struct stat attr;
 	char *state_buf;
-	char *state_buf_;
 
 	/* Acquire access to marshalled data. */
 	xsnprintf(shm_path, SHM_PATH_PATTERN, (intmax_t)pid);
 	reexec_fd = shm_open(shm_path, O_RDONLY, S_IRWXU);
 	fail_if (reexec_fd < 0); /* Critical. */
 
-	/* Read the state file. */
-	fail_if (!(state_buf = state_buf_ = full_read(reexec_fd, NULL)));
+	/* Map the state file, it is parsed in place. */
+	fail_if (fstat(reexec_fd, &attr) < 0);
+	fail_if ((size_t)attr.st_size < 2 * sizeof(int));
+	state_map_size = (size_t)attr.st_size;
+	state_buf = mmap(NULL, state_map_size, PROT_READ, MAP_PRIVATE, reexec_fd, 0);
+	fail_if (state_buf == MAP_FAILED);
+	state_map = state_buf;
+	state_map_refs = 1;
 
-	/* Release resources. */
+	/* Release resources. The mapping outlives the file. */
 	xclose(reexec_fd);
 	shm_unlink(shm_path);
 
 
 	/* Unmarshal state. */
 
-	/* Get the marshal protocal version. Not needed, there is only the one version right now. */
-	/* buf_get(state_buf_, int, 0, MDS_BASE_VARS_VERSION); */
-	buf_next(state_buf_, int, 1);
+	/* Get the marshal protocal version, version 0 did not include the profile. */
+	buf_get_next(state_buf, int, version);
+
+	buf_get_next(state_buf, int, socket_fd);
+	if (version >= 1) {
+		buf_get_next(state_buf, time_t, reexec_profile.marshal_start.tv_sec);
+		buf_get_next(state_buf, long, reexec_profile.marshal_start.tv_nsec);
+		buf_get_next(state_buf, time_t, reexec_profile.marshal_end.tv_sec);
+		buf_get_next(state_buf, long, reexec_profile.marshal_end.tv_nsec);
+	}
+	r = unmarshal_server(state_buf);
 
-	buf_get_next(state_buf_, int, socket_fd);
-	r = unmarshal_server(state_buf_);
 
+	/* Release resources, unless adopted by the server. */
+	base_state_release(state_map);
 
-	/* Release resources. */
-	free(state_buf);
+	/* Finish the profile of the re-exec. */
+	if (version >= 1 && !monotone(&(reexec_profile.unmarshal_end)))
+		reexec_profile.state_size = state_map_size;
 
 	/* Recover after failure. */
 	fail_if (r && reexec_failure_recover());
@@ -461,9 +539,70 @@ fail:
 }
 
 
+/**
+ * Get the number of nanoseconds between two points in time
+ * 
+ * @param   start  The earlier point in time
+ * @param   end    The later point in time
+ * @return         The number of nanoseconds from `start` to `end`
+ */
+static long long int __attribute__((pure, nonnull))
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (long long int)(end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+
+/**
+ * Log the profile of the re-exec the server continued from,
+ * and, if connected to the display, announce it with a
+ * `reexec-profile` message so that it can be retrieved by
+ * intercepting that message
+ */
+static void
+report_reexec_profile(void)
+{
+	const reexec_profile_t *p = &reexec_profile;
+	long long int marshal   = elapsed_ns(&(p->marshal_start), &(p->marshal_end));
+	long long int exec      = elapsed_ns(&(p->marshal_end),   &(p->exec));
+	long long int unmarshal = elapsed_ns(&(p->exec),          &(p->unmarshal_end));
+	long long int downtime  = elapsed_ns(&(p->marshal_start), &(p->unmarshal_end));
+	char *message = NULL;
+
+	eprintf("re-exec downtime %.3f ms (marshal %.3f ms, exec %.3f ms, unmarshal %.3f ms), %zu bytes of state.",
+	        (double)downtime / 1000000, (double)marshal / 1000000, (double)exec / 1000000, (double)unmarshal / 1000000,
+	        p->state_size);
+
+	if (!server_characteristics.require_display || socket_fd < 0)
+		return;
+
+	fail_if (xasprintf(message,
+	                   "Command: reexec-profile\n"
+	                   "Message ID: 0\n"
+	                   "Server: %s\n"
+	                   "State size: %zu\n"
+	                   "Marshal: %lli\n"
+	                   "Exec: %lli\n"
+	                   "Unmarshal: %lli\n"
+	                   "Downtime: %lli\n"
+	                   "\n",
+	                   *argv, p->state_size, marshal, exec, unmarshal, downtime));
+	fail_if (full_send(socket_fd, message, strlen(message)));
+
+	free(message);
+	return;
+fail:
+	/* Not critical, the server can do without it. */
+	xperror(*argv);
+	free(message);
+}
+
+
 /**
  * Marshal the server's state
  * 
+ * The state is written directly into the file via a shared mapping
+ * 
  * @param   reexec_fd  The file descriptor of the file into which the state shall be saved
  * @return             Non-zero on error
  */
@@ -471,15 +610,22 @@ static int
 base_marshal(int reexec_fd)
 {
 	size_t state_n;
-	char *state_buf;
+	char *state_buf = MAP_FAILED;
 	char *state_buf_;
+	char *profile_buf;
+	struct timespec marshal_start, marshal_end;
+
+	fail_if (monotone(&marshal_start));
 
 	/* Calculate the size of the state data when it is marshalled. */
-	state_n = 2 * sizeof(int);
+	state_n = 2 * sizeof(int) + 2 * (sizeof(time_t) + sizeof(long));
 	state_n += marshal_server_size();
 
-	/* Allocate a buffer for all data. */
-	fail_if (xbmalloc(state_buf = state_buf_, state_n));
+	/* Map the file, with its final size, as the buffer for all data. */
+	fail_if (ftruncate(reexec_fd, (off_t)state_n) < 0);
+	state_buf = mmap(NULL, state_n, PROT_READ | PROT_WRITE, MAP_SHARED, reexec_fd, 0);
+	fail_if (state_buf == MAP_FAILED);
+	state_buf_ = state_buf;
 
 
 	/* Marshal the state of the server. */
@@ -489,18 +635,26 @@ base_marshal(int reexec_fd)
 
 	/* Store the state. */
 	buf_set_next(state_buf_, int, socket_fd);
+	profile_buf = state_buf_;
+	buf_next(state_buf_, char, 2 * (sizeof(time_t) + sizeof(long)));
 	fail_if (marshal_server(state_buf_));
 
+	/* Store the profile of the re-exec, now that it is known when marshalling ended. */
+	fail_if (monotone(&marshal_end));
+	buf_set_next(profile_buf, time_t, marshal_start.tv_sec);
+	buf_set_next(profile_buf, long, marshal_start.tv_nsec);
+	buf_set_next(profile_buf, time_t, marshal_end.tv_sec);
+	buf_set_next(profile_buf, long, marshal_end.tv_nsec);
 
-	/* Send the marshalled data into the file. */
-	fail_if (full_write(reexec_fd, state_buf, state_n) < 0);
 
-	free(state_buf);
+	/* The data is already in the file. */
+	munmap(state_buf, state_n);
 	return 0;
 
 fail:
 	xperror(*argv);
-	free(state_buf);
+	if (state_buf != MAP_FAILED)
+		munmap(state_buf, state_n);
 	return 1;
 }
 
@@ -551,6 +705,9 @@ main(int argc_, char **argv_)
 	argc = argc_;
 	argv = argv_;
 
+	/* In case this is a re-exec, note when it started running. */
+	monotone(&(reexec_profile.exec));
+
 
 	if (!server_characteristics.require_privileges)
 		/* Drop privileges like it's hot. */
@@ -591,6 +748,8 @@ main(int argc_, char **argv_)
 	} else {
 		/* Unmarshal the server's saved state. */
 		fail_if (base_unmarshal());
+		if (reexec_profile.state_size)
+			report_reexec_profile();
 	}
 
 	/* Initialise the server. */
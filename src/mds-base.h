@@ -21,9 +21,11 @@
 
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
+#include <time.h>
 
 
-#define MDS_BASE_VARS_VERSION 0
+#define MDS_BASE_VARS_VERSION 1
 
 
 
@@ -80,6 +82,38 @@ typedef struct server_characteristics {
 } __attribute__((packed)) server_characteristics_t;
 
 
+/**
+ * Profile of a re-exec, all timestamps are from
+ * `monotone`, whose clock is not reset by exec
+ */
+typedef struct reexec_profile {
+	/**
+	 * When the old process started marshalling its state
+	 */
+	struct timespec marshal_start;
+
+	/**
+	 * When the old process finished marshalling its state
+	 */
+	struct timespec marshal_end;
+
+	/**
+	 * When the new process started
+	 */
+	struct timespec exec;
+
+	/**
+	 * When the new process finished unmarshalling the state
+	 */
+	struct timespec unmarshal_end;
+
+	/**
+	 * The number of bytes of the marshalled state
+	 */
+	size_t state_size;
+} reexec_profile_t;
+
+
 
 /**
  * This variable should declared by the actual server implementation.
@@ -152,6 +186,13 @@ extern volatile sig_atomic_t reexecing;
  */
 extern volatile sig_atomic_t danger;
 
+/**
+ * Profile of the re-exec the server continued from,
+ * only valid if `is_reexec` is non-zero and
+ * `reexec_profile.state_size` is non-zero
+ */
+extern reexec_profile_t reexec_profile;
+
 
 /**
  * The file descriptor of the socket
@@ -244,6 +285,29 @@ void received_danger(int signo); /* __attribute__((weak)) */
  */
 void received_info(int signo); /* __attribute__((weak)) */
 
+/**
+ * Keep the marshalled state mapped if a pointer points into it,
+ * so that the memory can be used without being copied
+ * 
+ * This may only be used from `unmarshal_server`, the
+ * marshalled state is read-only and must not be modified
+ * 
+ * @param   ptr  The pointer
+ * @return       Whether the pointer points into the marshalled state,
+ *               if so, it must be released with `base_state_release`
+ */
+int base_state_adopt(const void *ptr);
+
+/**
+ * Release a pointer, if it points into the marshalled state,
+ * the state is unmapped when the last reference is released
+ * 
+ * @param   ptr  The pointer, may be `NULL`
+ * @return       Whether the pointer pointed into the marshalled state,
+ *               if not, the caller remains responsible for freeing it
+ */
+int base_state_release(const void *ptr);
+
 /**
  * This function should be implemented by the actual server implementation
  * 
@@ -20,6 +20,7 @@
 #include <libmdsserver/macros.h>
 #include <libmdsserver/util.h>
 #include <libmdsserver/mds-message.h>
+#include <libmdsserver/header-matcher.h>
 
 #include <errno.h>
 #include <inttypes.h>
@@ -81,6 +82,17 @@ static size_t clipboard_used[CLIPBOARD_LEVELS] = { 0, 0, 0 };
  */
 static clipitem_t *clipboard[CLIPBOARD_LEVELS];
 
+/**
+ * Replies that have not been sent yet because more
+ * messages had been received, see `full_send_corked`
+ */
+static char *cork = NULL;
+
+/**
+ * The number of bytes stored in `cork`
+ */
+static size_t cork_size = 0;
+
 
 
 /**
@@ -94,6 +106,30 @@ static clipitem_t *clipboard[CLIPBOARD_LEVELS];
 	((full_send)(socket_fd, message, length))
 
 
+/**
+ * Send a message, it is corked if more messages have been
+ * received and it does not have a payload, the payload is
+ * never copied, as it may be sensitive
+ * 
+ * @param   message         The message, or its headers if it has a payload
+ * @param   length          The length of `message`
+ * @param   payload         The payload, `NULL` if none
+ * @param   payload_length  The length of `payload`
+ * @return                  Zero on success, -1 on error
+ */
+static int
+send_corked(char *message, size_t length, char *payload, size_t payload_length)
+{
+	struct iovec iov[2];
+	int more = !payload && mds_message_ready(&received);
+	iov[0].iov_base = message;
+	iov[0].iov_len = length;
+	iov[1].iov_base = payload;
+	iov[1].iov_len = payload_length;
+	return full_send_corked(socket_fd, iov, payload ? 2 : 1, more, &cork, &cork_size);
+}
+
+
 /**
  * This function will be invoked before `initialise_server` (if not re-exec:ing)
  * or before `unmarshal_server` (if re-exec:ing)
@@ -214,13 +250,17 @@ void *(*volatile mds_clipboard_my_explicit_memset)(void *s, int c, size_t n) = m
 /**
  * Wipe a memory area and free it
  * 
+ * Content used in place from the marshalled state is
+ * released instead, it is read-only, and its pages are
+ * returned to the kernel when the state is unmapped
+ * 
  * @param  s  The memory area
  * @param  n  The number of bytes to write
  */
 static inline void
 wipe_and_free(void *s, size_t n)
 {
-	if (s)
+	if (s && !base_state_release(s))
 		free(mds_clipboard_my_explicit_memset(s, 0, n));
 }
 
@@ -241,6 +281,7 @@ marshal_server(char *state_buf)
 	buf_set_next(state_buf, int, connected);
 	buf_set_next(state_buf, uint32_t, message_id);
 	mds_message_marshal(&received, state_buf);
+	state_buf += mds_message_marshal_size(&received);
 
 	/* Removed entires from the clipboard that may not be marshalled. */
 	for (i = 0; i < CLIPBOARD_LEVELS; i++) {
@@ -272,7 +313,8 @@ marshal_server(char *state_buf)
 			memcpy(state_buf, clip.content, clip.length * sizeof(char));
 			state_buf += clip.length;
 			
-			free(clip.content);
+			if (!base_state_release(clip.content))
+				free(clip.content);
 		}
 		free(clipboard[i]);
 	}
@@ -306,6 +348,7 @@ unmarshal_server(char *state_buf)
 	buf_get_next(state_buf, int, connected);
 	buf_get_next(state_buf, uint32_t, message_id);
 	fail_if (mds_message_unmarshal(&received, state_buf));
+	state_buf += mds_message_marshal_size(&received);
 
 	for (i = 0; i < CLIPBOARD_LEVELS; i++) {
 		buf_get_next(state_buf, size_t, clipboard_size[i]);
@@ -319,7 +362,10 @@ unmarshal_server(char *state_buf)
 			buf_get_next(state_buf, long, clip->dethklok.tv_nsec);
 			buf_get_next(state_buf, uint64_t, clip->client);
 			buf_get_next(state_buf, int, clip->autopurge);
-			fail_if (xmemdup(clip->content, state_buf, clip->length, char));
+			if (clip->length >= CLIPBOARD_ADOPT_MIN && base_state_adopt(state_buf))
+				clip->content = state_buf;
+			else
+				fail_if (xmemdup(clip->content, state_buf, clip->length, char));
 			state_buf += clip->length;
 		}
 	}
@@ -331,7 +377,8 @@ fail:
 	for (i = 0; i < CLIPBOARD_LEVELS; i++) {
 		if (clipboard[i] != NULL) {
 			for (j = 0; j < clipboard_used[i]; j++)
-				free(clipboard[i][j].content);
+				if (!base_state_release(clipboard[i][j].content))
+					free(clipboard[i][j].content);
 			free(clipboard[i]);
 		}
 	}
@@ -372,7 +419,9 @@ master_loop(void)
 
 		if (r = mds_message_read(&received, socket_fd), r == 0)
 			if (r = handle_message(), r == 0)
-				continue;
+				if (mds_message_ready(&received) ||
+				    (r = full_send_corked(socket_fd, NULL, 0, 0, &cork, &cork_size), r == 0))
+					continue;
 
 		if (r == -2) {
 			eprint("corrupt message received, aborting.");
@@ -386,16 +435,23 @@ master_loop(void)
 		eprint("lost connection to server.");
 		mds_message_destroy(&received);
 		mds_message_initialise(&received);
+		cork_size = 0;
 		connected = 0;
 		fail_if (reconnect_to_display());
 		connected = 1;
 	}
 
+	/* Do not leave replies behind if we are re-exec:ing. */
+	if (connected)
+		fail_if (full_send_corked(socket_fd, NULL, 0, 0, &cork, &cork_size));
+
 	rc = 0;
 	goto done;
  fail:
 	xperror(*argv);
  done:
+	free(cork);
+	cork = NULL;
 	if (!rc && reexecing)
 		return 0;
 	mds_message_destroy(&received);
@@ -420,6 +476,12 @@ handle_message(void)
 {
 	/* Fetch message headers. */
 
+	static const char *const header_names[] = {
+		"Client ID", "Message ID", "Length", "Action", "Level",
+		"Size", "Index", "Time to live", "Client closed"
+	};
+	static header_matcher_t header_matcher;
+
 	const char *recv_client_id = "0:0";
 	const char *recv_message_id = NULL;
 	const char *recv_length = NULL;
@@ -429,26 +491,16 @@ handle_message(void)
 	const char *recv_index = "0";
 	const char *recv_time_to_live = "forever";
 	const char *recv_client_closed = NULL;
-	size_t i;
+	const char **const header_values[] = {
+		&recv_client_id, &recv_message_id, &recv_length, &recv_action, &recv_level,
+		&recv_size, &recv_index, &recv_time_to_live, &recv_client_closed
+	};
 	int level;
 
-#define __get_header(storage, header)\
-	(startswith(received.headers[i], header))\
-		storage = received.headers[i] + strlen(header)
-
-	for (i = 0; i < received.header_count; i++) {
-		if      __get_header(recv_client_id,     "Client ID: ");
-		else if __get_header(recv_message_id,    "Message ID: ");
-		else if __get_header(recv_length,        "Length: ");
-		else if __get_header(recv_action,        "Action: ");
-		else if __get_header(recv_level,         "Level: ");
-		else if __get_header(recv_size,          "Size: ");
-		else if __get_header(recv_index,         "Index: ");
-		else if __get_header(recv_time_to_live,  "Time to live: ");
-		else if __get_header(recv_client_closed, "Client closed: ");
-	}
-
-#undef __get_header
+	if (!header_matcher.count)
+		fail_if (header_matcher_compile(&header_matcher, header_names,
+		                                sizeof(header_names) / sizeof(*header_names)));
+	header_matcher_match(&header_matcher, received.headers, received.header_count, header_values);
 
 	/* Validate headers and take appropriate action. */
 
@@ -494,6 +546,8 @@ handle_message(void)
 
 	eprint("received message with invalid action, ignoring.");
 	return 0;
+fail:
+	return -1;
 }
 
 
@@ -505,9 +559,10 @@ handle_message(void)
 static inline void __attribute__((nonnull))
 free_clipboard_entry(clipitem_t *entry)
 {
-	if (entry->autopurge == CLIPITEM_AUTOPURGE_NEVER)
-		free(entry->content);
-	else
+	if (entry->autopurge == CLIPITEM_AUTOPURGE_NEVER) {
+		if (!base_state_release(entry->content))
+			free(entry->content);
+	} else
 		wipe_and_free(entry->content, entry->length);
 	entry->content = NULL;
 }
@@ -547,7 +602,7 @@ clipboard_notify_pop(int level, size_t index)
 	        message_id, level, index, size, used);
 
 	message_id = message_id == UINT32_MAX ? 0 : (message_id + 1);
-	fail_if (full_send(message, strlen(message)) ? -1 : 0);
+	fail_if (send_corked(message, strlen(message), NULL, 0));
 	return 0;
 fail:
 	return -1;
@@ -653,6 +708,8 @@ clipboard_add(int level, const char *time_to_live, const char *recv_client_id)
 	struct timespec dethklok;
 
 	fail_if (clipboard_purge(level, NULL));
+	if (!clipboard_size[level])
+		return 0;
 
 	if (strequals(time_to_live, "forever")) {
 		autopurge = CLIPITEM_AUTOPURGE_NEVER;
@@ -680,9 +737,10 @@ clipboard_add(int level, const char *time_to_live, const char *recv_client_id)
 	fail_if (xmemdup(new_clip.content, received.payload, new_clip.length, char));
 
 	if (clipboard_used[level] == clipboard_size[level])
-		free_clipboard_entry(clipboard[level] + clipboard_used[level] - 1);
-	memmove(clipboard[level] + 1, clipboard[level], (clipboard_used[level] - 1) * sizeof(clipitem_t));
+		free_clipboard_entry(clipboard[level] + --clipboard_used[level]);
+	memmove(clipboard[level] + 1, clipboard[level], clipboard_used[level] * sizeof(clipitem_t));
 	clipboard[level][0] = new_clip;
+	clipboard_used[level]++;
 
 	return 0;
 fail:
@@ -756,9 +814,7 @@ clipboard_read(int level, size_t index, const char *recv_client_id, const char *
 
 send:
 	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
-	fail_if (full_send(message, strlen(message)));
-	if (clip)
-		fail_if (full_send(clip->content, clip->length));
+	fail_if (send_corked(message, strlen(message), clip ? clip->content : NULL, clip ? clip->length : 0));
 
 	free(message);
 	return 0;
@@ -864,7 +920,7 @@ clipboard_get_size(int level, const char *recv_client_id, const char *recv_messa
 
 	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
 
-	fail_if (full_send(message, strlen(message)));
+	fail_if (send_corked(message, strlen(message), NULL, 0));
 
 	free(message);
 	return 0;
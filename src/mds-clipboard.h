@@ -85,6 +85,14 @@ typedef struct clipitem {
  */
 #define CLIPBOARD_LEVELS 3
 
+/**
+ * The minimum size of a clipboard entry for its content
+ * to be used in place from the marshalled state, rather
+ * than copied, when unmarshalling. Adopting keeps the
+ * entire state mapped until the entry is freed.
+ */
+#define CLIPBOARD_ADOPT_MIN (64 << 10)
+
 
 
 /**
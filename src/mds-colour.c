@@ -22,6 +22,7 @@
 #include <libmdsserver/macros.h>
 #include <libmdsserver/util.h>
 #include <libmdsserver/mds-message.h>
+#include <libmdsserver/header-matcher.h>
 #include <libmdsserver/hash-list.h>
 #include <libmdsserver/hash-help.h>
 
@@ -252,7 +253,7 @@ marshal_server(char *state_buf)
 	buf_set_next(state_buf, uint32_t, message_id);
 
 	mds_message_marshal(&received, state_buf);
-	state_buf += mds_message_marshal_size(&received) / sizeof(char*);
+	state_buf += mds_message_marshal_size(&received) / sizeof(char);
 
 	colour_list_marshal(&colours, state_buf);
 
@@ -283,7 +284,7 @@ unmarshal_server(char *state_buf)
 	buf_get_next(state_buf, uint32_t, message_id);
 
 	fail_if (mds_message_unmarshal(&received, state_buf));
-	state_buf += mds_message_marshal_size(&received) / sizeof(char*);
+	state_buf += mds_message_marshal_size(&received) / sizeof(char);
 	stage++;
 
 	fail_if (colour_list_unmarshal(&colours, state_buf));
@@ -378,6 +379,12 @@ done:
 int
 handle_message(void)
 {
+	static const char *const header_names[] = {
+		"Command", "Client ID", "Message ID", "Include values", "Name",
+		"Remove", "Bytes", "Red", "Green", "Blue"
+	};
+	static header_matcher_t header_matcher;
+
 	const char *recv_command = NULL;
 	const char *recv_client_id = "0:0";
 	const char *recv_message_id = NULL;
@@ -388,26 +395,15 @@ handle_message(void)
 	const char *recv_red = NULL;
 	const char *recv_green = NULL;
 	const char *recv_blue = NULL;
-	size_t i;
-
-#define __get_header(storage, header)\
-	(startswith(received.headers[i], header))\
-		storage = received.headers[i] + strlen(header)
-
-	for (i = 0; i < received.header_count; i++) {
-		if      __get_header(recv_command,        "Command: ");
-		else if __get_header(recv_client_id,      "Client ID: ");
-		else if __get_header(recv_message_id,     "Message ID: ");
-		else if __get_header(recv_include_values, "Include values: ");
-		else if __get_header(recv_name,           "Name: ");
-		else if __get_header(recv_remove,         "Remove: ");
-		else if __get_header(recv_bytes,          "Bytes: ");
-		else if __get_header(recv_red,            "Red: ");
-		else if __get_header(recv_green,          "Green: ");
-		else if __get_header(recv_blue,           "Blue: ");
-	}
+	const char **const header_values[] = {
+		&recv_command, &recv_client_id, &recv_message_id, &recv_include_values, &recv_name,
+		&recv_remove, &recv_bytes, &recv_red, &recv_green, &recv_blue
+	};
 
-#undef __get_header
+	if (!header_matcher.count)
+		fail_if (header_matcher_compile(&header_matcher, header_names,
+		                                sizeof(header_names) / sizeof(*header_names)));
+	header_matcher_match(&header_matcher, received.headers, received.header_count, header_values);
 
 	if (!recv_message_id) {
 		eprint("received message without ID, ignoring, master server is misbehaving.");
@@ -557,8 +553,9 @@ handle_list_colours(const char *recv_client_id, const char *recv_message_id, con
 	                "In response to: \n"
 	                "Message ID: \n"
 	                "Origin command: list-colours\n"
+	                "Length: \n"
 	                "\n") / sizeof(char);
-	length += strlen(recv_client_id) + strlen(recv_message_id) + 10 + payload_length;
+	length += strlen(recv_client_id) + strlen(recv_message_id) + 10 + 3 * sizeof(size_t) + payload_length;
 
 	if (length > send_buffer_size) {
 		fail_if (yrealloc(temp, send_buffer, length, char));
@@ -570,11 +567,16 @@ handle_list_colours(const char *recv_client_id, const char *recv_message_id, con
 	        "In response to: %s\n"
 	        "Message ID: %"PRIu32"\n"
 	        "Origin command: list-colours\n"
-	        "\n%zn",
+	        "%zn",
 	        recv_client_id, recv_message_id, message_id, (ssize_t*)&length);
+	if (payload_length)
+		length += (size_t)sprintf(send_buffer + length, "Length: %zu\n", payload_length);
+	send_buffer[length++] = '\n';
 	memcpy(send_buffer + length, payload, payload_length * sizeof(char));
 	length += payload_length;
 
+	message_id = message_id == UINT32_MAX ? 0 : (message_id + 1);
+
 	fail_if (full_send(send_buffer, length));
 	return 0;
 fail:
@@ -636,9 +638,9 @@ handle_get_colour(const char *recv_client_id, const char *recv_message_id, const
 	        "Red: %"PRIu64"\n"
 	        "Green: %"PRIu64"\n"
 	        "Blue: %"PRIu64"\n"
-	        "\n",
+	        "\n%zn",
 	        recv_client_id, recv_message_id, message_id, colour.bytes,
-	        colour.red, colour.green, colour.blue);
+	        colour.red, colour.green, colour.blue, (ssize_t*)&length);
 
 	message_id = message_id == UINT32_MAX ? 0 : (message_id + 1);
 
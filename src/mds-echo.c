@@ -76,6 +76,17 @@ static char *echo_buffer = NULL;
  */
 static size_t echo_buffer_size = 0;
 
+/**
+ * Echoes that have not been sent yet because more
+ * messages had been received, see `full_send_corked`
+ */
+static char *cork = NULL;
+
+/**
+ * The number of bytes stored in `cork`
+ */
+static size_t cork_size = 0;
+
 
 
 /**
@@ -239,7 +250,8 @@ master_loop(void)
 	while (!reexecing && !terminating) {
 		if (!(r = mds_message_read(&received, socket_fd)))
 			if (!(r = echo_message()))
-				continue;
+				if (!(r = send_corked_echoes()))
+					continue;
 
 		if (r == -2) {
 			eprint("corrupt message received, aborting.");
@@ -253,11 +265,16 @@ master_loop(void)
 		eprint("lost connection to server.");
 		mds_message_destroy(&received);
 		mds_message_initialise(&received);
+		cork_size = 0;
 		connected = 0;
 		fail_if (reconnect_to_display());
 		connected = 1;
 	}
 
+	/* Do not leave echoes behind if we are re-exec:ing. */
+	if (connected)
+		fail_if (full_send_corked(socket_fd, NULL, 0, 0, &cork, &cork_size));
+
 	rc = 0;
 	goto done;
 fail:
@@ -266,10 +283,28 @@ done:
 	if (rc || !reexecing)
 		mds_message_destroy(&received);
 	free(echo_buffer);
+	free(cork);
 	return rc;
 }
 
 
+/**
+ * Send the echoes that have been corked, unless
+ * the next message has already been received in full,
+ * in which case its echo is sent with them
+ * 
+ * @return  Zero on success -1 on error or interruption,
+ *          `errno` will be set accordingly
+ */
+int
+send_corked_echoes(void)
+{
+	if (mds_message_ready(&received))
+		return 0;
+	return full_send_corked(socket_fd, NULL, 0, 0, &cork, &cork_size);
+}
+
+
 /**
  * Echo the received message payload
  * 
@@ -283,6 +318,7 @@ echo_message(void)
 	const char *recv_client_id = NULL;
 	const char *recv_message_id = NULL;
 	const char *recv_length = NULL;
+	struct iovec iov[2];
 	size_t i, n;
 	int saved_errno;
 
@@ -336,9 +372,12 @@ echo_message(void)
 	/* Increase message ID. */
 	message_id = message_id == UINT32_MAX ? 0 : (message_id + 1);
   
-	/* Send echo. */
-	fail_if (full_send(echo_buffer, strlen(echo_buffer)));
-	return full_send(received.payload, received.payload_size);
+	/* Send echo, the payload is not copied to be sent with the headers. */
+	iov[0].iov_base = echo_buffer;
+	iov[0].iov_len = strlen(echo_buffer);
+	iov[1].iov_base = received.payload;
+	iov[1].iov_len = received.payload_size;
+	return full_send_corked(socket_fd, iov, 2, 1, &cork, &cork_size);
 fail:
 	saved_errno = errno;
 	free(old_buffer);
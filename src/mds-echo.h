@@ -30,5 +30,15 @@
  */
 int echo_message(void);
 
+/**
+ * Send the echoes that have been corked, unless
+ * the next message has already been received in full,
+ * in which case its echo is sent with them
+ * 
+ * @return  Zero on success -1 on error or interruption,
+ *          `errno` will be set accordingly
+ */
+int send_corked_echoes(void);
+
 
 #endif
@@ -22,6 +22,8 @@
 #include <libmdsserver/macros.h>
 #include <libmdsserver/util.h>
 #include <libmdsserver/mds-message.h>
+#include <libmdsserver/mpsc-queue.h>
+#include <libmdsserver/header-matcher.h>
 
 #include <inttypes.h>
 #include <string.h>
@@ -32,6 +34,8 @@
 #include <sys/ioctl.h>
 #include <linux/kd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <alloca.h>
 #define reconnect_to_display() -1
 
@@ -82,6 +86,31 @@
  */
 #define lengthof(str) (sizeof(str) / sizeof(char) - 1)
 
+/**
+ * The number of key events that the keyboard listener
+ * thread can queue before it has to wait for the main
+ * thread to broadcast them
+ */
+#define KEY_QUEUE_SIZE  256
+
+
+
+/**
+ * A key event that the keyboard listener thread has
+ * read, waiting to be broadcasted by the main thread
+ */
+struct key_event {
+	/**
+	 * The scancode
+	 */
+	int scancode[3];
+
+	/**
+	 * Whether the scancode has three integers rather than one
+	 */
+	int trio;
+};
+
 
 
 /**
@@ -182,14 +211,10 @@ static pthread_t kbd_thread;
 static volatile sig_atomic_t kbd_thread_started = 0;
 
 /**
- * Mutex that should be used when sending message
- */
-static pthread_mutex_t send_mutex;
-
-/**
- * Mutex that should be used when accessing the keycode map
+ * Key events that the keyboard listener thread has queued for
+ * the main thread, which is the only thread that sends messages
  */
-static pthread_mutex_t mapping_mutex;
+static mpsc_queue_t key_queue;
 
 /**
  * The value Num Lock's LED is mapped
@@ -324,8 +349,6 @@ initialise_server(void)
 
 	fail_if (open_leds() < 0); stage++;
 	fail_if (open_input() < 0); stage++;
-	fail_if (pthread_mutex_init(&send_mutex, NULL)); stage++;
-	fail_if (pthread_mutex_init(&mapping_mutex, NULL)); stage++;
 	fail_if (full_send(message, strlen(message)));
 	fail_if (server_initialised());  stage++;
 	fail_if (mds_message_initialise(&received));
@@ -334,13 +357,11 @@ initialise_server(void)
 
 fail:
 	xperror(*argv);
-	if (stage < 5) {
+	if (stage < 3) {
 		if (stage >= 2) close_input();
 		if (stage >= 1) close_leds();
 	}
-	if (stage >= 3) pthread_mutex_destroy(&send_mutex);
-	if (stage >= 4) pthread_mutex_destroy(&mapping_mutex);
-	if (stage >= 5) mds_message_destroy(&received);
+	if (stage >= 3) mds_message_destroy(&received);
 	return 1;
 }
 
@@ -490,6 +511,53 @@ reexec_failure_recover(void)
 }
 
 
+/**
+ * Broadcast the key events that the keyboard listener thread has queued
+ */
+static void
+send_queued_keys(void)
+{
+	struct key_event event;
+	while (!mpsc_queue_pop(&key_queue, &event))
+		send_key(event.scancode, event.trio);
+}
+
+
+/**
+ * Wait until a message can be read from the display,
+ * or the keyboard listener thread has queued a key event
+ * 
+ * @return  Zero if a message shall be read, 1 if only key events
+ *          have been queued, -1 on error or interruption
+ */
+static int
+wait_for_input(void)
+{
+	struct pollfd fds[2];
+	int r, saved_errno;
+
+	/* What remains of the last read may hold the next message. */
+	if (received.buffer_ptr > received.buffer_off)
+		return 0;
+
+	if (mpsc_queue_prepare_wait(&key_queue))
+		return 1;
+
+	fds[0].fd = socket_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = key_queue.wakeup_fd;
+	fds[1].events = POLLIN;
+	r = poll(fds, 2, -1);
+
+	saved_errno = errno;
+	mpsc_queue_finish_wait(&key_queue);
+	errno = saved_errno;
+	if (r < 0)
+		return -1;
+	return fds[0].revents ? 0 : 1;
+}
+
+
 /**
  * Perform the server's mission
  * 
@@ -498,13 +566,17 @@ reexec_failure_recover(void)
 int
 master_loop(void)
 {
-	int rc = 1, joined = 0, r;
+	int rc = 1, joined = 1, r;
 	void *kbd_ret;
 
+	/* Create the queue the keyboard listener thread passes key events through. */
+	fail_if (mpsc_queue_create(&key_queue, KEY_QUEUE_SIZE, sizeof(struct key_event), MPSC_QUEUE_WAKEUP));
+
 	/* Start thread that reads input from the keyboard. */
 	fail_if ((errno = pthread_create(&kbd_thread, NULL, keyboard_loop, NULL)));
+	joined = 0;
 
-	/* Listen for messages. */
+	/* Listen for messages, and broadcast keys. */
 	while (!reexecing && !terminating) {
 		if (danger) {
 			danger = 0;
@@ -513,7 +585,11 @@ master_loop(void)
 			send_buffer_size = 0;
 		}
 
-		if (!(r = mds_message_read(&received, socket_fd)))
+		send_queued_keys();
+		if ((r = wait_for_input()) > 0)
+			continue;
+
+		if (!r && !(r = mds_message_read(&received, socket_fd)))
 			if (!(r = handle_message()))
 				continue;
 
@@ -537,15 +613,17 @@ master_loop(void)
 	joined = 1;
 	fail_if ((errno = pthread_join(kbd_thread, &kbd_ret)));
 	rc = kbd_ret == NULL ? 0 : 1;
+	/* Do not lose keys that were read before the thread stopped. */
+	if (connected)
+		send_queued_keys();
 	goto done;
  fail:
 	xperror(*argv);
  done:
-	pthread_mutex_destroy(&send_mutex);
-	pthread_mutex_destroy(&mapping_mutex);
-	free(send_buffer);
 	if (!joined && (errno = pthread_join(kbd_thread, NULL)))
 		xperror(*argv);
+	mpsc_queue_destroy(&key_queue);
+	free(send_buffer);
 	if (!rc && reexecing)
 		return 0;
 	mds_message_destroy(&received);
@@ -587,6 +665,12 @@ fail:
 int
 handle_message(void)
 {
+	static const char *const header_names[] = {
+		"Command", "Client ID", "Message ID", "Modify ID",
+		"Active", "Mask", "Keyboard", "Action"
+	};
+	static header_matcher_t header_matcher;
+
 	const char *recv_command = NULL;
 	const char *recv_client_id = "0:0";
 	const char *recv_message_id = NULL;
@@ -595,24 +679,15 @@ handle_message(void)
 	const char *recv_mask = NULL;
 	const char *recv_keyboard = NULL;
 	const char *recv_action = NULL;
-	size_t i;
+	const char **const header_values[] = {
+		&recv_command, &recv_client_id, &recv_message_id, &recv_modify_id,
+		&recv_active, &recv_mask, &recv_keyboard, &recv_action
+	};
 
-#define __get_header(storage, header)\
-	(startswith(received.headers[i], header))\
-		storage = received.headers[i] + strlen(header)
-
-	for (i = 0; i < received.header_count; i++) {
-		if      __get_header(recv_command,    "Command: ");
-		else if __get_header(recv_client_id,  "Client ID: ");
-		else if __get_header(recv_message_id, "Message ID: ");
-		else if __get_header(recv_modify_id,  "Modify ID: ");
-		else if __get_header(recv_active,     "Active: ");
-		else if __get_header(recv_mask,       "Mask: ");
-		else if __get_header(recv_keyboard,   "Keyboard: ");
-		else if __get_header(recv_action,     "Action: ");
-	}
-
-#undef __get_header
+	if (!header_matcher.count)
+		fail_if (header_matcher_compile(&header_matcher, header_names,
+		                                sizeof(header_names) / sizeof(*header_names)));
+	header_matcher_match(&header_matcher, received.headers, received.header_count, header_values);
 
 	if (!recv_message_id)
 		return eprint("received message without ID, ignoring, master server is misbehaving."), 0;
@@ -682,7 +757,6 @@ handle_enumerate_keyboards(const char *recv_client_id, const char *recv_message_
 {
 	uint32_t msgid;
 	size_t n;
-	int r;
 
 	if (!recv_modify_id)
 		return eprint("did not get a modify ID, ignoring."), 0;
@@ -691,10 +765,8 @@ handle_enumerate_keyboards(const char *recv_client_id, const char *recv_message_
 	if (strequals(recv_client_id, "0:0")) {
 		eprint("received information request from an anonymous client, sending non-modifying response.");
 
-		with_mutex (send_mutex,
-		            msgid = message_id;
-		            message_id = message_id == UINT32_MAX ? 0 : (message_id + 1);
-		           );
+		msgid = message_id;
+		message_id = message_id == UINT32_MAX ? 0 : (message_id + 1);
 
 		fail_if (ensure_send_buffer_size(47 + strlen(recv_modify_id) + 1) < 0);
 		sprintf(send_buffer,
@@ -704,19 +776,13 @@ handle_enumerate_keyboards(const char *recv_client_id, const char *recv_message_
 		        "\n",
 		        recv_modify_id, msgid);
 
-		with_mutex (send_mutex,
-		            r = full_send(send_buffer, strlen(send_buffer));
-		            if (r) r = errno ? errno : -1;
-		           );
-		fail_if (errno = (r == -1 ? 0 : r), r);
+		fail_if (full_send(send_buffer, strlen(send_buffer)));
 		return 0;
 	}
 
-	with_mutex (send_mutex,
-	            msgid = message_id;
-	            message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
-	            message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
-	           );
+	msgid = message_id;
+	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
+	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
 
 	n = 134 + 3 * sizeof(size_t) + lengthof(KEYBOARD_ID);
 	n += strlen(recv_client_id) + strlen(recv_modify_id) + strlen(recv_message_id);
@@ -737,11 +803,7 @@ handle_enumerate_keyboards(const char *recv_client_id, const char *recv_message_
 	        recv_modify_id, msgid,
 	        recv_client_id, recv_message_id, lengthof(KEYBOARD_ID) + 1, msgid + 1);
 
-	with_mutex (send_mutex,
-	            r = full_send(send_buffer, strlen(send_buffer));
-	            if (r) r = errno ? errno : -1;
-	           );
-	fail_if (errno = (r == -1 ? 0 : r), r);
+	fail_if (full_send(send_buffer, strlen(send_buffer)));
 	return 0;
 fail:
 	return -1;
@@ -761,7 +823,7 @@ handle_keyboard_enumeration(const char *recv_modify_id)
 	size_t i, off, m, n = lengthof(KEYBOARD_ID "\n") + 3 * sizeof(size_t);
 	ssize_t top;
 	uint32_t msgid;
-	int r, have_len = 0;
+	int have_len = 0;
 	const char *header;
 
 	if (!recv_modify_id)
@@ -800,10 +862,8 @@ handle_keyboard_enumeration(const char *recv_modify_id)
 	fail_if (ensure_send_buffer_size(n + 1) < 0);
 
 	/* Fetch and increase local message ID. */
-	with_mutex (send_mutex,
-	            msgid = message_id;
-	            message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
-	           );
+	msgid = message_id;
+	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
 
 
 	/* Write outbound message payload. */
@@ -866,12 +926,7 @@ handle_keyboard_enumeration(const char *recv_modify_id)
 
 	/* Send message. */
 
-	with_mutex (send_mutex,
-	            r = full_send(send_buffer + off, n);
-	            if (r) r = errno ? errno : -1;
-	           );
-
-	fail_if (errno = (r == -1 ? 0 : r), r);
+	fail_if (full_send(send_buffer + off, n));
 	return 0;
 fail:
 	return -1;
@@ -961,7 +1016,7 @@ handle_get_keyboard_leds(const char *recv_client_id, const char *recv_message_id
 {
 	uint32_t msgid;
 	size_t n;
-	int r, leds, error;
+	int leds, error;
   
 	if (recv_keyboard && !strequals(recv_keyboard, KEYBOARD_ID))
 		return 0;
@@ -980,10 +1035,8 @@ handle_get_keyboard_leds(const char *recv_client_id, const char *recv_message_id
 		fail_if (errno = error, 1);
 	}
 
-	with_mutex (send_mutex,
-	            msgid = message_id;
-	            message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
-	           );
+	msgid = message_id;
+	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
 
 	n = 65 + 2 * strlen(PRESENT_LEDS);
 	n += strlen(recv_client_id) + strlen(recv_message_id);
@@ -1005,12 +1058,7 @@ handle_get_keyboard_leds(const char *recv_client_id, const char *recv_message_id
 	        "",
 	        leds == 0 ? " none" : "");
   
-	with_mutex (send_mutex,
-	            r = full_send(send_buffer, strlen(send_buffer));
-	            if (r) r = errno ? errno : -1;
-	           );
-
-	fail_if (errno = (r == -1 ? 0 : r), r);
+	fail_if (full_send(send_buffer, strlen(send_buffer)));
 	return 0;
 fail:
 	xperror(*argv);
@@ -1302,7 +1350,7 @@ mapping_query(const char *recv_client_id, const char *recv_message_id)
 {
 	size_t top = 64 + 3 * sizeof(size_t), n = 0, off, i;
 	ssize_t len;
-	int greatest = 0, r;
+	int greatest = 0;
 	uint32_t msgid;
 
 	/* Count the number of non-identity mappings, and
@@ -1328,10 +1376,8 @@ mapping_query(const char *recv_client_id, const char *recv_message_id)
 	fail_if (ensure_send_buffer_size(top + n + 2) < 0);
 
 	/* Fetch and increase local message ID. */
-	with_mutex (send_mutex,
-	            msgid = message_id;
-	            message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
-	           );
+	msgid = message_id;
+	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
 
 	/* The offset for the payload should fit all
 	   headers and an empty line. */
@@ -1361,12 +1407,7 @@ mapping_query(const char *recv_client_id, const char *recv_message_id)
 
 	/* Send the message. */
 
-	with_mutex (send_mutex,
-	            r = full_send(send_buffer + off, top + n);
-	            if (r) r = errno ? errno : -1;
-	           );
-
-	fail_if (errno = (r == -1 ? 0 : r), r);
+	fail_if (full_send(send_buffer + off, top + n));
 	return 0;
 fail:
 	return -1;
@@ -1387,7 +1428,6 @@ int
 handle_keycode_map(const char *recv_client_id, const char *recv_message_id,
                    const char *recv_action, const char *recv_keyboard)
 {
-	int r;
 	if (recv_keyboard && !strequals(recv_keyboard, KEYBOARD_ID))
 		return 0;
   
@@ -1396,16 +1436,10 @@ handle_keycode_map(const char *recv_client_id, const char *recv_message_id,
 	} else if (strequals(recv_action, "remap")) {
 		if (!received.payload_size)
 			return eprint("received keycode remap request without a payload, ignoring."), 0;
-		with_mutex (mapping_mutex,
-		            r = remap(received.payload, received.payload_size);
-		            if (r) r = errno ? errno : -1;
-		           );
-		fail_if (errno = (r == -1 ? 0 : r), r);
+		fail_if (remap(received.payload, received.payload_size));
 	} else if (strequals(recv_action, "reset")) {
-		with_mutex (mapping_mutex,
-		            free(mapping);
-		            mapping_size = 0;
-		           );
+		free(mapping);
+		mapping_size = 0;
 	} else if (strequals(recv_action, "query")) {
 		if (strequals(recv_client_id, "0:0"))
 			return eprint("received information request from an anonymous client, ignoring."), 0;
@@ -1561,7 +1595,7 @@ close_input(void)
 int
 send_key(int *restrict scancode, int trio)
 {
-	int r, keycode, released = (scancode[0] & 0x80) == 0x80;
+	int keycode, released = (scancode[0] & 0x80) == 0x80;
 	uint32_t msgid;
 	scancode[0] &= 0x7F;
 	if (trio) {
@@ -1571,15 +1605,11 @@ send_key(int *restrict scancode, int trio)
 		keycode = scancode[0];
 	}
 
-	with_mutex (mapping_mutex,
-	            if ((size_t)keycode < mapping_size)
-	                    keycode = mapping[keycode];
-	           );
+	if ((size_t)keycode < mapping_size)
+		keycode = mapping[keycode];
 
-	with_mutex (send_mutex,
-	            msgid = message_id;
-	            message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
-	           );
+	msgid = message_id;
+	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
 
 	if (trio) {
 		sprintf(key_send_buffer,
@@ -1605,11 +1635,7 @@ send_key(int *restrict scancode, int trio)
 		        released ? "yes" : "no", msgid);
 	}
 
-	with_mutex (send_mutex,
-	            r = full_send(key_send_buffer, strlen(key_send_buffer));
-	            if (r) r = errno ? errno : 0;
-	           );
-	fail_if (errno = (r == -1 ? 0 : r), r);
+	fail_if (full_send(key_send_buffer, strlen(key_send_buffer)));
 	return 0;
 fail:
 	return -1;
@@ -1617,7 +1643,29 @@ fail:
 
 
 /**
- * Fetch and broadcast keys until interrupted
+ * Queue a keyboard input event for the main thread to broadcast,
+ * waiting for room in the queue if the main thread is behind
+ * 
+ * @param  scancode  The scancode
+ * @param  trio      Whether the scancode has three integers rather than one
+ */
+static void __attribute__((nonnull))
+queue_key(const int *restrict scancode, int trio)
+{
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000L };
+	struct key_event event;
+
+	memcpy(event.scancode, scancode, (trio ? 3 : 1) * sizeof(int));
+	event.trio = trio;
+
+	while (mpsc_queue_push(&key_queue, &event))
+		if (reexecing || terminating || nanosleep(&delay, NULL))
+			break;
+}
+
+
+/**
+ * Fetch keys and queue them for broadcasting until interrupted
  * 
  * @return  Zero on success, -1 on error
  */
@@ -1659,7 +1707,7 @@ fetch_keys(void)
 			if (!(c & 0x7F))
 				scancode_ptr++;
 			else
-				send_key(scancode_buf, 0);
+				queue_key(scancode_buf, 0);
 			break;
 		case 1:
 			if (!(c & 0x80)) {
@@ -1671,10 +1719,10 @@ fetch_keys(void)
 		default:
 			scancode_ptr = 0;
 			if (!(c & 0x80)) {
-				send_key(scancode_buf + 1, 0);
+				queue_key(scancode_buf + 1, 0);
 				goto redo;
 			}
-			send_key(scancode_buf, 1);
+			queue_key(scancode_buf, 1);
 		}
 	}
 
@@ -1697,14 +1745,11 @@ int
 send_errno(int error, const char *recv_client_id, const char *recv_message_id)
 {
 	int r;
-	with_mutex (send_mutex,
-	            r = send_error(recv_client_id, recv_message_id, "get-keyboard-leds",
-	                           0, error, NULL, &send_buffer, &send_buffer_size,
-	                           message_id, socket_fd);
-	            message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
-	            if (r) r = errno ? errno : -1;
-	           );
-	fail_if (errno = (r == -1 ? 0 : r), r);
+	r = send_error(recv_client_id, recv_message_id, "get-keyboard-leds",
+	               0, error, NULL, &send_buffer, &send_buffer_size,
+	               message_id, socket_fd);
+	message_id = message_id == INT32_MAX ? 0 : (message_id + 1);
+	fail_if (r);
 	return 0;
 fail:
 	return -1;
@@ -166,7 +166,7 @@ __attribute__((nonnull))
 int send_key(int *restrict scancode, int trio);
 
 /**
- * Fetch and broadcast keys until interrupted
+ * Fetch keys and queue them for broadcasting until interrupted
  * 
  * @return  Zero on success, -1 on error
  */
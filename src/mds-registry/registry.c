@@ -27,6 +27,7 @@
 #include <libmdsserver/macros.h>
 #include <libmdsserver/hash-help.h>
 #include <libmdsserver/client-list.h>
+#include <libmdsserver/header-matcher.h>
 
 #include <errno.h>
 #include <inttypes.h>
@@ -188,6 +189,7 @@ registry_action_remove(size_t command_key, uint64_t client)
 {
 	hash_entry_t *entry = hash_table_get_entry(&reg_table, command_key);
 	size_t address = entry->value;
+	size_t key = entry->key;
 	client_list_t *list = (void *)address;
 
 	/* Remove server from protocol. */
@@ -198,7 +200,7 @@ registry_action_remove(size_t command_key, uint64_t client)
 		client_list_destroy(list);
 		free(list);
 		hash_table_remove(&reg_table, command_key);
-		reg_table_free_key(entry->key);
+		reg_table_free_key(key);
 	}
 }
 
@@ -402,30 +404,24 @@ static int
 handle_register_message(void)
 {
 	/* Fetch message headers. */
+	static const char *const header_names[] = {
+		"Client ID", "Message ID", "Length", "Action"
+	};
+	static header_matcher_t header_matcher;
+
 	const char *recv_client_id = NULL;
 	const char *recv_message_id = NULL;
 	const char *recv_length = NULL;
 	const char *recv_action = NULL;
-	size_t i, length = 0;
-
-#define __get_header(storage, header)\
-	(startswith(received.headers[i], header))\
-		storage = received.headers[i] + strlen(header)
-
-	for (i = 0; i < received.header_count; i++) {
-		if      __get_header(recv_client_id,  "Client ID: ");
-		else if __get_header(recv_message_id, "Message ID: ");
-		else if __get_header(recv_length,     "Length: ");
-		else if __get_header(recv_action,     "Action: ");
-		else
-			continue;
-
-		/* Stop if we got all headers we recognised, except ‘Time to live’. */
-		if (recv_client_id && recv_message_id && recv_length && recv_action)
-			break;
-	}
+	const char **const header_values[] = {
+		&recv_client_id, &recv_message_id, &recv_length, &recv_action
+	};
+	size_t length = 0;
 
-#undef __get_header
+	if (!header_matcher.count)
+		fail_if (header_matcher_compile(&header_matcher, header_names,
+		                                sizeof(header_names) / sizeof(*header_names)));
+	header_matcher_match(&header_matcher, received.headers, received.header_count, header_values);
 
 	/* Validate headers. */
 	if (!recv_client_id || strequals(recv_client_id, "0:0"))
@@ -456,6 +452,8 @@ handle_register_message(void)
 	}
 
 #undef __registry_action
+fail:
+	return -1;
 }
 
 
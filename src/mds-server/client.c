@@ -28,6 +28,21 @@
 
 
 
+/**
+ * The largest allocation, for a client's pending messages,
+ * that is kept when all pending messages have been sent
+ */
+#define SEND_PENDING_KEEP_CAPACITY  (64 << 10)
+
+/**
+ * The number of multicast messages that can be queued
+ * for a client before `overflow` is used, must be a
+ * power of two
+ */
+#define CLIENT_MULTICAST_QUEUE_SIZE  16
+
+
+
 /**
  * Initialise a client
  * 
@@ -54,13 +69,46 @@ client_initialise(client_t *restrict this)
 	this->mutex_created = 0;
 	this->interception_conditions = NULL;
 	this->interception_conditions_count = 0;
-	this->multicasts = NULL;
-	this->multicasts_count = 0;
+	this->multicasts_created = 0;
+	this->overflow = NULL;
+	this->overflow_head = 0;
+	this->overflow_count = 0;
+	this->overflow_capacity = 0;
 	this->send_pending = NULL;
+	this->send_pending_head = 0;
 	this->send_pending_size = 0;
+	this->send_pending_capacity = 0;
+	this->send_pending_coalescible = 0;
+	this->congested = 0;
+	memset(&(this->queue_stats), 0, sizeof(this->queue_stats));
+	this->sending = NULL;
+	this->sending_buffer = NULL;
+	this->modify_waiting = 0;
 	this->modify_message = NULL;
 	this->modify_mutex_created = 0;
 	this->modify_cond_created = 0;
+	this->draining = 0;
+	this->senders = 0;
+	this->closing = 0;
+	this->poll_writable = 0;
+}
+
+
+/**
+ * Copy the fields that are read when messages are routed
+ * into a client's record in the list of clients
+ * 
+ * @param  this     The client information
+ * @param  summary  The client's record in the list of clients
+ */
+void
+client_summarise(const client_t *restrict this, client_summary_t *restrict summary)
+{
+	/* The record is read without locking the client. */
+	__atomic_store_n(&(summary->id), this->id, __ATOMIC_RELAXED);
+	__atomic_store_n(&(summary->interception_conditions_count),
+	                 this->interception_conditions_count, __ATOMIC_RELAXED);
+	__atomic_store_n(&(summary->open), this->open, __ATOMIC_RELAXED);
 }
 
 
@@ -72,6 +120,7 @@ client_initialise(client_t *restrict this)
  * - mutex
  * - modify_mutex
  * - modify_cond
+ * - multicasts
  * 
  * @param   this  The client information
  * @return        Zero on success, -1 on error
@@ -93,12 +142,310 @@ client_initialise_threading(client_t *restrict this)
 	fail_if ((errno = pthread_cond_init(&(this->modify_cond), NULL)));
 	this->modify_cond_created = 1;
 
+	/* Create the queue multicast messages are added to without locking. */
+	fail_if (mpsc_queue_create(&(this->multicasts), CLIENT_MULTICAST_QUEUE_SIZE, sizeof(multicast_t), 0));
+	this->multicasts_created = 1;
+
 	return 0;
  fail:
 	return -1;
 }
 
 
+/**
+ * Append a message to `overflow`
+ * 
+ * The client's mutex must be held by the caller, unless
+ * no other thread can access the client
+ * 
+ * @param   this       The client information
+ * @param   multicast  The multicast message, it is moved into the queue
+ * @return             Zero on success, -1 on error
+ */
+static int
+push_overflow(client_t *restrict this, const multicast_t *restrict multicast)
+{
+	multicast_t *new_buf;
+	size_t capacity, first;
+
+	if (this->overflow_count == this->overflow_capacity) {
+		/* Double the capacity, and unwrap the queue while doing so. */
+		capacity = this->overflow_capacity ? this->overflow_capacity << 1 : 4;
+		fail_if (xmalloc(new_buf, capacity, multicast_t));
+		if (this->overflow) {
+			first = min(this->overflow_count, this->overflow_capacity - this->overflow_head);
+			memcpy(new_buf, this->overflow + this->overflow_head, first * sizeof(multicast_t));
+			memcpy(new_buf + first, this->overflow, (this->overflow_count - first) * sizeof(multicast_t));
+			free(this->overflow);
+		}
+		this->overflow = new_buf;
+		this->overflow_head = 0;
+		this->overflow_capacity = capacity;
+	}
+
+	first = (this->overflow_head + this->overflow_count) % this->overflow_capacity;
+	this->overflow[first] = *multicast;
+	__atomic_store_n(&(this->overflow_count), this->overflow_count + 1, __ATOMIC_RELEASE);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Remove the first message from `overflow`
+ * 
+ * The client's mutex must be held by the caller, unless
+ * no other thread can access the client
+ * 
+ * @param   this       The client information
+ * @param   multicast  Output parameter for the multicast message
+ * @return             Zero on success, -1 if the queue is empty
+ */
+static int
+pop_overflow(client_t *restrict this, multicast_t *restrict multicast)
+{
+	if (!this->overflow_count)
+		return -1;
+	*multicast = this->overflow[this->overflow_head];
+	this->overflow_head = (this->overflow_head + 1) % this->overflow_capacity;
+	if (this->overflow_count == 1)
+		this->overflow_head = 0;
+	__atomic_store_n(&(this->overflow_count), this->overflow_count - 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/**
+ * Append a message to a client's queue of pending multicast messages
+ * 
+ * The client's mutex must not be held by the caller, and only
+ * one thread at a time may add messages to the queue, but
+ * messages may be removed concurrently
+ * 
+ * @param   this       The client information
+ * @param   multicast  The multicast message, it is moved into the queue
+ * @return             Zero on success, -1 on error
+ */
+int
+client_push_multicast(client_t *restrict this, const multicast_t *restrict multicast)
+{
+	int r;
+
+	/* Messages may only be added to `multicasts` when `overflow` is empty,
+	 * otherwise they could be sent before older messages in `overflow`.
+	 * Only this thread adds messages to `overflow`, so once it is seen
+	 * empty, it stays empty until this thread adds to it. */
+	if (this->multicasts_created && !__atomic_load_n(&(this->overflow_count), __ATOMIC_ACQUIRE))
+		if (!mpsc_queue_push(&(this->multicasts), multicast))
+			return 0;
+
+	if (!this->mutex_created)
+		return push_overflow(this, multicast);
+	with_mutex (this->mutex,
+		r = push_overflow(this, multicast);
+	);
+	return r;
+}
+
+
+/**
+ * Remove the first message from a client's queue of pending multicast messages
+ * 
+ * The client's mutex must not be held by the caller, and only
+ * the thread that sets the client's `draining` field may remove
+ * messages from the queue, but messages may be added concurrently
+ * 
+ * @param   this       The client information
+ * @param   multicast  Output parameter for the multicast message
+ * @return             Zero on success, -1 if the queue is empty
+ */
+int
+client_pop_multicast(client_t *restrict this, multicast_t *restrict multicast)
+{
+	int r;
+
+	if (this->multicasts_created && !mpsc_queue_pop(&(this->multicasts), multicast))
+		return 0;
+	if (!__atomic_load_n(&(this->overflow_count), __ATOMIC_ACQUIRE))
+		return -1;
+
+	/* The mutex has not been created when the queue
+	 * is restored after re-exec, but then the client
+	 * is not yet accessible by any other thread. */
+	if (!this->mutex_created)
+		return pop_overflow(this, multicast);
+	with_mutex (this->mutex,
+		r = pop_overflow(this, multicast);
+	);
+	return r;
+}
+
+
+/**
+ * Get the first message in a client's queue of pending multicast messages
+ * 
+ * This may only be done when no other thread can access the
+ * queue, as is the case when it is restored after a re-exec
+ * 
+ * @param   this  The client information
+ * @return        The first multicast message, `NULL` if the queue is empty
+ */
+multicast_t *
+client_peek_multicast(const client_t *restrict this)
+{
+	multicast_t *multicast;
+	if (this->multicasts_created && (multicast = mpsc_queue_peek(&(this->multicasts))))
+		return multicast;
+	if (!__atomic_load_n(&(this->overflow_count), __ATOMIC_ACQUIRE))
+		return NULL;
+	return this->overflow + this->overflow_head;
+}
+
+
+/**
+ * Check whether a client's queue of pending multicast messages
+ * is non-empty, unless called by the thread that may remove
+ * messages, this is only a snapshot
+ * 
+ * @param   this  The client information
+ * @return        Whether the queue is non-empty
+ */
+int
+client_has_multicasts(const client_t *restrict this)
+{
+	if (this->multicasts_created && mpsc_queue_size(&(this->multicasts)))
+		return 1;
+	return !!__atomic_load_n(&(this->overflow_count), __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * Append data to a client's pending messages
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param   this    The client information
+ * @param   iov     The data to append
+ * @param   iovcnt  The number of elements in `iov`
+ * @return          Zero on success, -1 on error
+ */
+int
+client_push_pending(client_t *restrict this, const struct iovec *restrict iov, size_t iovcnt)
+{
+	struct iovec old[2];
+	char *new_buf;
+	size_t i, n = 0, m, len, first, tail, capacity;
+
+	for (i = 0; i < iovcnt; i++)
+		n += iov[i].iov_len / sizeof(char);
+	if (!n)
+		return 0;
+
+	if (this->send_pending_size + n > this->send_pending_capacity) {
+		/* Grow the buffer at least twofold, and unwrap it while doing so. */
+		capacity = max(this->send_pending_capacity << 1, this->send_pending_size + n);
+		fail_if (xmalloc(new_buf, capacity, char));
+		for (i = 0, tail = 0, m = client_pending_iovec(this, old); i < m; i++) {
+			memcpy(new_buf + tail, old[i].iov_base, old[i].iov_len);
+			tail += old[i].iov_len / sizeof(char);
+		}
+		free(this->send_pending);
+		this->send_pending = new_buf;
+		this->send_pending_head = 0;
+		this->send_pending_capacity = capacity;
+	}
+
+	tail = (this->send_pending_head + this->send_pending_size) % this->send_pending_capacity;
+	for (i = 0; i < iovcnt; i++) {
+		len = iov[i].iov_len / sizeof(char);
+		first = min(len, this->send_pending_capacity - tail);
+		memcpy(this->send_pending + tail, iov[i].iov_base, first * sizeof(char));
+		memcpy(this->send_pending, (const char *)(iov[i].iov_base) + first, (len - first) * sizeof(char));
+		tail = (tail + len) % this->send_pending_capacity;
+		this->send_pending_size += len;
+	}
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Describe a client's pending messages as
+ * buffers to send with scatter–gather I/O
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param   this  The client information
+ * @param   iov   Output parameter for the buffers, must have room for two elements
+ * @return        The number of elements stored in `iov`
+ */
+size_t
+client_pending_iovec(const client_t *restrict this, struct iovec *restrict iov)
+{
+	size_t first;
+
+	if (!this->send_pending_size)
+		return 0;
+
+	first = min(this->send_pending_size, this->send_pending_capacity - this->send_pending_head);
+	iov[0].iov_base = this->send_pending + this->send_pending_head;
+	iov[0].iov_len = first * sizeof(char);
+	if (first == this->send_pending_size)
+		return 1;
+	iov[1].iov_base = this->send_pending;
+	iov[1].iov_len = (this->send_pending_size - first) * sizeof(char);
+	return 2;
+}
+
+
+/**
+ * Remove data from the beginning of a client's pending messages
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param  this  The client information
+ * @param  n     The number of characters to remove, at most `this->send_pending_size`
+ */
+void
+client_pop_pending(client_t *restrict this, size_t n)
+{
+	if (!n)
+		return;
+	this->send_pending_head = (this->send_pending_head + n) % this->send_pending_capacity;
+	this->send_pending_size -= n;
+	if (this->send_pending_size)
+		return;
+
+	/* Start from the beginning of the buffer, so that the next
+	   message is not wrapped, and release it if it is large. */
+	this->send_pending_head = 0;
+	if (this->send_pending_capacity > SEND_PENDING_KEEP_CAPACITY)
+		client_clear_pending(this);
+}
+
+
+/**
+ * Discard all of a client's pending messages
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param  this  The client information
+ */
+void
+client_clear_pending(client_t *restrict this)
+{
+	free(this->send_pending);
+	this->send_pending = NULL;
+	this->send_pending_head = 0;
+	this->send_pending_size = 0;
+	this->send_pending_capacity = 0;
+	this->send_pending_coalescible = 0;
+}
+
+
 /**
  * Release all resources assoicated with a client
  * 
@@ -107,6 +454,7 @@ client_initialise_threading(client_t *restrict this)
 void
 client_destroy(client_t *restrict this)
 {
+	multicast_t multicast;
 	size_t i;
 	if (this->interception_conditions) {
 		for (i = 0; i < this->interception_conditions_count; i++)
@@ -116,11 +464,19 @@ client_destroy(client_t *restrict this)
 	if (this->mutex_created)
 		pthread_mutex_destroy(&(this->mutex));
 	mds_message_destroy(&(this->message));
-	if (this->multicasts) {
-		for (i = 0; i < this->multicasts_count; i++)
-			multicast_destroy(this->multicasts + i);
-		free(this->multicasts);
+	if (this->multicasts_created) {
+		while (!mpsc_queue_pop(&(this->multicasts), &multicast))
+			multicast_destroy(&multicast);
+		mpsc_queue_destroy(&(this->multicasts));
+	}
+	if (this->overflow) {
+		for (i = 0; i < this->overflow_count; i++)
+			multicast_destroy(this->overflow + (this->overflow_head + i) % this->overflow_capacity);
+		free(this->overflow);
 	}
+	if (this->sending)
+		multicast_destroy(this->sending);
+	free(this->sending_buffer);
 	free(this->send_pending);
 	if (this->modify_message) {
 		mds_message_destroy(this->modify_message);
@@ -143,13 +499,17 @@ client_destroy(client_t *restrict this)
 size_t
 client_marshal_size(const client_t *restrict this)
 {
-	size_t i, n = sizeof(ssize_t) + 3 * sizeof(int) + sizeof(uint64_t) + 5 * sizeof(size_t);
+	size_t i, m, n = sizeof(ssize_t) + 4 * sizeof(int) + sizeof(uint64_t) + 6 * sizeof(size_t) + sizeof(client_queue_stats_t);
 
 	n += mds_message_marshal_size(&(this->message));
 	for (i = 0; i < this->interception_conditions_count; i++)
 		n += interception_condition_marshal_size(this->interception_conditions + i);
-	for (i = 0; i < this->multicasts_count; i++)
-		n += multicast_marshal_size(this->multicasts + i);
+	if (this->sending)
+		n += multicast_marshal_size(this->sending);
+	for (i = 0, m = this->multicasts_created ? mpsc_queue_size(&(this->multicasts)) : 0; i < m; i++)
+		n += multicast_marshal_size(mpsc_queue_get(&(this->multicasts), i));
+	for (i = 0; i < this->overflow_count; i++)
+		n += multicast_marshal_size(this->overflow + (this->overflow_head + i) % this->overflow_capacity);
 	n += this->send_pending_size * sizeof(char);
 	n += !this->modify_message ? 0 : mds_message_marshal_size(this->modify_message);
 
@@ -167,7 +527,8 @@ client_marshal_size(const client_t *restrict this)
 size_t
 client_marshal(const client_t *restrict this, char *restrict data)
 {
-	size_t i, n;
+	struct iovec iov[2];
+	size_t i, n, m;
 	buf_set_next(data, int, CLIENT_T_VERSION);
 	buf_set_next(data, ssize_t, this->list_entry);
 	buf_set_next(data, int, this->socket_fd);
@@ -181,13 +542,25 @@ client_marshal(const client_t *restrict this, char *restrict data)
 	buf_set_next(data, size_t, this->interception_conditions_count);
 	for (i = 0; i < this->interception_conditions_count; i++)
 		data += n = interception_condition_marshal(this->interception_conditions + i, data) / sizeof(char);
-	buf_set_next(data, size_t, this->multicasts_count);
-	for (i = 0; i < this->multicasts_count; i++)
-		data += multicast_marshal(this->multicasts + i, data) / sizeof(char);
+	/* The multicast that is being sent is marshalled first in the queue,
+	   and the queues are joined, `multicasts` before `overflow`. */
+	m = this->multicasts_created ? mpsc_queue_size(&(this->multicasts)) : 0;
+	buf_set_next(data, size_t, m + this->overflow_count + (this->sending ? 1 : 0));
+	if (this->sending)
+		data += multicast_marshal(this->sending, data) / sizeof(char);
+	for (i = 0; i < m; i++)
+		data += multicast_marshal(mpsc_queue_get(&(this->multicasts), i), data) / sizeof(char);
+	for (i = 0; i < this->overflow_count; i++)
+		data += multicast_marshal(this->overflow + (this->overflow_head + i) % this->overflow_capacity, data) / sizeof(char);
+	/* The queues are unwrapped when marshalled. */
 	buf_set_next(data, size_t, this->send_pending_size);
-	if (this->send_pending_size > 0)
-		memcpy(data, this->send_pending, this->send_pending_size * sizeof(char));
-	data += this->send_pending_size;
+	for (i = 0, n = client_pending_iovec(this, iov); i < n; i++) {
+		memcpy(data, iov[i].iov_base, iov[i].iov_len);
+		data += iov[i].iov_len / sizeof(char);
+	}
+	buf_set_next(data, size_t, this->send_pending_coalescible);
+	buf_set_next(data, int, this->congested);
+	buf_set_next(data, client_queue_stats_t, this->queue_stats);
 	n = !this->modify_message ? 0 : mds_message_marshal_size(this->modify_message);
 	buf_set_next(data, size_t, n);
 	if (this->modify_message)
@@ -207,16 +580,29 @@ size_t
 client_unmarshal(client_t *restrict this, char *restrict data)
 {
 	size_t i, n, m, rc = sizeof(ssize_t) + 3 * sizeof(int) + sizeof(uint64_t) + 5 * sizeof(size_t);
-	int saved_errno, stage = 0;
+	int saved_errno, stage = 0, version;
 	this->interception_conditions = NULL;
-	this->multicasts = NULL;
+	this->multicasts_created = 0;
+	this->overflow = NULL;
+	this->overflow_head = 0;
+	this->overflow_capacity = 0;
 	this->send_pending = NULL;
+	this->send_pending_head = 0;
+	this->send_pending_capacity = 0;
+	this->sending = NULL;
+	this->sending_buffer = NULL;
+	this->modify_waiting = 0;
+	this->modify_message = NULL;
 	this->mutex_created = 0;
 	this->modify_mutex_created = 0;
 	this->modify_cond_created = 0;
-	this->multicasts_count = 0;
-	/* buf_get_next(data, int, CLIENT_T_VERSION); */
-	buf_next(data, int, 1);
+	this->overflow_count = 0;
+	this->draining = 0;
+	this->senders = 0;
+	this->closing = 0;
+	this->poll_writable = 0;
+	/* Get the marshal protocal version, version 0 did not include the queue's congestion state. */
+	buf_get_next(data, int, version);
 	buf_get_next(data, ssize_t, this->list_entry);
 	buf_get_next(data, int, this->socket_fd);
 	buf_get_next(data, int, this->open);
@@ -238,10 +624,14 @@ client_unmarshal(client_t *restrict this, char *restrict data)
 		data += n / sizeof(char);
 		rc += n;
 	}
+	/* The queue is restored into `overflow`, `multicasts`
+	   is created when the client is served again. */
 	buf_get_next(data, size_t, n);
-	fail_if (xmalloc(this->multicasts, n, multicast_t));
-	for (i = 0; i < n; i++, this->multicasts_count++) {
-		m = multicast_unmarshal(this->multicasts + i, data);
+	if (n > 0)
+		fail_if (xmalloc(this->overflow, n, multicast_t));
+	this->overflow_capacity = n;
+	for (i = 0; i < n; i++, this->overflow_count++) {
+		m = multicast_unmarshal(this->overflow + i, data);
 		fail_if (!m);
 		data += m / sizeof(char);
 		rc += m;
@@ -249,13 +639,25 @@ client_unmarshal(client_t *restrict this, char *restrict data)
 	buf_get_next(data, size_t, this->send_pending_size);
 	if (this->send_pending_size > 0) {
 		fail_if (xmemdup(this->send_pending, data, this->send_pending_size, char));
+		this->send_pending_capacity = this->send_pending_size;
 		data += this->send_pending_size, rc += this->send_pending_size * sizeof(char);
 	}
+	if (version >= 1) {
+		buf_get_next(data, size_t, this->send_pending_coalescible);
+		buf_get_next(data, int, this->congested);
+		buf_get_next(data, client_queue_stats_t, this->queue_stats);
+		rc += sizeof(size_t) + sizeof(int) + sizeof(client_queue_stats_t);
+	} else {
+		this->send_pending_coalescible = 0;
+		this->congested = 0;
+		memset(&(this->queue_stats), 0, sizeof(this->queue_stats));
+	}
 	buf_get_next(data, size_t, n);
-	if (n > 0)
-		mds_message_unmarshal(this->modify_message, data);
-	else
-		this->modify_message = NULL;
+	if (n > 0) {
+		fail_if (xmalloc(this->modify_message, 1, mds_message_t));
+		mds_message_zero_initialise(this->modify_message);
+		fail_if (mds_message_unmarshal(this->modify_message, data));
+	}
 	rc += n * sizeof(char);
 	return rc;
 
@@ -267,9 +669,9 @@ fail:
 	for (i = 0; i < this->interception_conditions_count; i++)
 		free(this->interception_conditions[i].condition);
 	free(this->interception_conditions);
-	for (i = 0; i < this->multicasts_count; i++)
-		multicast_destroy(this->multicasts + i);
-	free(this->multicasts);
+	for (i = 0; i < this->overflow_count; i++)
+		multicast_destroy(this->overflow + i);
+	free(this->overflow);
 	free(this->send_pending);
 	if (this->modify_message) {
 		mds_message_destroy(this->modify_message);
@@ -290,7 +692,8 @@ size_t
 client_unmarshal_skip(char *restrict data)
 {
 	size_t n, c, rc = sizeof(ssize_t) + 3 * sizeof(int) + sizeof(uint64_t) + 5 * sizeof(size_t);
-	buf_next(data, int, 1);
+	int version;
+	buf_get_next(data, int, version);
 	buf_next(data, ssize_t, 1);
 	buf_next(data, int, 2);
 	buf_next(data, uint64_t, 1);
@@ -312,6 +715,12 @@ client_unmarshal_skip(char *restrict data)
 	buf_get_next(data, size_t, n);
 	data += n;
 	rc += n * sizeof(char);
+	if (version >= 1) {
+		buf_next(data, size_t, 1);
+		buf_next(data, int, 1);
+		buf_next(data, client_queue_stats_t, 1);
+		rc += sizeof(size_t) + sizeof(int) + sizeof(client_queue_stats_t);
+	}
 	buf_get_next(data, size_t, n);
 	rc += n * sizeof(char);
 	return rc;
@@ -23,22 +23,81 @@
 #include "multicast.h"
 
 #include <libmdsserver/mds-message.h>
+#include <libmdsserver/mpsc-queue.h>
 
 #include <stdlib.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 
 
-#define CLIENT_T_VERSION 0
+#define CLIENT_T_VERSION 1
+
+/**
+ * Statistics for a client's queue of messages pending to be sent
+ */
+typedef struct client_queue_stats {
+	/**
+	 * The number of messages that could not be sent
+	 * immediately, in full, and had to be queued
+	 */
+	uint64_t queued;
+
+	/**
+	 * The number of messages that were not
+	 * sent because the queue was congested
+	 */
+	uint64_t dropped;
+
+	/**
+	 * The number of queued messages that were replaced by
+	 * a newer message because the queue was congested
+	 */
+	uint64_t coalesced;
+
+	/**
+	 * The number of times the queue has
+	 * exceeded the high watermark
+	 */
+	uint64_t congestions;
+
+	/**
+	 * The largest size, in bytes, of the queue
+	 */
+	uint64_t peak;
+} client_queue_stats_t;
+
+/**
+ * The fields of a client that are read when messages are
+ * routed, this is stored inline in `client_list`, and
+ * is updated whenever any of the fields change
+ */
+typedef struct client_summary {
+	/**
+	 * The client's ID
+	 */
+	uint64_t id;
+
+	/**
+	 * The number of interception conditions
+	 */
+	size_t interception_conditions_count;
+
+	/**
+	 * Whether the socket is open
+	 */
+	int open;
+} client_summary_t;
 
 /**
  * Client information structure
  */
 typedef struct client {
 	/**
-	 * The client's entry in the list of clients
+	 * The client's handle in the list of clients,
+	 * `-1` if the client is not listed
 	 */
 	ssize_t list_entry;
 
@@ -90,37 +149,121 @@ typedef struct client {
 	size_t interception_conditions_count;
 
 	/**
-	 * Pending multicast messages
+	 * Pending multicast messages, messages are added to
+	 * this queue without holding `mutex`, but once it has
+	 * been full, they are added to `overflow` instead until
+	 * `overflow` has been emptied, the messages in this
+	 * queue are always older than those in `overflow`
+	 */
+	mpsc_queue_t multicasts;
+
+	/**
+	 * Whether `multicasts` has been created
+	 */
+	int multicasts_created;
+
+	/**
+	 * Pending multicast messages that did not fit in
+	 * `multicasts`, a ring buffer with room for
+	 * `overflow_capacity` messages, the first message
+	 * is at `overflow_head`
+	 * 
+	 * Protected by `mutex`
+	 */
+	struct multicast *overflow;
+
+	/**
+	 * The index in `overflow` of the first pending multicast message
+	 */
+	size_t overflow_head;
+
+	/**
+	 * The number of pending multicast messages in `overflow`
 	 */
-	struct multicast *multicasts;
+	size_t overflow_count;
 
 	/**
-	 * The number of pending multicast messages
+	 * The number of elements allocated to `overflow`
 	 */
-	size_t multicasts_count;
+	size_t overflow_capacity;
 
 	/**
-	 * Messages pending to be sent (concatenated)
+	 * Messages pending to be sent (concatenated), a ring
+	 * buffer with room for `send_pending_capacity` characters,
+	 * the first character is at `send_pending_head`
 	 */
 	char *send_pending;
 
+	/**
+	 * The index in `send_pending` of the first pending character
+	 */
+	size_t send_pending_head;
+
 	/**
 	 * The character length of the messages pending to be sent
 	 */
 	size_t send_pending_size;
 
 	/**
-	 * Pending reply to the multicast interception
+	 * The number of characters allocated to `send_pending`
+	 */
+	size_t send_pending_capacity;
+
+	/**
+	 * The number of bytes at the end of `send_pending` that make
+	 * up a message that has not started being sent, and that
+	 * may be replaced by a newer message if the queue is congested
+	 */
+	size_t send_pending_coalescible;
+
+	/**
+	 * Whether `send_pending` has exceeded the high watermark
+	 * and has not yet been reduced to the low watermark
+	 */
+	int congested;
+
+	/**
+	 * Statistics for `send_pending`
+	 */
+	client_queue_stats_t queue_stats;
+
+	/**
+	 * The multicast message that is being sent, it has
+	 * been removed from `multicasts`, `NULL` if none
+	 */
+	struct multicast *sending;
+
+	/**
+	 * The memory `sending` points to when it is not `NULL`,
+	 * it is kept between multicasts so that it does not
+	 * have to be allocated for every message
+	 */
+	struct multicast *sending_buffer;
+
+	/**
+	 * Whether `sending` is waiting for an interceptor to reply,
+	 * it is then resumed by the thread that receives the reply
+	 * 
+	 * Protected by the global `modify_mutex`
+	 */
+	int modify_waiting;
+
+	/**
+	 * Reply to `sending` from the interceptor that may modify it,
+	 * that was received before `sending` started to wait for it
+	 * 
+	 * Protected by the global `modify_mutex`
 	 */
 	struct mds_message *modify_message;
 
 	/**
-	 * Mutex for `modify_message` 
+	 * Mutex for `modify_cond`
 	 */
 	pthread_mutex_t modify_mutex;
 
 	/**
-	 * Condidition for `modify_message` 
+	 * Condition that is broadcasted when the client's
+	 * multicast queue has been sent
 	 */
 	pthread_cond_t modify_cond;
 
@@ -133,6 +276,33 @@ typedef struct client {
 	 * Whether `modify_cond` has been initialised
 	 */
 	int modify_cond_created;
+
+	/**
+	 * Whether a thread is sending the messages in `multicasts`,
+	 * or `sending` is waiting for an interceptor to reply
+	 */
+	int draining;
+
+	/**
+	 * The number of threads that are sending a multicast
+	 * message to the client, the client must not be freed
+	 * until this is zero, and it must be unmapped first
+	 * 
+	 * Protected by `modify_mutex`
+	 */
+	size_t senders;
+
+	/**
+	 * Whether the client shall be freed when `multicasts` has been
+	 * sent, only used when the clients are served by event loops
+	 */
+	int closing;
+
+	/**
+	 * Whether the event loop serving the client
+	 * is waiting for the socket to become writable
+	 */
+	int poll_writable;
 } client_t;
 
 
@@ -156,6 +326,16 @@ typedef struct client {
 __attribute__((nonnull))
 void client_initialise(client_t *restrict this);
 
+/**
+ * Copy the fields that are read when messages are routed
+ * into a client's record in the list of clients
+ * 
+ * @param  this     The client information
+ * @param  summary  The client's record in the list of clients
+ */
+__attribute__((nonnull))
+void client_summarise(const client_t *restrict this, client_summary_t *restrict summary);
+
 /**
  * Initialise fields that have to do with threading
  * 
@@ -164,6 +344,7 @@ void client_initialise(client_t *restrict this);
  * - mutex
  * - modify_mutex
  * - modify_cond
+ * - multicasts
  * 
  * @param   this  The client information
  * @return        Zero on success, -1 on error
@@ -171,6 +352,104 @@ void client_initialise(client_t *restrict this);
 __attribute__((nonnull))
 int client_initialise_threading(client_t *restrict this);
 
+/**
+ * Append a message to a client's queue of pending multicast messages
+ * 
+ * The client's mutex must not be held by the caller, and only
+ * one thread at a time may add messages to the queue, but
+ * messages may be removed concurrently
+ * 
+ * @param   this       The client information
+ * @param   multicast  The multicast message, it is moved into the queue
+ * @return             Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int client_push_multicast(client_t *restrict this, const struct multicast *restrict multicast);
+
+/**
+ * Remove the first message from a client's queue of pending multicast messages
+ * 
+ * The client's mutex must not be held by the caller, and only
+ * the thread that sets the client's `draining` field may remove
+ * messages from the queue, but messages may be added concurrently
+ * 
+ * @param   this       The client information
+ * @param   multicast  Output parameter for the multicast message
+ * @return             Zero on success, -1 if the queue is empty
+ */
+__attribute__((nonnull))
+int client_pop_multicast(client_t *restrict this, struct multicast *restrict multicast);
+
+/**
+ * Get the first message in a client's queue of pending multicast messages
+ * 
+ * This may only be done when no other thread can access the
+ * queue, as is the case when it is restored after a re-exec
+ * 
+ * @param   this  The client information
+ * @return        The first multicast message, `NULL` if the queue is empty
+ */
+__attribute__((pure, nonnull))
+struct multicast *client_peek_multicast(const client_t *restrict this);
+
+/**
+ * Check whether a client's queue of pending multicast messages
+ * is non-empty, unless called by the thread that may remove
+ * messages, this is only a snapshot
+ * 
+ * @param   this  The client information
+ * @return        Whether the queue is non-empty
+ */
+__attribute__((pure, nonnull))
+int client_has_multicasts(const client_t *restrict this);
+
+/**
+ * Append data to a client's pending messages
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param   this    The client information
+ * @param   iov     The data to append
+ * @param   iovcnt  The number of elements in `iov`
+ * @return          Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int client_push_pending(client_t *restrict this, const struct iovec *restrict iov, size_t iovcnt);
+
+/**
+ * Describe a client's pending messages as
+ * buffers to send with scatter–gather I/O
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param   this  The client information
+ * @param   iov   Output parameter for the buffers, must have room for two elements
+ * @return        The number of elements stored in `iov`
+ */
+__attribute__((nonnull))
+size_t client_pending_iovec(const client_t *restrict this, struct iovec *restrict iov);
+
+/**
+ * Remove data from the beginning of a client's pending messages
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param  this  The client information
+ * @param  n     The number of characters to remove, at most `this->send_pending_size`
+ */
+__attribute__((nonnull))
+void client_pop_pending(client_t *restrict this, size_t n);
+
+/**
+ * Discard all of a client's pending messages
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param  this  The client information
+ */
+__attribute__((nonnull))
+void client_clear_pending(client_t *restrict this);
+
 /**
  * Release all resources assoicated with a client
  * 
@@ -0,0 +1,487 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "event-loop.h"
+
+#include "mds-server.h"
+#include "globals.h"
+#include "client.h"
+#include "interceptors.h"
+#include "sending.h"
+#include "slavery.h"
+#include "receiving.h"
+#include "interception-index.h"
+
+#include <libmdsserver/packed-list.h>
+#include <libmdsserver/fd-table.h>
+#include <libmdsserver/macros.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+
+/**
+ * The maximum number of events an event loop
+ * fetches from its epoll instance at a time
+ */
+#define EVENTS_PER_WAIT  64
+
+
+
+/**
+ * An event loop thread and the clients it serves
+ */
+typedef struct event_loop {
+	/**
+	 * The thread running the event loop
+	 */
+	pthread_t thread;
+
+	/**
+	 * Whether `thread` has been started
+	 */
+	int thread_started;
+
+	/**
+	 * The epoll instance that the clients'
+	 * sockets are registered in
+	 */
+	int epoll_fd;
+
+	/**
+	 * Event file descriptor used to wake up the event loop
+	 */
+	int wakeup_fd;
+
+	/**
+	 * The number of clients served by the event loop,
+	 * protected by `slave_mutex`
+	 */
+	size_t clients;
+} event_loop_t;
+
+
+
+/**
+ * The event loops, `event_loop_count` elements
+ */
+static event_loop_t *event_loops = NULL;
+
+
+
+/**
+ * Get the event loop that serves a client
+ * 
+ * Clients are distributed over the event loops by
+ * their socket's file descriptor, so that they are
+ * always served by the same event loop, even after
+ * a re-exec
+ * 
+ * @param   client  The client
+ * @return          The event loop that serves the client
+ */
+static inline event_loop_t * __attribute__((pure, nonnull))
+loop_of(const client_t *client)
+{
+	return event_loops + (size_t)(client->socket_fd) % event_loop_count;
+}
+
+
+/**
+ * Close a client's socket, unlist it and free it
+ * 
+ * @param  client  The client
+ */
+void
+event_loop_finish_client(client_t *client)
+{
+	event_loop_t *loop = loop_of(client);
+
+	/* Unlist and unmap the client before closing the socket
+	   so that a new client with the same file descriptor
+	   cannot be unmapped by mistake. The client must be
+	   removed from the interception index before it is
+	   unlisted, lookups rely on `client_lock`. */
+	interception_index_remove_client(client);
+	with_wrlock (client_lock,
+	             packed_list_remove(&client_list, client->list_entry);
+	             client->list_entry = -1;
+	             fd_table_remove(&client_map, client->socket_fd);
+	            );
+	with_mutex (slave_mutex, loop->clients--;);
+
+	/* Close socket and free resources, once no
+	   thread is sending a message to the client. */
+	if (client->modify_cond_created)
+		wait_for_multicast_senders(client);
+	xclose(client->socket_fd);
+	client_destroy(client);
+
+	/* Let the event loop notice that it may be done. */
+	if (!running)
+		event_loops_wake();
+}
+
+
+/**
+ * Stop serving a client, the client is freed
+ * when its multicast queue has been sent
+ * 
+ * @param  client  The client
+ */
+static void __attribute__((nonnull))
+drop_client(client_t *client)
+{
+	epoll_ctl(loop_of(client)->epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
+	with_mutex (client->mutex,
+	            client->open = 0;
+	            __atomic_store_n(&(client->closing), 1, __ATOMIC_RELEASE);
+	           );
+	update_client_summary(client);
+	multicast_recipient_closed(client);
+	send_multicast_queue(client);
+}
+
+
+/**
+ * Multicast information about a client closing, and stop serving it
+ * 
+ * @param  client  The client
+ */
+static void __attribute__((nonnull))
+close_client(client_t *client)
+{
+	char *msgbuf;
+	size_t n;
+
+	n = 2 * 10 + 1 + strlen("Client closed: :\n\n");
+	if (xmalloc(msgbuf, n, char)) {
+		xperror(*argv);
+	} else {
+		snprintf(msgbuf, n,
+		         "Client closed: %" PRIu32 ":%" PRIu32 "\n"
+		         "\n",
+		         (uint32_t)(client->id >> 32),
+		         (uint32_t)(client->id >>  0));
+		n = strlen(msgbuf);
+		queue_message_multicast(msgbuf, n, client);
+	}
+
+	drop_client(client);
+}
+
+
+/**
+ * Handle an event on a client's socket
+ * 
+ * @param  client  The client
+ * @param  events  The events that have occurred
+ */
+static void __attribute__((nonnull))
+handle_event(client_t *client, uint32_t events)
+{
+	int r;
+
+	/* Fetch all messages that have arrived. */
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		for (;;) {
+			r = fetch_message(client);
+			if (!r) {
+				if (message_received(client))
+					return; /* Re-exec:ing or terminating. */
+			} else if (r == -2) {
+				drop_client(client);
+				return;
+			} else if (!client->open) {
+				close_client(client);
+				return;
+			} else if (errno == EINTR) {
+				if (terminating)
+					return;
+			} else {
+				break; /* Would block. */
+			}
+		}
+	}
+
+	/* Send queued multicast messages. */
+	send_multicast_queue(client);
+
+	/* Send queued messages. */
+	send_reply_queue(client);
+}
+
+
+/**
+ * Check whether an event loop should continue running
+ * 
+ * @param   loop  The event loop
+ * @return        Whether the event loop should continue
+ */
+static int __attribute__((nonnull))
+keep_running(event_loop_t *loop)
+{
+	int rc;
+	if (terminating)
+		return 0;
+	if (running)
+		return 1;
+	with_mutex (slave_mutex, rc = loop->clients > 0;);
+	return rc;
+}
+
+
+/**
+ * Master function for event loop threads
+ * 
+ * @param   data  The event loop
+ * @return        `NULL`
+ */
+static void *
+event_loop(void *data)
+{
+	event_loop_t *loop = data;
+	struct epoll_event events[EVENTS_PER_WAIT];
+	uint64_t counter;
+	int i, n;
+
+	/* Set up traps for especially handled signals. */
+	fail_if (trap_signals() < 0);
+
+	while (keep_running(loop)) {
+		n = epoll_wait(loop->epoll_fd, events, EVENTS_PER_WAIT, -1);
+		if (n < 0) {
+			fail_if (errno != EINTR);
+			continue;
+		}
+
+		for (i = 0; i < n && !terminating; i++) {
+			if (events[i].data.ptr)
+				handle_event(events[i].data.ptr, events[i].events);
+			else
+				while (read(loop->wakeup_fd, &counter, sizeof(counter)) > 0);
+		}
+	}
+
+	return NULL;
+fail:
+	xperror(*argv);
+	return NULL;
+}
+
+
+/**
+ * Create the event loops and start their threads
+ * 
+ * Nothing is done if `event_loop_count` is zero
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int
+event_loops_start(void)
+{
+	struct epoll_event ev;
+	event_loop_t *loop;
+	size_t i;
+
+	if (!event_loop_count)
+		return 0;
+
+	fail_if (xcalloc(event_loops, event_loop_count, event_loop_t));
+	for (i = 0; i < event_loop_count; i++)
+		event_loops[i].epoll_fd = event_loops[i].wakeup_fd = -1;
+
+	for (i = 0; i < event_loop_count; i++) {
+		loop = event_loops + i;
+		fail_if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0);
+		fail_if ((loop->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		fail_if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &ev) < 0);
+		fail_if ((errno = pthread_create(&(loop->thread), NULL, event_loop, loop)));
+		loop->thread_started = 1;
+	}
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Wait for the event loops to exit and release their resources
+ * 
+ * The event loops exit when the server is terminating, or when
+ * the server is no longer running and they have no clients left
+ */
+void
+event_loops_destroy(void)
+{
+	size_t i;
+
+	if (!event_loops)
+		return;
+
+	event_loops_wake();
+	for (i = 0; i < event_loop_count; i++) {
+		if (event_loops[i].thread_started)
+			pthread_join(event_loops[i].thread, NULL);
+		if (event_loops[i].epoll_fd >= 0)
+			xclose(event_loops[i].epoll_fd);
+		if (event_loops[i].wakeup_fd >= 0)
+			xclose(event_loops[i].wakeup_fd);
+	}
+
+	free(event_loops);
+	event_loops = NULL;
+}
+
+
+/**
+ * Wake up all event loops so that they notice
+ * that the server is terminating or re-exec:ing
+ * 
+ * This function is async-signal-safe
+ */
+void
+event_loops_wake(void)
+{
+	uint64_t one = 1;
+	int saved_errno = errno;
+	size_t i;
+
+	if (event_loops)
+		for (i = 0; i < event_loop_count; i++)
+			if (event_loops[i].wakeup_fd >= 0)
+				if (write(event_loops[i].wakeup_fd, &one, sizeof(one)) < 0)
+					continue; /* The counter is already non-zero. */
+
+	errno = saved_errno;
+}
+
+
+/**
+ * Create a client for a newly accepted connection
+ * and hand it over to one of the event loops
+ * 
+ * @param   client_fd  The file descriptor of the client's socket
+ * @return             Zero on success, -1 on error
+ */
+int
+event_loop_accept(int client_fd)
+{
+	client_t *client;
+	char buf[] = "To: all";
+
+	/* Initialise the client. */
+	if (!(client = initialise_client(client_fd))) {
+		xperror(*argv);
+		xclose(client_fd);
+		return -1;
+	}
+	with_mutex (slave_mutex, loop_of(client)->clients++;);
+	fail_if (client_initialise_threading(client));
+
+	/* Register client to receive broadcasts. */
+	add_intercept_condition(client, buf, 0, 0, 0);
+
+	/* Start serving the client. */
+	fail_if (event_loop_resume(client));
+
+	return 0;
+fail:
+	xperror(*argv);
+	event_loop_finish_client(client);
+	return -1;
+}
+
+
+/**
+ * Hand over a client that has been unmarshalled
+ * after a re-exec to one of the event loops
+ * 
+ * @param   client  The client
+ * @return          Zero on success, -1 on error
+ */
+int
+event_loop_resume(client_t *client)
+{
+	event_loop_t *loop = loop_of(client);
+	struct epoll_event ev;
+	int flags, r;
+
+	if (!client->mutex_created) {
+		/* Resuming after a re-exec. */
+		fail_if (client_initialise_threading(client));
+		with_mutex (slave_mutex, loop->clients++;);
+	}
+	client->thread = loop->thread;
+
+	/* The event loop must never block on the socket. */
+	fail_if ((flags = fcntl(client->socket_fd, F_GETFL)) < 0);
+	fail_if (fcntl(client->socket_fd, F_SETFL, flags | O_NONBLOCK) < 0);
+
+	/* Wait for writability immediately if messages were
+	   queued before the re-exec, so they will be sent. */
+	with_mutex (client->mutex,
+	            client->poll_writable = client->send_pending_size || client_has_multicasts(client) || client->sending;
+	            ev.events = EPOLLIN | (client->poll_writable ? EPOLLOUT : 0);
+	            ev.data.ptr = client;
+	            r = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client->socket_fd, &ev);
+	           );
+	fail_if (r < 0);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Select whether the event loop owning a client shall wait for the
+ * client's socket to become writable, this is used when a client has
+ * pending outbound data that could not be sent without blocking
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param  client    The client
+ * @param  writable  Whether to wait for the socket to become writable
+ */
+void
+event_loop_want_write(client_t *client, int writable)
+{
+	struct epoll_event ev;
+
+	writable = !!writable;
+	if (client->poll_writable == writable)
+		return;
+
+	ev.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+	ev.data.ptr = client;
+	/* Fails if the client is being dropped, that is fine. */
+	if (!epoll_ctl(loop_of(client)->epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &ev))
+		client->poll_writable = writable;
+}
@@ -0,0 +1,102 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_MDS_SERVER_EVENT_LOOP_H
+#define MDS_MDS_SERVER_EVENT_LOOP_H
+
+
+#include "client.h"
+
+#include <pthread.h>
+
+
+
+/**
+ * The highest number of event loops that may be requested
+ */
+#define EVENT_LOOPS_MAX  256
+
+
+
+/**
+ * Create the event loops and start their threads
+ * 
+ * Nothing is done if `event_loop_count` is zero
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int event_loops_start(void);
+
+/**
+ * Wait for the event loops to exit and release their resources
+ * 
+ * The event loops exit when the server is terminating, or when
+ * the server is no longer running and they have no clients left
+ */
+void event_loops_destroy(void);
+
+/**
+ * Wake up all event loops so that they notice
+ * that the server is terminating or re-exec:ing
+ * 
+ * This function is async-signal-safe
+ */
+void event_loops_wake(void);
+
+/**
+ * Create a client for a newly accepted connection
+ * and hand it over to one of the event loops
+ * 
+ * @param   client_fd  The file descriptor of the client's socket
+ * @return             Zero on success, -1 on error
+ */
+int event_loop_accept(int client_fd);
+
+/**
+ * Hand over a client that has been unmarshalled
+ * after a re-exec to one of the event loops
+ * 
+ * @param   client  The client
+ * @return          Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int event_loop_resume(client_t *client);
+
+/**
+ * Close a client's socket, unlist it and free it, this is done
+ * when a client that has closed has had its multicast queue sent
+ * 
+ * @param  client  The client
+ */
+__attribute__((nonnull))
+void event_loop_finish_client(client_t *client);
+
+/**
+ * Select whether the event loop owning a client shall wait for the
+ * client's socket to become writable, this is used when a client has
+ * pending outbound data that could not be sent without blocking
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param  client    The client
+ * @param  writable  Whether to wait for the socket to become writable
+ */
+__attribute__((nonnull))
+void event_loop_want_write(client_t *client, int writable);
+
+
+#endif
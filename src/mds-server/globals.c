@@ -24,6 +24,29 @@
 volatile sig_atomic_t running = 1;
 
 
+/**
+ * The number of event loop threads, zero if
+ * each client is served by its own slave thread
+ */
+size_t event_loop_count = 0;
+
+/**
+ * The size, in bytes, above which a client's
+ * queue of pending messages is congested
+ */
+size_t queue_high_watermark = 4 << 20;
+
+/**
+ * The size, in bytes, to which a congested client's queue
+ * of pending messages must be reduced to not be congested
+ */
+size_t queue_low_watermark = 1 << 20;
+
+/**
+ * What to do with messages to clients whose queue is congested
+ */
+queue_policy_t queue_policy = QUEUE_POLICY_DROP;
+
 /**
  * The number of running slaves
  */
@@ -39,6 +62,14 @@ pthread_mutex_t slave_mutex;
  */
 pthread_cond_t slave_cond;
 
+/**
+ * Read–write lock for `client_map` and `client_list`, it is
+ * read-locked when clients are looked up, so that routing
+ * messages does not serialise the threads, and write-locked
+ * when clients are added or removed
+ */
+pthread_rwlock_t client_lock;
+
 /**
  * Map from client socket file descriptor to all information (`client_t`)
  */
@@ -47,15 +78,15 @@ fd_table_t client_map;
 /**
  * List of client information (`client_t`)
  */
-linked_list_t client_list;
+packed_list_t client_list;
 
 /**
- * The next free ID for a client
+ * The next free ID for a client, accessed atomically
  */
 uint64_t next_client_id = 1;
 
 /**
- * The next free ID for a message modifications
+ * The next free ID for a message modifications, accessed atomically
  */
 uint64_t next_modify_id = 1;
 
@@ -70,6 +101,7 @@ pthread_mutex_t modify_mutex;
 pthread_cond_t modify_cond;
 
 /**
- * Map from modification ID to waiting client
+ * Map from modification ID to the client whose
+ * multicast is waiting for the modification
  */
 hash_table_t modify_map;
@@ -21,7 +21,7 @@
 #include "../mds-base.h" /* Include here so other do not need to. */
 
 
-#include <libmdsserver/linked-list.h>
+#include <libmdsserver/packed-list.h>
 #include <libmdsserver/hash-table.h>
 #include <libmdsserver/fd-table.h>
 
@@ -31,7 +31,33 @@
 
 
 
-#define MDS_SERVER_VARS_VERSION 0
+#define MDS_SERVER_VARS_VERSION 1
+
+
+
+/**
+ * What to do with a message to a client
+ * whose outbound queue is congested
+ */
+typedef enum queue_policy {
+	/**
+	 * Messages the client may not modify are not sent
+	 */
+	QUEUE_POLICY_DROP,
+
+	/**
+	 * Messages the client may not modify replace the
+	 * last such message in the queue, if it has the
+	 * same ‘Command’ header, unless it has started
+	 * being sent
+	 */
+	QUEUE_POLICY_COALESCE,
+
+	/**
+	 * The client is disconnected
+	 */
+	QUEUE_POLICY_DISCONNECT
+} queue_policy_t;
 
 
 
@@ -41,6 +67,29 @@
 extern volatile sig_atomic_t running;
 
 
+/**
+ * The number of event loop threads, zero if
+ * each client is served by its own slave thread
+ */
+extern size_t event_loop_count;
+
+/**
+ * The size, in bytes, above which a client's
+ * queue of pending messages is congested
+ */
+extern size_t queue_high_watermark;
+
+/**
+ * The size, in bytes, to which a congested client's queue
+ * of pending messages must be reduced to not be congested
+ */
+extern size_t queue_low_watermark;
+
+/**
+ * What to do with messages to clients whose queue is congested
+ */
+extern queue_policy_t queue_policy;
+
 /**
  * The number of running slaves
  */
@@ -56,6 +105,14 @@ extern pthread_mutex_t slave_mutex;
  */
 extern pthread_cond_t slave_cond;
 
+/**
+ * Read–write lock for `client_map` and `client_list`, it is
+ * read-locked when clients are looked up, so that routing
+ * messages does not serialise the threads, and write-locked
+ * when clients are added or removed
+ */
+extern pthread_rwlock_t client_lock;
+
 /**
  * Map from client socket file descriptor to all information (`client_t`)
  */
@@ -64,15 +121,15 @@ extern fd_table_t client_map;
 /**
  * List of client information (`client_t`)
  */
-extern linked_list_t client_list;
+extern packed_list_t client_list;
 
 /**
- * The next free ID for a client
+ * The next free ID for a client, accessed atomically
  */
 extern uint64_t next_client_id;
 
 /**
- * The next free ID for a message modifications
+ * The next free ID for a message modifications, accessed atomically
  */
 extern uint64_t next_modify_id;
 
@@ -87,7 +144,8 @@ extern pthread_mutex_t modify_mutex;
 extern pthread_cond_t modify_cond;
 
 /**
- * Map from modification ID to waiting client
+ * Map from modification ID to the client whose
+ * multicast is waiting for the modification
  */
 extern hash_table_t modify_map;
 
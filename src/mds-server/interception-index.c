@@ -0,0 +1,766 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "interception-index.h"
+
+#include "interception-condition.h"
+
+#include <libmdsserver/hash-table.h>
+#include <libmdsserver/hash-help.h>
+#include <libmdsserver/macros.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+
+
+/**
+ * The clients that are interested in messages
+ * satisfying a specific interception condition
+ */
+typedef struct interested {
+	/**
+	 * The handles, in `client_list`, of the interested clients
+	 */
+	ssize_t *clients;
+
+	/**
+	 * The number of interested clients
+	 */
+	size_t count;
+
+	/**
+	 * The size of the allocation of `clients`
+	 */
+	size_t capacity;
+} interested_t;
+
+
+
+/**
+ * Map from header names to the clients that
+ * have the header name as an interception
+ * condition, the values are `interested_t*`
+ */
+static hash_table_t header_index;
+
+/**
+ * Map from header name–value pairs to the clients
+ * that have the pair as an interception condition,
+ * the values are `interested_t*`
+ */
+static hash_table_t pair_index;
+
+/**
+ * The clients that intercept all messages
+ */
+static interested_t wildcard;
+
+/**
+ * The index entries that a message matches, the recipients
+ * of each distinct combination are cached in `cache`
+ */
+typedef struct signature {
+	/**
+	 * The matched entries, sorted by address
+	 */
+	interested_t **entries;
+
+	/**
+	 * The number of elements in `entries`
+	 */
+	size_t count;
+
+	/**
+	 * The hash of `entries`
+	 */
+	size_t hash;
+} signature_t;
+
+
+
+/**
+ * The number of matched entries that a lookup
+ * can keep track of without allocating memory
+ */
+#define SIGNATURE_STACK_SIZE  32
+
+/**
+ * The number of cached recipient lists at which
+ * the cache is cleared rather than grown
+ */
+#define CACHE_MAX  1024
+
+
+
+/**
+ * Map from signatures (`signature_t*`) to the recipients
+ * (`recipients_t*`) of messages with the signatures,
+ * all entries are removed when a condition is added,
+ * removed or updated
+ */
+static hash_table_t cache;
+
+/**
+ * Incremented whenever `cache` is invalidated, so that
+ * recipient lists built from an older index are not cached
+ */
+static uint64_t version = 0;
+
+/**
+ * Read–write lock for `header_index`, `pair_index`, `wildcard`,
+ * `cache` and `version`, lookups only read-lock it so that
+ * they can run concurrently
+ * 
+ * Never lock `client_lock` or any client's
+ * mutex while this lock is held
+ */
+static pthread_rwlock_t index_lock;
+
+/**
+ * Whether `index_lock` has been initialised
+ */
+static int index_lock_created = 0;
+
+
+
+/**
+ * Check whether two keys in one of the indices are equal
+ * 
+ * @param   a  The address of one of the interception conditions
+ * @param   b  The address of the other interception condition
+ * @return     Whether the interception conditions are equal
+ */
+static int __attribute__((pure))
+condition_comparator(size_t a, size_t b)
+{
+	char *str_a = (void *)a;
+	char *str_b = (void *)b;
+	return (str_a == str_b) || (str_a && str_b && strequals(str_a, str_b));
+}
+
+
+/**
+ * Calculate the hash of a key in one of the indices
+ * 
+ * @param   obj  The address of the interception condition
+ * @return       The hash of the interception condition
+ */
+static size_t __attribute__((pure))
+condition_hash(size_t obj)
+{
+	return string_hash((void *)obj);
+}
+
+
+/**
+ * Free a key stored in one of the indices
+ * 
+ * @param  obj  The address of the interception condition
+ */
+static void
+free_condition(size_t obj)
+{
+	char *condition = (void *)obj;
+	free(condition);
+}
+
+
+/**
+ * Free an `interested_t*` stored in one of the indices
+ * 
+ * @param  obj  The address of the `interested_t`
+ */
+static void
+free_interested(size_t obj)
+{
+	interested_t *interested = (void *)obj;
+	if (interested)
+		free(interested->clients);
+	free(interested);
+}
+
+
+/**
+ * Get the index in which a condition is stored,
+ * `NULL` is returned if the condition is stored
+ * in `wildcard` rather than in a hash table
+ * 
+ * @param   condition  The interception condition
+ * @return             The hash table the condition is stored in
+ */
+static hash_table_t *__attribute__((nonnull, pure))
+index_of(char *condition)
+{
+	if (!*condition)
+		return NULL;
+	return strchr(condition, ':') ? &pair_index : &header_index;
+}
+
+
+/**
+ * Check whether two signatures are equal
+ * 
+ * @param   a  The address of one of the signatures
+ * @param   b  The address of the other signature
+ * @return     Whether the signatures are equal
+ */
+static int __attribute__((pure))
+signature_comparator(size_t a, size_t b)
+{
+	const signature_t *sig_a = (void *)a;
+	const signature_t *sig_b = (void *)b;
+	return (sig_a->hash == sig_b->hash) && (sig_a->count == sig_b->count) &&
+	       !memcmp(sig_a->entries, sig_b->entries, sig_a->count * sizeof(interested_t *));
+}
+
+
+/**
+ * Get the hash of a signature
+ * 
+ * @param   obj  The address of the signature
+ * @return       The hash of the signature
+ */
+static size_t __attribute__((pure))
+signature_hash(size_t obj)
+{
+	return ((const signature_t *)(void *)obj)->hash;
+}
+
+
+/**
+ * Free a signature
+ * 
+ * @param  obj  The address of the signature
+ */
+static void
+free_signature(size_t obj)
+{
+	signature_t *signature = (void *)obj;
+	if (signature)
+		free(signature->entries);
+	free(signature);
+}
+
+
+/**
+ * Release the cache's reference to a list of recipients
+ * 
+ * @param  obj  The address of the list of recipients
+ */
+static void
+release_recipients(size_t obj)
+{
+	recipients_release((void *)obj);
+}
+
+
+/**
+ * Remove all recipient lists from the cache
+ * 
+ * `index_lock` must be write-locked by the caller
+ */
+static void
+clear_cache(void)
+{
+	hash_entry_t *entry;
+	size_t i;
+
+	foreach_hash_table_entry (cache, i, entry) {
+		free_signature(entry->key);
+		release_recipients(entry->value);
+	}
+	hash_table_clear(&cache);
+}
+
+
+/**
+ * Remove all recipient lists from the cache, and prevent
+ * recipient lists that are being built from being cached,
+ * this is done whenever a condition is added, removed or updated
+ * 
+ * `index_lock` must be write-locked by the caller
+ */
+static void
+invalidate_cache(void)
+{
+	clear_cache();
+	version++;
+}
+
+
+/**
+ * Create the interception index
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int
+interception_index_create(void)
+{
+	fail_if ((errno = pthread_rwlock_init(&index_lock, NULL)));
+	index_lock_created = 1;
+
+	fail_if (hash_table_create(&header_index));
+	header_index.key_comparator = condition_comparator;
+	header_index.hasher = condition_hash;
+
+	fail_if (hash_table_create(&pair_index));
+	pair_index.key_comparator = condition_comparator;
+	pair_index.hasher = condition_hash;
+
+	fail_if (hash_table_create(&cache));
+	cache.key_comparator = signature_comparator;
+	cache.hasher = signature_hash;
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Release all resources in the interception index, should
+ * be done even if `interception_index_create` fails
+ */
+void
+interception_index_destroy(void)
+{
+	hash_table_destroy(&header_index, free_condition, free_interested);
+	hash_table_destroy(&pair_index, free_condition, free_interested);
+	hash_table_destroy(&cache, free_signature, release_recipients);
+	free(wildcard.clients);
+	memset(&header_index, 0, sizeof(header_index));
+	memset(&pair_index, 0, sizeof(pair_index));
+	memset(&cache, 0, sizeof(cache));
+	memset(&wildcard, 0, sizeof(wildcard));
+	if (index_lock_created)
+		pthread_rwlock_destroy(&index_lock);
+	index_lock_created = 0;
+}
+
+
+/**
+ * List a client as interested in messages satisfying an interception
+ * condition, this must only be done once per client and condition,
+ * and only while the client is listed in `client_list`
+ * 
+ * @param   client     The intercepting client
+ * @param   condition  The header, optionally with value, to look for, or empty for all messages
+ * @return             Zero on success, -1 on error
+ */
+int
+interception_index_add(client_t *client, char *condition)
+{
+	hash_table_t *table = index_of(condition);
+	interested_t *interested = &wildcard;
+	interested_t *new_interested = NULL;
+	char *key = NULL;
+	ssize_t *old;
+	size_t address;
+	int saved_errno;
+
+	if ((errno = pthread_rwlock_wrlock(&index_lock)))
+		return -1;
+
+	/* Get the list of interested clients, create it if missing. */
+	if (table) {
+		address = hash_table_get(table, (size_t)(void *)condition);
+		interested = (void *)address;
+	}
+	if (!interested) {
+		fail_if (xstrdup_nn(key, condition));
+		fail_if (xcalloc(new_interested, 1, interested_t));
+		errno = 0;
+		hash_table_put(table, (size_t)(void *)key, (size_t)(void *)new_interested);
+		fail_if (errno);
+		interested = new_interested;
+	}
+
+	/* List the client. */
+	if (!interested->capacity) {
+		fail_if (xmalloc(interested->clients, 4, ssize_t));
+		interested->capacity = 4;
+	} else if (interested->count == interested->capacity) {
+		fail_if (growalloc(old, interested->clients, interested->capacity, ssize_t));
+	}
+	interested->clients[interested->count++] = client->list_entry;
+	invalidate_cache();
+
+	pthread_rwlock_unlock(&index_lock);
+	return 0;
+fail:
+	saved_errno = errno;
+	if (new_interested && (interested == new_interested)) {
+		/* The list could not be populated, but it was created, unlist it. */
+		hash_table_remove(table, (size_t)(void *)key);
+		free(new_interested->clients);
+	}
+	pthread_rwlock_unlock(&index_lock);
+	free(new_interested);
+	free(key);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Unlist a client as interested in messages satisfying an interception condition
+ * 
+ * @param  client     The intercepting client
+ * @param  condition  The header, optionally with value, to look for, or empty for all messages
+ */
+void
+interception_index_remove(client_t *client, char *condition)
+{
+	hash_table_t *table = index_of(condition);
+	interested_t *interested = &wildcard;
+	hash_entry_t *entry = NULL;
+	char *key;
+	size_t i;
+
+	with_wrlock (index_lock,
+	             if (table) {
+	                     entry = hash_table_get_entry(table, (size_t)(void *)condition);
+	                     interested = entry ? (void *)(entry->value) : NULL;
+	             }
+	             if (interested) {
+	                     /* Unlist the client, the order is insignificant. */
+	                     for (i = 0; i < interested->count; i++)
+	                             if (interested->clients[i] == client->list_entry)
+	                                     break;
+	                     if (i < interested->count)
+	                             interested->clients[i] = interested->clients[--(interested->count)];
+
+	                     /* Forget about conditions that no one is using. */
+	                     if (entry && !interested->count) {
+	                             key = (void *)(entry->key);
+	                             hash_table_remove(table, entry->key);
+	                             free(key);
+	                             free_interested((size_t)(void *)interested);
+	                     }
+	             }
+	             invalidate_cache();
+	            );
+}
+
+
+/**
+ * Invalidate the cached recipient lists because a client
+ * has changed the priority of, or whether it may modify
+ * messages for, one of its interception conditions
+ */
+void
+interception_index_touch(void)
+{
+	with_wrlock (index_lock, invalidate_cache(););
+}
+
+
+/**
+ * List a client as interested in messages satisfying
+ * any of its interception conditions, this is used
+ * when the clients have been unmarshalled
+ * 
+ * @param   client  The intercepting client
+ * @return          Zero on success, -1 on error
+ */
+int
+interception_index_add_client(client_t *client)
+{
+	size_t i;
+	for (i = 0; i < client->interception_conditions_count; i++)
+		fail_if (interception_index_add(client, client->interception_conditions[i].condition));
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Unlist a client for all of its interception conditions,
+ * this must be done before the client is removed from
+ * `client_list` so that the client cannot be found by
+ * `interception_index_lookup` once it is freed
+ * 
+ * @param  client  The intercepting client
+ */
+void
+interception_index_remove_client(client_t *client)
+{
+	size_t i;
+	for (i = 0; i < client->interception_conditions_count; i++)
+		interception_index_remove(client, client->interception_conditions[i].condition);
+}
+
+
+/**
+ * Add an entry to a signature
+ * 
+ * @param   signature  The signature
+ * @param   capacity   Pointer to the number of elements that fit in `signature->entries`
+ * @param   stack      The initial, stack-allocated, buffer of `signature->entries`
+ * @param   entry      The entry to add, nothing is done if `NULL` or if it has no clients
+ * @return             Zero on success, -1 on error
+ */
+static int __attribute__((nonnull(1, 2, 3)))
+add_to_signature(signature_t *signature, size_t *capacity, interested_t **stack, interested_t *entry)
+{
+	interested_t **new_entries;
+
+	if (!entry || !entry->count)
+		return 0;
+
+	if (signature->count == *capacity) {
+		if (signature->entries == stack) {
+			fail_if (xmalloc(new_entries, *capacity << 1, interested_t *));
+			memcpy(new_entries, stack, *capacity * sizeof(interested_t *));
+			signature->entries = new_entries;
+			*capacity <<= 1;
+		} else {
+			fail_if (growalloc(new_entries, signature->entries, *capacity, interested_t *));
+		}
+	}
+	signature->entries[signature->count++] = entry;
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Compare two pointers by address
+ * 
+ * @param   a  Pointer to one of the pointers
+ * @param   b  Pointer to the other pointer
+ * @return     Negative if `a` is before `b`, positive if `a` is after `b`, otherwise zero
+ */
+static int __attribute__((pure, nonnull))
+cmp_address(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)*(void *const *)a;
+	uintptr_t y = (uintptr_t)*(void *const *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Sort a list of pointers by address and remove duplicates
+ * 
+ * @param   list  The list
+ * @param   n     The number of elements in `list`
+ * @return        The number of unique elements in `list`
+ */
+static size_t __attribute__((nonnull))
+sort_unique(void **list, size_t n)
+{
+	size_t i, j;
+	if (n < 2)
+		return n;
+	qsort(list, n, sizeof(void *), cmp_address);
+	for (i = j = 1; i < n; i++)
+		if (list[i] != list[j - 1])
+			list[j++] = list[i];
+	return j;
+}
+
+
+/**
+ * Compare two handles
+ * 
+ * @param   a  Pointer to one of the handles
+ * @param   b  Pointer to the other handle
+ * @return     Negative if `a` is before `b`, positive if `a` is after `b`, otherwise zero
+ */
+static int __attribute__((pure, nonnull))
+cmp_handle(const void *a, const void *b)
+{
+	ssize_t x = *(const ssize_t *)a;
+	ssize_t y = *(const ssize_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Sort a list of handles and remove duplicates
+ * 
+ * @param   list  The list
+ * @param   n     The number of elements in `list`
+ * @return        The number of unique elements in `list`
+ */
+static size_t __attribute__((nonnull))
+sort_unique_handles(ssize_t *list, size_t n)
+{
+	size_t i, j;
+	if (n < 2)
+		return n;
+	qsort(list, n, sizeof(ssize_t), cmp_handle);
+	for (i = j = 1; i < n; i++)
+		if (list[i] != list[j - 1])
+			list[j++] = list[i];
+	return j;
+}
+
+
+/**
+ * Look up the clients that may intercept a message
+ * 
+ * If the index has not changed since a message with the
+ * same matching interception conditions was multicast,
+ * the recipients of that message are returned. Otherwise
+ * the clients that have at least one of the matching
+ * conditions are returned, each client once, but the caller
+ * must check which of the client's conditions match, and
+ * then pass the list of recipients to `interception_index_cache`
+ * 
+ * `client_lock` must be read-locked by the caller
+ * 
+ * @param   keys            The header names
+ * @param   headers         The header name–value pairs
+ * @param   count           The number of accepted patterns
+ * @param   recipients_out  Output parameter for the cached recipients, with a reference
+ *                          that the caller must release, `NULL` if not cached
+ * @param   lookup          Output parameter for the found clients, if
+ *                          the recipients are not cached, `lookup->signature`
+ *                          is `NULL` if no condition matches the message
+ * @return                  Zero on success, -1 on error
+ */
+int
+interception_index_lookup(char **keys, char **headers, size_t count,
+                          recipients_t **recipients_out, interception_lookup_t *lookup)
+{
+	interested_t *stack[SIGNATURE_STACK_SIZE];
+	signature_t signature = { .entries = stack, .count = 0, .hash = 0 };
+	size_t i, n = 0, capacity = SIGNATURE_STACK_SIZE, address;
+	recipients_t *recipients;
+	signature_t *saved = NULL;
+	ssize_t *out = NULL;
+	int saved_errno, locked = 0;
+
+	*recipients_out = NULL;
+	memset(lookup, 0, sizeof(*lookup));
+
+	fail_if ((errno = pthread_rwlock_rdlock(&index_lock)));
+	locked = 1;
+
+	/* Find the matching conditions. Wildcard conditions
+	   are only satisfied by messages with headers. */
+	if (count)
+		fail_if (add_to_signature(&signature, &capacity, stack, &wildcard));
+	for (i = 0; i < count; i++) {
+		address = hash_table_get(&header_index, (size_t)(void *)(keys[i]));
+		fail_if (add_to_signature(&signature, &capacity, stack, (void *)address));
+		address = hash_table_get(&pair_index, (size_t)(void *)(headers[i]));
+		fail_if (add_to_signature(&signature, &capacity, stack, (void *)address));
+	}
+	if (!signature.count)
+		goto done;
+	signature.count = sort_unique((void **)(signature.entries), signature.count);
+	for (i = 0; i < signature.count; i++)
+		signature.hash = signature.hash * 31 + (size_t)(uintptr_t)(signature.entries[i]);
+
+	/* Use the cached recipients if available. */
+	address = hash_table_get(&cache, (size_t)(void *)&signature);
+	if ((recipients = (void *)address)) {
+		__atomic_add_fetch(&(recipients->references), 1, __ATOMIC_RELAXED);
+		*recipients_out = recipients;
+		goto done;
+	}
+
+	/* Otherwise, list the clients that have any of the matching conditions. */
+	for (i = 0; i < signature.count; i++)
+		n += signature.entries[i]->count;
+	fail_if (xmalloc(out, n, ssize_t));
+	for (i = n = 0; i < signature.count; i++) {
+		memcpy(out + n, signature.entries[i]->clients, signature.entries[i]->count * sizeof(ssize_t));
+		n += signature.entries[i]->count;
+	}
+
+	/* Keep the signature, so that the recipients can be cached. */
+	fail_if (xmalloc(saved, 1, signature_t));
+	*saved = signature;
+	if (signature.entries == stack)
+		fail_if (xmemdup(saved->entries, stack, signature.count, interested_t *));
+	signature.entries = stack;
+	lookup->version = version;
+
+	pthread_rwlock_unlock(&index_lock);
+	locked = 0;
+
+	/* List each client once. This is done without marking the clients,
+	   so that concurrent lookups do not write to shared memory. */
+	lookup->candidates = out;
+	lookup->candidates_count = sort_unique_handles(out, n);
+	lookup->signature = saved;
+	return 0;
+
+done:
+	pthread_rwlock_unlock(&index_lock);
+	if (signature.entries != stack)
+		free(signature.entries);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (locked)
+		pthread_rwlock_unlock(&index_lock);
+	if (signature.entries != stack)
+		free(signature.entries);
+	free(saved);
+	free(out);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Cache the recipients of a message, found with the help of
+ * `interception_index_lookup`, unless the index has changed,
+ * and release the resources in the result of the lookup
+ * 
+ * @param  lookup      The result of `interception_index_lookup`
+ * @param  recipients  The recipients of the message, `NULL` if they
+ *                     could not be determined, the cache takes
+ *                     its own reference if they are cached
+ */
+void
+interception_index_cache(interception_lookup_t *lookup, recipients_t *recipients)
+{
+	signature_t *signature = lookup->signature;
+	size_t address = (size_t)(void *)signature;
+
+	free(lookup->candidates);
+
+	if (signature && recipients) {
+		with_wrlock (index_lock,
+		             if ((lookup->version != version) || hash_table_contains_key(&cache, address))
+		                     break;
+		             if (cache.size >= CACHE_MAX)
+		                     clear_cache();
+		             errno = 0;
+		             hash_table_put(&cache, address, (size_t)(void *)recipients);
+		             if (errno)
+		                     break;
+		             __atomic_add_fetch(&(recipients->references), 1, __ATOMIC_RELAXED);
+		             signature = NULL;
+		            );
+	}
+
+	free_signature((size_t)(void *)signature);
+	memset(lookup, 0, sizeof(*lookup));
+}
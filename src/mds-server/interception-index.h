@@ -0,0 +1,165 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_MDS_SERVER_INTERCEPTION_INDEX_H
+#define MDS_MDS_SERVER_INTERCEPTION_INDEX_H
+
+
+#include "client.h"
+#include "queued-interception.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/**
+ * The result of `interception_index_lookup` when
+ * the recipients of the message are not cached
+ */
+typedef struct interception_lookup {
+	/**
+	 * The handles, in `client_list`, of the clients that
+	 * have any of the interception conditions that match
+	 * the message
+	 */
+	ssize_t *candidates;
+
+	/**
+	 * The number of elements in `candidates`
+	 */
+	size_t candidates_count;
+
+	/**
+	 * The interception conditions that match the message, `NULL`
+	 * if there are none, in which case there are no candidates
+	 */
+	struct signature *signature;
+
+	/**
+	 * The version of the index that the lookup was made in
+	 */
+	uint64_t version;
+} interception_lookup_t;
+
+
+
+/**
+ * Create the interception index
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int interception_index_create(void);
+
+/**
+ * Release all resources in the interception index, should
+ * be done even if `interception_index_create` fails
+ */
+void interception_index_destroy(void);
+
+/**
+ * List a client as interested in messages satisfying an interception
+ * condition, this must only be done once per client and condition,
+ * and only while the client is listed in `client_list`
+ * 
+ * @param   client     The intercepting client
+ * @param   condition  The header, optionally with value, to look for, or empty for all messages
+ * @return             Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int interception_index_add(client_t *client, char *condition);
+
+/**
+ * Unlist a client as interested in messages satisfying an interception condition
+ * 
+ * @param  client     The intercepting client
+ * @param  condition  The header, optionally with value, to look for, or empty for all messages
+ */
+__attribute__((nonnull))
+void interception_index_remove(client_t *client, char *condition);
+
+/**
+ * List a client as interested in messages satisfying
+ * any of its interception conditions, this is used
+ * when the clients have been unmarshalled
+ * 
+ * @param   client  The intercepting client
+ * @return          Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int interception_index_add_client(client_t *client);
+
+/**
+ * Unlist a client for all of its interception conditions,
+ * this must be done before the client is removed from
+ * `client_list` so that the client cannot be found by
+ * `interception_index_lookup` once it is freed
+ * 
+ * @param  client  The intercepting client
+ */
+__attribute__((nonnull))
+void interception_index_remove_client(client_t *client);
+
+/**
+ * Invalidate the cached recipient lists because a client
+ * has changed the priority of, or whether it may modify
+ * messages for, one of its interception conditions
+ */
+void interception_index_touch(void);
+
+/**
+ * Look up the clients that may intercept a message
+ * 
+ * If the index has not changed since a message with the
+ * same matching interception conditions was multicast,
+ * the recipients of that message are returned. Otherwise
+ * the clients that have at least one of the matching
+ * conditions are returned, each client once, but the caller
+ * must check which of the client's conditions match, and
+ * then pass the list of recipients to `interception_index_cache`
+ * 
+ * `client_lock` must be read-locked by the caller
+ * 
+ * @param   keys            The header names
+ * @param   headers         The header name–value pairs
+ * @param   count           The number of accepted patterns
+ * @param   recipients_out  Output parameter for the cached recipients, with a reference
+ *                          that the caller must release, `NULL` if not cached
+ * @param   lookup          Output parameter for the found clients, if
+ *                          the recipients are not cached, `lookup->signature`
+ *                          is `NULL` if no condition matches the message
+ * @return                  Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int interception_index_lookup(char **keys, char **headers, size_t count,
+                              recipients_t **recipients_out, interception_lookup_t *lookup);
+
+/**
+ * Cache the recipients of a message, found with the help of
+ * `interception_index_lookup`, unless the index has changed,
+ * and release the resources in the result of the lookup
+ * 
+ * @param  lookup      The result of `interception_index_lookup`
+ * @param  recipients  The recipients of the message, `NULL` if they
+ *                     could not be determined, the cache takes
+ *                     its own reference if they are cached
+ */
+__attribute__((nonnull(1)))
+void interception_index_cache(interception_lookup_t *lookup, recipients_t *recipients);
+
+
+#endif
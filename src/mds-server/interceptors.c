@@ -21,13 +21,17 @@
 #include "interception-condition.h"
 #include "client.h"
 #include "queued-interception.h"
+#include "interception-index.h"
+#include "slavery.h"
 
 #include <libmdsserver/macros.h>
 #include <libmdsserver/hash-help.h>
+#include <libmdsserver/packed-list.h>
 
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 
@@ -45,9 +49,11 @@ remove_intercept_condition(client_t *client, size_t index)
 	size_t n = client->interception_conditions_count;
 
 	/* Remove the condition from the list. */
+	interception_index_remove(client, conds[index].condition);
 	free(conds[index].condition);
-	memmove(conds + index, conds + index + 1, --n - index);
+	memmove(conds + index, conds + index + 1, (--n - index) * sizeof(interception_condition_t));
 	client->interception_conditions_count--;
+	update_client_summary(client);
 
 	/* Shrink the list. */
 	if (!client->interception_conditions_count) {
@@ -114,6 +120,7 @@ add_intercept_condition(client_t *client, char *condition, int64_t priority, int
 			/* Update parameters. */
 			conds[i].priority = priority;
 			conds[i].modifying = modifying;
+			interception_index_touch();
 
 			if (modifying && nonmodifying >= 0) {
 				/* Optimisation: put conditions that are modifying
@@ -139,8 +146,11 @@ add_intercept_condition(client_t *client, char *condition, int64_t priority, int
 		/* Grow the interception condition list. */
 		fail_if (xrealloc(conds, n + 1, interception_condition_t));
 		client->interception_conditions = conds; 
+		/* Let the client be found when routing messages. */
+		fail_if (interception_index_add(client, condition));
 		/* Store condition. */
 		client->interception_conditions_count++;
+		update_client_summary(client);
 		conds[n].condition = condition;
 		conds[n].header_hash = hash;
 		conds[n].priority = priority;
@@ -209,11 +219,11 @@ int
 find_matching_condition(client_t *client, size_t *hashes, char **keys, char **headers,
                         size_t count, queued_interception_t *interception_out)
 {
-	pthread_mutex_t mutex = client->mutex;
-	interception_condition_t *conds = client->interception_conditions;
+	interception_condition_t *conds;
 	size_t n = 0, i;
 
-	fail_if ((errno = pthread_mutex_lock(&(mutex))));
+	fail_if ((errno = pthread_mutex_lock(&(client->mutex))));
+	conds = client->interception_conditions;
 
 	/* Look for a matching condition. */
 	if (client->open)
@@ -222,13 +232,14 @@ find_matching_condition(client_t *client, size_t *hashes, char **keys, char **he
 		if (is_condition_matching(conds + i, hashes, keys, headers, count)) {
 			/* Report matching condition. */
 			interception_out->client    = client;
+			interception_out->socket_fd = client->socket_fd;
 			interception_out->priority  = conds[i].priority;
 			interception_out->modifying = conds[i].modifying;
 			break;
 		}
 	}
 
-	pthread_mutex_unlock(&mutex);
+	pthread_mutex_unlock(&(client->mutex));
 
 	return i < n;
 fail:
@@ -237,53 +248,92 @@ fail:
 
 
 /**
- * Get all interceptors who have at least one condition matching any of a set of acceptable patterns
+ * Compare two queued interceptors by priority
  * 
- * @param   sender                   The original sender of the message
- * @param   hashes                   The hashes of the accepted header names
- * @param   keys                     The header names
- * @param   headers                  The header name–value pairs
- * @param   count                    The number of accepted patterns
- * @param   interceptions_count_out  Slot at where to store the number of found interceptors
- * @return                           The found interceptors, `NULL` on error
+ * @param   a:const queued_interception_t*  One of the interceptors
+ * @param   b:const queued_interception_t*  The other of the two interceptors
+ * @return                                  Negative if a before b, positive if a after b, otherwise zero
  */
-queued_interception_t *
-get_interceptors(client_t *sender, size_t *hashes, char **keys, char **headers,
-                 size_t count, size_t *interceptions_count_out)
+static int __attribute__((nonnull))
+cmp_queued_interception(const void *a, const void *b)
 {
-	queued_interception_t *interceptions = NULL;
-	size_t interceptions_count = 0, n = 0;
-	ssize_t node;
+	const queued_interception_t *p = b; /* Highest first, so swap them. */
+	const queued_interception_t *q = a;
+	return p->priority < q->priority ? -1 : p->priority > q->priority;
+}
+
+
+/**
+ * Get all interceptors who have at least one condition matching any
+ * of a set of acceptable patterns, sorted by priority, highest first
+ * 
+ * The list is shared with other messages with the same matching
+ * conditions, and may include the sender of the message
+ * 
+ * `client_lock` must be read-locked by the caller
+ * 
+ * @param   hashes          The hashes of the accepted header names
+ * @param   keys            The header names
+ * @param   headers         The header name–value pairs
+ * @param   count           The number of accepted patterns
+ * @param   recipients_out  Output parameter for the found interceptors, with a
+ *                          reference that the caller must release, `NULL`
+ *                          if no condition matches
+ * @return                  Zero on success, -1 on error
+ */
+int
+get_interceptors(size_t *hashes, char **keys, char **headers, size_t count, recipients_t **recipients_out)
+{
+	interception_lookup_t lookup;
+	recipients_t *recipients = NULL;
+	size_t n = 0, i;
+	client_summary_t *summary;
 	int saved_errno, r;
 	client_t *client;
+	ssize_t handle;
 
-	/* Count clients. */
-	foreach_linked_list_node (client_list, node)
-		n++;
+	/* Use the interceptors found for an earlier message if possible,
+	   otherwise find the clients that have a condition that may match,
+	   rather than testing every condition of every client. */
+	fail_if (interception_index_lookup(keys, headers, count, recipients_out, &lookup));
+	if (*recipients_out || !lookup.signature)
+		return 0;
 
 	/* Allocate interceptor list. */
-	fail_if (xmalloc(interceptions, n, queued_interception_t));
+	fail_if (xbmalloc(recipients, sizeof(recipients_t) + lookup.candidates_count * sizeof(queued_interception_t)));
+	recipients->references = 1;
+
+	/* Search the candidates. */
+	for (i = 0; i < lookup.candidates_count; i++) {
+		handle = lookup.candidates[i];
 
-	/* Search clients. */
-	foreach_linked_list_node (client_list, node) {
-		client = (void *)(client_list.values[node]);
+		/* Skip closed clients using their records in the client
+		   list, so that they do not have to be visited. */
+		summary = packed_list_record(&client_list, handle);
+		if (!__atomic_load_n(&(summary->open), __ATOMIC_RELAXED))
+			continue;
 
 		/* Look for and list a matching condition. */
-		if (client->open && (client != sender)) {
-			r = find_matching_condition(client, hashes, keys, headers, count,
-			                            interceptions + interceptions_count);
-			fail_if (r == -1);
-			if (r)
-				/* List client of there was a matching condition. */
-				interceptions_count++;
-		}
+		client = (void *)packed_list_get(&client_list, handle);
+		r = find_matching_condition(client, hashes, keys, headers, count,
+		                            recipients->interceptions + n);
+		fail_if (r == -1);
+		if (r)
+			/* List client of there was a matching condition. */
+			n++;
 	}
+	recipients->count = n;
 
-	*interceptions_count_out = interceptions_count;
-	return interceptions;
+	/* Sort interceptors, this is only done when the interceptors have changed. */
+	qsort(recipients->interceptions, n, sizeof(queued_interception_t), cmp_queued_interception);
+
+	interception_index_cache(&lookup, recipients);
+	*recipients_out = recipients;
+	return 0;
 
 fail:
 	saved_errno = errno;
-	free(interceptions);
-	return errno = saved_errno, NULL;
+	interception_index_cache(&lookup, NULL);
+	free(recipients);
+	return errno = saved_errno, -1;
 }
@@ -72,18 +72,24 @@ int find_matching_condition(client_t *client, size_t *hashes, char **keys, char
 
 
 /**
- * Get all interceptors who have at least one condition matching any of a set of acceptable patterns
+ * Get all interceptors who have at least one condition matching any
+ * of a set of acceptable patterns, sorted by priority, highest first
  * 
- * @param   sender                   The original sender of the message
- * @param   hashes                   The hashes of the accepted header names
- * @param   keys                     The header names
- * @param   headers                  The header name–value pairs
- * @param   count                    The number of accepted patterns
- * @param   interceptions_count_out  Slot at where to store the number of found interceptors
- * @return                           The found interceptors, `NULL` on error
+ * The list is shared with other messages with the same matching
+ * conditions, and may include the sender of the message
+ * 
+ * `client_lock` must be read-locked by the caller
+ * 
+ * @param   hashes          The hashes of the accepted header names
+ * @param   keys            The header names
+ * @param   headers         The header name–value pairs
+ * @param   count           The number of accepted patterns
+ * @param   recipients_out  Output parameter for the found interceptors, with a
+ *                          reference that the caller must release, `NULL`
+ *                          if no condition matches
+ * @return                  Zero on success, -1 on error
  */
-__attribute__((pure, nonnull(1, 6)))
-queued_interception_t *get_interceptors(client_t *sender, size_t *hashes, char **keys, char **headers,
-                                        size_t count, size_t *interceptions_count_out);
+__attribute__((nonnull(5)))
+int get_interceptors(size_t *hashes, char **keys, char **headers, size_t count, recipients_t **recipients_out);
 
 #endif
@@ -26,9 +26,11 @@
 #include "sending.h"
 #include "slavery.h"
 #include "receiving.h"
+#include "event-loop.h"
+#include "interception-index.h"
 
 #include <libmdsserver/config.h>
-#include <libmdsserver/linked-list.h>
+#include <libmdsserver/packed-list.h>
 #include <libmdsserver/hash-table.h>
 #include <libmdsserver/fd-table.h>
 #include <libmdsserver/macros.h>
@@ -68,8 +70,10 @@ server_characteristics_t server_characteristics = {
 	if (I >  2) pthread_mutex_destroy(&modify_mutex);\
 	if (I >  3) pthread_cond_destroy(&modify_cond);\
 	if (I >= 4) hash_table_destroy(&modify_map, NULL, NULL);\
-	if (I >= 5) fd_table_destroy(&client_map, NULL, NULL);\
-	if (I >= 6) linked_list_destroy(&client_list)
+	if (I >= 5) interception_index_destroy();\
+	if (I >  6) pthread_rwlock_destroy(&client_lock);\
+	if (I >= 7) fd_table_destroy(&client_map, NULL, NULL);\
+	if (I >= 8) packed_list_destroy(&client_list)
 
 #define error_if(I, CONDITION)\
 	if (CONDITION) { xperror(*argv); __free(I); return 1; }
@@ -87,7 +91,7 @@ preinitialise_server(void)
 	int unparsed_args_ptr = 1;
 	char *unparsed_args[ARGC_LIMIT + LIBEXEC_ARGC_EXTRA_LIMIT + 1];
 	char *arg;
-	int i;
+	int i, loops, bytes, low_given = 0;
 	pid_t pid;
 
 #if (LIBEXEC_ARGC_EXTRA_LIMIT < 3)
@@ -105,6 +109,26 @@ preinitialise_server(void)
 			         eprintf("invalid value for %s: %s.", "--socket-fd", arg););
 		} else if (startswith(arg, "--alarm=")) { /* Schedule an alarm signal for forced abort. */
 			alarm((unsigned)min(atou(arg + strlen("--alarm=")), 60)); /* At most 1 minute. */
+		} else if (startswith(arg, "--event-loops=")) { /* Serve clients from event loops. */
+			exit_if (strict_atoi(arg += strlen("--event-loops="), &loops, 1, EVENT_LOOPS_MAX) < 0,
+			         eprintf("invalid value for %s: %s.", "--event-loops", arg););
+			event_loop_count = (size_t)loops;
+		} else if (startswith(arg, "--queue-high=")) { /* Size at which outbound queues become congested. */
+			exit_if (strict_atoi(arg += strlen("--queue-high="), &bytes, 1, INT_MAX) < 0,
+			         eprintf("invalid value for %s: %s.", "--queue-high", arg););
+			queue_high_watermark = (size_t)bytes;
+		} else if (startswith(arg, "--queue-low=")) { /* Size at which outbound queues stop being congested. */
+			exit_if (strict_atoi(arg += strlen("--queue-low="), &bytes, 0, INT_MAX) < 0,
+			         eprintf("invalid value for %s: %s.", "--queue-low", arg););
+			queue_low_watermark = (size_t)bytes;
+			low_given = 1;
+		} else if (startswith(arg, "--queue-policy=")) { /* What to do when an outbound queue is congested. */
+			arg += strlen("--queue-policy=");
+			if      (strequals(arg, "drop"))        queue_policy = QUEUE_POLICY_DROP;
+			else if (strequals(arg, "coalesce"))    queue_policy = QUEUE_POLICY_COALESCE;
+			else if (strequals(arg, "disconnect"))  queue_policy = QUEUE_POLICY_DISCONNECT;
+			else
+				exit_if (1, eprintf("invalid value for %s: %s.", "--queue-policy", arg););
 		} else if (!strequals(arg, "--initial-spawn") && !strequals(arg, "--respawn")) {
 				/* Not recognised, it is probably for another server. */
 				unparsed_args[unparsed_args_ptr++] = arg;
@@ -115,6 +139,12 @@ preinitialise_server(void)
 	/* Check that mandatory arguments have been specified. */
 	exit_if (socket_fd < 0, eprint("missing socket file descriptor argument."););
 
+	/* A queue cannot stop being congested at a size where it is congested. */
+	if (!low_given && queue_low_watermark > queue_high_watermark)
+		queue_low_watermark = queue_high_watermark / 4;
+	exit_if (queue_low_watermark > queue_high_watermark,
+	         eprintf("the value of %s is greater than the value of %s.", "--queue-low", "--queue-high"););
+
 
 	/* Run mdsinitrc. */
 	if (!is_respawn) {
@@ -135,10 +165,18 @@ preinitialise_server(void)
 	error_if (0, (errno = pthread_mutex_init(&slave_mutex, NULL)));
 	error_if (1, (errno = pthread_cond_init(&slave_cond, NULL)));
 
-	/* Create mutex, condition and map for message modification. */
+	/* Create mutex, condition and map for message modification. The map
+	   grows incrementally, so that no single multicast has to wait for all
+	   of its entries to be moved. */
 	error_if (2, (errno = pthread_mutex_init(&modify_mutex, NULL)));
 	error_if (3, (errno = pthread_cond_init(&modify_cond, NULL)));
-	error_if (4, hash_table_create(&modify_map));
+	error_if (4, hash_table_create_fine_tuned(&modify_map, 16, 0.75f, HASH_TABLE_INCREMENTAL_REHASH));
+
+	/* Create the index used to find intercepting clients. */
+	error_if (5, interception_index_create());
+
+	/* Create lock for the list and table of clients. */
+	error_if (6, (errno = pthread_rwlock_init(&client_lock, NULL)));
 
 
 	return 0;
@@ -159,8 +197,8 @@ int
 initialise_server(void)
 {
 	/* Create list and table of clients. */
-	error_if (5, fd_table_create(&client_map));
-	error_if (6, linked_list_create(&client_list, 32));
+	error_if (7, fd_table_create(&client_map));
+	error_if (8, packed_list_create_with_records(&client_list, 32, sizeof(client_summary_t)));
 
 	return 0;
 }
@@ -172,11 +210,27 @@ initialise_server(void)
  * 
  * @return  Non-zero on error
  */
-int __attribute__((const))
+int
 postinitialise_server(void)
 {
-	/* We do not need to initialise anything else. */
+	size_t i;
+
+	/* We do not need to initialise anything else
+	   unless the clients are served by event loops. */
+	if (!event_loop_count)
+		return 0;
+
+	/* Start the event loops, and hand over
+	   the clients we had before the re-exec. */
+	fail_if (event_loops_start());
+	foreach_packed_list_value (client_list, i)
+		if (event_loop_resume((client_t *)(void *)(client_list.values[i])))
+			xperror(*argv);
+
 	return 0;
+fail:
+	xperror(*argv);
+	return 1;
 }
 
 
@@ -192,14 +246,15 @@ master_loop(void)
 	while (running && !terminating) {
 		if (danger) {
 			danger = 0;
-			with_mutex (slave_mutex, linked_list_pack(&client_list););
+			with_wrlock (client_lock, packed_list_pack(&client_list););
 		}
 
 		if (accept_connection() == 1)
 			break;
 	}
 
-	/* Join with all slaves threads. */
+	/* Join with the event loops, and then with all slaves threads. */
+	event_loops_destroy();
 	with_mutex (slave_mutex,
 	            while (running_slaves > 0)
 	                    pthread_cond_wait(&slave_cond, &slave_mutex););
@@ -218,7 +273,8 @@ master_loop(void)
 
 
 /**
- * Accept an incoming and start a slave thread for it
+ * Accept an incoming and start a slave thread for it,
+ * or hand it over to an event loop
  * 
  * @return  Zero normally, 1 if terminating
  */
@@ -230,7 +286,10 @@ accept_connection(void)
 
 	/* Accept connection. */
 	client_fd = accept(socket_fd, NULL, NULL);
-	if (client_fd >= 0) {
+	if (client_fd >= 0 && event_loop_count) {
+		/* Let an event loop serve the client. */
+		event_loop_accept(client_fd);
+	} else if (client_fd >= 0) {
 		/* Increase number of running slaves. */
 		with_mutex (slave_mutex, running_slaves++;);
 
@@ -263,6 +322,7 @@ slave_loop(void *data)
 	client_t *information = (void *)information_address;
 	char *msgbuf = NULL;
 	char buf[] = "To: all";
+	sigset_t wake_set, wait_mask;
 	size_t n;
 	int r;
 
@@ -281,6 +341,13 @@ slave_loop(void *data)
 	/* Set up traps for especially handled signals. */
 	fail_if (trap_signals() < 0);
 
+	/* SIGRTMIN is sent to the slave when a message is queued for the client, it is
+	   only unblocked while waiting for the socket so that it cannot be missed. */
+	sigemptyset(&wake_set);
+	sigaddset(&wake_set, SIGRTMIN);
+	fail_if ((errno = pthread_sigmask(SIG_BLOCK, &wake_set, &wait_mask)));
+	sigdelset(&wait_mask, SIGRTMIN);
+
 
 	/* Fetch messages from the slave. */
 	while (!terminating && information->open) {
@@ -290,6 +357,15 @@ slave_loop(void *data)
 		/* Send queued messages. */
 		send_reply_queue(information);
 
+		/* Wait for a message, or for queued messages to be sendable. */
+		r = wait_for_client(information, &wait_mask);
+		if (r < 0 && errno == EINTR && terminating)
+			goto terminate; /* Stop the thread if we are re-exec:ing or terminating the server. */
+		else if (r < 0 && errno != EINTR)
+			goto fail;
+		else if (r <= 0)
+			continue;
+
 		/* Fetch message. */
 		r = fetch_message(information);
 		if (!r && message_received(information))
@@ -323,18 +399,37 @@ terminate: /* This done on success as well. */
 		goto reexec;
 
 done:
-	/* Close socket and free resources. */
-	xclose(slave_fd);
 	free(msgbuf);
 	if (information) {
-		/* Unlist and free client. */
-		with_mutex (slave_mutex, linked_list_remove(&client_list, information->list_entry););
+		/* Resume multicasts waiting for the client to reply, and
+		   wait for the client's own multicasts to be sent. */
+		if (information->modify_cond_created) {
+			with_mutex (information->mutex, information->open = 0;);
+			update_client_summary(information);
+			multicast_recipient_closed(information);
+			wait_for_multicast_queue(information);
+		}
+
+		/* Unlist and unmap the client, before the socket is closed
+		   so that a new client with the same file descriptor
+		   cannot be unmapped by mistake. */
+		interception_index_remove_client(information);
+		with_wrlock (client_lock,
+		             packed_list_remove(&client_list, information->list_entry);
+		             information->list_entry = -1;
+		             fd_table_remove(&client_map, slave_fd););
+
+		/* Free the client once no thread is sending a message to it. */
+		if (information->modify_cond_created)
+			wait_for_multicast_senders(information);
 		client_destroy(information);
+	} else {
+		with_wrlock (client_lock, fd_table_remove(&client_map, slave_fd););
 	}
 
-	/* Unmap client and decrease the slave count. */
+	/* Close socket and decrease the slave count. */
+	xclose(slave_fd);
 	with_mutex (slave_mutex,
-	            fd_table_remove(&client_map, slave_fd);
 	            running_slaves--;
 	            pthread_cond_signal(&slave_cond););
 	return NULL;
@@ -358,19 +453,19 @@ reexec:
 
 
 /**
- * Compare two queued interceptors by priority
- * 
- * @param   a:const queued_interception_t*  One of the interceptors
- * @param   b:const queued_interception_t*  The other of the two interceptors
- * @return                                  Negative if a before b, positive if a after b, otherwise zero
+ * The number of headers a message may have for
+ * its header lists to be allocated on the stack
+ * when the message is multicast
  */
-static int __attribute__((nonnull))
-cmp_queued_interception(const void *a, const void *b)
-{
-	const queued_interception_t *p = b; /* Highest first, so swap them. */
-	const queued_interception_t *q = a;
-	return p->priority < q->priority ? -1 : p->priority > q->priority;
-}
+#define HEADERS_STACK_SIZE  16
+
+/**
+ * The total length of the header names of a message,
+ * including NUL-termination, for which the buffer of
+ * header names is allocated on the stack when the
+ * message is multicast
+ */
+#define NAMES_STACK_SIZE  512
 
 
 /**
@@ -383,21 +478,22 @@ cmp_queued_interception(const void *a, const void *b)
 void
 queue_message_multicast(char *message, size_t length, client_t *sender)
 {
+	size_t hashes_stack[HEADERS_STACK_SIZE];
+	char *headers_stack[2 * HEADERS_STACK_SIZE];
+	char names_stack[NAMES_STACK_SIZE];
 	char *msg = message;
 	size_t header_count = 0;
 	size_t n = length - 1;
-	size_t *hashes = NULL;
-	char **headers = NULL;
-	char **header_values = NULL;
-	queued_interception_t *interceptions = NULL;
-	size_t interceptions_count = 0;
-	multicast_t *multicast = NULL;
+	size_t *hashes = hashes_stack;
+	char **headers = headers_stack;
+	char **header_values;
+	char *names = names_stack;
+	recipients_t *recipients = NULL;
+	multicast_t multicast;
 	size_t i;
 	uint64_t modify_id;
-	char modify_id_header[13 + 3 * sizeof(uint64_t)];
-	void *new_buf;
-	int saved_errno;
-	char *end, *colon;
+	char *end = NULL, *colon, *name;
+	int r;
 
 	/* Count the number of headers. */
 	for (i = 0; i < n; i++)
@@ -406,96 +502,88 @@ queue_message_multicast(char *message, size_t length, client_t *sender)
 				break;
 
 	if (!header_count)
-		return; /* Invalid message. */
-
-	/* Allocate multicast message. */
-	fail_if (xmalloc(multicast, 1, multicast_t));
-	multicast_initialise(multicast);
-
-	/* Allocate header lists. */
-	fail_if (xmalloc(hashes,        header_count, size_t));
-	fail_if (xmalloc(headers,       header_count, char *));
-	fail_if (xmalloc(header_values, header_count, char *));
+		goto done; /* Invalid message. */
+
+	/* Allocate header lists, unless they fit on the stack. The header
+	   name–value pairs are not copied, they are read directly from the
+	   message, but the header names are copied into one buffer, which
+	   cannot be larger than the headers (`i` is the index of the last
+	   header's LF.) */
+	if (header_count > HEADERS_STACK_SIZE) {
+		fail_if (xmalloc(hashes,  header_count,     size_t));
+		fail_if (xmalloc(headers, 2 * header_count, char *));
+	}
+	if (i + 1 > NAMES_STACK_SIZE)
+		fail_if (xmalloc(names, i + 1, char));
+	header_values = headers + header_count;
 
 	/* Populate header lists. */
-	for (i = 0; i < header_count; i++)
-		{
-			end = strchr(msg, '\n');
-			colon = strchr(msg, ':');
-
-			*end = '\0';
-			if (xstrdup(header_values[i], msg)) {
-				header_count = i;
-				fail_if (1);
-			}
-			*colon = '\0';
-			if (xstrdup(headers[i], msg)) {
-				saved_errno = errno, free(headers[i]), errno = saved_errno;
-				header_count = i;
-				fail_if (1);
-			}
-			*colon = ':';
-			*end = '\n';
-			hashes[i] = string_hash(headers[i]);
-
-			msg = end + 1;
-		}
-
-	/* Get intercepting clients. */
-	pthread_mutex_lock(&(slave_mutex));
-	interceptions = get_interceptors(sender, hashes, headers, header_values, header_count, &interceptions_count);
-	pthread_mutex_unlock(&(slave_mutex));
-	fail_if (!interceptions);
-
-	/* Sort interceptors. */
-	qsort(interceptions, interceptions_count, sizeof(queued_interception_t), cmp_queued_interception);
+	for (name = names, i = 0; i < header_count; i++) {
+		end = memchr(msg, '\n', length - (size_t)(msg - message));
+		*end = '\0'; /* Restored when the interceptors have been found. */
+		colon = memchr(msg, ':', (size_t)(end - msg));
+		n = (size_t)((colon ? colon : end) - msg);
+		memcpy(name, msg, n * sizeof(char));
+		name[n] = '\0';
+
+		headers[i] = name;
+		header_values[i] = msg;
+		hashes[i] = string_hash(name);
+
+		name += n + 1;
+		msg = end + 1;
+	}
 
-	/* Add prefix to message with ‘Modify ID’ header. */
-	with_mutex (slave_mutex,
-	            modify_id = next_modify_id++;
-	            if (!next_modify_id)
-	                    next_modify_id = 1;
-	           );
-	xsnprintf(modify_id_header, "Modify ID: %" PRIu64 "\n", modify_id);
-	n = strlen(modify_id_header);
-	new_buf = message;
-	fail_if (xrealloc(new_buf, n + length, char));
-	message = new_buf;
-	memmove(message + n, message, length * sizeof(char));
-	memcpy(message, modify_id_header, n * sizeof(char));
-
-	/* Store information. */
-	multicast->interceptions = interceptions;
-	multicast->interceptions_count = interceptions_count;
-	multicast->message = message;
-	multicast->message_length = length + n;
-	multicast->message_prefix = n;
-	message = NULL;
-
-#define fail fail_in_mutex
-	/* Queue message multicasting. */
-	with_mutex (sender->mutex,
-	            new_buf = sender->multicasts;
-	            fail_if (xrealloc(new_buf, sender->multicasts_count + 1, multicast_t));
-	            sender->multicasts = new_buf;
-	            sender->multicasts[sender->multicasts_count++] = *multicast;
-	            free(multicast);
-	            multicast = NULL;
-	            errno = 0;
-	fail_in_mutex:
-	            xperror(*argv);
-	           );
-#undef fail
+	/* Get intercepting clients, already sorted by priority. */
+	pthread_rwlock_rdlock(&client_lock);
+	r = get_interceptors(hashes, headers, header_values, header_count, &recipients);
+	pthread_rwlock_unlock(&client_lock);
+
+	/* Restore the message, the header name–value pairs are LF-terminated. */
+	for (i = 1; i < header_count; i++)
+		header_values[i][-1] = '\n';
+	*end = '\n';
+
+	fail_if (r < 0);
+
+	/* There is nothing to do if no one intercepts the message. */
+	if (!recipients || !recipients->count)
+		goto done;
+
+	/* Create the ‘Modify ID’ header, it is not added to the message,
+	   instead it is sent together with the message when needed. */
+	multicast_initialise(&multicast);
+	while (!(modify_id = __atomic_fetch_add(&next_modify_id, 1, __ATOMIC_RELAXED)));
+	xsnprintf(multicast.modify_id_header, "Modify ID: %" PRIu64 "\n", modify_id);
+
+	/* Store information. The interceptors are shared with other
+	   messages, the sender is skipped when the message is sent. */
+	multicast.recipients = recipients;
+	multicast.interceptions = recipients->interceptions;
+	multicast.interceptions_count = recipients->count;
+	multicast.message = message;
+	multicast.message_length = length;
+	multicast.message_prefix = strlen(multicast.modify_id_header);
+	multicast.modify_id = modify_id;
+
+	/* Queue message multicasting, only this thread adds messages to the queue. */
+	if (client_push_multicast(sender, &multicast)) {
+		xperror(*argv);
+	} else {
+		message = NULL;
+		recipients = NULL;
+	}
 
 done:
 	/* Release resources. */
-	xfree(headers, header_count);
-	xfree(header_values, header_count);
-	free(hashes);
+	if (headers != headers_stack)
+		free(headers);
+	if (names != names_stack)
+		free(names);
+	if (hashes != hashes_stack)
+		free(hashes);
 	free(message);
-	if (multicast)
-		multicast_destroy(multicast);
-	free(multicast);
+	recipients_release(recipients);
 	return;
 
 fail:
@@ -25,7 +25,8 @@
 
 
 /**
- * Accept an incoming and start a slave thread for it
+ * Accept an incoming and start a slave thread for it,
+ * or hand it over to an event loop
  * 
  * @return  Zero normally, 1 if terminating
  */
@@ -20,9 +20,11 @@
 #include "interception-condition.h"
 
 #include <libmdsserver/macros.h>
+#include <libmdsserver/util.h>
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 
 /**
@@ -34,12 +36,14 @@ void
 multicast_initialise(multicast_t *restrict this)
 {
 	this->interceptions = NULL;
+	this->recipients = NULL;
 	this->interceptions_count = 0;
 	this->interceptions_ptr = 0;
 	this->message = NULL;
 	this->message_length = 0;
 	this->message_ptr = 0;
 	this->message_prefix = 0;
+	this->modify_id = 0;
 }
 
 
@@ -51,7 +55,10 @@ multicast_initialise(multicast_t *restrict this)
 void
 multicast_destroy(multicast_t *restrict this)
 {
-	free(this->interceptions);
+	if (this->recipients)
+		recipients_release(this->recipients);
+	else
+		free(this->interceptions);
 	free(this->message);
 }
 
@@ -65,7 +72,8 @@ multicast_destroy(multicast_t *restrict this)
 size_t
 multicast_marshal_size(const multicast_t *restrict this)
 {
-	size_t i, rc = sizeof(int) + 5 * sizeof(size_t) + this->message_length * sizeof(char);
+	size_t i, rc = sizeof(int) + 5 * sizeof(size_t);
+	rc += (this->message_prefix + this->message_length) * sizeof(char);
 	for (i = 0; i < this->interceptions_count; i++)
 		rc += queued_interception_marshal_size();
 	return rc;
@@ -86,7 +94,8 @@ multicast_marshal(const multicast_t *restrict this, char *restrict data)
 	buf_set_next(data, int, MULTICAST_T_VERSION);
 	buf_set_next(data, size_t, this->interceptions_count);
 	buf_set_next(data, size_t, this->interceptions_ptr);
-	buf_set_next(data, size_t, this->message_length);
+	/* The ‘Modify ID’ header is marshalled as part of the message. */
+	buf_set_next(data, size_t, this->message_prefix + this->message_length);
 	buf_set_next(data, size_t, this->message_ptr);
 	buf_set_next(data, size_t, this->message_prefix);
 	for (i = 0; i < this->interceptions_count; i++) {
@@ -94,6 +103,9 @@ multicast_marshal(const multicast_t *restrict this, char *restrict data)
 		data += n / sizeof(char);
 		rc += n;
 	}
+	memcpy(data, this->modify_id_header, this->message_prefix * sizeof(char));
+	data += this->message_prefix;
+	rc += this->message_prefix * sizeof(char);
 	if (this->message_length > 0) {
 		memcpy(data, this->message, this->message_length * sizeof(char));
 		rc += this->message_length * sizeof(char);
@@ -115,6 +127,7 @@ multicast_unmarshal(multicast_t *restrict this, char *restrict data)
 {
 	size_t i, n, rc = sizeof(int) + 5 * sizeof(size_t);
 	this->interceptions = NULL;
+	this->recipients = NULL;
 	this->message = NULL;
 	/* buf_get_next(data, int, MULTICAST_T_VERSION); */
 	buf_next(data, int, 1);
@@ -130,6 +143,19 @@ multicast_unmarshal(multicast_t *restrict this, char *restrict data)
 		data += n / sizeof(char);
 		rc += n;
 	}
+	/* Split the ‘Modify ID’ header apart from the message. */
+	if ((this->message_prefix >= sizeof(this->modify_id_header)) ||
+	    (this->message_prefix > this->message_length)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	memcpy(this->modify_id_header, data, this->message_prefix * sizeof(char));
+	this->modify_id_header[this->message_prefix] = '\0';
+	if (startswith(this->modify_id_header, "Modify ID: "))
+		this->modify_id = atou64(this->modify_id_header + strlen("Modify ID: "));
+	data += this->message_prefix;
+	rc += this->message_prefix * sizeof(char);
+	this->message_length -= this->message_prefix;
 	if (this->message_length > 0) {
 		fail_if (xmemdup(this->message, data, this->message_length, char));
 		rc += this->message_length * sizeof(char);
@@ -21,6 +21,8 @@
 
 #include "queued-interception.h"
 
+#include <stdint.h>
+
 
 #define MULTICAST_T_VERSION 0
 
@@ -33,6 +35,15 @@ typedef struct multicast {
 	 */
 	struct queued_interception *interceptions;
 
+	/**
+	 * The shared list that `interceptions` belongs to, `NULL`
+	 * if `interceptions` is owned by the multicast
+	 * 
+	 * A shared list may include the sender of the message,
+	 * who must not receive the message
+	 */
+	struct recipients *recipients;
+
 	/**
 	 * The number of clients in `interceptions`
 	 */
@@ -44,7 +55,7 @@ typedef struct multicast {
 	size_t interceptions_ptr;
 
 	/**
-	 * The message to send
+	 * The message to send, without the ‘Modify ID’ header
 	 */
 	char *message;
 
@@ -54,14 +65,27 @@ typedef struct multicast {
 	size_t message_length;
 
 	/**
-	 * How much of the message that has already been sent to the current recipient
+	 * How much of the message, including the ‘Modify ID’
+	 * header, that has already been sent to the current recipient
 	 */
 	size_t message_ptr;
 
 	/**
-	 * How much of the message to skip if the recipient is not a modifier
+	 * The length of `modify_id_header`, this is how much of the
+	 * message to skip if the recipient is not a modifier
 	 */
 	size_t message_prefix;
+
+	/**
+	 * The ‘Modify ID’ header, it is sent before `message`, but
+	 * kept apart so that it does not have to be copied into it
+	 */
+	char modify_id_header[13 + 3 * sizeof(uint64_t)];
+
+	/**
+	 * The modify ID of the message
+	 */
+	uint64_t modify_id;
 } multicast_t;
 
 
@@ -19,6 +19,8 @@
 
 #include <libmdsserver/macros.h>
 
+#include <stdlib.h>
+
 
 /**
  * Calculate the buffer size need to marshal a queued interception
@@ -46,7 +48,7 @@ queued_interception_marshal(const queued_interception_t *restrict this, char *re
 	buf_set_next(data, int, QUEUED_INTERCEPTION_T_VERSION);
 	buf_set_next(data, int64_t, this->priority);
 	buf_set_next(data, int, this->modifying);
-	buf_set_next(data, int, this->client->socket_fd);
+	buf_set_next(data, int, this->socket_fd);
 	return queued_interception_marshal_size();
 }
 
@@ -82,3 +84,16 @@ queued_interception_unmarshal_skip(void)
 {
 	return queued_interception_marshal_size();
 }
+
+
+/**
+ * Release a reference to a list of queued interceptions
+ * 
+ * @param  this  The list of queued interceptions, may be `NULL`
+ */
+void
+recipients_release(recipients_t *restrict this)
+{
+	if (this && !__atomic_sub_fetch(&(this->references), 1, __ATOMIC_ACQ_REL))
+		free(this);
+}
@@ -46,12 +46,39 @@ typedef struct queued_interception {
 	int modifying;
 
 	/**
-	 * The file descriptor of the intercepting client's socket (used for unmarshalling)
+	 * The file descriptor of the intercepting client's socket
+	 * (used for unmarshalling, and for finding out whether the
+	 * client has closed)
 	 */
 	int socket_fd;
 } queued_interception_t;
 
 
+/**
+ * A list of queued interceptions, sorted by priority, that may
+ * be shared by multicasts and the interception index's cache
+ */
+typedef struct recipients {
+	/**
+	 * The number of references to the list, it is
+	 * freed when the last reference is released
+	 * 
+	 * Accessed atomically
+	 */
+	size_t references;
+
+	/**
+	 * The number of elements in `interceptions`
+	 */
+	size_t count;
+
+	/**
+	 * The queued interceptions, highest priority first
+	 */
+	queued_interception_t interceptions[];
+} recipients_t;
+
+
 /**
  * Calculate the buffer size need to marshal a queued interception
  * 
@@ -90,5 +117,12 @@ size_t queued_interception_unmarshal(queued_interception_t *restrict this, char
 __attribute__((const, nonnull))
 size_t queued_interception_unmarshal_skip(void);
 
+/**
+ * Release a reference to a list of queued interceptions
+ * 
+ * @param  this  The list of queued interceptions, may be `NULL`
+ */
+void recipients_release(recipients_t *restrict this);
+
 
 #endif
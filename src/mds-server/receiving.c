@@ -20,6 +20,9 @@
 #include "globals.h"
 #include "client.h"
 #include "interceptors.h"
+#include "multicast.h"
+#include "sending.h"
+#include "slavery.h"
 
 #include <libmdsserver/hash-table.h>
 #include <libmdsserver/mds-message.h>
@@ -30,6 +33,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 
 /**
@@ -44,57 +48,67 @@ void queue_message_multicast(char *message, size_t length, client_t *sender);
 
 
 /**
- * Notify waiting client about a received message modification
+ * Pass a reply from a client that may modify a message on to the
+ * multicast of the message, and resume the multicast if it is
+ * waiting for the reply
  * 
- * @param   client     The client whom sent the message
- * @param   message    The message
+ * @param   client     The client whom sent the reply
  * @param   modify_id  The modify ID of the message
  * @return             Normally zero, but 1 if exited because of re-exec or termination
  */
 static int __attribute__((nonnull))
-modifying_notify(client_t *client, mds_message_t message, uint64_t modify_id)
+modifying_notify(client_t *client, uint64_t modify_id)
 {
-	/* pthread_cond_timedwait is required to handle re-exec and termination because
-	   pthread_cond_timedwait and pthread_cond_wait ignore interruptions via signals. */
-	struct timespec timeout = {
-		.tv_sec = 1,
-		.tv_nsec = 0
-	};
+	mds_message_t *reply;
+	multicast_t *multicast;
+	client_t *sender;
 	size_t address;
-	client_t *recipient;
-	mds_message_t *multicast;
-	size_t i;
-
-	pthread_mutex_lock(&(modify_mutex));
-	while (!hash_table_contains_key(&modify_map, (size_t)modify_id)) {
-		if (terminating) {
-			pthread_mutex_unlock(&(modify_mutex));
-			return 1;
-		}
-		pthread_cond_timedwait(&slave_cond, &slave_mutex, &timeout);
-	}
-	address = hash_table_get(&modify_map, (size_t)modify_id);
-	recipient = (void *)address;
-	fail_if (xmalloc(multicast = recipient->modify_message, 1, mds_message_t));
-	mds_message_zero_initialise(multicast);
-	fail_if (xmemdup(multicast->payload, message.payload, message.payload_size, char));
-	fail_if (xmalloc(multicast->headers, message.header_count, char*));
-	for (i = 0; i < message.header_count; i++, multicast->header_count++)
-		fail_if (xstrdup(multicast->headers[i], message.headers[i]));
-done:
-	pthread_mutex_unlock(&(modify_mutex));
-	with_mutex (client->modify_mutex, pthread_cond_signal(&(client->modify_cond)););
+	int resume = 0;
 
-	return 0;
+	/* Take over the reply rather than copying it. */
+	if (xmalloc(reply, 1, mds_message_t)) {
+		xperror(*argv);
+		return 0;
+	}
+	mds_message_zero_initialise(reply);
+	reply->headers = client->message.headers;
+	reply->header_count = client->message.header_count;
+	reply->payload = client->message.payload;
+	reply->payload_size = client->message.payload_size;
+	reply->arena = client->message.arena;
+	client->message.headers = NULL;
+	client->message.header_count = 0;
+	client->message.payload = NULL;
+	client->message.payload_size = 0;
+	client->message.payload_ptr = 0;
+	arena_initialise(&(client->message.arena));
+
+	/* Find the multicast, the reply is only accepted from its current recipient. */
+	with_mutex (modify_mutex,
+	            address = hash_table_get(&modify_map, (size_t)modify_id);
+	            if (!(sender = (void *)address))
+	                    break;
+	            multicast = sender->sending;
+	            if (multicast->interceptions[multicast->interceptions_ptr].client != client) {
+	                    sender = NULL;
+	                    break;
+	            }
+	            hash_table_remove(&modify_map, (size_t)modify_id);
+	            /* Resume the multicast if it is waiting, otherwise let it pick up the reply. */
+	            if ((resume = sender->modify_waiting))
+	                    sender->modify_waiting = 0;
+	            else
+	                    sender->modify_message = reply;
+	           );
 
-fail:
-	xperror(*argv);
-	if (multicast) {
-		mds_message_destroy(multicast);
-		free(multicast);
-		recipient->modify_message = NULL;
+	if (resume) {
+		multicast_resume(sender, reply);
+	} else if (!sender) {
+		mds_message_destroy(reply);
+		free(reply);
 	}
-	goto done;
+
+	return terminating ? 1 : 0;
 }
 
 
@@ -172,8 +186,8 @@ assign_and_send_id(client_t *client, const char *message_id)
 {
 	char *msgbuf = NULL;
 	char *msgbuf_;
-	char *msg_new;
-	size_t n, new_len;
+	struct iovec iov;
+	size_t n;
 	int rc = -1;
 
 	/* Construct response. */
@@ -195,22 +209,12 @@ assign_and_send_id(client_t *client, const char *message_id)
 
 	/* Queue message to be sent when this function returns.
 	   This done to simplify `multicast_message` for re-exec and termination. */
+	iov.iov_base = msgbuf;
+	iov.iov_len = n * sizeof(char);
 #define fail fail_in_mutex
 	with_mutex (client->mutex,
-	            if (!client->send_pending_size) {
-	                    /* Set the pending message. */
-	                    client->send_pending = msgbuf;
-	                    client->send_pending_size = n;
-	            } else {
-	                    /* Concatenate message to already pending messages. */
-	                    new_len = client->send_pending_size + n;
-	                    msg_new = client->send_pending;
-	                    fail_if (xrealloc(msg_new, new_len, char));
-	                    memcpy(msg_new + client->send_pending_size, msgbuf, n * sizeof(char));
-	                    client->send_pending = msg_new;
-	                    client->send_pending_size = new_len;
-	            }
-	            (msgbuf = NULL, rc = 0, errno = 0);
+	            fail_if (client_push_pending(client, &iov, 1));
+	            (rc = 0, errno = 0);
 	fail_in_mutex:
 	           );
 #undef fail
@@ -238,6 +242,7 @@ message_received(client_t *client)
 	int intercept = 0;
 	int64_t priority = 0;
 	int stop = 0;
+	int modify_reply = 0;
 	const char *message_id = NULL;
 	uint64_t modify_id = 0;
 	char *msgbuf = NULL;
@@ -256,12 +261,13 @@ message_received(client_t *client)
 		else if (startswith(h, "Message ID: "))       message_id = strstr(h, ": ") + 2;
 		else if (startswith(h, "Priority: "))         priority   = ato64(strstr(h, ": ") + 2);
 		else if (startswith(h, "Modify ID: "))        modify_id  = atou64(strstr(h, ": ") + 2);
+		else if (startswith(h, "Modify: "))           modify_reply = 1;
 	}
 
 
-	/* Notify waiting client about a received message modification. */
-	if (modifying)
-		return modifying_notify(client, message, modify_id);
+	/* Notify the waiting multicast about a received message modification. */
+	if (modify_reply)
+		return modifying_notify(client, modify_id);
 	/* Do nothing more, not not even multicast this message. */
 
 
@@ -273,15 +279,16 @@ message_received(client_t *client)
 	/* Assign ID if not already assigned. */
 	if (assign_id && !client->id) {
 		intercept |= 2;
-		with_mutex_if (slave_mutex, !(client->id = next_client_id++),
-		               eprint("this is impossible, ID counter has overflowed.");
-		               /* If the program ran for a millennium it would
-		                  take c:a 585 assignments per nanosecond. This
-		                  cannot possibly happen. (It would require serious
-		                  dedication by generations of ponies (or just an alicorn)
-		                  to maintain the process and transfer it new hardware.) */
-		               abort();
-		              );
+		if (!(client->id = __atomic_fetch_add(&next_client_id, 1, __ATOMIC_RELAXED))) {
+			eprint("this is impossible, ID counter has overflowed.");
+			/* If the program ran for a millennium it would
+			   take c:a 585 assignments per nanosecond. This
+			   cannot possibly happen. (It would require serious
+			   dedication by generations of ponies (or just an alicorn)
+			   to maintain the process and transfer it new hardware.) */
+			abort();
+		}
+		update_client_summary(client);
 	}
 
 	/* Make the client listen for messages addressed to it. */
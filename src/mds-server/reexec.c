@@ -19,7 +19,10 @@
 #include "globals.h"
 #include "client.h"
 #include "slavery.h"
+#include "interception-index.h"
+#include "sending.h"
 
+#include <libmdsserver/packed-list.h>
 #include <libmdsserver/linked-list.h>
 #include <libmdsserver/hash-table.h>
 #include <libmdsserver/fd-table.h>
@@ -52,17 +55,15 @@
 size_t
 marshal_server_size(void)
 {
-	size_t list_size = linked_list_marshal_size(&client_list);
+	size_t list_size = packed_list_marshal_size(&client_list);
 	size_t map_size = fd_table_marshal_size(&client_map);
-	size_t list_elements = 0;
+	size_t list_elements = client_list.count;
 	size_t state_n = 0;
-	ssize_t node;
+	size_t i;
 
 	/* Calculate the grand size of all client information. */
-	foreach_linked_list_node (client_list, node) {
-		state_n += client_marshal_size((void *)(client_list.values[node]));
-		list_elements++;
-	}
+	foreach_packed_list_value (client_list, i)
+		state_n += client_marshal_size((void *)(client_list.values[i]));
 
 	/* Add the size of the rest of the program's state. */
 	state_n += sizeof(int) + sizeof(sig_atomic_t) + 2 * sizeof(uint64_t) + 2 * sizeof(size_t);
@@ -81,9 +82,9 @@ marshal_server_size(void)
 int
 marshal_server(char *state_buf)
 {
-	size_t list_size = linked_list_marshal_size(&client_list);
-	size_t list_elements = 0;
-	ssize_t node;
+	size_t list_size = packed_list_marshal_size(&client_list);
+	size_t list_elements = client_list.count;
+	size_t i;
 	size_t value_address;
 	client_t *value, *client;
 
@@ -94,12 +95,10 @@ marshal_server(char *state_buf)
 	pthread_mutex_destroy(&modify_mutex);
 	pthread_cond_destroy(&modify_cond);
 	hash_table_destroy(&modify_map, NULL, NULL);
+	interception_index_destroy();
+	pthread_rwlock_destroy(&client_lock);
 
 
-	/* Count the number of clients that online. */
-	foreach_linked_list_node (client_list, node)
-		list_elements++;
-
 	/* Tell the new version of the program what version of the program it is marshalling. */
 	buf_set_next(state_buf, int, MDS_SERVER_VARS_VERSION);
 
@@ -113,9 +112,9 @@ marshal_server(char *state_buf)
 	buf_set_next(state_buf, size_t, list_elements);
 
 	/* Marshal the clients. */
-	foreach_linked_list_node (client_list, node) {
+	foreach_packed_list_value (client_list, i) {
 		/* Get the memory address of the client. */
-		value_address = client_list.values[node];
+		value_address = client_list.values[i];
 		/* Get the client's information. */
 		value = (void *)value_address;
 
@@ -126,19 +125,19 @@ marshal_server(char *state_buf)
 	}
 
 	/* Marshal the client list. */
-	linked_list_marshal(&client_list, state_buf);
+	packed_list_marshal(&client_list, state_buf);
 	state_buf += list_size / sizeof(char);
 	/* Marshal the client map. */
 	fd_table_marshal(&client_map, state_buf);
 
 
 	/* Release resources. */
-	foreach_linked_list_node (client_list, node) {
-		client = (void *)(client_list.values[node]);
+	foreach_packed_list_value (client_list, i) {
+		client = (void *)(client_list.values[i]);
 		client_destroy(client);
 	}
 	fd_table_destroy(&client_map, NULL, NULL);
-	linked_list_destroy(&client_list);
+	packed_list_destroy(&client_list);
 
 	return 0;
 }
@@ -162,6 +161,44 @@ unmarshal_remapper(size_t old)
 }
 
 
+/**
+ * Unmarshal the client list that was marshalled as a linked list, by
+ * version 0, into `client_list`, and give the clients their new handles
+ * 
+ * This must be done after the clients have been unmarshalled,
+ * but before the list is remapped
+ * 
+ * @param   state_buf  The marshalled linked list
+ * @return             Non-zero on error
+ */
+static int
+unmarshal_linked_client_list(char *state_buf)
+{
+	linked_list_t list;
+	ssize_t node, handle;
+	size_t address;
+	int saved_errno;
+
+	fail_if (linked_list_unmarshal(&list, state_buf));
+	fail_if (packed_list_create_with_records(&client_list, 0, sizeof(client_summary_t)));
+
+	foreach_linked_list_node (list, node) {
+		handle = packed_list_insert(&client_list, list.values[node]);
+		fail_if (handle == PACKED_LIST_UNUSED);
+		address = unmarshal_remapper(list.values[node]);
+		if (address)
+			((client_t *)(void *)address)->list_entry = handle;
+	}
+
+	linked_list_destroy(&list);
+	return 0;
+fail:
+	saved_errno = errno;
+	linked_list_destroy(&list);
+	return errno = saved_errno, -1;
+}
+
+
 /**
  * Unmarshal server implementation specific data and update the servers state accordingly
  * 
@@ -179,11 +216,10 @@ unmarshal_server(char *state_buf)
 	size_t list_size;
 	size_t list_elements;
 	size_t i;
-	ssize_t node;
 	pthread_t slave_thread;
 	size_t n, value_address, new_address;
 	client_t *value, *client;
-	int slave_fd;
+	int slave_fd, version;
 
 #define fail soft_fail
 
@@ -193,9 +229,8 @@ unmarshal_server(char *state_buf)
 #undef fail
 #define fail clients_fail
   
-	/* Get the marshal protocal version. Not needed, there is only the one version right now. */
-	/* buf_get(state_buf, int, 0, MDS_SERVER_VARS_VERSION); */
-	buf_next(state_buf, int, 1);
+	/* Get the marshal protocal version, version 0 marshalled the client list as a linked list. */
+	buf_get_next(state_buf, int, version);
 
 	/* Unmarshal the miscellaneous state data. */
 	buf_get_next(state_buf, sig_atomic_t, running);
@@ -244,7 +279,10 @@ unmarshal_server(char *state_buf)
 #define fail  critical_fail
 
 	/* Unmarshal the client list. */
-	fail_if (linked_list_unmarshal(&client_list, state_buf));
+	if (version >= 1)
+		fail_if (packed_list_unmarshal(&client_list, state_buf));
+	else
+		fail_if (unmarshal_linked_client_list(state_buf));
 	state_buf += list_size / sizeof(char);
 
 	/* Unmarshal the client map. */
@@ -259,17 +297,33 @@ unmarshal_server(char *state_buf)
 				__bit(i, &= ~);
 #undef __bit
 
-	/* Remap the linked list and remove non-found elements, and start the clients. */
-	foreach_linked_list_node (client_list, node) {
-		/* Remap the linked list and remove non-found elements. */
-		new_address = unmarshal_remapper(client_list.values[node]);
-		client_list.values[node] = new_address;
+	/* Remap the client list and remove non-found elements. */
+	foreach_packed_list_value (client_list, i) {
+		/* Remap the client list and remove non-found elements. */
+		new_address = unmarshal_remapper(client_list.values[i]);
+		client_list.values[i] = new_address;
 		if (new_address == 0) { /* Returned if missing (or if the address is the invalid NULL.) */
-			linked_list_remove(&client_list, node);
-		} else {
+			packed_list_remove(&client_list, client_list.handles[i]);
+			continue;
+		}
+
+		/* Rebuild the client's record, and the interception index,
+		   which is not marshalled. */
+		client = (client_t*)(void*)new_address;
+		client_summarise(client, packed_list_record_at(&client_list, i));
+		fail_if (interception_index_add_client(client));
+
+		/* Let multicasts that were waiting for a reply receive it. */
+		if (multicast_restore(client))
+			xperror(*argv);
+	}
+
+	/* Start the clients, this is done once all clients have been
+	   restored so that no client can be reached before it is ready. */
+	if (!event_loop_count) { /* Event loops are started by `postinitialise_server`. */
+		foreach_packed_list_value (client_list, i) {
 			/* Start the clients. (Errors do not need to be reported.) */
-			client = (client_t*)(void*)new_address;
-			slave_fd = client->socket_fd;
+			slave_fd = ((client_t*)(void*)(client_list.values[i]))->socket_fd;
 
 			/* Increase number of running slaves. */
 			with_mutex (slave_mutex, running_slaves++;);
@@ -21,6 +21,8 @@
 #include "client.h"
 #include "queued-interception.h"
 #include "multicast.h"
+#include "event-loop.h"
+#include "slavery.h"
 
 #include <libmdsserver/mds-message.h>
 #include <libmdsserver/macros.h>
@@ -32,232 +34,775 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
 
 
 
 /**
- * Get the client by its socket's file descriptor in a synchronised manner
+ * The longest ‘Command’ header value for which
+ * messages can replace each other in a queue
+ */
+#define COALESCE_COMMAND_MAX  64
+
+
+
+/**
+ * Get the recipient of an interception in a synchronised manner, and
+ * prevent the recipient from being freed until `release_recipient`
+ * has been called
  * 
- * @param   client_fd  The file descriptor of the client's socket
- * @return             The client
+ * @param   interception  The interception
+ * @return                The recipient, `NULL` if it has closed
  */
-static client_t *
-client_by_socket(int client_fd)
+static client_t * __attribute__((nonnull))
+acquire_recipient(queued_interception_t *interception)
 {
+	client_t *client;
 	size_t address;
-	with_mutex (slave_mutex, address = fd_table_get(&client_map, client_fd););
-	return (client_t*)(void*)address;
+
+	/* After unmarshalling at re-exec, the client will be NULL and must be
+	   mapped from its socket. Otherwise, the client is looked up anyway,
+	   as the client may have closed and been freed since the message was
+	   queued, in which case the socket may even belong to another client. */
+	with_rdlock (client_lock,
+	             address = fd_table_get(&client_map, interception->socket_fd);
+	             client = (void *)address;
+	             if (client && interception->client && (client != interception->client))
+	                     client = NULL;
+	             if (client)
+	                     with_mutex (client->modify_mutex, client->senders++;);
+	            );
+
+	/* The interceptions may be shared between messages,
+	   so they are only written to when unmarshalled. */
+	if (client && !interception->client)
+		interception->client = client;
+	return client;
+}
+
+
+/**
+ * Allow a client acquired by `acquire_recipient` to be freed
+ * 
+ * @param  client  The client
+ */
+static void __attribute__((nonnull))
+release_recipient(client_t *client)
+{
+	with_mutex (client->modify_mutex,
+	            if (!--(client->senders))
+	                    pthread_cond_broadcast(&(client->modify_cond));
+	           );
+}
+
+
+/**
+ * Let the thread that serves a client know that the client has
+ * pending messages, that shall be sent when its socket is writable
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param  client  The client
+ */
+static void __attribute__((nonnull))
+want_write(client_t *client)
+{
+	if (event_loop_count)
+		event_loop_want_write(client, 1);
+	else if (!pthread_equal(client->thread, pthread_self()))
+		pthread_kill(client->thread, SIGRTMIN); /* Interrupts the slave's wait for its socket. */
+}
+
+
+/**
+ * Disconnect a client because its queue of pending messages is
+ * congested, the client's socket is shut down so that the thread
+ * that serves the client closes it as if the client had closed
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param  client  The client
+ */
+static void __attribute__((nonnull))
+disconnect_congested(client_t *client)
+{
+	eprintf("disconnecting client %" PRIu32 ":%" PRIu32 " because it is not reading its messages.",
+	        (uint32_t)(client->id >> 32),
+	        (uint32_t)(client->id >>  0));
+	shutdown(client->socket_fd, SHUT_RDWR);
+	client->open = 0;
+	update_client_summary(client);
+	client_clear_pending(client);
+	client->congested = 0;
+}
+
+
+/**
+ * Get the value of the ‘Command’ header of a message
+ * 
+ * @param   iov      The buffers that the message is stored in
+ * @param   iovcnt   The number of elements in `iov`
+ * @param   skip     The number of bytes before the message in the buffers
+ * @param   command  Output buffer for the value, it will be NUL-terminated
+ * @return           Whether the message has a ‘Command’ header,
+ *                   and its value could be stored in `command`
+ */
+static int __attribute__((nonnull))
+get_command(const struct iovec *iov, size_t iovcnt, size_t skip, char command[COALESCE_COMMAND_MAX + 1])
+{
+	static const char key[] = "Command: ";
+	size_t i, j, n, pos = 0, length = 0;
+	int mismatch = 0, in_value = 0;
+	const char *p;
+
+	for (i = 0; i < iovcnt; i++, skip = 0) {
+		p = iov[i].iov_base;
+		n = iov[i].iov_len / sizeof(char);
+		if (skip >= n) {
+			skip -= n;
+			continue;
+		}
+		for (j = skip; j < n; j++) {
+			if (p[j] == '\n') {
+				if (in_value)
+					return command[length] = '\0', 1;
+				if (!pos) /* The end of the headers. */
+					return 0;
+				pos = 0, mismatch = 0;
+			} else if (in_value) {
+				if (length == COALESCE_COMMAND_MAX)
+					return 0;
+				command[length++] = p[j];
+			} else {
+				if (!mismatch && p[j] != key[pos])
+					mismatch = 1;
+				else if (!mismatch && pos + 2 == sizeof(key))
+					in_value = 1;
+				pos++;
+			}
+		}
+	}
+
+	return 0;
 }
 
 
 /**
- * Send a multicast message to one recipient
+ * Send a message to a client without blocking, what cannot be
+ * sent immediately is appended to the client's pending messages
+ * and sent by the thread that serves the client when its socket
+ * becomes writable
+ * 
+ * If the pending messages are congested, `queue_policy`
+ * is applied to the message, unless `droppable` is zero,
+ * in which case the message is queued anyway, unless the
+ * client is disconnected
+ * 
+ * The client's mutex must be held by the caller
+ * 
+ * @param   client     The client
+ * @param   iov        The message, will be updated to describe what has not been sent
+ * @param   iovcnt     The number of elements in `iov`
+ * @param   droppable  Whether the message may be dropped, or replaced,
+ *                     if the client's pending messages are congested
+ * @return             Zero on success, -1 on error
+ */
+static int __attribute__((nonnull))
+send_nonblocking(client_t *client, struct iovec *iov, size_t iovcnt, int droppable)
+{
+	char command[COALESCE_COMMAND_MAX + 1], pending_command[COALESCE_COMMAND_MAX + 1];
+	struct iovec pending[2];
+	size_t i, m, n = 0;
+	int coalescible = 0;
+
+	/* Do not send past messages that are already waiting. */
+	if (!client->send_pending_size) {
+		send_message_vector(client->socket_fd, iov, iovcnt, MSG_DONTWAIT);
+		fail_if (errno && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		n += iov[i].iov_len;
+	if (!n)
+		return 0;
+
+	/* Apply the policy for congested queues. This is never done to a message
+	   that has started being sent, and thus have nothing queued before it. */
+	if (client->send_pending_size && (client->congested || client->send_pending_size + n > queue_high_watermark)) {
+		if (!client->congested) {
+			client->congested = 1;
+			client->queue_stats.congestions++;
+		}
+		if (queue_policy == QUEUE_POLICY_DISCONNECT) {
+			disconnect_congested(client);
+			return 0;
+		} else if (droppable && queue_policy == QUEUE_POLICY_DROP) {
+			client->queue_stats.dropped++;
+			return 0;
+		} else if (droppable && queue_policy == QUEUE_POLICY_COALESCE) {
+			/* Only a message with the same command is replaced. */
+			coalescible = get_command(iov, iovcnt, 0, command);
+			if (coalescible && client->send_pending_coalescible) {
+				m = client_pending_iovec(client, pending);
+				if (get_command(pending, m, client->send_pending_size - client->send_pending_coalescible,
+				                pending_command) && strequals(command, pending_command)) {
+					client->send_pending_size -= client->send_pending_coalescible;
+					client->queue_stats.coalesced++;
+				}
+			}
+		}
+	}
+
+	/* Queue the rest. */
+	fail_if (client_push_pending(client, iov, iovcnt));
+	client->send_pending_coalescible = coalescible ? n : 0;
+	client->queue_stats.queued++;
+	if (client->queue_stats.peak < client->send_pending_size)
+		client->queue_stats.peak = client->send_pending_size;
+	want_write(client);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Send a multicast message to one recipient, or queue it
  * 
  * @param   multicast  The message
  * @param   recipient  The recipient
  * @param   modifying  Whether the recipient may modify the message
- * @return             Evaluates to true if and only if the entire message was sent
+ * @return             Whether the message was sent, queued, or dropped
+ *                     because the recipient is congested, rather than
+ *                     the recipient being closed or an error occurring
  */
 static int __attribute__((nonnull))
 send_multicast_to_recipient(multicast_t *multicast, client_t *recipient, int modifying)
 {
-	char *msg = multicast->message + multicast->message_ptr;
-	size_t n = multicast->message_length - multicast->message_ptr;
-	size_t sent;
+	size_t prefix = multicast->message_prefix;
+	size_t ptr;
+	struct iovec iov[2];
+	int rc = 0;
 
 	/* Skip Modify ID header if the interceptors will not perform a modification. */
-	if (!modifying && !multicast->message_ptr) {
-		n -= multicast->message_prefix;
-		multicast->message_ptr += multicast->message_prefix;
-	}
+	if (!modifying && !multicast->message_ptr)
+		multicast->message_ptr = prefix;
 
-	/* Send the message. */
-	n *= sizeof(char);
+	/* The Modify ID header is sent together with the message,
+	   so that it does not have to be copied into it. */
+	ptr = multicast->message_ptr;
+	iov[0].iov_base = multicast->modify_id_header + min(ptr, prefix);
+	iov[0].iov_len  = (prefix - min(ptr, prefix)) * sizeof(char);
+	ptr = ptr > prefix ? ptr - prefix : 0;
+	iov[1].iov_base = multicast->message + ptr;
+	iov[1].iov_len  = (multicast->message_length - ptr) * sizeof(char);
+
+	/* Send the message, or queue it if the recipient's socket is busy.
+	   A recipient that may modify the message must always receive it. */
 	with_mutex (recipient->mutex,
 	            if (recipient->open) {
-	                    sent = send_message(recipient->socket_fd, msg + multicast->message_ptr, n);
-	                    n -= sent;
-	                    multicast->message_ptr += sent / sizeof(char);
-	                    if (n > 0 && errno != EINTR)
+	                    rc = !send_nonblocking(recipient, iov, 2, !modifying);
+	                    if (!rc)
 	                            xperror(*argv);
 	            }
 	           );
-	
-	return !n;
+
+	return rc;
 }
 
 
 /**
- * Wait for the recipient of a multicast to reply
+ * Register a multicast as waiting for a reply from its current
+ * recipient, so that the reply can be routed back to it
  * 
- * @param  recipient  The recipient
- * @param  modify_id  The modify ID of the multicast
+ * @param   multicast  The multicast message
+ * @param   sender     The client that sent the message
+ * @return             Zero on success, -1 on error
  */
-static void __attribute__((nonnull))
-wait_for_reply(client_t *recipient, uint64_t modify_id)
+static int __attribute__((nonnull))
+await_reply(multicast_t *multicast, client_t *sender)
 {
-	/* pthread_cond_timedwait is required to handle re-exec and termination because
-	   pthread_cond_timedwait and pthread_cond_wait ignore interruptions via signals. */
-	struct timespec timeout = {
-		.tv_sec = 1,
-		.tv_nsec = 0
-	};
-
-	with_mutex_if (modify_mutex, !recipient->modify_message,
-	               if (!hash_table_contains_key(&modify_map, (size_t)modify_id)) {
-	                       hash_table_put(&modify_map, (size_t)modify_id, (size_t)(void*)recipient);
-	                       pthread_cond_signal(&slave_cond);
-	               }
-	              );
-	
-	with_mutex_if (recipient->modify_mutex, !recipient->modify_message,
-	               while (!recipient->modify_message && !terminating)
-	                       pthread_cond_timedwait(&slave_cond, &slave_mutex, &timeout);
-	               if (!terminating)
-	                       hash_table_remove(&modify_map, (size_t)modify_id);
-	              );
+	int saved_errno = 0;
+	with_mutex (modify_mutex,
+	            errno = 0;
+	            hash_table_put(&modify_map, (size_t)(multicast->modify_id), (size_t)(void *)sender);
+	            saved_errno = errno;
+	           );
+	return errno = saved_errno, saved_errno ? -1 : 0;
 }
 
 
 /**
- * Multicast a message
+ * Stop waiting for a reply to a multicast
  * 
  * @param  multicast  The multicast message
  */
-void multicast_message(multicast_t *multicast)
+static void __attribute__((nonnull))
+forget_reply(multicast_t *multicast)
 {
-	int consumed = 0, modifying = 0;
-	uint64_t modify_id = 0;
-	size_t i, n = strlen("Modify ID: ");
-	char *value, *lf,  *old_buf;
-	mds_message_t* mod;
-	client_t* client;
-	queued_interception_t client_;
-
-	if (startswith_n(multicast->message, "Modify ID: ", multicast->message_length, n)) {
-		value = multicast->message + n;
-		lf = strchr(value, '\n');
-		*lf = '\0';
-		modify_id = atou64(value);
-		*lf = '\n';
+	with_mutex (modify_mutex, hash_table_remove(&modify_map, (size_t)(multicast->modify_id)););
+}
+
+
+/**
+ * Act upon a reply from a recipient that may modify a multicast
+ * message, and free the reply
+ * 
+ * @param   multicast  The multicast message
+ * @param   reply      The reply, `NULL` if the message was not modified
+ * @return             Whether the message was consumed
+ */
+static int __attribute__((nonnull(1)))
+apply_reply(multicast_t *multicast, mds_message_t *reply)
+{
+	int modifying = 0, consumed = 0;
+	char *message;
+	size_t i;
+
+	if (!reply)
+		return 0;
+
+	for (i = 0; i < reply->header_count; i++) {
+		if (strequals(reply->headers[i], "Modify: yes")) {
+			modifying = 1;
+			consumed = reply->payload_size == 0;
+			break;
+		}
+	}
+	if (modifying && !consumed) {
+		/* The modified message is allocated in the reply's arena, so it is copied. */
+		if (xmemdup(message, reply->payload, reply->payload_size, char)) {
+			xperror(*argv);
+		} else {
+			free(multicast->message);
+			multicast->message = message;
+			multicast->message_length = reply->payload_size;
+		}
 	}
 
+	mds_message_destroy(reply);
+	free(reply);
+	return consumed;
+}
+
+
+/**
+ * Multicast a message, or continue multicasting it
+ * 
+ * Once the message has been sent to a recipient that may modify
+ * it, the multicast is suspended until the recipient replies,
+ * it is then resumed by the thread that receives the reply
+ * 
+ * @param   multicast  The multicast message
+ * @param   sender     The client that sent the message
+ * @return             Zero if the multicast has completed, 1 if it is waiting
+ *                     for a reply or if we are re-exec:ing or terminating
+ */
+int
+multicast_message(multicast_t *multicast, client_t *sender)
+{
+	queued_interception_t *interception;
+	mds_message_t *reply;
+	client_t *client;
+	int modifying, waiting = 0;
+
 	for (; multicast->interceptions_ptr < multicast->interceptions_count; multicast->interceptions_ptr++) {
-		client_ = multicast->interceptions[multicast->interceptions_ptr];
-		client = client_.client;
-		modifying = 0;
+		interception = multicast->interceptions + multicast->interceptions_ptr;
+		modifying = interception->modifying;
 
-		/* After unmarshalling at re-exec, client will be NULL and must be mapped from its socket. */
-		if (!client)
-			client_.client = client = client_by_socket(client_.socket_fd);
+		if (!(client = acquire_recipient(interception))) {
+			/* The recipient has closed. */
+			multicast->message_ptr = 0;
+			continue;
+		}
+
+		/* The interceptors are shared between messages
+		   with different senders, so they include the sender. */
+		if (client == sender) {
+			release_recipient(client);
+			continue;
+		}
+
+		/* Let the reply find its way back to the multicast. (If the message has
+		   been partially sent, this was done before it started being sent.) */
+		if (modifying && !multicast->message_ptr && await_reply(multicast, sender)) {
+			xperror(*argv);
+			modifying = 0;
+		}
 
 		/* Send the message to the recipient. */
-		if (!send_multicast_to_recipient(multicast, client, client_.modifying)) {
+		if (!send_multicast_to_recipient(multicast, client, modifying)) {
+			release_recipient(client);
 			/* Stop if we are re-exec:ing or terminating, or continue to next recipient on error. */
 			if (terminating)
-				return;
-			else
-				continue;
+				return 1;
+			if (modifying)
+				forget_reply(multicast);
+			multicast->message_ptr = 0;
+			continue;
 		}
 
 		/* Do not wait for a reply if it is non-modifying. */
-		if (!client_.modifying) {
+		if (!modifying) {
+			release_recipient(client);
 			/* Reset how much of the message has been sent before we continue with next recipient. */
 			multicast->message_ptr = 0;
 			continue;
 		}
 
-		/* Wait for a reply. */
-		wait_for_reply(client, modify_id);
+		/* Remember that the message has been sent, in case we re-exec before the reply arrives. */
+		multicast->message_ptr = multicast->message_prefix + multicast->message_length;
+
+		/* Suspend the multicast, unless the reply has already been received,
+		   or the recipient has closed and will never reply. */
+		with_mutex (modify_mutex,
+		            reply = sender->modify_message;
+		            sender->modify_message = NULL;
+		            waiting = !reply && client->open;
+		            if (waiting)
+		                    sender->modify_waiting = 1;
+		            else if (!reply)
+		                    hash_table_remove(&modify_map, (size_t)(multicast->modify_id));
+		           );
+		release_recipient(client);
+		if (waiting)
+			return 1;
+
+		/* Act upon the reply, and reset how much of the message
+		   has been sent before we continue with next recipient. */
+		multicast->message_ptr = 0;
+		if (apply_reply(multicast, reply))
+			break;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Let other threads drain a client's multicast queue, because it
+ * has been seen empty, unless the client is closing, in which case
+ * the client is freed instead
+ * 
+ * The caller must have set the client's `draining` field
+ * 
+ * @param   client   The client
+ * @param   recheck  Whether the queue shall be checked again after
+ *                   `draining` has been cleared, in case a message
+ *                   was added in the meantime
+ * @return           Whether the caller shall continue draining the queue,
+ *                   in which case `draining` has been set again
+ */
+static int __attribute__((nonnull))
+stop_draining(client_t *client, int recheck)
+{
+	if (__atomic_load_n(&(client->closing), __ATOMIC_ACQUIRE)) {
+		/* No message can be added once the client is closing,
+		   and `draining` is kept so that it is freed only once. */
+		event_loop_finish_client(client);
+		return 0;
+	}
+
+	/* Let the thread that frees the client know that the queue has been sent. */
+	with_mutex (client->modify_mutex,
+	            __atomic_store_n(&(client->draining), 0, __ATOMIC_SEQ_CST);
+	            pthread_cond_broadcast(&(client->modify_cond));
+	           );
+
+	/* A message may have been added, or the client closed, after the queue was
+	   seen empty but before `draining` was cleared, in which case the thread that
+	   did so saw `draining` set and left the message to us. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!recheck)
+		return 0;
+	if (!client_has_multicasts(client) && !__atomic_load_n(&(client->closing), __ATOMIC_ACQUIRE))
+		return 0;
+	return !__atomic_exchange_n(&(client->draining), 1, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * Send the messages in a client's multicast queue until
+ * it is empty or a multicast is waiting for a reply
+ * 
+ * The caller must have set the client's `draining`
+ * field, which is cleared once the queue is empty
+ * 
+ * @param  client  The client
+ */
+static void __attribute__((nonnull))
+drain_multicast_queue(client_t *client)
+{
+	for (;;) {
+		/* Leave the rest of the queue for the next image if we are re-exec:ing. */
 		if (terminating)
 			return;
 
-		/* Act upon the reply. */
-		mod = client->modify_message;
-		for (i = 0; i < mod->header_count; i++) {
-			if (strequals(mod->headers[i], "Modify: yes")) {
-				modifying = 1;
-				consumed = mod->payload_size == 0;
-				break;
+		if (!client->sending) {
+			int popped = 0;
+			if (client_has_multicasts(client)) {
+				if (!client->sending_buffer && xmalloc(client->sending_buffer, 1, multicast_t)) {
+					xperror(*argv);
+					stop_draining(client, 0);
+					return;
+				}
+				/* The queue size includes messages that are still being
+				   pushed, so the queue can be seen non-empty but still
+				   have nothing to pop. */
+				with_mutex (client->modify_mutex,
+				            client->sending = client->sending_buffer;
+				            popped = !client_pop_multicast(client, client->sending);
+				            if (!popped)
+				              client->sending = NULL;
+				           );
 			}
-		}
-		if (modifying && !consumed) {
-			n = mod->payload_size;
-			old_buf = multicast->message;
-			if (xrealloc(multicast->message, multicast->message_prefix + n, char)) {
-				xperror(*argv);
-				multicast->message = old_buf;
-			} else {
-				memcpy(multicast->message + multicast->message_prefix, mod->payload, n);
+			if (!popped) {
+				if (stop_draining(client, 1))
+					continue;
+				return;
 			}
 		}
 
-		/* Free the reply. */
-		mds_message_destroy(client->modify_message);
+		/* Stop if the multicast is waiting for a reply, it will
+		   continue draining the queue once it has been resumed. */
+		if (multicast_message(client->sending, client))
+			return;
+		multicast_destroy(client->sending);
+		client->sending = NULL;
+	}
+}
 
-		/* Reset how much of the message has been sent before we continue with next recipient. */
-		multicast->message_ptr = 0;
 
-		if (consumed)
+/**
+ * Send the messages in a client's multicast queue,
+ * unless another thread is already doing so or a
+ * multicast is waiting for a reply
+ * 
+ * @param  client  The client
+ */
+void
+send_multicast_queue(client_t *client)
+{
+	/* Pairs with the fence in `stop_draining`, so that either
+	   we set `draining` or the draining thread sees the message. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_exchange_n(&(client->draining), 1, __ATOMIC_SEQ_CST))
+		drain_multicast_queue(client);
+}
+
+
+/**
+ * Resume a client's multicast that has been waiting
+ * for a reply, and continue sending its multicast queue
+ * 
+ * The caller must have removed the multicast from `modify_map`
+ * and cleared the client's `modify_waiting` field
+ * 
+ * @param  sender  The client whose multicast is waiting for the reply
+ * @param  reply   The reply, `NULL` if the message was not modified
+ */
+void
+multicast_resume(client_t *sender, mds_message_t *reply)
+{
+	multicast_t *multicast = sender->sending;
+
+	/* Act upon the reply and continue with the next recipient. */
+	multicast->message_ptr = 0;
+	if (apply_reply(multicast, reply))
+		multicast->interceptions_ptr = multicast->interceptions_count;
+	else
+		multicast->interceptions_ptr++;
+
+	drain_multicast_queue(sender);
+}
+
+
+/**
+ * Find a multicast that is waiting for a reply from a specific
+ * recipient, and remove it from `modify_map`
+ * 
+ * `modify_mutex` must be held by the caller
+ * 
+ * @param   recipient  The recipient
+ * @return             The client whose multicast was waiting, `NULL` if none
+ */
+static client_t * __attribute__((nonnull))
+take_waiting_sender(client_t *recipient)
+{
+	hash_entry_t *entry;
+	client_t *sender;
+	multicast_t *multicast;
+	size_t i;
+
+	foreach_hash_table_entry (modify_map, i, entry) {
+		sender = (void *)(entry->value);
+		multicast = sender->sending;
+		if (!sender->modify_waiting || multicast->interceptions[multicast->interceptions_ptr].client != recipient)
+			continue;
+		hash_table_remove(&modify_map, entry->key);
+		sender->modify_waiting = 0;
+		return sender;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Resume all multicasts that are waiting for a reply from a
+ * client that has closed, as if their messages were not modified
+ * 
+ * The client's `open` field must be cleared before this is done
+ * 
+ * @param  recipient  The client that has closed
+ */
+void
+multicast_recipient_closed(client_t *recipient)
+{
+	client_t *sender;
+	for (;;) {
+		with_mutex (modify_mutex, sender = take_waiting_sender(recipient););
+		if (!sender)
 			break;
+		multicast_resume(sender, NULL);
 	}
 }
 
 
 /**
- * Send the next message in a clients multicast queue
+ * Wait until a client's multicast queue has been sent,
+ * this is done by a slave thread before it frees its client
  * 
  * @param  client  The client
  */
 void
-send_multicast_queue(client_t *client)
+wait_for_multicast_queue(client_t *client)
 {
-	multicast_t multicast;
-	size_t c;
-	while (client->multicasts_count > 0) {
-		with_mutex_if (client->mutex, client->multicasts_count > 0,
-		               c = (client->multicasts_count -= 1) * sizeof(multicast_t);
-		               multicast = client->multicasts[0];
-		               memmove(client->multicasts, client->multicasts + 1, c);
-		               if (c == 0) {
-		                       free(client->multicasts);
-		                       client->multicasts = NULL;
-		               }
-		              );
-		multicast_message(&multicast);
-		multicast_destroy(&multicast);
+	/* pthread_cond_timedwait is required to handle re-exec and termination because
+	   pthread_cond_timedwait and pthread_cond_wait ignore interruptions via signals. */
+	struct timespec timeout;
+
+	pthread_mutex_lock(&(client->modify_mutex));
+	while (!terminating && (__atomic_load_n(&(client->draining), __ATOMIC_ACQUIRE) || client_has_multicasts(client))) {
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += 1;
+		pthread_cond_timedwait(&(client->modify_cond), &(client->modify_mutex), &timeout);
 	}
+	pthread_mutex_unlock(&(client->modify_mutex));
+
+	/* If we are terminating, the multicast may still be waiting for a reply,
+	   it must not be resumed by its recipient once the client is freed. */
+	if (client->sending)
+		forget_reply(client->sending);
 }
 
 
 /**
- * Send the messages that are in a clients reply queue
+ * Wait until no thread is sending a multicast message to a client,
+ * this is done before a client is freed, and after it has been
+ * unmapped so that no new thread can start sending to it
  * 
  * @param  client  The client
  */
 void
-send_reply_queue(client_t *client)
+wait_for_multicast_senders(client_t *client)
+{
+	/* Sending to a client never blocks, so this is brief
+	   and does not have to handle re-exec and termination. */
+	pthread_mutex_lock(&(client->modify_mutex));
+	while (client->senders)
+		pthread_cond_wait(&(client->modify_cond), &(client->modify_mutex));
+	pthread_mutex_unlock(&(client->modify_mutex));
+}
+
+
+/**
+ * Prepare a client's multicast queue after a re-exec, so that a
+ * multicast that was waiting for a reply can receive the reply
+ * 
+ * `client_map` must have been unmarshalled, and this must
+ * be done before the client's multicast queue is sent
+ * 
+ * @param   client  The client
+ * @return          Zero on success, -1 on error
+ */
+int
+multicast_restore(client_t *client)
 {
-	char *sendbuf = client->send_pending;
-	char *sendbuf_ = sendbuf;
-	size_t sent, n;
+	multicast_t *multicast = client_peek_multicast(client);
+	queued_interception_t *interception;
+	size_t address;
+
+	/* Was the first multicast waiting for, or being sent to, a recipient that may modify it? */
+	if (!multicast || !multicast->message_ptr)
+		return 0;
+	if (multicast->interceptions_ptr >= multicast->interceptions_count)
+		return 0;
+	interception = multicast->interceptions + multicast->interceptions_ptr;
+	if (!interception->modifying)
+		return 0;
+
+	/* The reply can only be accepted from the recipient,
+	   so the recipient must be mapped from its socket. */
+	address = fd_table_get(&client_map, (size_t)(interception->socket_fd));
+	if (!(interception->client = (void *)address))
+		return 0; /* The recipient has closed, and will be skipped. */
 
-	if (!client->send_pending_size)
-		return;
+	/* Make the multicast the one being sent. */
+	if (!client->sending_buffer)
+		fail_if (xmalloc(client->sending_buffer, 1, multicast_t));
+	client->sending = client->sending_buffer;
+	client_pop_multicast(client, client->sending);
+
+	/* Let the reply find its way back to the multicast. If this
+	   fails, the message is sent again and a new reply is awaited. */
+	if (await_reply(client->sending, client)) {
+		client->sending->message_ptr = 0;
+		fail_if (1);
+	}
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Send as much as possible of the messages that are in
+ * a clients reply queue, without blocking, the rest is
+ * sent when the client's socket becomes writable
+ * 
+ * @param  client  The client
+ */
+void
+send_reply_queue(client_t *client)
+{
+	struct iovec iov[2];
+	size_t sent, n, iovcnt;
 
-	n = client->send_pending_size;
-	client->send_pending_size = 0;
-	client->send_pending = NULL;
 	with_mutex (client->mutex,
-	            while (n > 0) {
-	                    sent = send_message(client->socket_fd, sendbuf_, n);
-	                    n -= sent;
-	                    sendbuf_ += sent / sizeof(char);
-	                    if (n > 0 && errno != EINTR) { /* Ignore EINTR */
+	            if (client->send_pending_size) {
+	                    n = client->send_pending_size;
+	                    iovcnt = client_pending_iovec(client, iov);
+	                    sent = send_message_vector(client->socket_fd, iov, iovcnt, MSG_DONTWAIT) / sizeof(char);
+	                    if (sent < n && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+	                            /* The client has probably closed, drop what is left. */
 	                            xperror(*argv);
-	                            break;
+	                            sent = n;
 	                    }
+	                    client_pop_pending(client, sent);
+	                    n = client->send_pending_size;
+	                    /* A message that has started being sent cannot be replaced. */
+	                    if (client->send_pending_coalescible > n)
+	                            client->send_pending_coalescible = 0;
+	                    if (client->congested && n <= queue_low_watermark)
+	                            client->congested = 0;
 	            }
-	            free(sendbuf);
+	            if (event_loop_count)
+	                    event_loop_want_write(client, client->send_pending_size > 0);
 	           );
 }
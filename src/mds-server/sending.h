@@ -22,17 +22,28 @@
 #include "multicast.h"
 #include "client.h"
 
+#include <libmdsserver/mds-message.h>
+
 
 /**
- * Multicast a message
+ * Multicast a message, or continue multicasting it
+ * 
+ * Once the message has been sent to a recipient that may modify
+ * it, the multicast is suspended until the recipient replies,
+ * it is then resumed by the thread that receives the reply
  * 
- * @param  multicast  The multicast message
+ * @param   multicast  The multicast message
+ * @param   sender     The client that sent the message
+ * @return             Zero if the multicast has completed, 1 if it is waiting
+ *                     for a reply or if we are re-exec:ing or terminating
  */
 __attribute__((nonnull))
-void multicast_message(multicast_t *multicast);
+int multicast_message(multicast_t *multicast, client_t *sender);
 
 /**
- * Send the next message in a clients multicast queue
+ * Send the messages in a client's multicast queue,
+ * unless another thread is already doing so or a
+ * multicast is waiting for a reply
  * 
  * @param  client  The client
  */
@@ -40,7 +51,65 @@ __attribute__((nonnull))
 void send_multicast_queue(client_t *client);
 
 /**
- * Send the messages that are in a clients reply queue
+ * Resume a client's multicast that has been waiting
+ * for a reply, and continue sending its multicast queue
+ * 
+ * The caller must have removed the multicast from `modify_map`
+ * and cleared the client's `modify_waiting` field
+ * 
+ * @param  sender  The client whose multicast is waiting for the reply
+ * @param  reply   The reply, `NULL` if the message was not modified
+ */
+__attribute__((nonnull(1)))
+void multicast_resume(client_t *sender, mds_message_t *reply);
+
+/**
+ * Resume all multicasts that are waiting for a reply from a
+ * client that has closed, as if their messages were not modified
+ * 
+ * The client's `open` field must be cleared before this is done
+ * 
+ * @param  recipient  The client that has closed
+ */
+__attribute__((nonnull))
+void multicast_recipient_closed(client_t *recipient);
+
+/**
+ * Wait until a client's multicast queue has been sent,
+ * this is done by a slave thread before it frees its client
+ * 
+ * @param  client  The client
+ */
+__attribute__((nonnull))
+void wait_for_multicast_queue(client_t *client);
+
+/**
+ * Wait until no thread is sending a multicast message to a client,
+ * this is done before a client is freed, and after it has been
+ * unmapped so that no new thread can start sending to it
+ * 
+ * @param  client  The client
+ */
+__attribute__((nonnull))
+void wait_for_multicast_senders(client_t *client);
+
+/**
+ * Prepare a client's multicast queue after a re-exec, so that a
+ * multicast that was waiting for a reply can receive the reply
+ * 
+ * `client_map` must have been unmarshalled, and this must
+ * be done before the client's multicast queue is sent
+ * 
+ * @param   client  The client
+ * @return          Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int multicast_restore(client_t *client);
+
+/**
+ * Send as much as possible of the messages that are in
+ * a clients reply queue, without blocking, the rest is
+ * sent when the client's socket becomes writable
  * 
  * @param  client  The client
  */
@@ -18,11 +18,14 @@
 
 #include "globals.h"
 #include "client.h"
+#include "event-loop.h"
 
-#include <libmdsserver/linked-list.h>
+#include <libmdsserver/packed-list.h>
 #include <libmdsserver/macros.h>
 
 #include <pthread.h>
+#include <inttypes.h>
+#include <stdio.h>
 
 
 /**
@@ -33,19 +36,76 @@
 void signal_all(int signo)
 {      
 	pthread_t current_thread;
-	ssize_t node;
+	size_t i;
 	client_t *value;
 
 	current_thread = pthread_self();
 
 	if (pthread_equal(current_thread, master_thread) == 0)
 		pthread_kill(master_thread, signo);
+
+	/* The event loops only block in epoll_wait, which they wake up from. */
+	if (event_loop_count) {
+		event_loops_wake();
+		return;
+	}
 	
-	with_mutex (slave_mutex,
-	            foreach_linked_list_node (client_list, node) {
-	                    value = (client_t*)(void*)(client_list.values[node]);
-	                    if (!pthread_equal(current_thread, value->thread))
-	                            pthread_kill(value->thread, signo);
-	            }
-	           );
+	with_rdlock (client_lock,
+	             foreach_packed_list_value (client_list, i) {
+	                     value = (client_t*)(void*)(client_list.values[i]);
+	                     if (!pthread_equal(current_thread, value->thread))
+	                             pthread_kill(value->thread, signo);
+	             }
+	            );
+}
+
+
+/**
+ * This function is called when a signal that
+ * signals that the system to dump state information
+ * and statistics has been received
+ * 
+ * @param  signo  The signal that has been received
+ */
+void
+received_info(int signo)
+{
+	SIGHANDLER_START;
+	size_t i;
+	client_t *client;
+	client_summary_t *summary;
+	client_queue_stats_t stats;
+	(void) signo;
+	iprintf("event loops: %zu", event_loop_count);
+	iprintf("outbound queue high watermark: %zu bytes", queue_high_watermark);
+	iprintf("outbound queue low watermark: %zu bytes", queue_low_watermark);
+	iprintf("outbound queue policy: %s",
+	        queue_policy == QUEUE_POLICY_DROP       ? "drop" :
+	        queue_policy == QUEUE_POLICY_COALESCE   ? "coalesce" :
+	        queue_policy == QUEUE_POLICY_DISCONNECT ? "disconnect" :
+	        "unrecognised policy, something is wrong here!");
+	/* The client list may be modified by the interrupted thread. */
+	if (pthread_rwlock_tryrdlock(&client_lock)) {
+		iprint("(the client list is in use, unable to list the clients)");
+		goto done;
+	}
+	foreach_packed_list_value (client_list, i) {
+		client = (client_t *)(void *)(client_list.values[i]);
+		summary = packed_list_record_at(&client_list, i);
+		stats = client->queue_stats;
+		iprintf("client %" PRIu32 ":%" PRIu32 ": socket FD: %i", (uint32_t)(summary->id >> 32),
+		        (uint32_t)(summary->id), client->socket_fd);
+		iprintf("  open: %s", summary->open ? "yes" : "no");
+		iprintf("  interception conditions: %zu", summary->interception_conditions_count);
+		iprintf("  outbound queue: %zu bytes", client->send_pending_size);
+		iprintf("  congested: %s", client->congested ? "yes" : "no");
+		iprintf("  queued messages: %" PRIu64, stats.queued);
+		iprintf("  dropped messages: %" PRIu64, stats.dropped);
+		iprintf("  coalesced messages: %" PRIu64, stats.coalesced);
+		iprintf("  congestions: %" PRIu64, stats.congestions);
+		iprintf("  largest queue: %" PRIu64 " bytes", stats.peak);
+	}
+	pthread_rwlock_unlock(&client_lock);
+done:
+	SIGHANDLER_END;
 }
@@ -21,12 +21,14 @@
 #include "client.h"
 
 #include <libmdsserver/macros.h>
-#include <libmdsserver/linked-list.h>
+#include <libmdsserver/packed-list.h>
 
 #include <pthread.h>
 #include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
+#include <signal.h>
+#include <poll.h>
 
 
 /**
@@ -54,9 +56,13 @@ fetch_message(client_t *client)
 	} else if (r == -2) {
 		eprint("corrupt message received.");
 		fail_if (1);
+	} else if (errno == EAGAIN) {
+		/* Nothing more to read from a non-blocking socket. */
+		return -1;
 	} else if (errno == ECONNRESET) {
 		r = mds_message_read(&(client->message), client->socket_fd);
 		client->open = 0;
+		update_client_summary(client);
 		/* Connection closed. */
 	} else if (errno != EINTR) {
 		xperror(*argv);
@@ -70,6 +76,38 @@ fail:
 }
 
 
+/**
+ * Wait until a message can be read from a client, or until
+ * the client's pending messages can be sent, if it has any
+ * 
+ * @param   client   The client
+ * @param   sigmask  The signal mask to use while waiting, the signal that
+ *                   interrupts the wait when a message is queued for the
+ *                   client should only be unblocked while waiting
+ * @return           1 if a message can be read, 0 if not, -1 on error or interruption
+ */
+int
+wait_for_client(client_t *client, const sigset_t *sigmask)
+{
+	struct pollfd pfd;
+	int writable;
+
+	/* A part of the next message may already have been received. */
+	if (client->message.buffer_ptr > client->message.buffer_off)
+		return 1;
+
+	with_mutex (client->mutex, writable = client->send_pending_size > 0;);
+	pfd.fd = client->socket_fd;
+	pfd.events = (short)(writable ? (POLLIN | POLLOUT) : POLLIN);
+	pfd.revents = 0;
+	fail_if (ppoll(&pfd, 1, NULL, sigmask) < 0);
+
+	return !!(pfd.revents & (POLLIN | POLLHUP | POLLERR));
+fail:
+	return -1;
+}
+
+
 /**
  * Create, start and detache a slave thread
  * 
@@ -104,7 +142,7 @@ fail:
 client_t *
 initialise_client(int client_fd)
 {
-	ssize_t entry = LINKED_LIST_UNUSED;
+	ssize_t entry = PACKED_LIST_UNUSED;
 	client_t *information;
 	int locked = 0, saved_errno;
 	size_t tmp;
@@ -114,21 +152,22 @@ initialise_client(int client_fd)
 	client_initialise(information);
 
 	/* Add to list of clients. */
-	fail_if ((errno = pthread_mutex_lock(&slave_mutex)));
+	fail_if ((errno = pthread_rwlock_wrlock(&client_lock)));
 	locked = 1;
-	entry = linked_list_insert_end(&client_list, (size_t)(void *)information);
-	fail_if (entry == LINKED_LIST_UNUSED);
+	entry = packed_list_insert(&client_list, (size_t)(void *)information);
+	fail_if (entry == PACKED_LIST_UNUSED);
 
 	/* Add client to table. */
 	tmp = fd_table_put(&client_map, client_fd, (size_t)(void *)information);
 	fail_if (!tmp && errno);
-	pthread_mutex_unlock(&slave_mutex);
+	pthread_rwlock_unlock(&client_lock);
 	locked = 0;
 
 	/* Fill information table. */
 	information->list_entry = entry;
 	information->socket_fd = client_fd;
 	information->open = 1;
+	update_client_summary(information);
 	fail_if (mds_message_initialise(&(information->message)));
 
 	return information;
@@ -136,9 +175,25 @@ initialise_client(int client_fd)
 fail:
 	saved_errno = errno;
 	if (locked)
-		pthread_mutex_unlock(&slave_mutex);
+		pthread_rwlock_unlock(&client_lock);
 	free(information);
-	if (entry != LINKED_LIST_UNUSED)
-		with_mutex (slave_mutex, linked_list_remove(&client_list, entry););
+	if (entry != PACKED_LIST_UNUSED)
+		with_wrlock (client_lock, packed_list_remove(&client_list, entry););
 	return errno = saved_errno, NULL;
 }
+
+
+/**
+ * Update a client's record in the list of clients, this must
+ * be done whenever any of the fields in the record change
+ * 
+ * @param  client  The client
+ */
+void
+update_client_summary(client_t *client)
+{
+	with_rdlock (client_lock,
+	             if (client->list_entry >= 0)
+	                     client_summarise(client, packed_list_record(&client_list, client->list_entry));
+	            );
+}
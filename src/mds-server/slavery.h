@@ -22,6 +22,7 @@
 #include "client.h"
 
 #include <pthread.h>
+#include <signal.h>
 
 
 /**
@@ -33,6 +34,19 @@
 __attribute__((nonnull))
 int fetch_message(client_t *client);
 
+/**
+ * Wait until a message can be read from a client, or until
+ * the client's pending messages can be sent, if it has any
+ * 
+ * @param   client   The client
+ * @param   sigmask  The signal mask to use while waiting, the signal that
+ *                   interrupts the wait when a message is queued for the
+ *                   client should only be unblocked while waiting
+ * @return           1 if a message can be read, 0 if not, -1 on error or interruption
+ */
+__attribute__((nonnull))
+int wait_for_client(client_t *client, const sigset_t *sigmask);
+
 /**
  * Create, start and detache a slave thread
  * 
@@ -51,5 +65,14 @@ int create_slave(pthread_t *thread_slot, int slave_fd);
  */
 client_t *initialise_client(int client_fd);
 
+/**
+ * Update a client's record in the list of clients, this must
+ * be done whenever any of the fields in the record change
+ * 
+ * @param  client  The client
+ */
+__attribute__((nonnull))
+void update_client_summary(client_t *client);
+
 
 #endif